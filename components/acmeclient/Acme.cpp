@@ -36,6 +36,7 @@
 #include "esp_log.h"
 
 #include "Acme.h"
+#include "Base64url.h"
 
 #include <sys/socket.h>
 #include <lwip/etharp.h>
@@ -47,7 +48,32 @@
 #include <esp_http_client.h>
 #include <esp_crt_bundle.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <esp_system.h>
+
+// Commands for the ACME task, see StartTask()
+enum AcmeCommand {
+  ACME_CMD_TICK,				// Argument : the time passed to loop()
+  ACME_CMD_RENEW,
+  ACME_CMD_DISCONNECT,			// Close the HTTP client, see close_pending
+  ACME_CMD_SESSION_CACHE		// Argument : the TlsSessionCache pointer
+};
+
+static const time_t acme_retry_after_max = 86400;	// Don't sleep longer than this on the server's say
+
+// How often to ask for renewal information, unless the server says otherwise (Retry-After)
+static const time_t acme_ari_check_default = 6 * 3600;
+static const time_t acme_ari_check_min = 3600;
+static const time_t acme_ari_check_max = 86400;
 
 /*
  * CTOR / DTOR
@@ -57,12 +83,15 @@ Acme::Acme() {
   account = 0;
   order = 0;
   challenge = 0;
+  challenge_count = 0;
   // location = 0;
-  account_location = 0;
-  nonce = 0;
-  reply_buffer = 0;
-  reply_buffer_len = 0;
-  http01_ix = -1;
+  reply_location = 0;
+  retry_after = 0;
+  for (int i=0; i<acme_nonce_pool_size; i++)
+    nonce_pool[i] = 0;
+  nonce_count = 0;
+  reply_stats_hook = 0;
+  reply_http_status = 0;
   last_run = 0;
   certificate = 0;
 
@@ -80,15 +109,52 @@ Acme::Acme() {
   ftp_user = ftp_pass = 0;
   ftp_path = 0;
 
-  webserver = 0;
-  ws_registered = false;
-  ovf = 0;
+  publisher = 0;
+  own_publisher = false;
 
   accountkey = 0;
   certkey = 0;
-  rsa = 0;
+  account_key_type = cert_key_type = ACME_KEY_RSA2048;
+  account_jwk = account_thumbprint = 0;
+  acme_client = 0;
+  acme_client_origin = 0;
+  acme_client_used = 0;
+  handshakes = 0;
+  acme_client_connected = false;
+  request_sent = reply_started = request_replayed = false;
+  sync_policy = SAFE_FILE_SYNC_FILE;
+  order_dirty = false;
+  order_written_hash = 0;
+  order_writes_avoided = 0;
+  state_fn = 0;
+  directory_fn = 0;
+  directory_ttl = 86400;
+  directory_fetched = 0;
+  directory_stale = false;
+  order_stale = false;
+  local_state_read = false;
+  engine = 0;
+  tick_pending = false;
+  close_pending = false;
+  event_cb = 0;
+  event_arg = 0;
+  next_wake = 0;
+  poll_attempt = 0;
+  poll_min = 2;
+  poll_max = 600;
+  challenge_posted = false;
+  cert_id = ari_cert_id = 0;
+  ari_start = ari_end = ari_renew_at = ari_next_check = 0;
+  renewal_fn = 0;
+  renew_fraction = 0.66;			// About a month before the end of a 90 day certificate
+  renew_jitter = 0.05;
+  state_generation = 0;
+  state_written_crc = 0;
+  account_generation = order_generation = 0;
   root_certificate = 0;
+  tls_session_cache = 0;
   root_certificate_fn = 0;
+  root_certificate_partition = 0;
 
   wait_for_timesync = time_synced = false;
 
@@ -132,27 +198,31 @@ Acme::Acme() {
    * Don't generate private keys automatically.
    * Do load the private keys early on (from files) if they're here.
    */
-  if (account_key_fn && (accountkey = ReadPrivateKey(account_key_fn))) {
-    rsa = mbedtls_pk_rsa(*accountkey);
-  }
+  if (account_key_fn)
+    accountkey = ReadPrivateKey(account_key_fn);
   if (cert_key_fn)
     certkey = ReadPrivateKey(cert_key_fn);
 #endif
 }
 
 Acme::~Acme() {
+  StopTask();
+  setPublisher(0, false);
   ClearAccount();
   ClearOrder();
   ClearChallenge();
   ClearDirectory();
-  if (nonce)
-    free(nonce);
-  if (reply_buffer)
-    free(reply_buffer);
-  reply_buffer_len = 0;
-
-  free(rsa);
-  rsa = 0;
+  ClearNonces();
+  free(reply_location);
+  reply_location = 0;
+  free(cert_id);
+  cert_id = 0;
+  free(ari_cert_id);
+  ari_cert_id = 0;
+  reply_buf.Clear();
+  ClearKeyCache();
+  CloseAcmeClient();
+
   free(entropy);
   entropy = 0;
   free(ctr_drbg);
@@ -188,15 +258,15 @@ bool Acme::checkConfig() {
 }
 
 void Acme::GenerateAccountKey() {
-  accountkey = GeneratePrivateKey();
-  rsa = mbedtls_pk_rsa(*accountkey);
-  if (account_key_fn)
+  accountkey = GeneratePrivateKey(account_key_type);
+  UpdateKeyCache();
+  if (accountkey && account_key_fn)
     WritePrivateKey(accountkey, account_key_fn);
 }
 
 void Acme::GenerateCertificateKey() {
-  certkey = GeneratePrivateKey();
-  if (cert_key_fn)
+  certkey = GeneratePrivateKey(cert_key_type);
+  if (certkey && cert_key_fn)
     WritePrivateKey(certkey, cert_key_fn);
 }
 
@@ -223,11 +293,9 @@ mbedtls_pk_context *Acme::getCertificateKey() {
 
 void Acme::setAccountKey(mbedtls_pk_context *ak) {
   accountkey = ak;
-  if (accountkey) {
-    rsa = mbedtls_pk_rsa(*accountkey);
-    if (account_key_fn)
-      WritePrivateKey(accountkey, account_key_fn);
-  }
+  UpdateKeyCache();
+  if (accountkey && account_key_fn)
+    WritePrivateKey(accountkey, account_key_fn);
 }
 
 void Acme::setCertificateKey(mbedtls_pk_context *ck) {
@@ -236,6 +304,17 @@ void Acme::setCertificateKey(mbedtls_pk_context *ck) {
     WritePrivateKey(certkey, cert_key_fn);
 }
 
+/*
+ * Select the type of key that GenerateAccountKey() and GenerateCertificateKey() create.
+ */
+void Acme::setAccountKeyType(AcmeKeyType t) {
+  account_key_type = t;
+}
+
+void Acme::setCertificateKeyType(AcmeKeyType t) {
+  cert_key_type = t;
+}
+
 /*
  * Network connect / disconnect handlers.
  * These use the esp-idf API for such functions.
@@ -246,27 +325,25 @@ void Acme::NetworkConnected(void *ctx, system_event_t *event) {
   connected = true;
 
   /*
-   * Get startup info :
-   * - the API calls for the ACME server
-   * - an initial nonce
-   * - our account and order status
-   * See if we already have a local certificate
-   *
-   * FIX ME it may be a good idea to postpone the network calls.
-   * Now we do them at each reboot...
+   * Nothing to do here : the directory and the account are only looked up once an order needs
+   * the server (see GetDirectory()), the local certificate is read by loop().
    */
-  if (time_synced || !wait_for_timesync) {
-    QueryAcmeDirectory();
-    RequestNewNonce();
-    RequestNewAccount(email_address, true);	// This looks up the account, doesn't create one.
-
-    ReadCertificate();
-  }
 }
 
+/*
+ * In async mode the ACME task may be in the middle of a query with the client, so it closes it
+ * itself. The flag covers a full command queue : the task then closes at the next command.
+ */
 void Acme::NetworkDisconnected(void *ctx, system_event_t *event) {
   connected = false;
   time_synced = false;
+
+  if (engine && ! engine->OnTask()) {
+    close_pending = true;
+    engine->Post(ACME_CMD_DISCONNECT, 0);
+    return;
+  }
+  CloseAcmeClient();			// The connection is gone anyway
 }
 
 void Acme::WaitForTimesync(bool w) {
@@ -289,19 +366,31 @@ void Acme::TimeSync(struct timeval *tp) {
  *
  * Returns true if there was a change to the certificate.
  */
+/*
+ * In async mode, this only asks the ACME task for a pass : loop() then returns immediately,
+ * and what it would have returned is reported through the event callback.
+ */
 bool Acme::loop(time_t now) {
-  if (wait_for_timesync && !time_synced)
+  if (engine) {
+    if (! tick_pending.exchange(true) && ! engine->Post(ACME_CMD_TICK, now))
+      tick_pending = false;
     return false;
+  }
+  return LoopPass(now);
+}
 
-  if (directory == 0) {
-    QueryAcmeDirectory();
-    RequestNewNonce();
-    RequestNewAccount(email_address, true);	// This looks up the account, doesn't create one.
+bool Acme::LoopPass(time_t now) {
+  if (wait_for_timesync && !time_synced)
+    return false;
 
+  // No network traffic until an order needs it
+  if (! local_state_read) {
     ReadCertificate();
+    ReadRenewalInfo();
+    local_state_read = true;
   }
 
-  if (order) {
+  if (OrderInProgress()) {
     if (AcmeProcess(now))
       return true;
     return false;	// FIXME ? Only look into renewal if we're not processing here.
@@ -315,17 +404,134 @@ bool Acme::loop(time_t now) {
   // If we have a certificate, are we inside the renewal time range
   if (certificate == 0)
     return false;
-  time_t until = TimeMbedToTimestamp(certificate->valid_to);
-  time_t month = 60 * 60 * 24 * 31;
-
-  // TODO
-  if (until - month < now) {
+  CheckRenewalInfo(now);
+  if (RenewalTime() < now) {
     ESP_LOGI(acme_tag, "Renewing certificate from %s", __FUNCTION__);
     RenewCertificate();
   }
   return false;
 }
 
+// A downloaded order is done, unless the certificate went missing
+bool Acme::OrderInProgress() {
+  if (order == 0)
+    return false;
+  return ! (order->status && strcmp(order->status, acme_status_downloaded) == 0 && certificate);
+}
+
+/*
+ * At the time picked in the window that the server suggested, if we have one for this certificate.
+ * Otherwise renew_fraction into its lifetime, give or take renew_jitter : the jitter is derived from
+ * the serial number, so it's the same after a reboot but differs between devices.
+ */
+time_t Acme::RenewalTime() {
+  if (ari_renew_at && cert_id && ari_cert_id && strcmp(cert_id, ari_cert_id) == 0)
+    return ari_renew_at;
+
+  time_t from = TimeMbedToTimestamp(certificate->valid_from);
+  time_t until = TimeMbedToTimestamp(certificate->valid_to);
+
+  uint32_t h = 2166136261u;
+  for (size_t i=0; i<certificate->serial.len; i++) {
+    h ^= certificate->serial.p[i];
+    h *= 16777619u;
+  }
+  float f = renew_fraction + renew_jitter * ((h % 20001) / 10000.0f - 1.0f);
+  if (f < 0)
+    f = 0;
+  if (f > 1)
+    f = 1;
+  return from + (time_t)((until - from) * f);
+}
+
+/*
+ * For an application that wants to sleep (or deep sleep) between calls to loop() :
+ * while an order runs this is when the server should have made progress, otherwise it's
+ * the next certificate check.
+ */
+time_t Acme::nextWakeTime() {
+  if (OrderInProgress())
+    return next_wake;
+
+  time_t t = last_run + 3600;
+  if (certificate) {
+    time_t r = RenewalTime();
+    if (ari_next_check && ari_next_check < r)
+      r = ari_next_check;
+    if (r > t)
+      t = r;
+  }
+  return t;
+}
+
+/*
+ * Async mode : the FSM runs on its own task, with its own stack, so the caller's task (often the
+ * Arduino or app_main loop) doesn't have to be sized for TLS and key generation, and isn't
+ * blocked while we talk to the ACME server.
+ * The task doesn't lock anything : after StartTask(), leave the Acme object to it, and use the
+ * certificate from the event callback. Only loop(), RenewCertificate(), NetworkConnected(),
+ * NetworkDisconnected(), TimeSync(), setTlsSessionCache(), setEventCallback() (before the first
+ * tick) and StopTask() may still be called from other tasks : they only set flags or queue a
+ * command for the task.
+ */
+bool Acme::StartTask(int stack_size, int priority) {
+  if (engine)
+    return true;
+
+  engine = new AcmeTask(TaskHandler, this);
+  if (! engine->Start("acme", stack_size, priority)) {
+    delete engine;
+    engine = 0;
+    return false;
+  }
+  return true;
+}
+
+void Acme::StopTask() {
+  if (engine == 0)
+    return;
+  engine->Stop();
+  delete engine;
+  engine = 0;
+  tick_pending = false;
+  if (close_pending.exchange(false))
+    CloseAcmeClient();
+}
+
+void Acme::setEventCallback(acme_event_cb_t cb, void *arg) {
+  event_cb = cb;
+  event_arg = arg;
+}
+
+void Acme::TaskHandler(void *ctx, int cmd, int64_t arg) {
+  Acme	*me = (Acme *)ctx;
+  bool	changed = false;
+
+  if (me->close_pending.exchange(false))
+    me->CloseAcmeClient();
+
+  switch (cmd) {
+  case ACME_CMD_TICK:
+    me->tick_pending = false;
+    changed = me->LoopPass((time_t)arg);
+    break;
+  case ACME_CMD_RENEW:
+    me->RenewCertificate();
+    break;
+  case ACME_CMD_DISCONNECT:		// Done above
+    return;
+  case ACME_CMD_SESSION_CACHE:
+    me->setTlsSessionCache((TlsSessionCache *)(intptr_t)arg);
+    return;
+  default:
+    ESP_LOGE(acme_tag, "%s: unknown command %d", __FUNCTION__, cmd);
+    return;
+  }
+
+  if (me->event_cb)
+    me->event_cb(me, changed ? ACME_EVENT_CERTIFICATE : ACME_EVENT_DONE, me->event_arg);
+}
+
 /*
  * Some methods and macros to slow down the process.
  * ProcessStep and ProcessCheck make AcmeProcess return after a functional step.
@@ -407,23 +613,116 @@ bool Acme::_ProcessDelay(time_t now) {
  *
  * Returns true if a (new) certificate was downloaded
  */
-static int process_count = 5;
-
+/*
+ * A pass that leaves the order in the state it found it in (the server is still validating or
+ * issuing, or a query failed) is retried after a while : as long as the server asks in its
+ * Retry-After header, or else with exponential backoff.
+ */
 bool Acme::AcmeProcess(time_t now) {
+  char	before[16];
+
+  if (now < next_wake)
+    return false;
+
+  snprintf(before, sizeof(before), "%s", (order && order->status) ? order->status : "");
+  bool r = AcmeProcessPass(now);
+
+  // Whatever changed in the order during this pass is written once, here
+  FlushOrderInfo();
+
+  if (! r && order && strcmp(before, order->status ? order->status : "") == 0)
+    SchedulePoll(now);
+  else {
+    next_wake = 0;
+    poll_attempt = 0;
+  }
+  return r;
+}
+
+void Acme::setPollInterval(time_t min, time_t max) {
+  poll_min = (min > 0) ? min : 1;
+  poll_max = (max > poll_min) ? max : poll_min;
+}
+
+void Acme::SchedulePoll(time_t now) {
+  time_t d = PollDelay();
+
+  next_wake = now + d;
+  poll_attempt++;
+  ESP_LOGI(acme_tag, "%s: order %s, next pass in %ld s", __FUNCTION__,
+    (order && order->status) ? order->status : "new", (long)d);
+}
+
+/*
+ * Retry-After if the server sent one, or else poll_min doubled for every pass that didn't get
+ * anywhere, up to poll_max, and then somewhere between half of that and all of it, so devices
+ * that started together don't keep polling together.
+ */
+time_t Acme::PollDelay() {
+  if (retry_after > 0)
+    return (retry_after < acme_retry_after_max) ? retry_after : acme_retry_after_max;
+
+  time_t d = poll_min;
+  for (int i=0; i<poll_attempt && d < poll_max; i++)
+    d *= 2;
+  if (d > poll_max)
+    d = poll_max;
+
+  return d / 2 + Random() % (d - d / 2 + 1);
+}
+
+uint32_t Acme::Random() {
+  uint32_t r = 0;
+  if (ctr_drbg)
+    mbedtls_ctr_drbg_random(ctr_drbg, (unsigned char *)&r, sizeof(r));
+  return r;
+}
+
+/*
+ * Retry-After is either a number of seconds or an HTTP date (RFC 7231 §7.1.3).
+ */
+/*
+ * Like timegm(), which newlib doesn't have : mktime() would take the time as local time.
+ * Days since the epoch from the civil date, with March as the first month of the year.
+ */
+static time_t UtcTime(const struct tm *tms) {
+  int	y = tms->tm_year + 1900, m = tms->tm_mon + 1;
+
+  if (m <= 2)
+    y--;
+  int	era = (y >= 0 ? y : y - 399) / 400;
+  int	yoe = y - era * 400;
+  int	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + tms->tm_mday - 1;
+  int	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  long	days = era * 146097L + doe - 719468;
+
+  return (time_t)days * 86400 + tms->tm_hour * 3600 + tms->tm_min * 60 + tms->tm_sec;
+}
+
+time_t Acme::ParseRetryAfter(const char *v) {
+  char *e;
+  long secs = strtol(v, &e, 10);
+  if (e != v && *e == 0)
+    return (secs > 0) ? secs : 0;
+
+  // HTTP-date (RFC 7231), always in GMT
+  struct tm tms;
+  memset(&tms, 0, sizeof(tms));
+  e = strptime(v, "%a, %d %b %Y %H:%M:%S GMT", &tms);
+  if (e == 0 || *e != 0)
+    return 0;
+  time_t t = UtcTime(&tms) - time(0);
+  return (t > 0) ? t : 0;
+}
+
+bool Acme::AcmeProcessPass(time_t now) {
   if (! checkConfig())
     return false;		// Silent
 
   ProcessStep(ACME_STEP_NONE);
   ProcessDelay(now);
 
-  /*
-   * Note keep the two checks in this order.
-   * If directory == 0 we only print limited number of error messages.
-   */
-  if (process_count-- < 0) {
-    return false;
-  }
-  if (directory == 0) {
+  if (! GetDirectory()) {
     ESP_LOGE(acme_tag, "%s: no directory", __FUNCTION__);
     return false;
   }
@@ -462,7 +761,7 @@ bool Acme::AcmeProcess(time_t now) {
       ESP_LOGD(acme_tag, "%s request new order", __FUNCTION__);
       // RequestNewOrder(acme_url);
       RequestNewOrder(acme_url, alt_urls);
-      WriteOrderInfo();
+      MarkOrderDirty();
       return false;
     }
   }
@@ -474,50 +773,56 @@ bool Acme::AcmeProcess(time_t now) {
 
   // Check deeper
   bool invalid = false;
-  if (challenge && strcmp(challenge->status, acme_status_invalid) == 0) {
-    ProcessStep(ACME_STEP_CHALLENGE);
-    ESP_LOGE(acme_tag, "%s : %s challenge, starting a new order", __FUNCTION__, acme_status_invalid);
-    invalid = true;
-  } else if (challenge && challenge->challenges) {
+  for (int i=0; i<challenge_count && ! invalid; i++) {
+    Challenge *c = &challenge[i];
     ProcessStep(ACME_STEP_CHALLENGE);
-    for (int i=0; challenge->challenges[i].status; i++)
-      if (strcmp(challenge->challenges[i].status, acme_status_invalid) == 0) {
-	ESP_LOGE(acme_tag, "%s : %s challenge[%d], starting a new order", __FUNCTION__, acme_status_invalid, i);
+    if (c->status && strcmp(c->status, acme_status_invalid) == 0) {
+      ESP_LOGE(acme_tag, "%s : %s authorization %d, starting a new order", __FUNCTION__, acme_status_invalid, i);
+      invalid = true;
+    }
+    for (int j=0; j<c->nchallenges && ! invalid; j++)
+      if (c->challenges[j].status && strcmp(c->challenges[j].status, acme_status_invalid) == 0) {
+	ESP_LOGE(acme_tag, "%s : %s challenge[%d] of authorization %d, starting a new order", __FUNCTION__,
+	  acme_status_invalid, j, i);
         invalid = true;
-	break;
       }
   }
   if (invalid) {
     RequestNewOrder(acme_url, alt_urls);
-    WriteOrderInfo();
+    MarkOrderDirty();
     return false;
   }
   ProcessCheck(ACME_STEP_CHALLENGE, "Challenge");
 
   if (strcmp(order->status, acme_status_pending) == 0) {
     ProcessStep(ACME_STEP_VALIDATE);
-    bool ok = ValidateOrder();
-    ESP_LOGI(acme_tag, "%s: ValidateOrder -> %s", __FUNCTION__, ok ? "ok" : "fail");
-    WriteOrderInfo();
+    if (challenge_posted) {
+      bool ok = PollAuthorization();
+      ESP_LOGI(acme_tag, "%s: PollAuthorization -> %s", __FUNCTION__, ok ? "ok" : "not yet");
+    } else {
+      bool ok = ValidateOrder();
+      ESP_LOGI(acme_tag, "%s: ValidateOrder -> %s", __FUNCTION__, ok ? "ok" : challenge_posted ? "waiting" : "fail");
+    }
+    MarkOrderDirty();
   }
   ProcessCheck(ACME_STEP_VALIDATE, "Validate");
 
   if (strcmp(order->status, acme_status_ready) == 0) {
     ProcessStep(ACME_STEP_FINALIZE);
     FinalizeOrder();
-    WriteOrderInfo();
+    MarkOrderDirty();
   }
   ProcessCheck(ACME_STEP_FINALIZE, "Finalize");
 
   if (strcmp(order->status, acme_status_processing) == 0) {
-    ;
+    // The server is issuing the certificate, ask how far it got
+    PollOrder();
   }
   if (strcmp(order->status, acme_status_downloaded) == 0) {
     // There shouldn't be anything here, but if the downloaded file goes bust, download it again.
     if (certificate == 0) {
-      free(order->status);
-      order->status = strdup(acme_status_valid);
-      WriteOrderInfo();
+      order->status = order_arena.Strdup(acme_status_valid);
+      MarkOrderDirty();
     }
   }
   if (strcmp(order->status, acme_status_valid) == 0) {
@@ -525,17 +830,16 @@ bool Acme::AcmeProcess(time_t now) {
     ProcessStep(ACME_STEP_DOWNLOAD);
     if (order->certificate) {
       ok = DownloadCertificate();
-      WriteOrderInfo();
+      MarkOrderDirty();
     }
 
-    if (ws_registered)
-      DisableLocalWebServer();
+    if (publisher)
+      publisher->Reset();
 
     if (ok) {
-      free(order->status);
-      order->status = strdup(acme_status_downloaded);		// an additional status
+      order->status = order_arena.Strdup(acme_status_downloaded);		// an additional status
     }
-    WriteOrderInfo();
+    MarkOrderDirty();
 
     if (ok)
       return true;
@@ -546,10 +850,9 @@ bool Acme::AcmeProcess(time_t now) {
     // Something went wrong with this order, need to restart a new order
     // RequestNewOrder(acme_url);
     RequestNewOrder(acme_url, alt_urls);
-    WriteOrderInfo();
-
-    if (ws_registered)
-      DisableLocalWebServer();
+    MarkOrderDirty();
+    if (publisher)
+      publisher->Reset();
 
     return false;
   }
@@ -570,12 +873,7 @@ bool Acme::CreateNewAccount() {
       time_synced ? "yes" : "no");
     return false;
   }
-  if (directory == 0) {
-    ESP_LOGD(acme_tag, "%s: directory NULL", __FUNCTION__);
-    QueryAcmeDirectory();
-    RequestNewNonce();
-  }
-  if (directory == 0) {
+  if (! GetDirectory()) {
     ESP_LOGE(acme_tag, "%s: directory NULL", __FUNCTION__);
     return false;
   }
@@ -611,6 +909,10 @@ bool Acme::CreateNewAccount() {
  * This creates a structure so the process gets triggered
  */
 void Acme::CreateNewOrder() {
+  handshakes = 0;
+  next_wake = 0;
+  poll_attempt = 0;
+  challenge_posted = false;
   ClearOrder();
   order = (Order *)malloc(sizeof(Order));
   memset((void *)order, 0, sizeof(Order));
@@ -621,97 +923,49 @@ void Acme::CreateNewOrder() {
  * Caller needs to free the result.
  */
 char *Acme::Base64(const char *s) {
-  size_t olen;
-
   if (s == 0) {
     ESP_LOGD(acme_tag, "%s : null", __FUNCTION__);
     return 0;
   }
 
-  int sl = strlen(s);
-  if (sl == 0) {
-    ESP_LOGD(acme_tag, "%s : empty string", __FUNCTION__);
-    char *r = (char *)malloc(1);
-    *r = 0;
-    return r;
-  }
-
-  (void) mbedtls_base64_encode(0, 0, &olen, (const unsigned char *)s, sl);
-  char *r = (char *)malloc(olen + 1);
-  (void) mbedtls_base64_encode((unsigned char *)r, olen+1, &olen, (const unsigned char *)s, sl);
-
-  // Replace some characters by acceptable ones, without making the string longer. Also in the RFCs.
-  for (int i=0; i<=olen; i++)
-    if (r[i] == '+')
-      r[i] = '-';
-    else if (r[i] == '/')
-      r[i] = '_';
-    else if (r[i] == '=')
-      r[i] = 0;	
-
-  return r;
+  return Base64(s, strlen(s));
 }
 
 // And the opposite
 char *Acme::Unbase64(const char *s) {
   int len = strlen(s);
-  char *r = (char *)malloc(len+4);	// For a trailing 0 and up to 2 trailing '='
-  for (int i=0; i<=len; i++)
-    if (s[i] == '-')
-      r[i] = '+';
-    else if (s[i] == '_')
-      r[i] = '/';
-    else if (s[i] == 0) {
-      r[i]   = '=';
-      r[i+1] = '=';
-      r[i+2] = 0;
-    } else
-      r[i] = s[i];
-
-  size_t olen = 0;
-  (void) mbedtls_base64_decode(0, 0, &olen, (const unsigned char *)r, len);
-
-  ESP_LOGI(acme_tag, "%s: strlen -> %d, olen %d", __FUNCTION__, len, olen);
+  size_t olen = base64url_decoded_len(len);
+
   char *obuf = (char *)malloc(olen+1);
   if (obuf == 0) {
     ESP_LOGE(acme_tag, "%s: malloc -> 0, errno %d", __FUNCTION__, errno);
-    free(r);
     return 0;
   }
-  int err = mbedtls_base64_decode((unsigned char *)obuf, olen+1, &olen, (const unsigned char *)r, len);
-  if (err != 0) {
-    char buf[80];
-    mbedtls_strerror(err, buf, sizeof(buf));
-    ESP_LOGE(acme_tag, "%s: mbedtls_base64_decode error %d %s", __FUNCTION__, err, buf);
-    free(r);
+  int r = base64url_decode(obuf, olen, s, len);
+  if (r < 0) {
+    ESP_LOGE(acme_tag, "%s: invalid base64url input", __FUNCTION__);
     free(obuf);
     return 0;
   }
-  free(r);
+  obuf[r] = 0;
   return obuf;
 }
 
 /*
  * Support stuff
+ * Encoding is done in one pass, straight into a buffer of the right size (see Base64url.h).
  */
 char *Acme::Base64(const char *s, int len) {
   if (s == 0)
     return 0;
 
-  size_t olen;
-  (void) mbedtls_base64_encode(0, 0, &olen, (const unsigned char *)s, len);
-
-  char *r = (char *)malloc(olen + 1);
-  (void) mbedtls_base64_encode((unsigned char *)r, olen+1, &olen, (const unsigned char *)s, len);
-
-  // Replace some characters by acceptable ones, without making the string longer. Also in the RFCs.
-  for (int i=0; i<=olen; i++)
-    if (r[i] == '+')
-      r[i] = '-';
-    else if (r[i] == '/')
-      r[i] = '_';
-    else if (r[i] == '=')
-      r[i] = 0;	
+  size_t olen = base64url_encoded_len(len) + 1;
+  char *r = (char *)malloc(olen);
+  if (r == 0) {
+    ESP_LOGE(acme_tag, "%s: malloc(%d) failed", __FUNCTION__, (int)olen);
+    return 0;
+  }
+  (void) base64url_encode(r, olen, s, len);
 
   return r;
 }
@@ -731,63 +985,147 @@ char *Acme::Base64(const char *s, int len) {
  * {"url": "https://acme-staging-v02.api.letsencrypt.org/acme/new-acct", "jwk": {"kty": "RSA",
  *  "n": "...", "e": "AQAB"}, "alg": "ES256", "nonce": "U8b_2ZGRATuySa9yPOF3JDN4JXTyEdAfrL--WTzqYKQ"}
  */
-char *Acme::MakeMessageJWK(char *url, char *payload, char *jwk) {
+char *Acme::MakeMessageJWK(char *url, char *payload, const char *jwk) {
   ESP_LOGD(acme_tag, "%s(%s,%s,%s)", __FUNCTION__, url, payload, jwk);
 
-  int sz = 0;
-  char *p_rotected = 0;
+  return MakeJWS(url, payload, jwk);
+}
+
+/*
+ * Build a JWS in Flattened JSON Serialization (RFC 7515 §7.2.2), as RFC 8555 §6.2 wants.
+ * With a jwk, this is a message for newAccount or revokeCert, without one the "kid" field
+ * (our account URL) is used.
+ *
+ * All sizes are known up front : base64url has no padding, and the signature length follows
+ * from the key. So the result is allocated once, and the protected header, payload and signature
+ * are encoded straight into it. The plain protected header and the raw signature live in the
+ * same allocation, behind the message. The signing input ("protected.payload") is hashed piece
+ * by piece instead of being copied together first.
+ *
+ * Caller must free the result.
+ */
+char *Acme::MakeJWS(const char *url, const char *payload, const char *jwk) {
+  const char	*part1 = "{\n  \"protected\": \"",
+		*part2 = "\",\n  \"payload\": \"",
+		*part3 = "\",\n  \"signature\": \"",
+		*part4 = "\"\n}";
+  const char	*alg = JWSAlgorithm();
+  char		*my_nonce;
+  int		hlen;
+
+  if (accountkey == 0) {
+    ESP_LOGE(acme_tag, "%s: no account key", __FUNCTION__);
+    return 0;
+  }
+  if (jwk == 0 && (account == 0 || account->location == 0)) {
+    ESP_LOGE(acme_tag, "%s: location null", __FUNCTION__);
+    return 0;
+  }
+  if ((my_nonce = GetNonce()) == 0)
+    return 0;
+
+  if (jwk)
+    hlen = snprintf(0, 0, acme_message_jwk_template1, url, jwk, alg, my_nonce);
+  else
+    hlen = snprintf(0, 0, acme_protected_kid_template, alg, my_nonce, url, account->location);
+  if (hlen < 0) {
+    free(my_nonce);
+    return 0;
+  }
+
+  size_t pllen = strlen(payload);
+  size_t siglen = mbedtls_pk_can_do(accountkey, MBEDTLS_PK_ECDSA) ? 64 : mbedtls_pk_get_len(accountkey);
+  size_t pr64 = base64url_encoded_len(hlen),
+	 pl64 = base64url_encoded_len(pllen),
+	 sig64 = base64url_encoded_len(siglen);
+  size_t len = strlen(part1) + pr64 + strlen(part2) + pl64 + strlen(part3) + sig64 + strlen(part4);
 
-  char *my_nonce = GetNonce();
-  if (my_nonce == 0)
+  // Message, then the plain protected header, then the raw signature
+  char *js = (char *)malloc(len + 1 + hlen + 1 + siglen);
+  if (js == 0) {
+    ESP_LOGE(acme_tag, "%s: malloc(%d) failed", __FUNCTION__, (int)(len + hlen + siglen + 2));
+    free(my_nonce);
     return 0;
+  }
+  char *hdr = js + len + 1;
+  unsigned char *sig = (unsigned char *)hdr + hlen + 1;
 
-  // First use snprintf to calculate size, then allocate, then actually make the message
-  // "{\"url\": \"%s\", \"jwk\": %s, \"alg\": \"RS256\", \"nonce\": \"%s\"}",
-  sz = snprintf(p_rotected, sz, acme_message_jwk_template1, url, jwk, my_nonce);
-  if (sz < 0)
+  if (jwk)
+    snprintf(hdr, hlen + 1, acme_message_jwk_template1, url, jwk, alg, my_nonce);
+  else
+    snprintf(hdr, hlen + 1, acme_protected_kid_template, alg, my_nonce, url, account->location);
+  free(my_nonce);
+  ESP_LOGD(acme_tag, "%s: protected %s", __FUNCTION__, hdr);
+
+  char *p = js;
+  memcpy(p, part1, strlen(part1));
+  p += strlen(part1);
+  char *pr = p;
+  p += base64url_encode(p, pr64 + 1, hdr, hlen);
+  memcpy(p, part2, strlen(part2));
+  p += strlen(part2);
+  char *pl = p;
+  p += base64url_encode(p, pl64 + 1, payload, pllen);
+  memcpy(p, part3, strlen(part3));
+  p += strlen(part3);
+
+  // Hash the signing input without building it
+  unsigned char hash[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  int ret = mbedtls_sha256_starts_ret(&sha, 0);
+  if (ret == 0) ret = mbedtls_sha256_update_ret(&sha, (const unsigned char *)pr, pr64);
+  if (ret == 0) ret = mbedtls_sha256_update_ret(&sha, (const unsigned char *)".", 1);
+  if (ret == 0) ret = mbedtls_sha256_update_ret(&sha, (const unsigned char *)pl, pl64);
+  if (ret == 0) ret = mbedtls_sha256_finish_ret(&sha, hash);
+  mbedtls_sha256_free(&sha);
+  if (ret != 0) {
+    char buf[80];
+    mbedtls_strerror(ret, buf, sizeof(buf));
+    ESP_LOGE(acme_tag, "%s: sha256 failed %s (0x%04x)", __FUNCTION__, buf, -ret);
+    free(js);
     return 0;
-  sz++;
-  p_rotected = (char *)malloc(sz);
-  // "{\"url\": \"%s\", \"jwk\": %s, \"alg\": \"RS256\", \"nonce\": \"%s\"}",
-  snprintf(p_rotected, sz, acme_message_jwk_template1, url, jwk, my_nonce);
-  ESP_LOGD(acme_tag, "p_rotected 2 (sz %d, len %d) %s", sz, strlen(p_rotected), p_rotected);
-
-  char *p_rotected64 = Base64(p_rotected);
-  free(p_rotected);
-  char *p_ayload = Base64(payload);
-  char *s_ignature = Signature(p_rotected64, p_ayload);
-
-  sz = 0;
-  char *js = 0;
-  // First use snprintf to calculate size, then allocate, then actually make the message
-  // "{\n  \"protected\": \"%s\",\n  \"payload\": \"%s\",\n  \"signature\": \"%s\"\n}",
-  sz = snprintf(js, sz, acme_message_jwk_template2, p_rotected64, p_ayload, s_ignature);
-  if (sz < 0) {
-    free(p_ayload);
-    free(s_ignature);
+  }
+
+  size_t sl = 0;
+  if (! SignHash(hash, sig, &sl) || sl != siglen) {
+    free(js);
     return 0;
   }
-  sz++;
-  js = (char *)malloc(sz);
-  // "{\n  \"protected\": \"%s\",\n  \"payload\": \"%s\",\n  \"signature\": \"%s\"\n}",
-  snprintf(js, sz, acme_message_jwk_template2, p_rotected64, p_ayload, s_ignature);
-  free(p_ayload);
-  free(s_ignature);
-  ESP_LOGD(acme_tag, "js 2 (sz %d len %d) %s", sz, strlen(js), js);
+  p += base64url_encode(p, sig64 + 1, sig, sl);
+  memcpy(p, part4, strlen(part4) + 1);
 
+  ESP_LOGD(acme_tag, "%s: (len %d) %s", __FUNCTION__, (int)len, js);
   return js;
 }
 
 /*
  * Caller must free
  *
- * This basically prints out the N (public key modulus) field from the key in the RSA context pointer.
+ * For an EC key, this is the public point (x and y coordinates, RFC 7518 §6.2.1).
+ * For RSA, this basically prints out the N (public key modulus) field from the key in the RSA context pointer.
  * We're extracting the N and E mpi's. Note that their type is char * but they're not strings.
  * Can start with 0 if not allocated properly, and not null-terminated. Hence the two-parameter call to Base64().
  */
 char *Acme::MakeJWK() {
   int err;
 
+  if (mbedtls_pk_can_do(accountkey, MBEDTLS_PK_ECDSA)) {
+    char *x64, *y64;
+    if (! ExportEcPoint(&x64, &y64))
+      return 0;
+
+    int len = strlen(acme_jwk_ec_template) + strlen(x64) + strlen(y64) + 4;
+    char *r = (char *)malloc(len);
+    sprintf(r, acme_jwk_ec_template, x64, y64);
+    free(x64);
+    free(y64);
+
+    ESP_LOGD(acme_tag, "%s -> %s", __FUNCTION__, r);
+    return r;
+  }
+
+  mbedtls_rsa_context *rsa = mbedtls_pk_rsa(*accountkey);
   int ne = 4;						// E will be at the rear end of this array
   unsigned char	E[4];
   int nl = mbedtls_rsa_get_len(rsa);
@@ -797,6 +1135,7 @@ char *Acme::MakeJWK() {
     char buf[80];
     mbedtls_strerror(err, buf, sizeof(buf));
     ESP_LOGE(acme_tag, "%s: failed rsa_export_raw %d %s", __FUNCTION__, err, buf);
+    free(N);
     return 0;
   }
 
@@ -823,82 +1162,131 @@ char *Acme::MakeJWK() {
 }
 
 /*
- * RFC 8555 (ACME v2) says (§6.2) : encapsulate payload in a JWS (RFC7515) object,
- * using Flattened JSON Serialization.
- *
- * RFC 7518 (JWS) §3.3 : A key of size 2048 bits or larger MUST be used with these algorithms.
- *
  * Signature as specified by JWS (https://tools.ietf.org/html/rfc7515).
  * This must be JSON Web Signature (see RFC 8555, §6.1).
  *
- * Parameters are already base64-url formatted
+ * RFC 7518 (JWS) §3.3 : A key of size 2048 bits or larger MUST be used with these algorithms.
  *
- * Caller should free the result
+ * Sign the SHA-256 hash of the signing input with the account key. For RS256 this is PKCS#1 v1.5
+ * (mbedtls_pk_get_len() bytes), for ES256 it's R and S as two 32 byte big endian numbers
+ * (RFC 7518 §3.4), not the ASN.1 structure that mbedtls_pk_sign() produces.
  */
-char *Acme::Signature(const char *pr, const char *pl) {
+bool Acme::SignHash(const unsigned char *hash, unsigned char *signature, size_t *signature_size) {
   int ret;
   char buf[80];
 
-  ESP_LOGD(acme_tag, "PR %s", pr);
-  ESP_LOGD(acme_tag, "PL %s", pl);
-
-  int len = strlen(pr) + strlen(pl) + 4;
-  char *bb = (char *)malloc(len);
-  sprintf(bb, "%s.%s", pr, pl);
-  ESP_LOGD(acme_tag, "signing input (length %d) {%s}", strlen((char *)bb), bb);
-
-  // Generate a digital signature
-  unsigned char *signature = (unsigned char *)calloc(2, mbedtls_pk_get_len(accountkey));	// hack
-  if (! signature) {
-    ESP_LOGE(acme_tag, "calloc failed, mbedtls_pk_get_len %d", mbedtls_pk_get_len(accountkey));
-    free(bb);
-    return 0;
-  }
-  int hash_size = 32;
-  unsigned char *hash = (unsigned char *)calloc(1, hash_size);
-  if (hash == 0) {
-    ESP_LOGE(acme_tag, "calloc(32) failed");
-    free(signature);
-    free(bb);
-    return 0;
-  }
-
-  const mbedtls_md_info_t *mdi = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-  if (!mdi) {
-    ESP_LOGE("Acme", "mbedtls_hash_get_len: md_info not found");
-    free(signature);
-    free(hash);
-    return 0;
-  }
-  ret = mbedtls_md(mdi, (const unsigned char *)bb, strlen(bb), (unsigned char *)hash);
-  free(bb); bb = 0;
-  if (ret != 0) {
-    mbedtls_strerror(ret, buf, sizeof(buf));
-    ESP_LOGE(acme_tag, "mbedtls_hash_fast failed %s (0x%04x)", buf, -ret);
-    free(signature);
-    free(hash);
-    return 0;
-  }
+  *signature_size = 0;
+  if (mbedtls_pk_can_do(accountkey, MBEDTLS_PK_ECDSA)) {
+    mbedtls_ecp_keypair *ec = mbedtls_pk_ec(*accountkey);
+    mbedtls_mpi r, s;
+
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    ret = mbedtls_ecdsa_sign(&ec->grp, &r, &s, &ec->d, hash, 32, mbedtls_ctr_drbg_random, ctr_drbg);
+    if (ret == 0)
+      ret = mbedtls_mpi_write_binary(&r, signature, 32);
+    if (ret == 0)
+      ret = mbedtls_mpi_write_binary(&s, signature + 32, 32);
+    mbedtls_mpi_free(&r);
+    mbedtls_mpi_free(&s);
+    *signature_size = 64;
+  } else
+    ret = mbedtls_pk_sign(accountkey, MBEDTLS_MD_SHA256, hash, 32, signature, signature_size, mbedtls_ctr_drbg_random, ctr_drbg);
 
-  size_t signature_size = 0;
-  ret = mbedtls_pk_sign(accountkey, MBEDTLS_MD_SHA256, hash, hash_size, signature, &signature_size, mbedtls_ctr_drbg_random, ctr_drbg);
   if (ret != 0) {
     mbedtls_strerror(ret, buf, sizeof(buf));
     ESP_LOGE(acme_tag, "mbedtls_pk_sign failed %s (0x%04x)", buf, -ret);
-    free(signature);
-    free(hash);
-    return 0;
+    return false;
   }
 
-  ESP_LOGD(acme_tag, "%s: signature size %d", __FUNCTION__, signature_size);
+  ESP_LOGD(acme_tag, "%s: signature size %d", __FUNCTION__, *signature_size);
+  return true;
+}
+
+#ifndef ARDUINOJSON_5
+/*
+ * ACME replies are parsed with a filter, so only the fields that we use end up in the JSON document,
+ * whatever else the server sends. The document is sized from the filter : the reply buffer is
+ * parsed in place, so strings take no room, only the fields do. Arrays in a filter are described
+ * by one element, the document has room for acme_json_max_array of them.
+ */
+void Acme::FilterReplyStatus(JsonDocument &filter) {
+  filter[acme_json_status] = true;
+  filter[acme_json_type] = true;
+  filter[acme_json_detail] = true;
+}
+
+size_t Acme::FilterDirectory(JsonDocument &filter) {
+  filter["newAccount"] = true;
+  filter["newNonce"] = true;
+  filter["newOrder"] = true;
+  filter[acme_json_renewal_info] = true;
+  return filter.memoryUsage();
+}
+
+size_t Acme::FilterRenewalInfo(JsonDocument &filter) {
+  FilterReplyStatus(filter);
+  filter[acme_json_suggested_window][acme_json_start] = true;
+  filter[acme_json_suggested_window][acme_json_end] = true;
+  return filter.memoryUsage();
+}
+
+size_t Acme::FilterAccount(JsonDocument &filter) {
+  FilterReplyStatus(filter);
+  filter[acme_json_key][acme_json_kty] = true;
+  filter[acme_json_key][acme_json_n] = true;
+  filter[acme_json_key][acme_json_e] = true;
+  filter["initialIp"] = true;
+  filter["createdAt"] = true;
+  filter[acme_json_contact] = true;
+  return filter.memoryUsage() + JSON_ARRAY_SIZE(acme_json_max_array);
+}
+
+size_t Acme::FilterOrder(JsonDocument &filter) {
+  FilterReplyStatus(filter);
+  filter[acme_json_expires] = true;
+  filter[acme_json_finalize] = true;
+  filter[acme_json_certificate] = true;
+  filter[acme_json_identifiers][0][acme_json_type] = true;
+  filter[acme_json_identifiers][0][acme_json_value] = true;
+  filter[acme_json_authorizations] = true;
+  return filter.memoryUsage()
+    + acme_json_max_array * (JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(2))	// identifiers
+    + JSON_ARRAY_SIZE(acme_json_max_array);				// authorizations
+}
+
+size_t Acme::FilterAuthorization(JsonDocument &filter) {
+  FilterReplyStatus(filter);
+  filter[acme_json_expires] = true;
+  filter[acme_json_identifier][acme_json_value] = true;
+  filter["challenges"][0][acme_json_type] = true;
+  filter["challenges"][0][acme_json_status] = true;
+  filter["challenges"][0][acme_json_url] = true;
+  filter["challenges"][0][acme_json_token] = true;
+  return filter.memoryUsage() + acme_json_max_array * (JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(4));
+}
 
-  /* Base64-encode and return.. it's important to use signature_size from mbedtls_pk_sign,
-   * the signature can contain 0 bytes. */
-  char *s = Base64((char *)signature, signature_size);
-  free(signature);
+size_t Acme::FilterChallenge(JsonDocument &filter) {
+  FilterReplyStatus(filter);
+  return filter.memoryUsage();
+}
 
-  return s;
+/*
+ * Parse reply in place (it must stay around while root is used), keeping only what filter asks for.
+ */
+DeserializationError Acme::ParseReply(DynamicJsonDocument &root, char *reply, JsonDocument &filter) {
+  if (reply == 0)
+    return DeserializationError(DeserializationError::EmptyInput);
+
+  DeserializationError je = deserializeJson(root, reply, DeserializationOption::Filter(filter));
+  if (je == DeserializationError::NoMemory || root.overflowed())
+    ESP_LOGE(acme_tag, "%s: reply doesn't fit in %d bytes, more than %d array elements ?", __FUNCTION__,
+      (int)root.capacity(), acme_json_max_array);
+  else
+    ESP_LOGD(acme_tag, "%s: %d of %d bytes used", __FUNCTION__, (int)root.memoryUsage(), (int)root.capacity());
+  return je;
 }
+#endif
 
 /***************************************************
  * And now for real ACME ...
@@ -917,7 +1305,7 @@ void Acme::QueryAcmeDirectory() {
     return;
   }
 
-  if (root_certificate_fn != 0 && root_certificate == 0)
+  if ((root_certificate_fn != 0 || root_certificate_partition != 0) && root_certificate == 0)
     ReadRootCertificate();
   if (root_certificate == 0) {
     ESP_LOGE(acme_tag, "%s: failed, no root certificate", __FUNCTION__);
@@ -941,13 +1329,14 @@ void Acme::QueryAcmeDirectory() {
   JsonObject &root = jb.parseObject(reply);
   if (! root.success())
 #else
-  DynamicJsonDocument root(512);
-  DeserializationError je = deserializeJson(root, reply);
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterDirectory(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
   if (je)
 #endif
   {
     ESP_LOGE(acme_tag, "Could not parse JSON");
-    free(reply);
+    FreeReply(reply);
     return;
   }
   directory = (Directory *)malloc(sizeof(Directory));
@@ -967,8 +1356,11 @@ void Acme::QueryAcmeDirectory() {
   SD(directory->newAccount, "newAccount");
   SD(directory->newNonce, "newNonce");
   SD(directory->newOrder, "newOrder");
+  SD(directory->renewalInfo, acme_json_renewal_info);
+  directory_fetched = time(0);
+  directory_stale = false;
 
-  free(reply);
+  FreeReply(reply);
 
   if (directory->newAccount == 0 || directory->newNonce == 0 || directory->newOrder == 0)
     ESP_LOGE(acme_tag, "%s: incomplete results : newAccount %p newNonce %p newOrder %p", __FUNCTION__,
@@ -985,6 +1377,7 @@ void Acme::ClearDirectory() {
     if (directory->newAccount) free(directory->newAccount);
     if (directory->newNonce) free(directory->newNonce);
     if (directory->newOrder) free(directory->newOrder);
+    if (directory->renewalInfo) free(directory->renewalInfo);
     free(directory);
     directory = 0;
   }
@@ -992,7 +1385,8 @@ void Acme::ClearDirectory() {
 
 /*
  * Nonce : this is an ACME v1 vs v2 difference : make sure the server only gets queries in a sequence.
- * Each ACME query will include the "nonce" that its predecessor received from the server.
+ * Each ACME query will include a "nonce" received from the server. Every reply carries a new one,
+ * these are kept in nonce_pool, so this query is only needed when the pool is empty.
  *
  * We send a HEAD query to the URL in the directory, and fetch the header "Replay-Nonce" in the reply.
  * This requires a 3 function implementation because the esp_http_client API doesn't expose reply headers except in an event handler.
@@ -1000,7 +1394,6 @@ void Acme::ClearDirectory() {
  */
 bool Acme::RequestNewNonce() {
   esp_err_t			err;
-  esp_http_client_config_t	httpc;
   esp_http_client_handle_t	client;
 
   if (directory == 0) {
@@ -1008,15 +1401,6 @@ bool Acme::RequestNewNonce() {
     return false;
   }
 
-  if (nonce) {
-    ESP_LOGE(acme_tag, "%s but nonce present (%s)", __FUNCTION__, nonce);
-
-    free(nonce);
-    nonce = 0;
-  } else {
-    ESP_LOGD(acme_tag, "%s", __FUNCTION__);
-  }
-
   if (directory->newNonce == 0) {
     ESP_LOGE(acme_tag, "%s: we have no newNonce URL", __FUNCTION__);
     return false;
@@ -1024,96 +1408,109 @@ bool Acme::RequestNewNonce() {
 
   ESP_LOGD(acme_tag, "%s(%s)", __FUNCTION__, directory->newNonce);
 
-  memset(&httpc, 0, sizeof(httpc));
-  httpc.url = directory->newNonce;
-  httpc.event_handler = NonceHttpEvent;
-  httpc.crt_bundle_attach = esp_crt_bundle_attach;
-  if (root_certificate)
-    httpc.cert_pem = root_certificate;	// Required in esp-idf 4.3 for https
-
-  client = esp_http_client_init(&httpc);
-
-  SetAcmeUserAgentHeader(client);
+  if ((client = AcmeClient(directory->newNonce)) == 0)
+    return false;
 
+  esp_http_client_set_post_field(client, 0, 0);
+  esp_http_client_delete_header(client, acme_accept_header);
   if ((err = esp_http_client_set_method(client, HTTP_METHOD_HEAD)) != ESP_OK) {
     ESP_LOGE(acme_tag, "%s: client_set_method error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-    esp_http_client_cleanup(client);
     return false;
   }
   ESP_LOGD(acme_tag, "%s set_method(HEAD) ok", __FUNCTION__);
 
-  if ((err = esp_http_client_perform(client)) != ESP_OK) {
+  if ((err = AcmeClientPerform(client)) != ESP_OK) {
     ESP_LOGE(acme_tag, "%s: client_perform error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-    esp_http_client_cleanup(client);
+    CloseAcmeClient();
     return false;
   }
   ESP_LOGD(acme_tag, "%s client_perform ok", __FUNCTION__);
 
-  esp_http_client_close(client);
-  esp_http_client_cleanup(client);
-
-  nonce_use = 0;
-
   // It should already be there, so report back
-  return (nonce != 0);
+  if (nonce_count == 0) {
+    ESP_LOGE(acme_tag, "%s: no nonce from %s (HTTP status %d)", __FUNCTION__, directory->newNonce,
+      esp_http_client_get_status_code(client));
+    InvalidateDirectory();			// Perhaps it moved
+    return false;
+  }
+  return true;
 }
 
+/*
+ * Take the most recent nonce out of the pool, only ask the server for one if the pool is empty.
+ */
 char *Acme::GetNonce() {
-  nonce_use++;
-  if (nonce_use == 1)
-    return nonce;
-  ESP_LOGE(acme_tag, "%s: nonce_use %d", __FUNCTION__, nonce_use);
-  return NULL;
+  if (nonce_count == 0 && ! RequestNewNonce()) {
+    ESP_LOGE(acme_tag, "%s: no nonce", __FUNCTION__);
+    return NULL;
+  }
+  char *r = nonce_pool[--nonce_count];
+  nonce_pool[nonce_count] = 0;
+  return r;
 }
 
-esp_err_t Acme::NonceHttpEvent(esp_http_client_event_t *event) {
-  if (event->event_id == HTTP_EVENT_ON_HEADER) {
-    ESP_LOGD("Acme", "%s: header %s value %s", __FUNCTION__, event->header_key, event->header_value);
-    if (strcmp(event->header_key, acme_nonce_header) == 0)
-      acme->setNonce(event->header_value);
+void Acme::ClearNonces() {
+  for (int i=0; i<nonce_count; i++) {
+    free(nonce_pool[i]);
+    nonce_pool[i] = 0;
   }
-  return ESP_OK;
+  nonce_count = 0;
 }
 
 /*
  * These are handlers called by HttpEvent() so we can pick up stuff from HTTP headers in replies from the ACME server.
  */
 void Acme::setNonce(char *s) {
-  if (nonce)
-    free(nonce);
-  nonce = strdup(s);
-  nonce_use = 0;
+  // When the pool is full, drop the oldest
+  if (nonce_count == acme_nonce_pool_size) {
+    free(nonce_pool[0]);
+    memmove(&nonce_pool[0], &nonce_pool[1], (acme_nonce_pool_size - 1) * sizeof(char *));
+    nonce_count--;
+  }
+  nonce_pool[nonce_count++] = strdup(s);
 
-  ESP_LOGD(acme_tag, "%s(%s)", __FUNCTION__, nonce);
+  ESP_LOGD(acme_tag, "%s(%s), %d in pool", __FUNCTION__, s, nonce_count);
 }
 
 // This is needed because the location field is passed back in an HTTP header
 void Acme::setLocation(const char *s) {
   ESP_LOGD(acme_tag, "%s(%s)", __FUNCTION__, s);
-  if (account_location)
-    free(account_location);
-  account_location = strdup(s);
+  if (reply_location)
+    free(reply_location);
+  reply_location = strdup(s);
 }
 
 /*
  * Manage private key
  */
-mbedtls_pk_context *Acme::GeneratePrivateKey() {
+mbedtls_pk_context *Acme::GeneratePrivateKey(AcmeKeyType type) {
   mbedtls_pk_context	*key;
   int			ret;
   char			buf[80];
 
-  ESP_LOGI(acme_tag, "Generating private key ...");
+  ESP_LOGI(acme_tag, "Generating %s private key ...", (type == ACME_KEY_ES256) ? "ES256" : "RSA");
 
   key = (mbedtls_pk_context *)calloc(1, sizeof(mbedtls_pk_context));
   mbedtls_pk_init(key);
-  mbedtls_pk_setup(key, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA));
 
-  if ((ret = mbedtls_rsa_gen_key(mbedtls_pk_rsa(*key), mbedtls_ctr_drbg_random, ctr_drbg, /* key size */ 2048, /* exponent */ 0x10001)) != 0) {
-    mbedtls_strerror(ret, buf, sizeof(buf));
-    ESP_LOGE(acme_tag, "%s: mbedtls_rsa_gen_key failed %s (0x%04x)", __FUNCTION__, buf, -ret);
-    free((void *)key);
-    return 0;
+  if (type == ACME_KEY_ES256) {
+    mbedtls_pk_setup(key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
+    if ((ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(*key), mbedtls_ctr_drbg_random, ctr_drbg)) != 0) {
+      mbedtls_strerror(ret, buf, sizeof(buf));
+      ESP_LOGE(acme_tag, "%s: mbedtls_ecp_gen_key failed %s (0x%04x)", __FUNCTION__, buf, -ret);
+      mbedtls_pk_free(key);
+      free((void *)key);
+      return 0;
+    }
+    return key;
+  }
+
+  mbedtls_pk_setup(key, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA));
+  if ((ret = mbedtls_rsa_gen_key(mbedtls_pk_rsa(*key), mbedtls_ctr_drbg_random, ctr_drbg, /* key size */ 2048, /* exponent */ 0x10001)) != 0) {
+    mbedtls_strerror(ret, buf, sizeof(buf));
+    ESP_LOGE(acme_tag, "%s: mbedtls_rsa_gen_key failed %s (0x%04x)", __FUNCTION__, buf, -ret);
+    free((void *)key);
+    return 0;
   }
   return key;
 }
@@ -1135,8 +1532,21 @@ mbedtls_pk_context *Acme::ReadPrivateKey(const char *ifn) {
   pk = (mbedtls_pk_context *)calloc(1, sizeof(mbedtls_pk_context));
   mbedtls_pk_init(pk);
   if ((ret = mbedtls_pk_parse_keyfile(pk, fn, 0)) != 0) {
+    // Try the previous copy, in case we crashed while replacing the key file
+    char *bak = SafeFile::BackupName(fn);
+    mbedtls_pk_free(pk);
+    mbedtls_pk_init(pk);
+    if (bak && mbedtls_pk_parse_keyfile(pk, bak, 0) == 0) {
+      ESP_LOGE(acme_tag, "%s: %s is unusable, using %s", __FUNCTION__, fn, bak);
+      free(bak);
+      free(fn);
+      return pk;
+    }
+    free(bak);
+
     mbedtls_strerror(ret, buf, sizeof(buf));
     ESP_LOGE(acme_tag, "%s: mbedtls_pk_parse_keyfile(%s) failed %s (0x%04x)", __FUNCTION__, fn, buf, -ret);
+    mbedtls_pk_free(pk);
     free(fn);
     free((void *)pk);
     return 0;
@@ -1202,7 +1612,8 @@ void Acme::WritePrivateKey(mbedtls_pk_context *pk, const char *ifn) {
   ESP_LOGE(acme_tag, "WritePrivateKey(%s)", fn);
 
   CreateDirectories(fn);
-  FILE *f = fopen(fn, "w");
+  SafeFile sf(fn, sync_policy);
+  FILE *f = sf.Open();
   if (f == 0) {
     ESP_LOGE(acme_tag, "%s: could not write private key to file %s", __FUNCTION__, fn);
     free(fn);
@@ -1247,12 +1658,11 @@ void Acme::WritePrivateKey(mbedtls_pk_context *pk, const char *ifn) {
 
   if (fwrite(keystring, 1, len, f) != len) {
     ESP_LOGE(acme_tag, "%s: write private key to %s failed, %d %s", __FUNCTION__, fn, errno, strerror(errno));
-    fclose(f);
     free(fn);
-    return;
+    return;				// SafeFile removes the temporary file, the old key stays
   }
-  if (fclose(f) != 0) {
-    ESP_LOGE(acme_tag, "%s: write private key to %s failed, %d %s", __FUNCTION__, fn, errno, strerror(errno));
+  if (! sf.Commit()) {
+    ESP_LOGE(acme_tag, "%s: write private key to %s failed", __FUNCTION__, fn);
     free(fn);
     return;
   }
@@ -1284,11 +1694,9 @@ void Acme::WritePrivateKey() {
   sprintf(fn, "%s/%s", filename_prefix, account_key_fn);
 
   CreateDirectories(fn);
-  FILE *f = fopen(fn, "w");
-  if (f) {
-    fwrite(keystring, 1, len, f);
-    fclose(f);
-  } else {
+  SafeFile sf(fn, sync_policy);
+  FILE *f = sf.Open();
+  if (f == 0 || fwrite(keystring, 1, len, f) != (size_t)len || ! sf.Commit()) {
     ESP_LOGE(acme_tag, "%s: could not write private key to file %s", __FUNCTION__, fn);
   }
   free(fn);
@@ -1302,17 +1710,18 @@ bool Acme::RequestNewAccount(const char *contact, bool onlyExisting) {
   ESP_LOGD(acme_tag, "%s(%s,%s)", __FUNCTION__, contact,
     onlyExisting ? "onlyExisting" : "alwaysCreate");
 
-  char *msg, *jwk, *payload;
+  char *payload;
+  const char *jwk;
 
   if (directory == 0) {
     ESP_LOGE(acme_tag, "%s fail, no directory", __FUNCTION__);
     return false;
   }
 
-  if (rsa == 0) {
+  if (accountkey == 0) {
     ReadAccountKey();
-    if (rsa == 0) {
-      ESP_LOGE(acme_tag, "%s(%s) fail, rsa null", __FUNCTION__, contact);
+    if (accountkey == 0) {
+      ESP_LOGE(acme_tag, "%s(%s) fail, no account key", __FUNCTION__, contact);
       return false;
     }
   }
@@ -1337,21 +1746,9 @@ bool Acme::RequestNewAccount(const char *contact, bool onlyExisting) {
     ESP_LOGD(acme_tag, "%s(NULL) msg %s", __FUNCTION__, payload);
   }
 
-  jwk = MakeJWK();
-  if (jwk) {
-    msg = MakeMessageJWK(directory->newAccount, payload, jwk);
-    free(jwk);
-  } else
-    msg = MakeMessageJWK(directory->newAccount, payload, (char *)"");
-
-  if (! msg) {
-    ESP_LOGE(acme_tag, "%s: null message", __FUNCTION__);
-    return false;
-  }
-  ESP_LOGD(acme_tag, "%s : msg %s", __FUNCTION__, msg);
-
-  char *reply = PerformWebQuery(directory->newAccount, msg, acme_jose_json, 0);
-  free(msg);
+  jwk = AccountJWK();
+  char *reply = SignedQuery(directory->newAccount, payload, jwk ? jwk : "", 0);
+  free(payload);
   if (reply == 0) {
     ESP_LOGE(acme_tag, "%s PerformWebQuery -> null", __FUNCTION__);
     return false;
@@ -1365,13 +1762,14 @@ bool Acme::RequestNewAccount(const char *contact, bool onlyExisting) {
   JsonObject &root = jb.parseObject(reply);
   if (! root.success())
 #else
-  DynamicJsonDocument root(512);
-  DeserializationError je = deserializeJson(root, reply);
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterAccount(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
   if (je)
 #endif
   {
     ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
-    free(reply);
+    FreeReply(reply);
     return false;
   }
   ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
@@ -1400,7 +1798,7 @@ bool Acme::RequestNewAccount(const char *contact, bool onlyExisting) {
     if (!onlyExisting)
       ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status, reply_type, reply_detail);
 
-    free(reply);
+    FreeReply(reply);
     return false;
   } else if (reply_status == 0) {
     /*
@@ -1413,7 +1811,7 @@ bool Acme::RequestNewAccount(const char *contact, bool onlyExisting) {
      * but we can bail on this.
      */
     ESP_LOGE(acme_tag, "%s: null reply_status (reply %s)", __FUNCTION__, reply);
-    free(reply);
+    FreeReply(reply);
     return false;
   } else {
     ESP_LOGD(acme_tag, "%s: reply_status '%s'", __FUNCTION__, reply_status);
@@ -1421,7 +1819,7 @@ bool Acme::RequestNewAccount(const char *contact, bool onlyExisting) {
 
   ReadAccount(root);
 
-  free(reply);
+  FreeReply(reply);
   return true;
 }
 
@@ -1474,7 +1872,7 @@ void Acme::ReadAccount(DynamicJsonDocument &json)
 #ifdef ARDUINOJSON_5
   JsonArray &jca = json["contact"];
 #else
-  DynamicJsonDocument jca = json["contact"];
+  JsonArray jca = json[acme_json_contact];
 #endif
   ESP_LOGD(acme_tag, "%s : %d contacts", __FUNCTION__, jca.size());
   account->contact = (char **)calloc(jca.size()+1, sizeof(char *));
@@ -1491,9 +1889,9 @@ void Acme::ReadAccount(DynamicJsonDocument &json)
 
   if (account->location)
     free(account->location);
-  if (account_location) {
-    account->location = account_location;
-    account_location = 0;
+  if (reply_location) {
+    account->location = reply_location;
+    reply_location = 0;
   } else if (l)
     account->location = strdup(l);
 
@@ -1520,23 +1918,8 @@ void Acme::ClearOrderContent() {
     memset((void *)order, 0, sizeof(Order));
     return;
   }
-  if (order->status) free(order->status);
-  if (order->expires) free(order->expires);
-  if (order->finalize) free(order->finalize);
-  if (order->certificate) free(order->certificate);
-  if (order->identifiers) {
-    for (int i=0; order->identifiers[i]._type; i++) {
-      free(order->identifiers[i]._type);
-      free(order->identifiers[i].value);
-    }
-    free(order->identifiers);
-  }
-  if (order->authorizations) {
-    for (int i=0; order->authorizations[i]; i++)
-      free(order->authorizations[i]);
-    free(order->authorizations);
-  }
-
+  // All strings and arrays of the order are in order_arena
+  order_arena.Reset();
   memset(order, 0, sizeof(Order));
 }
 
@@ -1551,33 +1934,24 @@ void Acme::ClearOrder() {
 
 void Acme::ClearChallenge() {
   if (challenge) {
-    if (challenge->status) free(challenge->status);
-    if (challenge->expires) free(challenge->expires);
-    if (challenge->identifiers) {
-      for (int i=0; challenge->identifiers[i]._type; i++) {
-        free(challenge->identifiers[i]._type);
-        free(challenge->identifiers[i].value);
-      }
-      free(challenge->identifiers);
-    }
-    if (challenge->challenges) {
-      for (int i=0; challenge->challenges[i]._type; i++) {
-        free(challenge->challenges[i]._type);
-        free(challenge->challenges[i].status);
-        free(challenge->challenges[i].url);
-        free(challenge->challenges[i].token);
-      }
-      free(challenge->challenges);
-    }
+    if (publisher)
+      publisher->Reset();
+    challenge_arena.Reset();		// Holds its strings and arrays
     free(challenge);
     challenge = 0;
   }
+  challenge_count = 0;
 }
 
 /*
  * Read from file
  */
 bool Acme::ReadAccountInfo() {
+  if (state_fn && filename_prefix) {
+    if (! ReadStateFile(true, false) && ImportJsonState())
+      ReadStateFile(true, false);
+    return account != 0;
+  }
   if (account_fn == 0 || filename_prefix == 0) {
     ESP_LOGE(acme_tag, "%s: ACME files not configured", __FUNCTION__);
     return false;
@@ -1585,39 +1959,29 @@ bool Acme::ReadAccountInfo() {
   char *fn = (char *)malloc(strlen(account_fn) + 5 + strlen(filename_prefix));
   sprintf(fn, "%s/%s", filename_prefix, account_fn);
 
-  FILE *f = fopen(fn, "r");
-  if (f == NULL) {
-    ESP_LOGE(acme_tag, "Could not read account info from %s, %s", fn, strerror(errno));
-    free(fn);
-    return false;
-  }
-
-// Choose wisely
-#define	NREAD_INC	250
-
-  // ESP-IDF VFS over SPIFFS doesn't allow use of fseek to determine file length, so read in chunks in that case
-  // Potential over-allocation is limited to NREAD_INC bytes
-  long len = fseek(f, 0L, SEEK_END);
-  if (len == 0) {
-    len = NREAD_INC;
+  bool ok = ReadAccountInfo(fn);
+  if (! ok) {
+    // Missing or damaged, fall back to the previous copy
+    char *bak = SafeFile::BackupName(fn);
+    if (bak && (ok = ReadAccountInfo(bak)))
+      ESP_LOGE(acme_tag, "%s: using %s (generation %u)", __FUNCTION__, bak, account_generation);
+    else
+      ESP_LOGE(acme_tag, "Could not read account info from %s", fn);
+    free(bak);
   }
-  ESP_LOGI(acme_tag, "Reading Account info from %s", fn);
   free(fn);
+  return ok;
+}
 
-  fseek(f, 0L, SEEK_SET);
-  char *buffer = (char *)malloc(len+1);
-  size_t total = fread((void *)buffer, 1, len, f);
-  buffer[total] = 0;
-  int inc = total;
-  while (inc == NREAD_INC) {
-    len += NREAD_INC;
-    buffer = (char *)realloc((void *)buffer, len + 1);
-    inc = fread((void *)(buffer + total), 1, NREAD_INC, f);
-    total += inc;
-    buffer[total] = 0;
-    ESP_LOGD(acme_tag, "Reading -> %d bytes, total %d ", inc, total);
-  }
-  fclose(f);
+bool Acme::ReadAccountInfo(const char *fn) {
+  size_t len;
+  char *buffer = read_file(fn, &len);
+  if (buffer == NULL) {
+    if (errno != ENOENT)
+      ESP_LOGE(acme_tag, "Could not read account info from %s, %s", fn, strerror(errno));
+    return false;
+  }
+  ESP_LOGI(acme_tag, "Reading Account info from %s (%d bytes)", fn, (int)len);
   ESP_LOGD(acme_tag, "%s: %s", __FUNCTION__, buffer);
 
 #ifdef ARDUINOJSON_5
@@ -1636,6 +2000,7 @@ bool Acme::ReadAccountInfo() {
   }
   ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
   ReadAccount(root);
+  account_generation = root[acme_json_generation].as<unsigned>();
 
   free(buffer);
   return true;
@@ -1646,11 +2011,16 @@ void Acme::WriteAccountInfo() {
     ESP_LOGE(acme_tag, "%s: NULL account", __FUNCTION__);
     return;
   }
+  if (state_fn) {
+    WriteStateFile();
+    return;
+  }
 
   char *fn = (char *)malloc(strlen(account_fn) + 5 + strlen(filename_prefix));
   sprintf(fn, "%s/%s", filename_prefix, account_fn);
   CreateDirectories(fn);
-  FILE *f = fopen(fn, "w");
+  SafeFile sf(fn, sync_policy);
+  FILE *f = sf.Open();
   if (f == NULL) {
     ESP_LOGE(acme_tag, "Could not write account info into %s, %s", fn, strerror(errno));
     free(fn);
@@ -1666,6 +2036,7 @@ void Acme::WriteAccountInfo() {
 #else
   DynamicJsonDocument jo(1024);
 #endif
+  jo[acme_json_generation] = ++account_generation;
   jo[acme_json_status] = account->status;
   jo[acme_json_location] = account->location;
 
@@ -1695,7 +2066,8 @@ void Acme::WriteAccountInfo() {
 #endif
 
   fprintf(f, "%s", output);
-  fclose(f);
+  if (! sf.Commit())
+    ESP_LOGE(acme_tag, "%s: failed, keeping the previous account info", __FUNCTION__);
   ESP_LOGD(acme_tag, "Wrote %d bytes of JSON account info", strlen(output));
   ESP_LOGD(acme_tag, "Account info : %s", output);
   free(output);
@@ -1713,7 +2085,7 @@ void Acme::RequestNewOrder(const char *url, const char **alt_urls) {
       int pos = strlen(line);
       snprintf(&line[pos], sizeof(line)-pos, ", %s", alt_urls[i]);
     }
-    ESP_LOGI(acme_tag, "%s(%s) [Nonce %s use %d]", __FUNCTION__, line, nonce, nonce_use);
+    ESP_LOGI(acme_tag, "%s(%s) [%d nonces]", __FUNCTION__, line, nonce_count);
   }
   // ESP_LOGE(acme_tag, "%s %d", __FUNCTION__, __LINE__);
 
@@ -1724,6 +2096,7 @@ void Acme::RequestNewOrder(const char *url, const char **alt_urls) {
 
   ClearOrderContent();
   ClearChallenge();
+  challenge_posted = false;
   /*
    * prot :
    *  {"alg": "RS256", "nonce": "webIkLvTEpwjbA9rZSTv8", "kid": "https://acme-staging-v02.api.letsencrypt.org/acme/acct/0123", "url": "https://acme-staging-v02.api.letsencrypt.org/acme/new-order"}
@@ -1738,10 +2111,9 @@ void Acme::RequestNewOrder(const char *url, const char **alt_urls) {
    * }
    * 2019-07-31 04:01:52,543:DEBUG:requests.packages.urllib3.connectionpool:https://acme-staging-v02.api.letsencrypt.org:443 "POST /acme/new-order HTTP/1.1" 201 36
    */
-  if (directory == 0 || rsa == 0)
+  if (directory == 0 || accountkey == 0)
     return;
 
-  char *msg;
   int request_len = strlen(new_order_template2) + strlen(url) + strlen(new_order_subtemplate)+ 4;
   for (int i=0; alt_urls[i]; i++)
     request_len += strlen(alt_urls[i]) + strlen(new_order_subtemplate) + 4;
@@ -1767,17 +2139,8 @@ void Acme::RequestNewOrder(const char *url, const char **alt_urls) {
   free((void *)request1);
   ESP_LOGD(acme_tag, "%s msg %s", __FUNCTION__, request2);
 
-  msg = MakeMessageKID(directory->newOrder, request2);
+  char *reply = SignedQuery(directory->newOrder, request2, 0, 0);
   free((void *)request2);
-
-  if (! msg) {
-    ESP_LOGE(acme_tag, "%s: MakeMessageKID -> null message", __FUNCTION__);
-    return;
-  }
-  ESP_LOGD(acme_tag, "%s -> %s", __FUNCTION__, msg);
-
-  char *reply = PerformWebQuery(directory->newOrder, msg, acme_jose_json, 0);
-  // free(msg);
   if (reply) {
     ESP_LOGD(acme_tag, "PerformWebQuery -> %s", reply);
   } else {
@@ -1790,13 +2153,14 @@ void Acme::RequestNewOrder(const char *url, const char **alt_urls) {
   JsonObject &root = jb.parseObject(reply);
   if (! root.success())
 #else
-  DynamicJsonDocument root(512);
-  DeserializationError je = deserializeJson(root, reply);
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterOrder(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
   if (je)
 #endif
   {
     ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
-    free(reply);
+    FreeReply(reply);
     return;
   }
   ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
@@ -1808,7 +2172,7 @@ void Acme::RequestNewOrder(const char *url, const char **alt_urls) {
 
     ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status, reply_type, reply_detail);
 
-    free(reply);
+    FreeReply(reply);
     return;
   } else if (reply_status == 0) {
     // ESP_LOGE(acme_tag, "%s: null reply_status", __FUNCTION__);
@@ -1819,13 +2183,14 @@ void Acme::RequestNewOrder(const char *url, const char **alt_urls) {
 
   ReadOrder(root);
 
-  free(reply);
+  FreeReply(reply);
   return;
 }
 
 void Acme::RequestNewOrder(const char *url) {
   ClearOrderContent();
   ClearChallenge();
+  challenge_posted = false;
   ESP_LOGI(acme_tag, "%s (%s)", __FUNCTION__, url);
   /*
    * prot :
@@ -1841,24 +2206,15 @@ void Acme::RequestNewOrder(const char *url) {
    * }
    * 2019-07-31 04:01:52,543:DEBUG:requests.packages.urllib3.connectionpool:https://acme-staging-v02.api.letsencrypt.org:443 "POST /acme/new-order HTTP/1.1" 201 36
    */
-  if (directory == 0 || rsa == 0)
+  if (directory == 0 || accountkey == 0)
     return;
 
-  char *msg;
   char *request = (char *)malloc(strlen(new_order_template) + strlen(url) + 4);
   sprintf(request, new_order_template, url);
   ESP_LOGD(acme_tag, "%s msg %s", __FUNCTION__, request);
 
-  msg = MakeMessageKID(directory->newOrder, request);
-
-  if (! msg) {
-    ESP_LOGE(acme_tag, "%s: MakeMessageKID -> null message", __FUNCTION__);
-    return;
-  }
-  ESP_LOGD(acme_tag, "%s -> %s", __FUNCTION__, msg);
-
-  char *reply = PerformWebQuery(directory->newOrder, msg, acme_jose_json, 0);
-  // free(msg);
+  char *reply = SignedQuery(directory->newOrder, request, 0, 0);
+  free(request);
   if (reply) {
     ESP_LOGD(acme_tag, "PerformWebQuery -> %s", reply);
   } else {
@@ -1871,13 +2227,14 @@ void Acme::RequestNewOrder(const char *url) {
   JsonObject &root = jb.parseObject(reply);
   if (! root.success())
 #else
-  DynamicJsonDocument root(512);
-  DeserializationError je = deserializeJson(root, reply);
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterOrder(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
   if (je)
 #endif
   {
     ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
-    free(reply);
+    FreeReply(reply);
     return;
   }
   ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
@@ -1889,7 +2246,7 @@ void Acme::RequestNewOrder(const char *url) {
 
     ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status, reply_type, reply_detail);
 
-    free(reply);
+    FreeReply(reply);
     return;
   } else if (reply_status == 0) {
     // ESP_LOGE(acme_tag, "%s: null reply_status", __FUNCTION__);
@@ -1900,7 +2257,7 @@ void Acme::RequestNewOrder(const char *url) {
 
   ReadOrder(root);
 
-  free(reply);
+  FreeReply(reply);
   return;
 }
 
@@ -1908,43 +2265,37 @@ void Acme::RequestNewOrder(const char *url) {
  * Read from file
  */
 bool Acme::ReadOrderInfo() {
+  if (state_fn && filename_prefix) {
+    if (! ReadStateFile(false, true) && ImportJsonState())
+      ReadStateFile(false, true);
+    return order != 0;
+  }
+  if (order_fn == 0)
+    return false;
   char *fn = (char *)malloc(strlen(order_fn) + 5 + strlen(filename_prefix));
   sprintf(fn, "%s/%s", filename_prefix, order_fn);
 
-  FILE *f = fopen(fn, "r");
-  if (f == NULL) {
+  bool ok = ReadOrderInfo(fn);
+  if (! ok) {
+    // Missing or damaged, fall back to the previous copy
+    char *bak = SafeFile::BackupName(fn);
+    if (bak && (ok = ReadOrderInfo(bak)))
+      ESP_LOGE(acme_tag, "%s: using %s (generation %u)", __FUNCTION__, bak, order_generation);
+    free(bak);
+  }
+  free(fn);
+  return ok;
+}
+
+bool Acme::ReadOrderInfo(const char *fn) {
+  size_t len;
+  char *buffer = read_file(fn, &len);
+  if (buffer == NULL) {
     if (errno != ENOENT)	// Don't bother telling the file simply isn't there
       ESP_LOGE(acme_tag, "Could not read order info from %s, %s", fn, strerror(errno));
-    free(fn);
     return false;
   }
-
-// Choose wisely
-#define	NREAD_INC	250
-
-  // ESP-IDF VFS over SPIFFS doesn't allow use of fseek to determine file length, so read in chunks in that case
-  // Potential over-allocation is limited to NREAD_INC bytes
-  long len = fseek(f, 0L, SEEK_END);
-  if (len == 0) {
-    len = NREAD_INC;
-    ESP_LOGI(acme_tag, "Reading order info from %s (in chunks of %d)", fn, NREAD_INC);
-  } else
-    ESP_LOGI(acme_tag, "Reading order info from %s (%ld bytes)", fn, len);
-  fseek(f, 0L, SEEK_SET);
-  free(fn);
-
-  char *buffer = (char *)malloc(len+1);
-  size_t total = fread((void *)buffer, 1, len, f);
-  int inc = total;
-  while (inc == NREAD_INC) {
-    len += NREAD_INC;
-    buffer = (char *)realloc((void *)buffer, len + 1);
-    inc = fread((void *)(buffer + total), 1, NREAD_INC, f);
-    total += inc;
-    ESP_LOGD(acme_tag, "Reading -> %d bytes, total %d ", inc, total);
-  }
-  fclose(f);
-  buffer[total] = 0;
+  ESP_LOGI(acme_tag, "Reading order info from %s (%d bytes)", fn, (int)len);
   ESP_LOGI(acme_tag, "%s: %s", __FUNCTION__, buffer);
 
 #ifdef ARDUINOJSON_5
@@ -1964,6 +2315,7 @@ bool Acme::ReadOrderInfo() {
 
   ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
   ReadOrder(root);
+  order_generation = root[acme_json_generation].as<unsigned>();
 
   free(buffer);
 
@@ -1974,24 +2326,18 @@ bool Acme::ReadOrderInfo() {
   return true;
 }
 
-void Acme::WriteOrderInfo() {
+/*
+ * Write the order into its file, unless the file already has this content.
+ * Don't call this directly from the protocol code, use MarkOrderDirty() : FlushOrderInfo() then
+ * writes once per AcmeProcess() pass.
+ */
+bool Acme::WriteOrderInfo() {
   if (order == NULL) {
     ESP_LOGE(acme_tag, "%s: NULL order", __FUNCTION__);
-    return;
-  }
-
-  char *fn = (char *)malloc(strlen(order_fn) + 5 + strlen(filename_prefix));
-  sprintf(fn, "%s/%s", filename_prefix, order_fn);
-  CreateDirectories(fn);
-  FILE *f = fopen(fn, "w");
-  if (f == NULL) {
-    ESP_LOGE(acme_tag, "Could write order info into %s, %s", fn, strerror(errno));
-    free(fn);
-    return;
+    return false;
   }
-
-  ESP_LOGI(acme_tag, "Writing order info into %s", fn);
-  free(fn);
+  if (state_fn)
+    return WriteStateFile();
 
 #ifdef ARDUINOJSON_5
   DynamicJsonBuffer jb;
@@ -2003,19 +2349,20 @@ void Acme::WriteOrderInfo() {
   if (order->status) jo[acme_json_expires] = order->expires;
   if (order->finalize) jo[acme_json_finalize] = order->finalize;
   if (order->certificate) jo[acme_json_certificate] = order->certificate;
+  if (order->location) jo[acme_json_location] = order->location;
 
   if (order->identifiers) {
     // identifiers array must be NULL terminated
 #ifdef ARDUINOJSON_5
     JsonArray &jia = jo.createNestedArray(acme_json_identifiers);
 #else
-    DynamicJsonDocument jia = jo.createNestedArray(acme_json_identifiers);
+    JsonArray jia = jo.createNestedArray(acme_json_identifiers);
 #endif
     for (int i=0; order->identifiers[i]._type != 0 || order->identifiers[i].value != 0; i++) {
 #ifdef ARDUINOJSON_5
       JsonObject &jie = jia.createNestedObject();
 #else
-      DynamicJsonDocument jie = jia.createNestedObject();
+      JsonObject jie = jia.createNestedObject();
 #endif
       jie[acme_json_type] = order->identifiers[i]._type;
       jie[acme_json_value] = order->identifiers[i].value;
@@ -2027,234 +2374,1293 @@ void Acme::WriteOrderInfo() {
 #ifdef ARDUINOJSON_5
     JsonArray &jaa = jo.createNestedArray(acme_json_authorizations);
 #else
-    DynamicJsonDocument jaa = jo.createNestedArray(acme_json_authorizations);
+    JsonArray jaa = jo.createNestedArray(acme_json_authorizations);
 #endif
     for (int i=0; order->authorizations[i]; i++)
       jaa.add(order->authorizations[i]);
   }
 
-  char *output = (char *)malloc(1536);	// FIX ME
+  // Leave room for the generation, added below
 #ifdef ARDUINOJSON_5
-  jo.printTo(output, 1536);		// FIX ME
+  size_t olen = jo.measureLength() + 32;
 #else
-  serializeJson(jo, output, 1536);
+  size_t olen = measureJson(jo) + 32;
+#endif
+  char *output = (char *)malloc(olen);
+  if (output == 0) {
+    ESP_LOGE(acme_tag, "%s: could not allocate %d bytes", __FUNCTION__, (int)olen);
+    return false;
+  }
+#ifdef ARDUINOJSON_5
+  jo.printTo(output, olen);
+#else
+  serializeJson(jo, output, olen);
+#endif
+
+  // Same as what we wrote last time ? Then don't wear out the flash.
+  uint32_t hash = OrderHash(output);
+  if (hash == order_written_hash) {
+    ESP_LOGD(acme_tag, "%s: order info unchanged", __FUNCTION__);
+    order_writes_avoided++;
+    free(output);
+    return true;
+  }
+
+  jo[acme_json_generation] = ++order_generation;
+#ifdef ARDUINOJSON_5
+  jo.printTo(output, olen);
+#else
+  serializeJson(jo, output, olen);
 #endif
 
+  char *fn = (char *)malloc(strlen(order_fn) + 5 + strlen(filename_prefix));
+  sprintf(fn, "%s/%s", filename_prefix, order_fn);
+  CreateDirectories(fn);
+  SafeFile sf(fn, sync_policy);
+  FILE *f = sf.Open();
+  if (f == NULL) {
+    ESP_LOGE(acme_tag, "Could write order info into %s, %s", fn, strerror(errno));
+    free(fn);
+    free(output);
+    return false;
+  }
+
+  ESP_LOGI(acme_tag, "Writing order info into %s", fn);
+  free(fn);
+
   fprintf(f, "%s", output);
-  fclose(f);
+  bool ok = sf.Commit();
+  if (ok)
+    order_written_hash = hash;
+  else
+    ESP_LOGE(acme_tag, "%s: failed, keeping the previous order info", __FUNCTION__);
   ESP_LOGD(acme_tag, "Wrote %d bytes of JSON order info", strlen(output));
   ESP_LOGD(acme_tag, "Order info : %s", output);
   free(output);
+  return ok;
 }
 
 /*
+ * FNV-1a, to tell whether the order file needs rewriting. 0 means "not written yet".
  */
-#ifdef ARDUINOJSON_5
-void Acme::ReadOrder(JsonObject &json)
-#else
-void Acme::ReadOrder(DynamicJsonDocument &json)
-#endif
-{
-  // Treat the case separately where we have an empty order structure : it's brand new so no need to free/reallocate
-  if (order && order->status != 0)
-    ClearOrder();
-  if (order == 0) {
-    order = (Order *)malloc(sizeof(Order));
-    memset((void *)order, 0, sizeof(Order));
+uint32_t Acme::OrderHash(const char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619u;
   }
+  return h ? h : 1;
+}
 
 /*
- * Replace a single statement such as
- *   account->key_type = strdup(json["key"]["kty"]);
- * by a macro invocation to protect against calling strdup(0) if an element is not in the JSON.
- * C/C++ syntax hint : #x turns the macro argument x into a string.
+ * Note that the order changed. Several changes in one AcmeProcess() pass cause one write.
  */
-#define	BZZ(x)									\
-  {										\
-    const char *x = json[#x];							\
-    if (x) {									\
-      ESP_LOGD(acme_tag, "%s : read %s as %s", __FUNCTION__, #x, x);		\
-      order->x = strdup(x);							\
-    } else {									\
-      order->x = 0;								\
-    }										\
-  }
+void Acme::MarkOrderDirty() {
+  if (order_dirty)
+    order_writes_avoided++;
+  order_dirty = true;
+}
 
-  BZZ(status);
-  BZZ(expires);
-  BZZ(finalize);
-  BZZ(certificate);
+/*
+ * Checkpoint : write the order file now if the order changed.
+ * AcmeProcess() does this at the end of every pass.
+ */
+void Acme::FlushOrderInfo() {
+  if (! order_dirty)
+    return;
+  if (order && ! WriteOrderInfo())
+    return;				// Try again next time
+  order_dirty = false;
+}
 
-  if (order->expires)
-    order->t_expires = timestamp(order->expires);
+int Acme::getAvoidedOrderWrites() {
+  return order_writes_avoided;
+}
 
-#undef BZZ
+/*
+ * Binary state file (see StateFile.h), used instead of the account and order JSON files
+ * when setStateFilename() is called.
+ * Each part starts with a marker record, the tags of a part are in one range so a part that
+ * isn't in memory can be copied over from the previous file when writing.
+ */
+enum AcmeStateTag {
+  ACME_STATE_DIRECTORY = 0x10,
+  ACME_STATE_DIR_SERVER,
+  ACME_STATE_DIR_NEW_ACCOUNT,
+  ACME_STATE_DIR_NEW_NONCE,
+  ACME_STATE_DIR_NEW_ORDER,
+  ACME_STATE_DIR_FETCHED,
+  ACME_STATE_DIR_RENEWAL_INFO,
+
+  ACME_STATE_ACCOUNT = 0x20,
+  ACME_STATE_ACCOUNT_STATUS,
+  ACME_STATE_ACCOUNT_LOCATION,
+  ACME_STATE_ACCOUNT_CONTACT,			// One per contact
+  ACME_STATE_ACCOUNT_KTY,
+  ACME_STATE_ACCOUNT_N,
+  ACME_STATE_ACCOUNT_E,
+
+  ACME_STATE_ORDER = 0x30,
+  ACME_STATE_ORDER_STATUS,
+  ACME_STATE_ORDER_EXPIRES,
+  ACME_STATE_ORDER_FINALIZE,
+  ACME_STATE_ORDER_CERTIFICATE,
+  ACME_STATE_ORDER_ID_TYPE,			// Starts an identifier
+  ACME_STATE_ORDER_ID_VALUE,
+  ACME_STATE_ORDER_AUTHZ,			// One per authorization
+  ACME_STATE_ORDER_LOCATION,
+
+  ACME_STATE_CHALLENGE = 0x40,
+  ACME_STATE_CHALLENGE_STATUS,
+  ACME_STATE_CHALLENGE_EXPIRES,
+  ACME_STATE_CHALLENGE_TYPE,			// Starts a challenge item
+  ACME_STATE_CHALLENGE_ITEM_STATUS,
+  ACME_STATE_CHALLENGE_URL,
+  ACME_STATE_CHALLENGE_TOKEN,
+  ACME_STATE_CHALLENGE_IDENTIFIER,
+
+  ACME_STATE_CERTIFICATE = 0x50,		// Information only, the certificate is in cert_fn
+  ACME_STATE_CERT_VALID_FROM,
+  ACME_STATE_CERT_VALID_TO,
+
+  ACME_STATE_RENEWAL = 0x60,			// Renewal information (ARI) about the certificate
+  ACME_STATE_RENEWAL_CERT_ID,
+  ACME_STATE_RENEWAL_START,
+  ACME_STATE_RENEWAL_END,
+  ACME_STATE_RENEWAL_AT,
+  ACME_STATE_RENEWAL_NEXT_CHECK,
+};
+#define	ACME_STATE_PART(tag)	((tag) & 0xF0)
+
+void Acme::setStateFilename(const char *fn) {
+  state_fn = fn;
+}
 
-#ifdef ARDUINOJSON_5
-  JsonArray &jia = json["identifiers"];
-#else
-  DynamicJsonDocument jia = json["identifiers"];
-#endif
+char *Acme::StatePath() {
+  char *fn = (char *)malloc(strlen(state_fn) + 5 + strlen(filename_prefix));
+  sprintf(fn, "%s/%s", filename_prefix, state_fn);
+  return fn;
+}
 
-  ESP_LOGD(acme_tag, "%s : %d identifiers", __FUNCTION__, jia.size());
-  order->identifiers = (Identifier *)calloc(jia.size()+1, sizeof(Identifier));
-  order->identifiers[jia.size()]._type = 0;
-  order->identifiers[jia.size()].value = 0;
-  for (int i=0; i<jia.size(); i++) {
-    const char *it = jia[i]["type"];
-    const char *iv = jia[i]["value"];
-    order->identifiers[i]._type = strdup(it);
-    order->identifiers[i].value = strdup(iv);
+/*
+ * Load the state file, or its backup if that's missing or damaged.
+ */
+bool Acme::LoadStateFile(StateReader &r) {
+  char *fn = StatePath();
+  bool ok = r.Load(fn);
+  if (! ok) {
+    char *bak = SafeFile::BackupName(fn);
+    if (bak && (ok = r.Load(bak)))
+      ESP_LOGE(acme_tag, "%s: using %s (generation %u)", __FUNCTION__, bak, (unsigned)r.Generation());
+    free(bak);
   }
+  free(fn);
+  if (ok && r.Generation() > state_generation)
+    state_generation = r.Generation();
+  return ok;
+}
 
-#ifdef ARDUINOJSON_5
-  JsonArray &jaa = json["authorizations"];
-#else
-  DynamicJsonDocument jaa = json["authorizations"];
-#endif
-  ESP_LOGD(acme_tag, "%s : %d authorizations", __FUNCTION__, jaa.size());
-  order->authorizations = (char **)calloc(jia.size()+1, sizeof(char *));
-  order->authorizations[jaa.size()] = 0;
-  for (int i=0; i<jaa.size(); i++) {
-    const char *a = jaa[i];
-    order->authorizations[i] = strdup(a);
-  }
+static void CopyStatePart(StateWriter &w, StateReader &r, int part) {
+  uint8_t	tag;
+  const uint8_t	*data;
+  size_t	len;
+
+  r.Rewind();
+  while (r.Next(&tag, &data, &len))
+    if (ACME_STATE_PART(tag) == part)
+      w.Record(tag, data, len);
 }
 
-// Store a file on an FTP server
-bool Acme::ValidateOrder() {
-  ESP_LOGI(acme_tag, "%s", __FUNCTION__);
-  char *localfn = 0, *remotefn = 0;
+/*
+ * Write everything we know into the state file. Parts that aren't in memory (e.g. the order
+ * before it was read) are taken from the previous file.
+ */
+bool Acme::WriteStateFile() {
+  StateWriter	w;
+  StateReader	old;
+  bool		have_old = false;
 
-  int error = DownloadAuthorizationResource();
-  if (error != 0) {
-    ESP_LOGE(acme_tag, "%s: status %s, change to %s", __FUNCTION__, order->status, acme_status_invalid);
-    if (order->status) free(order->status);
-    order->status = strdup(acme_status_invalid);
-    return false;
-  }
+  if (directory == 0 || account == 0 || order == 0 || certificate == 0 || ari_cert_id == 0)
+    have_old = LoadStateFile(old);
 
-  const char *token = 0;
-  http01_ix = -1;
-  for (int i=0; challenge && challenge->challenges && challenge->challenges[i].status; i++) {
-    if (strcmp(challenge->challenges[i]._type, acme_http_01) == 0) {
-      token = challenge->challenges[i].token;
-      http01_ix = i;
-      ESP_LOGI(acme_tag, "%s: HTTP challenge in %d, token %s", __FUNCTION__, i, token);
-    }
-  }
-  if (token == 0) {
-    ESP_LOGE(acme_tag, "%s: no %s token found, aborting authorization", __FUNCTION__, acme_http_01);
-    return false;
-  }
-  ESP_LOGD(acme_tag, "%s: token %s", __FUNCTION__, token);
+  if (directory) {
+    w.Record(ACME_STATE_DIRECTORY, 0, 0);
+    w.String(ACME_STATE_DIR_SERVER, acme_server_url);
+    w.String(ACME_STATE_DIR_NEW_ACCOUNT, directory->newAccount);
+    w.String(ACME_STATE_DIR_NEW_NONCE, directory->newNonce);
+    w.String(ACME_STATE_DIR_NEW_ORDER, directory->newOrder);
+    w.Time(ACME_STATE_DIR_FETCHED, directory_fetched);
+    w.String(ACME_STATE_DIR_RENEWAL_INFO, directory->renewalInfo);
+  } else if (have_old && ! directory_stale)
+    CopyStatePart(w, old, ACME_STATE_DIRECTORY);
 
-  if (webserver == 0) {
-#if USE_EXTERNAL_WEBSERVER
-    if (! (ftp_user && ftp_path && ftp_server && ftp_pass)) {
-      ESP_LOGI(acme_tag, "%s: failed, incomplete FTP setup", __FUNCTION__);
-      return false;
+  if (account) {
+    w.Record(ACME_STATE_ACCOUNT, 0, 0);
+    w.String(ACME_STATE_ACCOUNT_STATUS, account->status);
+    w.String(ACME_STATE_ACCOUNT_LOCATION, account->location);
+    for (int i=0; account->contact && account->contact[i]; i++)
+      w.String(ACME_STATE_ACCOUNT_CONTACT, account->contact[i]);
+    w.String(ACME_STATE_ACCOUNT_KTY, account->key_type);
+    w.String(ACME_STATE_ACCOUNT_N, account->key_id);
+    w.String(ACME_STATE_ACCOUNT_E, account->key_e);
+  } else if (have_old)
+    CopyStatePart(w, old, ACME_STATE_ACCOUNT);
+
+  if (order) {
+    w.Record(ACME_STATE_ORDER, 0, 0);
+    w.String(ACME_STATE_ORDER_STATUS, order->status);
+    w.String(ACME_STATE_ORDER_EXPIRES, order->expires);
+    w.String(ACME_STATE_ORDER_FINALIZE, order->finalize);
+    w.String(ACME_STATE_ORDER_CERTIFICATE, order->certificate);
+    w.String(ACME_STATE_ORDER_LOCATION, order->location);
+    for (int i=0; order->identifiers && (order->identifiers[i]._type || order->identifiers[i].value); i++) {
+      w.String(ACME_STATE_ORDER_ID_TYPE, order->identifiers[i]._type ? order->identifiers[i]._type : "");
+      w.String(ACME_STATE_ORDER_ID_VALUE, order->identifiers[i].value);
+    }
+    for (int i=0; order->authorizations && order->authorizations[i]; i++)
+      w.String(ACME_STATE_ORDER_AUTHZ, order->authorizations[i]);
+
+    for (int i=0; i<challenge_count; i++) {
+      Challenge *c = &challenge[i];
+      w.Record(ACME_STATE_CHALLENGE, 0, 0);		// Starts an authorization
+      w.String(ACME_STATE_CHALLENGE_STATUS, c->status);
+      w.String(ACME_STATE_CHALLENGE_EXPIRES, c->expires);
+      w.String(ACME_STATE_CHALLENGE_IDENTIFIER, c->identifier);
+      for (int j=0; j<c->nchallenges; j++) {
+        w.String(ACME_STATE_CHALLENGE_TYPE, c->challenges[j]._type ? c->challenges[j]._type : "");
+        w.String(ACME_STATE_CHALLENGE_ITEM_STATUS, c->challenges[j].status);
+        w.String(ACME_STATE_CHALLENGE_URL, c->challenges[j].url);
+        w.String(ACME_STATE_CHALLENGE_TOKEN, c->challenges[j].token);
+      }
     }
+  } else if (have_old && ! order_stale) {
+    CopyStatePart(w, old, ACME_STATE_ORDER);
+    CopyStatePart(w, old, ACME_STATE_CHALLENGE);
+  }
 
-    /*
-     * This case uses services from a "site" web server.
-     * We use FTP to store and remove files on it.
-     *
-     * Store the token in a file.
-     * Notes : take a single file for two reasons : can't remove it (see below), and the file system
-     * doesn't always support file names in the format returned by an ACME server.
-     */
-    localfn = (char *)malloc(strlen(filename_prefix) + 15);
-    sprintf(localfn, "%s/token", filename_prefix);
+  if (certificate) {
+    w.Record(ACME_STATE_CERTIFICATE, 0, 0);
+    w.Time(ACME_STATE_CERT_VALID_FROM, TimeMbedToTimestamp(certificate->valid_from));
+    w.Time(ACME_STATE_CERT_VALID_TO, TimeMbedToTimestamp(certificate->valid_to));
+  } else if (have_old)
+    CopyStatePart(w, old, ACME_STATE_CERTIFICATE);
+
+  if (ari_cert_id) {
+    w.Record(ACME_STATE_RENEWAL, 0, 0);
+    w.String(ACME_STATE_RENEWAL_CERT_ID, ari_cert_id);
+    w.Time(ACME_STATE_RENEWAL_START, ari_start);
+    w.Time(ACME_STATE_RENEWAL_END, ari_end);
+    w.Time(ACME_STATE_RENEWAL_AT, ari_renew_at);
+    w.Time(ACME_STATE_RENEWAL_NEXT_CHECK, ari_next_check);
+  } else if (have_old)
+    CopyStatePart(w, old, ACME_STATE_RENEWAL);
+
+  if (w.Failed())
+    return false;
 
-    if (! CreateValidationFile(localfn, token)) {
-      ESP_LOGE(acme_tag, "%s: could not create local validation file %s", __FUNCTION__, localfn);
-      free(localfn);
-      return false;
-    }
+  // The generation is in the header, so this only changes when the content does
+  uint32_t crc = w.Checksum();
+  if (crc == state_written_crc) {
+    ESP_LOGD(acme_tag, "%s: state unchanged", __FUNCTION__);
+    order_writes_avoided++;
+    order_stale = false;		// The file is as we want it, without that order
+    return true;
+  }
 
-    // FTP the file
-    remotefn = (char *)malloc(strlen(ftp_path) + strlen(well_known) + strlen(token) + 5);
-    sprintf(remotefn, "%s%s%s", ftp_path, well_known, token);
+  char *fn = StatePath();
+  CreateDirectories(fn);
+  bool ok = w.Write(fn, state_generation + 1, sync_policy);
+  if (ok) {
+    state_generation++;
+    state_written_crc = crc;
+    order_stale = false;
+    ESP_LOGI(acme_tag, "%s: wrote %s, generation %u", __FUNCTION__, fn, (unsigned)state_generation);
+  } else
+    ESP_LOGE(acme_tag, "%s: failed, keeping the previous %s", __FUNCTION__, fn);
+  free(fn);
+  return ok;
+}
 
-    StoreFileOnWebserver(localfn, remotefn);
-#endif
-  } else {
-    /*
-     * The IoT device has a local web server.
-     * Either this device is "in the wild" or firewall/router/webserver tweaks have been
-     * made so it is accessible from the Internet.
-     */
-    ValidationString = CreateValidationString(token);
-    
-    // The file name that should be queried is a short form of the above remotefn
-    ValidationFile = (char *)malloc(strlen(well_known) + strlen(token) + 2);
-    sprintf(ValidationFile, "%s%s", well_known, token);
+/*
+ * Read the account and/or the order (with its challenge) from the state file.
+ * Returns false if there's no usable state file; a part that isn't in the file is left empty.
+ */
+bool Acme::ReadStateFile(bool want_account, bool want_order) {
+  StateReader	r;
+  uint8_t	tag;
+  const uint8_t	*data;
+  size_t	len;
 
-    EnableLocalWebServer();
-  }
+  if (! LoadStateFile(r))
+    return false;
 
-  // Alert the server
-  bool r = ValidateAlertServer();
+  if (want_account && r.Count(ACME_STATE_ACCOUNT)) {
+    ClearAccount();
+    account = (Account *)calloc(1, sizeof(Account));
+    int nc = r.Count(ACME_STATE_ACCOUNT_CONTACT), ic = 0;
+    account->contact = (char **)calloc(nc+1, sizeof(char *));
+
+    r.Rewind();
+    while (r.Next(&tag, &data, &len)) {
+      const char *s = StateReader::String(data, len);
+      if (ACME_STATE_PART(tag) != ACME_STATE_ACCOUNT || s == 0)
+        continue;
+      switch (tag) {
+      case ACME_STATE_ACCOUNT_STATUS:	account->status = strdup(s);		break;
+      case ACME_STATE_ACCOUNT_LOCATION:	account->location = strdup(s);		break;
+      case ACME_STATE_ACCOUNT_CONTACT:	if (ic < nc) account->contact[ic++] = strdup(s);	break;
+      case ACME_STATE_ACCOUNT_KTY:	account->key_type = strdup(s);		break;
+      case ACME_STATE_ACCOUNT_N:	account->key_id = strdup(s);		break;
+      case ACME_STATE_ACCOUNT_E:	account->key_e = strdup(s);		break;
+      }
+    }
+    ESP_LOGD(acme_tag, "%s: account %s", __FUNCTION__, account->location ? account->location : "?");
+  }
+
+  if (want_order && ! order_stale && r.Count(ACME_STATE_ORDER)) {
+    // Same as ReadOrder() : a brand new (empty) order structure doesn't need clearing
+    if (order && order->status != 0)
+      ClearOrder();
+    if (order == 0)
+      order = (Order *)calloc(1, sizeof(Order));
+    int ni = r.Count(ACME_STATE_ORDER_ID_TYPE), ii = -1;
+    int na = r.Count(ACME_STATE_ORDER_AUTHZ), ia = 0;
+    order->identifiers = (Identifier *)order_arena.Calloc(ni+1, sizeof(Identifier));
+    order->authorizations = (char **)order_arena.Calloc(na+1, sizeof(char *));
+
+    // One ACME_STATE_CHALLENGE record per authorization, followed by its challenges
+    ClearChallenge();
+    int nc = r.Count(ACME_STATE_CHALLENGE), ic = -1, ich = -1;
+    if (nc) {
+      challenge = (Challenge *)calloc(nc, sizeof(Challenge));
+      challenge_count = nc;
+      r.Rewind();
+      while (r.Next(&tag, &data, &len))
+        if (tag == ACME_STATE_CHALLENGE)
+          ic++;
+        else if (tag == ACME_STATE_CHALLENGE_TYPE && ic >= 0)
+          challenge[ic].nchallenges++;
+      for (ic = 0; ic < nc; ic++)
+        challenge[ic].challenges = (ChallengeItem *)challenge_arena.Calloc(challenge[ic].nchallenges+1,
+          sizeof(ChallengeItem));
+      ic = -1;
+    }
 
-  // Remove the file
-  if (webserver != 0) {
-    if (r) {
-      if (ValidationString) {
-        free(ValidationString);
-        ValidationString = 0;
+    r.Rewind();
+    while (r.Next(&tag, &data, &len)) {
+      if (tag == ACME_STATE_CHALLENGE && ic+1 < nc) {
+        ic++;
+        ich = -1;
+        continue;
       }
-      if (ValidationFile) {
-        free(ValidationFile);
-        ValidationFile = 0;
+      const char *s = StateReader::String(data, len);
+      if (s == 0)
+        continue;
+      switch (tag) {
+      case ACME_STATE_ORDER_STATUS:	order->status = order_arena.Strdup(s);		break;
+      case ACME_STATE_ORDER_EXPIRES:	order->expires = order_arena.Strdup(s);		break;
+      case ACME_STATE_ORDER_FINALIZE:	order->finalize = order_arena.Strdup(s);	break;
+      case ACME_STATE_ORDER_CERTIFICATE:	order->certificate = order_arena.Strdup(s);	break;
+      case ACME_STATE_ORDER_LOCATION:	order->location = order_arena.Strdup(s);	break;
+      case ACME_STATE_ORDER_ID_TYPE:
+        if (++ii < ni)
+          order->identifiers[ii]._type = order_arena.Strdup(s);
+        break;
+      case ACME_STATE_ORDER_ID_VALUE:
+        if (ii >= 0 && ii < ni)
+          order->identifiers[ii].value = order_arena.Strdup(s);
+        break;
+      case ACME_STATE_ORDER_AUTHZ:
+        if (ia < na)
+          order->authorizations[ia++] = order_arena.Strdup(s);
+        break;
       }
 
-      if (ws_registered)
-        DisableLocalWebServer();
-    }
-  } else {
-    /*
-     * FIXME Can't find a API call (except when accessing SPIFFS) to remove a file
-     * in the ESP-IDF VFS layer
-     *
-     * Sometimes this is too soon.
-     * Leaving the challenges here makes sure we can pick this up in AcmeProcess() in case
-     * of failures, only clean up on success.
-     */
-    if (r) {
-      // Remove the file from FTP server
-      RemoveFileFromWebserver(remotefn);
-
-      // Remove our in-memory record
-      ClearChallenge();
+      if (ic < 0)
+        continue;
+      Challenge *c = &challenge[ic];
+      switch (tag) {
+      case ACME_STATE_CHALLENGE_STATUS:	c->status = challenge_arena.Strdup(s);		break;
+      case ACME_STATE_CHALLENGE_EXPIRES:	c->expires = challenge_arena.Strdup(s);		break;
+      case ACME_STATE_CHALLENGE_IDENTIFIER:	c->identifier = challenge_arena.Strdup(s);	break;
+      case ACME_STATE_CHALLENGE_TYPE:
+        if (++ich < c->nchallenges)
+          c->challenges[ich]._type = challenge_arena.Strdup(s);
+        break;
+      case ACME_STATE_CHALLENGE_ITEM_STATUS:
+        if (ich >= 0 && ich < c->nchallenges)
+          c->challenges[ich].status = challenge_arena.Strdup(s);
+        break;
+      case ACME_STATE_CHALLENGE_URL:
+        if (ich >= 0 && ich < c->nchallenges)
+          c->challenges[ich].url = challenge_arena.Strdup(s);
+        break;
+      case ACME_STATE_CHALLENGE_TOKEN:
+        if (ich >= 0 && ich < c->nchallenges)
+          c->challenges[ich].token = challenge_arena.Strdup(s);
+        break;
+      }
     }
-
-    free(remotefn);
-    free(localfn);
+    if (order->expires)
+      order->t_expires = timestamp(order->expires);
+    for (ic = 0; ic < challenge_count; ic++)
+      if (challenge[ic].expires)
+        challenge[ic].t_expires = timestamp(challenge[ic].expires);
+    if (order->status)
+      ESP_LOGI(acme_tag, "%s : success, order status %s", __FUNCTION__, order->status);
   }
-  return r;
+  return true;
 }
 
 /*
- * Send a request to the server to read our token
- * We're only implementing the http-01 protocol here...
+ * Convert account.json and order.json into the state file. This leaves the in-memory state as
+ * it was : what wasn't loaded before is dropped again.
+ * Called automatically when there is no state file yet, so existing devices keep their account
+ * and order when switching over.
  */
-bool Acme::ValidateAlertServer() {
-  ESP_LOGI(acme_tag, "%s", __FUNCTION__);
-  if (http01_ix < 0) {
-    ESP_LOGE(acme_tag, "%s: no %s found", __FUNCTION__, acme_http_01);
+bool Acme::ImportJsonState() {
+  if (state_fn == 0 || filename_prefix == 0)
     return false;
-  }
 
-  char *msg = MakeMessageKID(challenge->challenges[http01_ix].url, "{}");
+  bool had_account = (account != 0), had_order = (order != 0);
 
-  ESP_LOGD(acme_tag, "%s: query %s message %s", __FUNCTION__, challenge->challenges[http01_ix].url, msg);
+  if (! had_account && account_fn) {
+    char *fn = (char *)malloc(strlen(account_fn) + 5 + strlen(filename_prefix));
+    sprintf(fn, "%s/%s", filename_prefix, account_fn);
+    ReadAccountInfo(fn);
+    free(fn);
+  }
+  if (! had_order && order_fn) {
+    char *fn = (char *)malloc(strlen(order_fn) + 5 + strlen(filename_prefix));
+    sprintf(fn, "%s/%s", filename_prefix, order_fn);
+    ReadOrderInfo(fn);
+    free(fn);
+  }
+  if (account == 0 && order == 0)
+    return false;			// Nothing to import
 
-  // FIXME only one authorization is picked up
-  char *reply = PerformWebQuery(challenge->challenges[http01_ix].url, msg, acme_jose_json, 0);
+  bool ok = WriteStateFile();
+  if (ok)
+    ESP_LOGI(acme_tag, "%s: imported %s%s%s", __FUNCTION__, account ? "account" : "",
+      (account && order) ? " and " : "", order ? "order" : "");
 
-  free(msg);
-  if (reply) {
+  if (! had_account)
+    ClearAccount();
+  if (! had_order)
+    ClearOrder();
+  return ok;
+}
+
+/*
+ * Directory cache.
+ * The directory rarely changes, so keep it on flash (in the state file, or else in directory_fn)
+ * for directory_ttl seconds, and don't talk to the server at boot at all. Only when an order
+ * needs the server, GetDirectory() fetches the directory, if the cached copy is too old.
+ */
+void Acme::setDirectoryFilename(const char *fn) {
+  directory_fn = fn;
+}
+
+void Acme::setDirectoryTtl(time_t ttl) {
+  directory_ttl = ttl;
+}
+
+/*
+ * Make sure we have the directory : from memory, from the cache, or else from the server.
+ */
+bool Acme::GetDirectory() {
+  time_t now = time(0);
+
+  if (directory) {
+    if (directory_ttl == 0 || (directory_fetched <= now && now - directory_fetched < directory_ttl))
+      return true;
+    ESP_LOGI(acme_tag, "%s: directory is older than %ld seconds", __FUNCTION__, (long)directory_ttl);
+    ClearDirectory();
+  }
+
+  if (ReadDirectoryCache())
+    return true;
+
+  QueryAcmeDirectory();
+  if (directory == 0)
+    return false;
+  WriteDirectoryCache();
+  return true;
+}
+
+/*
+ * Use cached URLs if they are for our server and recent enough.
+ */
+bool Acme::SetCachedDirectory(const char *server, const char *na, const char *nn, const char *no, const char *ri, time_t fetched) {
+  time_t now = time(0);
+
+  if (server == 0 || acme_server_url == 0 || strcmp(server, acme_server_url) != 0)
+    return false;
+  if (na == 0 || nn == 0 || no == 0)
+    return false;
+  if (fetched > now || now - fetched >= directory_ttl)
+    return false;
+
+  ClearDirectory();
+  directory = (Directory *)malloc(sizeof(Directory));
+  directory->newAccount = strdup(na);
+  directory->newNonce = strdup(nn);
+  directory->newOrder = strdup(no);
+  directory->renewalInfo = ri ? strdup(ri) : 0;
+  directory_fetched = fetched;
+  ESP_LOGI(acme_tag, "%s: using the directory from %ld seconds ago", __FUNCTION__, (long)(now - fetched));
+  return true;
+}
+
+bool Acme::ReadDirectoryCache() {
+  if (directory_ttl == 0)
+    return false;
+
+  if (state_fn) {
+    StateReader	r;
+    uint8_t	tag;
+    const uint8_t	*data;
+    size_t	len;
+    const char	*server = 0, *na = 0, *nn = 0, *no = 0, *ri = 0;
+    time_t	fetched = 0;
+
+    if (directory_stale || ! LoadStateFile(r))
+      return false;
+    while (r.Next(&tag, &data, &len))
+      switch (tag) {
+      case ACME_STATE_DIR_SERVER:	server = StateReader::String(data, len);	break;
+      case ACME_STATE_DIR_NEW_ACCOUNT:	na = StateReader::String(data, len);		break;
+      case ACME_STATE_DIR_NEW_NONCE:	nn = StateReader::String(data, len);		break;
+      case ACME_STATE_DIR_NEW_ORDER:	no = StateReader::String(data, len);		break;
+      case ACME_STATE_DIR_FETCHED:	fetched = StateReader::Time(data, len);		break;
+      case ACME_STATE_DIR_RENEWAL_INFO:	ri = StateReader::String(data, len);		break;
+      }
+    return SetCachedDirectory(server, na, nn, no, ri, fetched);
+  }
+
+  if (directory_fn == 0 || filename_prefix == 0)
+    return false;
+
+  char *fn = (char *)malloc(strlen(directory_fn) + 5 + strlen(filename_prefix));
+  sprintf(fn, "%s/%s", filename_prefix, directory_fn);
+  char *buffer = read_file(fn, 0);
+  free(fn);
+  if (buffer == 0)
+    return false;
+
+  bool ok = false;
+#ifdef ARDUINOJSON_5
+  DynamicJsonBuffer jb;
+  JsonObject &root = jb.parseObject(buffer);
+  if (root.success())
+#else
+  DynamicJsonDocument root(512);
+  DeserializationError je = deserializeJson(root, buffer);
+  if (! je)
+#endif
+  {
+    ok = SetCachedDirectory(root[acme_json_server], root["newAccount"], root["newNonce"], root["newOrder"],
+      root[acme_json_renewal_info], root[acme_json_fetched].as<long>());
+  }
+  free(buffer);
+  return ok;
+}
+
+void Acme::WriteDirectoryCache() {
+  if (directory == 0 || directory_ttl == 0)
+    return;
+
+  if (state_fn) {
+    WriteStateFile();
+    return;
+  }
+  if (directory_fn == 0 || filename_prefix == 0)
+    return;
+
+#ifdef ARDUINOJSON_5
+  DynamicJsonBuffer jb;
+  JsonObject &jo = jb.createObject();
+#else
+  DynamicJsonDocument jo(512);
+#endif
+  jo[acme_json_server] = acme_server_url;
+  jo["newAccount"] = directory->newAccount;
+  jo["newNonce"] = directory->newNonce;
+  jo["newOrder"] = directory->newOrder;
+  if (directory->renewalInfo)
+    jo[acme_json_renewal_info] = directory->renewalInfo;
+  jo[acme_json_fetched] = (long)directory_fetched;
+
+#ifdef ARDUINOJSON_5
+  size_t olen = jo.measureLength() + 1;
+#else
+  size_t olen = measureJson(jo) + 1;
+#endif
+  char *output = (char *)malloc(olen);
+  if (output == 0)
+    return;
+#ifdef ARDUINOJSON_5
+  jo.printTo(output, olen);
+#else
+  serializeJson(jo, output, olen);
+#endif
+
+  char *fn = (char *)malloc(strlen(directory_fn) + 5 + strlen(filename_prefix));
+  sprintf(fn, "%s/%s", filename_prefix, directory_fn);
+  CreateDirectories(fn);
+  SafeFile sf(fn, sync_policy);
+  FILE *f = sf.Open();
+  if (f) {
+    fputs(output, f);
+    if (sf.Commit())
+      ESP_LOGD(acme_tag, "%s: wrote %s", __FUNCTION__, fn);
+  }
+  free(fn);
+  free(output);
+}
+
+/*
+ * The server didn't like one of the cached URLs : fetch the directory again next time.
+ */
+void Acme::InvalidateDirectory() {
+  ESP_LOGI(acme_tag, "%s", __FUNCTION__);
+  ClearDirectory();
+  directory_fetched = 0;
+  directory_stale = true;		// Don't copy it from the previous state file either
+  if (state_fn)
+    WriteStateFile();
+  else if (directory_fn && filename_prefix) {
+    char *fn = (char *)malloc(strlen(directory_fn) + 5 + strlen(filename_prefix));
+    sprintf(fn, "%s/%s", filename_prefix, directory_fn);
+    unlink(fn);
+    free(fn);
+  }
+}
+
+/*
+ * Renewal information (ARI, RFC 9773).
+ * If the directory has a renewalInfo URL, the server suggests a window in which to renew our
+ * certificate. We pick a random time in it, so devices that got their certificates together
+ * don't all come back at once, and ask again every few hours (or when Retry-After says) in case
+ * the server moves the window, e.g. because it's going to revoke the certificate.
+ * The window is kept in the state file, or else in renewal_fn.
+ */
+void Acme::setRenewalFilename(const char *fn) {
+  renewal_fn = fn;
+}
+
+void Acme::setRenewalFraction(float fraction, float jitter) {
+  renew_fraction = fraction;
+  renew_jitter = jitter;
+}
+
+/*
+ * ARI identifies a certificate by base64url(authority key identifier) "." base64url(serial number),
+ * RFC 9773 §4.1. mbedtls 2.x doesn't keep the AKI, so find it among the extensions.
+ */
+char *Acme::CertificateId() {
+  if (certificate == 0 || certificate->v3_ext.p == 0 || certificate->serial.len == 0)
+    return 0;
+
+  unsigned char		*p = certificate->v3_ext.p;
+  const unsigned char	*end = p + certificate->v3_ext.len;
+  const unsigned char	*aki = 0;
+  size_t		len, aki_len = 0;
+
+  // Extensions ::= SEQUENCE OF Extension
+  if (mbedtls_asn1_get_tag(&p, end, &len, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE) != 0)
+    return 0;
+  end = p + len;
+  while (p < end && aki == 0) {
+    // Extension ::= SEQUENCE { extnID OID, critical BOOLEAN DEFAULT FALSE, extnValue OCTET STRING }
+    mbedtls_x509_buf	oid;
+    if (mbedtls_asn1_get_tag(&p, end, &len, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE) != 0)
+      return 0;
+    unsigned char *ext_end = p + len;
+    if (mbedtls_asn1_get_tag(&p, ext_end, &oid.len, MBEDTLS_ASN1_OID) != 0)
+      return 0;
+    oid.p = p;
+    p += oid.len;
+
+    if (MBEDTLS_OID_CMP(MBEDTLS_OID_AUTHORITY_KEY_IDENTIFIER, &oid) == 0) {
+      if (p < ext_end && *p == MBEDTLS_ASN1_BOOLEAN && mbedtls_asn1_get_tag(&p, ext_end, &len, MBEDTLS_ASN1_BOOLEAN) == 0)
+        p += len;
+      // AuthorityKeyIdentifier ::= SEQUENCE { keyIdentifier [0] IMPLICIT OCTET STRING OPTIONAL, ... }
+      if (mbedtls_asn1_get_tag(&p, ext_end, &len, MBEDTLS_ASN1_OCTET_STRING) == 0
+       && mbedtls_asn1_get_tag(&p, ext_end, &len, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE) == 0
+       && mbedtls_asn1_get_tag(&p, ext_end, &len, MBEDTLS_ASN1_CONTEXT_SPECIFIC | 0) == 0) {
+        aki = p;
+        aki_len = len;
+      }
+    }
+    p = ext_end;
+  }
+  if (aki == 0)
+    return 0;
+
+  size_t n = base64url_encoded_len(aki_len) + base64url_encoded_len(certificate->serial.len) + 2;
+  char *id = (char *)malloc(n);
+  if (id == 0)
+    return 0;
+  int l = base64url_encode(id, n, aki, aki_len);
+  id[l++] = '.';
+  base64url_encode(id + l, n - l, certificate->serial.p, certificate->serial.len);
+  return id;
+}
+
+/*
+ * Ask the server for its suggested renewal window, if it's time to.
+ */
+void Acme::CheckRenewalInfo(time_t now) {
+  if (cert_id == 0 || now < ari_next_check)
+    return;
+  if (! GetDirectory())
+    return;
+  if (directory->renewalInfo == 0) {
+    ESP_LOGD(acme_tag, "%s: server doesn't support ARI", __FUNCTION__);
+    ari_next_check = now + acme_ari_check_max;		// In case it does later
+    return;
+  }
+
+  const char *ri = directory->renewalInfo;
+  size_t rl = strlen(ri);
+  char *url = (char *)malloc(rl + strlen(cert_id) + 2);
+  sprintf(url, (rl && ri[rl-1] == '/') ? "%s%s" : "%s/%s", ri, cert_id);
+  ESP_LOGI(acme_tag, "%s: %s", __FUNCTION__, url);
+
+  // Plain GET, this doesn't need the account
+  char *reply = PerformWebQuery(url, 0, 0, 0);
+  free(url);
+
+  time_t next = retry_after ? retry_after : acme_ari_check_default;
+  if (next < acme_ari_check_min)
+    next = acme_ari_check_min;
+  if (next > acme_ari_check_max)
+    next = acme_ari_check_max;
+  ari_next_check = now + (reply ? next : acme_ari_check_min);
+
+  if (reply == 0) {
+    ESP_LOGE(acme_tag, "%s: PerformWebQuery -> null", __FUNCTION__);
+    return;
+  }
+
+#ifdef ARDUINOJSON_5
+  DynamicJsonBuffer jb;
+  JsonObject &root = jb.parseObject(reply);
+  if (! root.success())
+#else
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterRenewalInfo(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
+  if (je)
+#endif
+  {
+    ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
+    FreeReply(reply);
+    return;
+  }
+
+  const char *ws = root[acme_json_suggested_window][acme_json_start];
+  const char *we = root[acme_json_suggested_window][acme_json_end];
+  time_t start = ws ? timestamp(ws) : 0;
+  time_t end = we ? timestamp(we) : 0;
+  FreeReply(reply);
+
+  if (start == 0 || end < start) {
+    ESP_LOGE(acme_tag, "%s: no valid window (%s, %s)", __FUNCTION__, ws ? ws : "null", we ? we : "null");
+    return;
+  }
+  SetRenewalInfo(start, end);
+  WriteRenewalInfo();
+}
+
+/*
+ * Only pick a new time when the window changes, otherwise every check would move it.
+ */
+void Acme::SetRenewalInfo(time_t start, time_t end) {
+  if (ari_cert_id && strcmp(ari_cert_id, cert_id) == 0 && start == ari_start && end == ari_end)
+    return;
+
+  free(ari_cert_id);
+  ari_cert_id = strdup(cert_id);
+  ari_start = start;
+  ari_end = end;
+  ari_renew_at = start + (time_t)(Random() % (uint32_t)(end - start + 1));
+
+  char t[24];
+  strftime(t, sizeof(t), "%FT%TZ", gmtime(&ari_renew_at));
+  ESP_LOGI(acme_tag, "%s: window of %ld s, renewing at %s", __FUNCTION__, (long)(end - start), t);
+}
+
+void Acme::ReadRenewalInfo() {
+  const char	*id = 0;
+  time_t	start = 0, end = 0, at = 0, next = 0;
+  StateReader	r;
+  char		*buffer = 0;
+
+#ifdef ARDUINOJSON_5
+  DynamicJsonBuffer jb;
+#else
+  DynamicJsonDocument root(384);
+#endif
+
+  if (cert_id == 0)
+    return;
+
+  if (state_fn) {
+    uint8_t		tag;
+    const uint8_t	*data;
+    size_t		len;
+
+    if (! LoadStateFile(r))
+      return;
+    while (r.Next(&tag, &data, &len))
+      switch (tag) {
+      case ACME_STATE_RENEWAL_CERT_ID:		id = StateReader::String(data, len);	break;
+      case ACME_STATE_RENEWAL_START:		start = StateReader::Time(data, len);	break;
+      case ACME_STATE_RENEWAL_END:		end = StateReader::Time(data, len);	break;
+      case ACME_STATE_RENEWAL_AT:		at = StateReader::Time(data, len);	break;
+      case ACME_STATE_RENEWAL_NEXT_CHECK:	next = StateReader::Time(data, len);	break;
+      }
+  } else if (renewal_fn && filename_prefix) {
+    char *fn = (char *)malloc(strlen(renewal_fn) + 5 + strlen(filename_prefix));
+    sprintf(fn, "%s/%s", filename_prefix, renewal_fn);
+    buffer = read_file(fn, 0);
+    free(fn);
+    if (buffer == 0)
+      return;
+
+#ifdef ARDUINOJSON_5
+    JsonObject &root = jb.parseObject(buffer);
+    if (root.success())
+#else
+    if (! deserializeJson(root, buffer))
+#endif
+    {
+      id = root[acme_json_cert_id];
+      start = root[acme_json_start].as<long>();
+      end = root[acme_json_end].as<long>();
+      at = root[acme_json_renew_at].as<long>();
+      next = root[acme_json_next_check].as<long>();
+    }
+  }
+
+  // Only if it's about the certificate we have now
+  if (id && strcmp(id, cert_id) == 0 && at) {
+    free(ari_cert_id);
+    ari_cert_id = strdup(id);
+    ari_start = start;
+    ari_end = end;
+    ari_renew_at = at;
+    ari_next_check = next;
+    ESP_LOGI(acme_tag, "%s: renewing at %ld", __FUNCTION__, (long)at);
+  }
+  free(buffer);
+}
+
+void Acme::WriteRenewalInfo() {
+  if (ari_cert_id == 0)
+    return;
+
+  if (state_fn) {
+    WriteStateFile();
+    return;
+  }
+  if (renewal_fn == 0 || filename_prefix == 0)
+    return;
+
+#ifdef ARDUINOJSON_5
+  DynamicJsonBuffer jb;
+  JsonObject &jo = jb.createObject();
+#else
+  DynamicJsonDocument jo(384);
+#endif
+  jo[acme_json_cert_id] = ari_cert_id;
+  jo[acme_json_start] = (long)ari_start;
+  jo[acme_json_end] = (long)ari_end;
+  jo[acme_json_renew_at] = (long)ari_renew_at;
+  jo[acme_json_next_check] = (long)ari_next_check;
+
+#ifdef ARDUINOJSON_5
+  size_t olen = jo.measureLength() + 1;
+#else
+  size_t olen = measureJson(jo) + 1;
+#endif
+  char *output = (char *)malloc(olen);
+  if (output == 0)
+    return;
+#ifdef ARDUINOJSON_5
+  jo.printTo(output, olen);
+#else
+  serializeJson(jo, output, olen);
+#endif
+
+  char *fn = (char *)malloc(strlen(renewal_fn) + 5 + strlen(filename_prefix));
+  sprintf(fn, "%s/%s", filename_prefix, renewal_fn);
+  CreateDirectories(fn);
+  SafeFile sf(fn, sync_policy);
+  FILE *f = sf.Open();
+  if (f) {
+    fputs(output, f);
+    if (sf.Commit())
+      ESP_LOGD(acme_tag, "%s: wrote %s", __FUNCTION__, fn);
+  }
+  free(fn);
+  free(output);
+}
+
+/*
+ */
+#ifdef ARDUINOJSON_5
+void Acme::ReadOrder(JsonObject &json)
+#else
+void Acme::ReadOrder(DynamicJsonDocument &json)
+#endif
+{
+  // The order URL isn't in the JSON that the server sends, keep the one we have unless the reply has a new one
+  char *kept_location = (order && order->location) ? strdup(order->location) : 0;
+
+  // Treat the case separately where we have an empty order structure : it's brand new so no need to free/reallocate
+  if (order && order->status != 0)
+    ClearOrder();
+  if (order == 0) {
+    order = (Order *)malloc(sizeof(Order));
+    memset((void *)order, 0, sizeof(Order));
+  }
+
+/*
+ * Replace a single statement such as
+ *   account->key_type = strdup(json["key"]["kty"]);
+ * by a macro invocation to protect against calling strdup(0) if an element is not in the JSON.
+ * C/C++ syntax hint : #x turns the macro argument x into a string.
+ */
+#define	BZZ(x)									\
+  {										\
+    const char *x = json[#x];							\
+    if (x) {									\
+      ESP_LOGD(acme_tag, "%s : read %s as %s", __FUNCTION__, #x, x);		\
+      order->x = order_arena.Strdup(x);						\
+    } else {									\
+      order->x = 0;								\
+    }										\
+  }
+
+  BZZ(status);
+  BZZ(expires);
+  BZZ(finalize);
+  BZZ(certificate);
+  BZZ(location);				// Only in our own file
+
+  if (order->expires)
+    order->t_expires = timestamp(order->expires);
+
+  if (reply_location) {
+    order->location = order_arena.Strdup(reply_location);
+    free(reply_location);
+    reply_location = 0;
+  } else if (order->location == 0)
+    order->location = order_arena.Strdup(kept_location);
+  free(kept_location);
+
+#undef BZZ
+
+#ifdef ARDUINOJSON_5
+  JsonArray &jia = json["identifiers"];
+#else
+  JsonArray jia = json[acme_json_identifiers];
+#endif
+
+  ESP_LOGD(acme_tag, "%s : %d identifiers", __FUNCTION__, jia.size());
+  order->identifiers = (Identifier *)order_arena.Calloc(jia.size()+1, sizeof(Identifier));
+  order->identifiers[jia.size()]._type = 0;
+  order->identifiers[jia.size()].value = 0;
+  for (int i=0; i<jia.size(); i++) {
+    const char *it = jia[i]["type"];
+    const char *iv = jia[i]["value"];
+    order->identifiers[i]._type = order_arena.Strdup(it);
+    order->identifiers[i].value = order_arena.Strdup(iv);
+  }
+
+#ifdef ARDUINOJSON_5
+  JsonArray &jaa = json["authorizations"];
+#else
+  JsonArray jaa = json[acme_json_authorizations];
+#endif
+  ESP_LOGD(acme_tag, "%s : %d authorizations", __FUNCTION__, jaa.size());
+  order->authorizations = (char **)order_arena.Calloc(jaa.size()+1, sizeof(char *));
+  order->authorizations[jaa.size()] = 0;
+  for (int i=0; i<jaa.size(); i++) {
+    const char *a = jaa[i];
+    order->authorizations[i] = order_arena.Strdup(a);
+  }
+}
+
+/*
+ * Get all authorizations of the order done at once : publish the validation files of all of them
+ * first, then tell the server to validate each, back to back. The server can then check them in
+ * parallel, and we poll them together (PollAuthorization()) until they're all done.
+ * Authorizations that are already valid (the server may reuse earlier ones) are left alone.
+ */
+bool Acme::ValidateOrder() {
+  ESP_LOGI(acme_tag, "%s", __FUNCTION__);
+
+  int error = DownloadAuthorizationResource();
+  if (error != 0) {
+    ESP_LOGE(acme_tag, "%s: status %s, change to %s", __FUNCTION__, order->status, acme_status_invalid);
+    order->status = order_arena.Strdup(acme_status_invalid);
+    return false;
+  }
+
+  int todo = 0, unpublished = 0;
+  for (int i=0; i<challenge_count; i++) {
+    Challenge *c = &challenge[i];
+    if (c->status && strcmp(c->status, acme_status_valid) == 0)
+      continue;
+    ChallengeItem *ci = Http01(c);
+    if (ci == 0 || ci->token == 0) {
+      ESP_LOGE(acme_tag, "%s: no %s token found for %s, aborting authorization", __FUNCTION__, acme_http_01,
+        c->identifier ? c->identifier : "?");
+      return false;
+    }
+    ESP_LOGI(acme_tag, "%s: %s token %s", __FUNCTION__, c->identifier ? c->identifier : "?", ci->token);
+    if (! c->published)
+      unpublished++;
+    todo++;
+  }
+
+  // Publish them as one batch, so the publisher can use one connection for all of them
+  if (unpublished) {
+    ChallengePublisher *p = Publisher();
+    if (p == 0) {
+      ESP_LOGE(acme_tag, "%s: no web server, FTP server or publisher to put validation files on", __FUNCTION__);
+      return false;
+    }
+    if (! p->Begin())
+      return false;
+    for (int i=0; i<challenge_count; i++) {
+      Challenge *c = &challenge[i];
+      if (c->status && strcmp(c->status, acme_status_valid) == 0)
+        continue;
+      if (! c->published && ! PublishValidation(c)) {
+        p->End();
+        return false;
+      }
+    }
+    p->End();
+  }
+  ESP_LOGI(acme_tag, "%s: %d of %d authorization(s) to validate", __FUNCTION__, todo, challenge_count);
+
+  // Alert the server, once for each challenge it hasn't picked up yet
+  for (int i=0; i<challenge_count; i++) {
+    Challenge *c = &challenge[i];
+    ChallengeItem *ci = Http01(c);
+    if (c->status && strcmp(c->status, acme_status_valid) == 0)
+      continue;
+    if (ci->status && strcmp(ci->status, acme_status_pending) != 0)
+      continue;
+
+    /*
+     * Sometimes this is too soon.
+     * Leaving the validation files in place makes sure we can pick this up in AcmeProcess() in
+     * case of failures, they're only removed once all authorizations are done.
+     */
+    if (! ValidateAlertServer(c))
+      return false;
+  }
+
+  // From now on, poll until the server is done with all of them
+  challenge_posted = true;
+  return CheckAuthorizations();
+}
+
+/*
+ * Which of the authorization's challenges we answer : we're only implementing http-01.
+ */
+Acme::ChallengeItem *Acme::Http01(Challenge *c) {
+  for (int i=0; i<c->nchallenges; i++)
+    if (c->challenges[i]._type && strcmp(c->challenges[i]._type, acme_http_01) == 0)
+      return &c->challenges[i];
+  return 0;
+}
+
+/*
+ * Put the validation file for one authorization in place, through the publisher : on the FTP
+ * server, on our own web server, or wherever the application's publisher puts it.
+ * Called between Begin() and End() of the publisher.
+ */
+bool Acme::PublishValidation(Challenge *c) {
+  const char *token = Http01(c)->token;
+
+  char *vs = CreateValidationString(token);
+  if (vs == 0)
+    return false;
+  bool ok = publisher->Publish(token, vs);
+  free(vs);
+  if (! ok) {
+    ESP_LOGE(acme_tag, "%s: %s could not publish %s", __FUNCTION__, publisher->Name(), token);
+    return false;
+  }
+  c->published = true;
+  return true;
+}
+
+/*
+ * Take the validation file away again. Called between Begin() and End() of the publisher.
+ */
+void Acme::RemoveValidation(Challenge *c) {
+  if (! c->published)
+    return;
+  c->published = false;
+
+  ChallengeItem *ci = Http01(c);
+  if (ci && ci->token && ! publisher->Unpublish(ci->token))
+    ESP_LOGE(acme_tag, "%s: %s could not remove %s", __FUNCTION__, publisher->Name(), ci->token);
+}
+
+/*
+ * Done with the authorizations (all valid, or the order failed) : clean up all of them as one
+ * batch, end the publisher's session, and remove our in-memory record.
+ */
+void Acme::RemoveValidations() {
+  int n = 0;
+  for (int i=0; i<challenge_count; i++)
+    if (challenge[i].published)
+      n++;
+
+  if (n && publisher && publisher->Begin()) {
+    for (int i=0; i<challenge_count; i++)
+      RemoveValidation(&challenge[i]);
+    publisher->End();
+  }
+  if (publisher)
+    publisher->Close();
+  ClearChallenge();
+}
+
+/*
+ * How far did the server get with our authorizations ? Moves the order on to "ready" when
+ * all of them are valid, or to "invalid" if one failed.
+ */
+bool Acme::CheckAuthorizations() {
+  int waiting = 0;
+
+  for (int i=0; i<challenge_count; i++) {
+    Challenge *c = &challenge[i];
+    ChallengeItem *ci = Http01(c);
+    const char *cs = (ci && ci->status) ? ci->status : "";
+
+    if ((c->status && strcmp(c->status, acme_status_invalid) == 0) || strcmp(cs, acme_status_invalid) == 0) {
+      ESP_LOGE(acme_tag, "%s: authorization for %s %s, starting a new order", __FUNCTION__,
+        c->identifier ? c->identifier : "?", acme_status_invalid);
+      challenge_posted = false;
+      RemoveValidations();
+      order->status = order_arena.Strdup(acme_status_invalid);
+      MarkOrderDirty();
+      return false;
+    }
+    if ((c->status == 0 || strcmp(c->status, acme_status_valid) != 0) && strcmp(cs, acme_status_valid) != 0)
+      waiting++;
+  }
+
+  if (waiting) {
+    ESP_LOGI(acme_tag, "%s: %d of %d authorization(s) not valid yet", __FUNCTION__, waiting, challenge_count);
+    return false;
+  }
+
+  challenge_posted = false;
+  order->status = order_arena.Strdup(acme_status_ready);	// Important note : advancing our local order to "ready"
+  MarkOrderDirty();
+  RemoveValidations();
+  return true;
+}
+
+/*
+ * The server accepted our challenges but is still validating them : fetch the authorizations
+ * that aren't valid yet again, and move on when they all are. The caller retries later if
+ * they're not done yet.
+ */
+bool Acme::PollAuthorization() {
+  ESP_LOGD(acme_tag, "%s", __FUNCTION__);
+
+  if (challenge_count == 0 && DownloadAuthorizationResource() != 0)
+    return false;
+
+  for (int i=0; i<challenge_count; i++)
+    if (challenge[i].status == 0 || strcmp(challenge[i].status, acme_status_valid) != 0)
+      if (DownloadAuthorization(i) != 0)
+        return false;
+
+  return CheckAuthorizations();
+}
+
+/*
+ * While the order is "processing" the server is issuing our certificate. Fetch the order
+ * (POST-as-GET to its URL, RFC 8555 §7.4) to see whether it's valid yet.
+ */
+bool Acme::PollOrder() {
+  if (order->location == 0) {
+    // An order from before we kept its URL : nothing to poll, start over
+    ESP_LOGE(acme_tag, "%s: no order URL, starting a new order", __FUNCTION__);
+    order->status = order_arena.Strdup(acme_status_invalid);
+    MarkOrderDirty();
+    return false;
+  }
+
+  char *reply = SignedQuery(order->location, "", 0, 0);
+  if (reply == 0) {
+    ESP_LOGE(acme_tag, "%s: PerformWebQuery -> null", __FUNCTION__);
+    return false;
+  }
+
+#ifdef ARDUINOJSON_5
+  DynamicJsonBuffer jb;
+  JsonObject &root = jb.parseObject(reply);
+  if (! root.success())
+#else
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterOrder(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
+  if (je)
+#endif
+  {
+    ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
+    FreeReply(reply);
+    return false;
+  }
+
+  const char *reply_status = root[acme_json_status];
+  if (reply_status == 0 || reply_status[0] == '4') {
+    const char *reply_type = root[acme_json_type];
+    const char *reply_detail = root[acme_json_detail];
+
+    ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status ? reply_status : "(null)",
+      reply_type ? reply_type : "", reply_detail ? reply_detail : "");
+    FreeReply(reply);
+    return false;
+  }
+  ESP_LOGI(acme_tag, "%s: order %s", __FUNCTION__, reply_status);
+
+  ReadOrder(root);
+  MarkOrderDirty();
+  FreeReply(reply);
+  return true;
+}
+
+/*
+ * Send a request to the server to read our token
+ * We're only implementing the http-01 protocol here...
+ * Returns true if the server took the request, the challenge status is then in the reply.
+ */
+bool Acme::ValidateAlertServer(Challenge *c) {
+  ChallengeItem *ci = Http01(c);
+  ESP_LOGI(acme_tag, "%s(%s)", __FUNCTION__, c->identifier ? c->identifier : "?");
+  if (ci == 0 || ci->url == 0) {
+    ESP_LOGE(acme_tag, "%s: no %s found", __FUNCTION__, acme_http_01);
+    return false;
+  }
+
+  char *reply = SignedQuery(ci->url, "{}", 0, 0);
+  if (reply) {
     ESP_LOGD(acme_tag, "%s: PerformWebQuery -> %s", __FUNCTION__, reply);
   } else {
     ESP_LOGE(acme_tag, "%s: PerformWebQuery -> null", __FUNCTION__);
@@ -2266,13 +3672,14 @@ bool Acme::ValidateAlertServer() {
   JsonObject &root = jb.parseObject(reply);
   if (! root.success())
 #else
-  DynamicJsonDocument root(512);
-  DeserializationError je = deserializeJson(root, reply);
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterChallenge(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
   if (je)
 #endif
   {
     ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
-    free(reply);
+    FreeReply(reply);
     return false;
   }
   ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
@@ -2284,25 +3691,21 @@ bool Acme::ValidateAlertServer() {
 
     ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status, reply_type, reply_detail);
 
-    free(reply);
+    FreeReply(reply);
     return false;
   } else if (reply_status == 0) {
     // ESP_LOGE(acme_tag, "%s: null reply_status", __FUNCTION__);
     ESP_LOGE(acme_tag, "%s: null reply_status (reply %s)", __FUNCTION__, reply);
-    free(reply);
+    FreeReply(reply);
     return false;
   } else {
     ESP_LOGI(acme_tag, "%s: reply_status %s", __FUNCTION__, reply_status);
   }
 
-  if (ReadAuthorizationReply(root)) {
-    free(reply);
-    return true;
-  } else {
-    ESP_LOGE(acme_tag, "%s: failing", __FUNCTION__);
-    free(reply);
-    return false;
-  }
+  // Pending or processing : the server has our request, it's just not done validating
+  ci->status = ChallengeString(ci->status, reply_status);
+  FreeReply(reply);
+  return true;
 }
 
 /*
@@ -2316,14 +3719,8 @@ bool Acme::DownloadCertificate() {
   bool ok = true;
   ESP_LOGD(acme_tag, "%s(%s)", __FUNCTION__, order->certificate);
 
-  char *msg = MakeMessageKID(order->certificate, "");
-
-  ESP_LOGD(acme_tag, "%s: PerformWebQuery(%s,%s,%s,%s)", __FUNCTION__, order->certificate, msg, acme_jose_json, acme_accept_pem_chain);
-
-  char *reply = PerformWebQuery(order->certificate, msg, acme_jose_json, acme_accept_pem_chain);
-  // char *reply = PerformWebQuery(order->certificate, msg, acme_jose_json, acme_accept_der);
-
-  free(msg);
+  char *reply = SignedQuery(order->certificate, "", 0, acme_accept_pem_chain);
+  // char *reply = SignedQuery(order->certificate, "", 0, acme_accept_der);
   if (reply) {
     ESP_LOGD(acme_tag, "%s -> %s", __FUNCTION__, reply);
   } else {
@@ -2331,8 +3728,8 @@ bool Acme::DownloadCertificate() {
     return false;
   }
 
-  if (ws_registered)
-    DisableLocalWebServer();
+  if (publisher)
+    publisher->Reset();
 
   /*
    * We requested PEM so that's what we got.
@@ -2353,75 +3750,32 @@ bool Acme::DownloadCertificate() {
   int fnl = strlen(filename_prefix) + strlen(cert_fn) + 3;
   char *fn = (char *)malloc(fnl);
   sprintf(fn, "%s/%s", filename_prefix, cert_fn);
-  FILE *f = fopen(fn, "w");
+  SafeFile sf(fn, sync_policy);
+  FILE *f = sf.Open();
   if (f) {
     size_t fl = fwrite(cert_ptr, 1, cert_len, f);
     if (fl != cert_len) {
       ESP_LOGE(acme_tag, "Failed to write certificate to %s, %d of %d written", fn, fl, cert_len);
       ok = false;
+    } else if (! sf.Commit()) {
+      ESP_LOGE(acme_tag, "Failed to write certificate to %s", fn);
+      ok = false;
     } else {
       ESP_LOGI(acme_tag, "Wrote certificate to %s", fn);
     }
-    fclose(f);
   } else {
     ESP_LOGE(acme_tag, "Could not open %s to write certificate, error %d (%s)", fn, errno, strerror(errno));
     ok = false;
   }
-  free(reply);
+  FreeReply(reply);
+
+  ESP_LOGI(acme_tag, "%s: %d connection(s) to the ACME server for this order, %d bytes of order data", __FUNCTION__,
+    handshakes, (int)getOrderMemoryUsage());
 
   if (ok) ReadCertificate();
   return ok;
 }
 
-/*
- * Fetch the result of an Authorization. If valid, then we can move ahead with certificate download.
- *
- * We're not storing this info into a structure similar to the message content. Rather, we're
- * using this info to match with our existing Order structure, and update it.
- *
- * {
- *   "type": "http-01",
- *   "status": "valid",
- *   "url": "https://acme-staging-v02.api.letsencrypt.org/acme/chall-v3/28523991/ZQYjMg",
- *   "token": "XNmOzvEOv57hbpXC7kbZMEAjy1HiLT6g_opkKG7XUaY",
- *   "validationRecord": [
- *     {
- *       "url": "http://dannybackx.hopto.org/.well-known/acme-challenge/XNmOzvEOv57hbpXC7kbZMEAjy1HiLT6g_opkKG7XUaY",
- *       "hostname": "dannybackx.hopto.org",
- *       "port": "80",
- *       "addressesResolved": [
- *         "94.224.125.18"
- *       ],
- *       "addressUsed": "94.224.125.18"
- *     }
- *   ]
- * }
- */
-#ifdef ARDUINOJSON_5
-bool Acme::ReadAuthorizationReply(JsonObject &json)
-#else
-bool Acme::ReadAuthorizationReply(DynamicJsonDocument &json)
-#endif
-{
-  const char *status = json[acme_json_status];
-  if (status == 0) {
-    ESP_LOGE(acme_tag, "Acme::ReadAuthorizationReply status (null)");
-    return false;
-  }
-  ESP_LOGD(acme_tag, "Acme::ReadAuthorizationReply status %s", status);
-
-  if (strcmp(status, acme_status_valid) != 0) {
-    ESP_LOGE(acme_tag, "Acme::ReadAuthorizationReply invalid status (%s), returning", status);
-    return false;
-  }
-
-  free(order->status);
-  order->status = strdup(acme_status_ready);	// Important note : advancing our local order to "ready"
-  ESP_LOGD(acme_tag, "Acme::ReadAuthorizationReply WriteOrderInfo() status %s", order->status);
-  WriteOrderInfo();
-  return true;
-}
-
 /*
  * Download Authorization Resource
  * See RFC 8555 §7.5
@@ -2450,61 +3804,77 @@ int Acme::DownloadAuthorizationResource() {
     return -1;
   }
 
-  // Loop over authorizations, one at a time
-  for (int i=0; order->authorizations[i]; i++) {
-    ESP_LOGI(acme_tag, "%s: %d %s", __FUNCTION__, i, order->authorizations[i]);
-
-    char *msg = MakeMessageKID(order->authorizations[i], "");
+  int n = 0;
+  while (order->authorizations[n])
+    n++;
+  if (challenge && challenge_count != n)
+    ClearChallenge();			// Not for this order
+  if (challenge == 0) {
+    challenge = (Challenge *)calloc(n, sizeof(Challenge));
+    challenge_count = n;
+  }
 
-    ESP_LOGD(acme_tag, "%s: query %s message %s", __FUNCTION__, order->authorizations[i], msg);
+  // Fetch all authorizations, back to back
+  for (int i=0; i<n; i++) {
+    int error = DownloadAuthorization(i);
+    if (error != 0)
+      return error;
+  }
+  return 0;
+}
 
-    char *reply = PerformWebQuery(order->authorizations[i], msg, acme_jose_json, 0);
+/*
+ * Fetch one authorization, keep what it says in challenge[i].
+ */
+int Acme::DownloadAuthorization(int i) {
+  ESP_LOGI(acme_tag, "%s: %d %s", __FUNCTION__, i, order->authorizations[i]);
 
-    free(msg);
-    if (reply) {
-      ESP_LOGD(acme_tag, "PerformWebQuery -> %s", reply);
-    } else {
-      ESP_LOGE(acme_tag, "%s: PerformWebQuery -> null", __FUNCTION__);
-    }
+  char *reply = SignedQuery(order->authorizations[i], "", 0, 0);
+  if (reply) {
+    ESP_LOGD(acme_tag, "PerformWebQuery -> %s", reply);
+  } else {
+    ESP_LOGE(acme_tag, "%s: PerformWebQuery -> null", __FUNCTION__);
+  }
 
-    // Decode JSON reply
+  // Decode JSON reply
 #ifdef ARDUINOJSON_5
   DynamicJsonBuffer jb;
   JsonObject &root = jb.parseObject(reply);
   if (! root.success())
 #else
-  DynamicJsonDocument root(512);
-  DeserializationError je = deserializeJson(root, reply);
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterAuthorization(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
   if (je)
 #endif
-    {
-      ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
-      free(reply);
-      return -1;
-    }
-    ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
-
-    const char *reply_status = root[acme_json_status];
-    if (reply_status && reply_status[0] == '4') {
-      const char *reply_type = root[acme_json_type];
-      const char *reply_detail = root[acme_json_detail];
+  {
+    ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
+    FreeReply(reply);
+    return -1;
+  }
+  ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
 
-      ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status, reply_type, reply_detail);
+  const char *reply_status = root[acme_json_status];
+  if (reply_status && reply_status[0] == '4') {
+    const char *reply_type = root[acme_json_type];
+    const char *reply_detail = root[acme_json_detail];
 
-      free(reply);
-      int reply_status_num = root[acme_json_status];
-      return reply_status_num;
-    } else if (reply_status == 0) {
-      // ESP_LOGE(acme_tag, "%s: null reply_status", __FUNCTION__);
-      ESP_LOGE(acme_tag, "%s: null reply_status (reply %s)", __FUNCTION__, reply);
-      return -1;
-    } else {
-      ESP_LOGD(acme_tag, "%s: reply_status %s", __FUNCTION__, reply_status);
-    }
+    ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status, reply_type, reply_detail);
 
-    ReadChallenge(root);
-    free(reply);
+    int reply_status_num = root[acme_json_status];
+    FreeReply(reply);
+    return reply_status_num;
+  } else if (reply_status == 0) {
+    // ESP_LOGE(acme_tag, "%s: null reply_status", __FUNCTION__);
+    ESP_LOGE(acme_tag, "%s: null reply_status (reply %s)", __FUNCTION__, reply);
+    FreeReply(reply);
+    return -1;
+  } else {
+    ESP_LOGD(acme_tag, "%s: reply_status %s", __FUNCTION__, reply_status);
   }
+
+  ReadChallenge(&challenge[i], root);
+  FreeReply(reply);
   return 0;
 }
 
@@ -2513,37 +3883,57 @@ int Acme::DownloadAuthorizationResource() {
  */
 char *Acme::JWSThumbprint() {
   int err;
+  char *t;
 
-  int ne = 4;						// E will be at the rear end of this array
-  unsigned char	E[4];
-  int nl = mbedtls_rsa_get_len(rsa);
-  unsigned char *N = (unsigned char *)malloc(nl);	// Allocate exactly long enough, don't add one more for trailing 0.
-
-  if ((err = mbedtls_rsa_export_raw(rsa, N, nl, /* P */ 0, 0, /* Q */ 0, 0, /* D */ 0, 0, E, ne)) != 0) {
-    char buf[80];
-    mbedtls_strerror(err, buf, sizeof(buf));
-    ESP_LOGE(acme_tag, "%s: failed rsa_export_raw %d %s", __FUNCTION__, err, buf);
+  if (accountkey == 0)
     return 0;
-  }
 
-  // E is at the rear end of this array, point q to it
-  char *q = (char *)E;
-  for (; *q == 0; q++,ne--);			// Skip initial zeroes
+  if (mbedtls_pk_can_do(accountkey, MBEDTLS_PK_ECDSA)) {
+    char *x64, *y64;
+    if (! ExportEcPoint(&x64, &y64))
+      return 0;
+
+    // Required members in lexicographic order, no white space (RFC 7638 §3.2)
+    const char *format = "{\"crv\":\"P-256\",\"kty\":\"EC\",\"x\":\"%s\",\"y\":\"%s\"}";
+
+    t = (char *)malloc(strlen(format) + strlen(x64) + strlen(y64) + 4);
+    sprintf(t, format, x64, y64);
+    free(x64);
+    free(y64);
+  } else {
+    mbedtls_rsa_context *rsa = mbedtls_pk_rsa(*accountkey);
+    int ne = 4;						// E will be at the rear end of this array
+    unsigned char	E[4];
+    int nl = mbedtls_rsa_get_len(rsa);
+    unsigned char *N = (unsigned char *)malloc(nl);	// Allocate exactly long enough, don't add one more for trailing 0.
 
-  // ESP_LOGI(acme_tag, "RSA key N : %s", N);
-  char *n64 = Base64((char *)N, nl);
-  char *e64 = Base64((char *)q, ne);
-  ESP_LOGI(acme_tag, "RSA key E(64) : %s, N(64) : %s", e64, n64);
+    if ((err = mbedtls_rsa_export_raw(rsa, N, nl, /* P */ 0, 0, /* Q */ 0, 0, /* D */ 0, 0, E, ne)) != 0) {
+      char buf[80];
+      mbedtls_strerror(err, buf, sizeof(buf));
+      ESP_LOGE(acme_tag, "%s: failed rsa_export_raw %d %s", __FUNCTION__, err, buf);
+      free(N);
+      return 0;
+    }
 
-  // White-space-less JWK format, as described.
-  // Don't change this even a little bit
-  const char *format = "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}";
+    // E is at the rear end of this array, point q to it
+    char *q = (char *)E;
+    for (; *q == 0; q++,ne--);			// Skip initial zeroes
 
-  char *t = (char *)malloc(strlen(format) + 2 * nl + ne + 4);		// hack : 2*, otherwise crash due to alloc(280), but use 370
-  sprintf(t, format, e64, n64);
-  free(N);
-  free(n64);
-  free(e64);
+    // ESP_LOGI(acme_tag, "RSA key N : %s", N);
+    char *n64 = Base64((char *)N, nl);
+    char *e64 = Base64((char *)q, ne);
+    ESP_LOGI(acme_tag, "RSA key E(64) : %s, N(64) : %s", e64, n64);
+
+    // White-space-less JWK format, as described.
+    // Don't change this even a little bit
+    const char *format = "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}";
+
+    t = (char *)malloc(strlen(format) + 2 * nl + ne + 4);		// hack : 2*, otherwise crash due to alloc(280), but use 370
+    sprintf(t, format, e64, n64);
+    free(N);
+    free(n64);
+    free(e64);
+  }
 
   int hash_size = 32;
   unsigned char *hash = (unsigned char *)calloc(1, hash_size);
@@ -2576,39 +3966,116 @@ char *Acme::JWSThumbprint() {
   return r;
 }
 
-// Create it locally
-bool Acme::CreateValidationFile(const char *localfn, const char *token) {
-  FILE *tf = fopen(localfn, "w");
-  if (! tf) {
-    ESP_LOGE(acme_tag, "%s: could not create %s, %s", __FUNCTION__, localfn, strerror(errno));
+/*
+ * The "alg" field in the JWS protected header, depends on the account key (RFC 7518 §3.1)
+ */
+const char *Acme::JWSAlgorithm() {
+  if (accountkey && mbedtls_pk_can_do(accountkey, MBEDTLS_PK_ECDSA))
+    return "ES256";
+  return "RS256";
+}
+
+/*
+ * Public point of an EC account key, as base64url coordinates for the JWK (RFC 7518 §6.2.1).
+ * Only P-256 is supported, the coordinates are always 32 bytes, leading zeroes included.
+ * Caller must free both strings.
+ */
+bool Acme::ExportEcPoint(char **x64, char **y64) {
+  mbedtls_ecp_keypair *ec = mbedtls_pk_ec(*accountkey);
+  unsigned char x[32], y[32];
+  int err;
+
+  if (ec->grp.id != MBEDTLS_ECP_DP_SECP256R1) {
+    ESP_LOGE(acme_tag, "%s: only P-256 keys are supported", __FUNCTION__);
+    return false;
+  }
+  if ((err = mbedtls_mpi_write_binary(&ec->Q.X, x, sizeof(x))) != 0
+   || (err = mbedtls_mpi_write_binary(&ec->Q.Y, y, sizeof(y))) != 0) {
+    char buf[80];
+    mbedtls_strerror(err, buf, sizeof(buf));
+    ESP_LOGE(acme_tag, "%s: failed mpi_write_binary %d %s", __FUNCTION__, err, buf);
     return false;
   }
+  *x64 = Base64((char *)x, sizeof(x));
+  *y64 = Base64((char *)y, sizeof(y));
+  return true;
+}
+
+/*
+ * The JWK and its thumbprint only depend on the account key, so compute them once when the key
+ * is read, generated or set, instead of for every request and every challenge.
+ */
+void Acme::UpdateKeyCache() {
+  ClearKeyCache();
+  if (accountkey == 0)
+    return;
+  account_jwk = MakeJWK();
+  account_thumbprint = JWSThumbprint();
+}
 
-  char *tp = JWSThumbprint();
-  fprintf(tf, "%s.%s\n", token, tp);
-  free(tp);
+void Acme::ClearKeyCache() {
+  if (account_jwk)
+    free(account_jwk);
+  if (account_thumbprint)
+    free(account_thumbprint);
+  account_jwk = account_thumbprint = 0;
+}
 
-  fclose(tf);
-  return true;
+const char *Acme::AccountJWK() {
+  if (account_jwk == 0)
+    UpdateKeyCache();
+  return account_jwk;
 }
 
-// For use by the local web server
+const char *Acme::AccountThumbprint() {
+  if (account_thumbprint == 0)
+    UpdateKeyCache();
+  return account_thumbprint;
+}
+
+// What the ACME server expects to find in the validation file
 char *Acme::CreateValidationString(const char *token) {
-  char *tp = JWSThumbprint();
+  const char *tp = AccountThumbprint();
+  if (tp == 0)
+    return 0;
   int len = strlen(token) + strlen(tp) + 4;
   char *r = (char *)malloc(len);
   sprintf(r, "%s.%s\n", token, tp);
   return r;					// Caller must free
 }
 
+/*
+ * Status strings change while we poll : only copy them into the arena when they do, so polling
+ * doesn't make it grow.
+ */
+char *Acme::ChallengeString(char *old, const char *s) {
+  if (s == 0)
+    return 0;
+  if (old && strcmp(old, s) == 0)
+    return old;
+  return challenge_arena.Strdup(s);
+}
+
 #ifdef ARDUINOJSON_5
-void Acme::ReadChallenge(JsonObject &json)
+void Acme::ReadChallenge(Challenge *c, JsonObject &json)
 #else
-void Acme::ReadChallenge(DynamicJsonDocument &json)
+void Acme::ReadChallenge(Challenge *c, DynamicJsonDocument &json)
 #endif
 {
-  challenge = (Challenge *)malloc(sizeof(Challenge));
-  memset((void *)challenge, 0, sizeof(Challenge));
+#ifdef ARDUINOJSON_5
+  JsonArray &jca = json["challenges"];
+#else
+  JsonArray jca = json["challenges"];
+#endif
+
+  // We get here again for each poll, then only the statuses change
+  if (c->challenges && c->nchallenges == (int)jca.size()) {
+    c->status = ChallengeString(c->status, json[acme_json_status]);
+    for (int i=0; i<c->nchallenges; i++)
+      c->challenges[i].status = ChallengeString(c->challenges[i].status, jca[i][acme_json_status]);
+    ESP_LOGD(acme_tag, "%s : %s %s", __FUNCTION__, c->identifier ? c->identifier : "?", c->status);
+    return;
+  }
 
 /*
  * Replace a single statement such as
@@ -2621,43 +4088,35 @@ void Acme::ReadChallenge(DynamicJsonDocument &json)
     const char *x = json[#x];							\
     if (x) {									\
       ESP_LOGI(acme_tag, "%s : read %s as %s", __FUNCTION__, #x, x);		\
-      challenge->x = strdup(x);							\
+      c->x = challenge_arena.Strdup(x);						\
     } else {									\
-      challenge->x = 0;								\
+      c->x = 0;									\
     }										\
   }
 
   BZZ(status);
   BZZ(expires);
 
-  challenge->t_expires = timestamp(challenge->expires);
+  c->t_expires = timestamp(c->expires);
 
 #undef BZZ
 
-  // we're not reading the identifier, as we're not using it
+  const char *id = json[acme_json_identifier][acme_json_value];
+  c->identifier = challenge_arena.Strdup(id);
 
-#ifdef ARDUINOJSON_5
-  JsonArray &jca = json["challenges"];
-#else
-  DynamicJsonDocument jca = json["challenges"];
-#endif
   ESP_LOGD(acme_tag, "%s : %d challenges", __FUNCTION__, jca.size());
-  challenge->challenges = (ChallengeItem *)calloc(jca.size()+1, sizeof(ChallengeItem));
-  // Null-terminate
-  challenge->challenges[jca.size()]._type = 0;
-  challenge->challenges[jca.size()].status = 0;
-  challenge->challenges[jca.size()].url = 0;
-  challenge->challenges[jca.size()].token = 0;
+  c->nchallenges = jca.size();
+  c->challenges = (ChallengeItem *)challenge_arena.Calloc(jca.size()+1, sizeof(ChallengeItem));
   for (int i=0; i<jca.size(); i++) {
     const char *ct = jca[i][acme_json_type];
     const char *cs = jca[i][acme_json_status];
     const char *cu = jca[i][acme_json_url];
     const char *ck = jca[i][acme_json_token];
 
-    challenge->challenges[i]._type = strdup(ct);
-    challenge->challenges[i].status = strdup(cs);
-    challenge->challenges[i].url = strdup(cu);
-    challenge->challenges[i].token = strdup(ck);
+    c->challenges[i]._type = challenge_arena.Strdup(ct);
+    c->challenges[i].status = challenge_arena.Strdup(cs);
+    c->challenges[i].url = challenge_arena.Strdup(cu);
+    c->challenges[i].token = challenge_arena.Strdup(ck);
   }
 }
 
@@ -2680,33 +4139,65 @@ void Acme::ReadChallenge(DynamicJsonDocument &json)
 char *Acme::MakeMessageKID(const char *url, const char *payload) {
   ESP_LOGD(acme_tag, "%s(%s,%s)", __FUNCTION__, url, payload);
 
-  char *prot = MakeProtectedKID(url);
-  if (prot == 0) {
-    ESP_LOGD(acme_tag, "%s: MakeProtectedKID -> null", __FUNCTION__);
-    return 0;
-  }
+  return MakeJWS(url, payload, 0);
+}
 
-  ESP_LOGD(acme_tag, "PR %s", prot);
-  char *pr = Base64(prot);
-  char *pl = Base64(payload);
-  char *sig = Signature(pr, pl);
+/*
+ * Sign payload (with jwk, or with our account URL if jwk is NULL), post it, and return the reply.
+ *
+ * A nonce can be refused (e.g. it expired while in the pool) : the server then replies with a
+ * badNonce error (status 400), and a fresh nonce in its Replay-Nonce header. Sign again with that
+ * and retry. Any other reply goes to the caller, even if it happens to mention badNonce.
+ */
+char *Acme::SignedQuery(const char *url, const char *payload, const char *jwk, const char *accept_msg) {
+  for (int attempt = 0; attempt < 3; attempt++) {
+    char *msg = MakeJWS(url, payload, jwk);
+    if (msg == 0) {
+      ESP_LOGE(acme_tag, "%s: null message", __FUNCTION__);
+      return 0;
+    }
+    ESP_LOGD(acme_tag, "%s: query %s message %s", __FUNCTION__, url, msg);
 
-  char *js = 0;
-  int sz = 0;
+    char *reply = PerformWebQuery(url, msg, acme_jose_json, accept_msg);
+    free(msg);
 
-  // "{\n  \"protected\": \"%s\",\n  \"payload\": \"%s\",\n  \"signature\": \"%s\"\n}",
-  sz = snprintf(js, sz, acme_message_kid_template, pr, pl, sig);
-  if (sz < 0)
-    return 0;
-  sz++;
-  js = (char *)malloc(sz);
-  snprintf(js, sz, acme_message_kid_template, pr, pl, sig);
-  free(prot);
-  free(pr);
-  free(pl);
-  free(sig);
+    if (reply == 0 || reply_http_status != 400 || ! IsBadNonce(reply))
+      return reply;
+    if (request_replayed) {
+      // The first copy may have been processed, a new signature could make that happen twice
+      ESP_LOGE(acme_tag, "%s: %s was sent twice, nonce refused, giving up", __FUNCTION__, url);
+      FreeReply(reply);
+      return 0;
+    }
 
-  return js;
+    ESP_LOGI(acme_tag, "%s: nonce refused by server, retrying", __FUNCTION__);
+    FreeReply(reply);
+  }
+  ESP_LOGE(acme_tag, "%s: %s keeps refusing our nonces", __FUNCTION__, url);
+  return 0;
+}
+
+/*
+ * Whether the problem document (RFC 7807) in an error reply has the badNonce type.
+ * The reply is parsed as const, so it stays intact for the caller if it's something else.
+ */
+bool Acme::IsBadNonce(const char *reply) {
+#ifdef ARDUINOJSON_5
+  DynamicJsonBuffer jb;
+  JsonObject &root = jb.parseObject(reply);
+  if (! root.success())
+    return false;
+#else
+  StaticJsonDocument<JSON_OBJECT_SIZE(1)> filter;
+  filter[acme_json_type] = true;
+  // Input that isn't ours to modify is copied : room for the key and for a badNonce value
+  DynamicJsonDocument root(JSON_OBJECT_SIZE(1) + strlen(acme_json_type) + strlen(acme_error_bad_nonce) + 2);
+  DeserializationError je = deserializeJson(root, reply, DeserializationOption::Filter(filter));
+  if (je)
+    return false;			// Also when the type is too long to be badNonce
+#endif
+  const char *type = root[acme_json_type];
+  return type && strcmp(type, acme_error_bad_nonce) == 0;
 }
 
 void Acme::SetAcmeUserAgentHeader(esp_http_client_handle_t client) {
@@ -2723,30 +4214,6 @@ void Acme::SetAcmeUserAgentHeader(esp_http_client_handle_t client) {
   free(acme_agent_value);
 }
 
-/*
- * This will be the protected field in the JSON
- *
- * {"alg": "RS256", "nonce": "webISTv8", "kid": "https://acme-staging-v02.api.letsencrypt.org/acme/acct/012", "url": "https://acme-staging-v02.api.letsencrypt.org/acme/new-order"}
- */
-char *Acme::MakeProtectedKID(const char *query) {
-  if (account->location == 0)
-    ESP_LOGE(acme_tag, "%s: location null", __FUNCTION__);
-  if (nonce == 0)
-    ESP_LOGE(acme_tag, "%s: nonce null", __FUNCTION__);
-  if (account->location == 0 || nonce == 0)
-    return 0;
-
-  char *my_nonce = GetNonce();
-  if (my_nonce == 0)
-    return 0;
-
-  const char *acme_protected_template = "{\"alg\": \"RS256\", \"nonce\": \"%s\", \"url\": \"%s\", \"kid\": \"%s\"}";
-  char *request = (char *)malloc(strlen(acme_protected_template) + strlen(query) + strlen(my_nonce) + strlen(account->location) + 4);
-  sprintf(request, acme_protected_template, my_nonce, query, account->location);
-
-  return request;
-}
-
 /*
  * Perform a query
  *
@@ -2754,48 +4221,32 @@ char *Acme::MakeProtectedKID(const char *query) {
  */
 char *Acme::PerformWebQuery(const char *query, const char *topost, const char *apptype, const char *accept_message) {
   esp_err_t			err;
-  esp_http_client_config_t	httpc;
   esp_http_client_handle_t	client;
-  char				*buf;
-  int				pos, total, rlen, content_length;
 
   ESP_LOGD(acme_tag, "%s(%s, POST %s, type %s)", __FUNCTION__, query,
     topost ? topost : "null",
     apptype ? apptype : "null");
 
-  memset(&httpc, 0, sizeof(httpc));
-  httpc.url = query;
-  httpc.event_handler = HttpEvent;
-  if (root_certificate)
-    httpc.cert_pem = root_certificate;	// Required in esp-idf 4.3 for https
-  httpc.crt_bundle_attach = esp_crt_bundle_attach;
-
-  client = esp_http_client_init(&httpc);
+  reply_http_status = 0;
+  if ((client = AcmeClient(query)) == 0)
+    return 0;
 
-  if (reply_buffer)
-    free(reply_buffer);
-  reply_buffer = 0;
-  reply_buffer_len = 0;
+  reply_buf.Begin();
 
-  if (topost) {
-    err = esp_http_client_set_post_field(client, topost, strlen(topost));
-    if (err != ESP_OK) {
-      ESP_LOGE(acme_tag, "%s: set_post_field error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-      esp_http_client_cleanup(client);
-      return 0;
-    } else
-      ESP_LOGD(acme_tag, "%s: set_post_field length %d", __FUNCTION__, strlen(topost));
+  // The client is reused, so set (or clear) everything that the previous query may have left
+  err = esp_http_client_set_post_field(client, topost, topost ? strlen(topost) : 0);
+  if (err != ESP_OK) {
+    ESP_LOGE(acme_tag, "%s: set_post_field error %d %s", __FUNCTION__, err, esp_err_to_name(err));
+    return 0;
+  } else if (topost)
+    ESP_LOGD(acme_tag, "%s: set_post_field length %d", __FUNCTION__, strlen(topost));
 
-    // Do a POST query if we're posting data.
-    if ((err = esp_http_client_set_method(client, HTTP_METHOD_POST)) != ESP_OK) {
-      ESP_LOGE(acme_tag, "%s: client_set_method error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-      esp_http_client_cleanup(client);
-      return 0;
-    }
+  // Do a POST query if we're posting data.
+  if ((err = esp_http_client_set_method(client, topost ? HTTP_METHOD_POST : HTTP_METHOD_GET)) != ESP_OK) {
+    ESP_LOGE(acme_tag, "%s: client_set_method error %d %s", __FUNCTION__, err, esp_err_to_name(err));
+    return 0;
   }
 
-  SetAcmeUserAgentHeader(client);
-
   const char *at = apptype ? apptype : "application/json";
   if ((err = esp_http_client_set_header(client, acme_content_type, at)) != ESP_OK) {
     ESP_LOGE(acme_tag, "%s: client_set_header(%s=%s) error %d %s", __FUNCTION__, acme_content_type, at, err, esp_err_to_name(err));
@@ -2812,96 +4263,193 @@ char *Acme::PerformWebQuery(const char *query, const char *topost, const char *a
     } else {
       ESP_LOGD(acme_tag, "Client_set_header(%s=%s)", acme_accept_header, accept_message);
     }
+  } else
+    esp_http_client_delete_header(client, acme_accept_header);
+
+  // The reply gets captured in Acme::HttpEvent
+  if ((err = AcmeClientPerform(client)) != ESP_OK) {
+    ESP_LOGE(acme_tag, "%s: client_perform error %d %s", __FUNCTION__, err, esp_err_to_name(err));
+    CloseAcmeClient();
+    reply_buf.Begin();
+    return 0;
   }
 
-  if (topost) {
-    // Need to use esp_http_client_perform() because esp_http_client_open() doesn't call esp_http_client_send_post_data() and
-    // that's a static function so we can't call it ourselves.
-    err = esp_http_client_perform(client);
+  reply_http_status = esp_http_client_get_status_code(client);
 
-    // Ok, now the data has been captured in Acme::HttpEvent, just pass it on and finish up.
-    ESP_LOGD(acme_tag, "%s -> %*s", __FUNCTION__, reply_buffer_len, reply_buffer);
+  const ReplyBufferStats *st = reply_buf.Stats();
+  ESP_LOGD(acme_tag, "%s -> %d bytes (buffer %d, %d allocations%s) %s", __FUNCTION__,
+    (int)st->length, (int)st->peak, st->allocations, st->presized ? ", presized" : "",
+    reply_buf.Data() ? reply_buf.Data() : "");
+  if (reply_stats_hook)
+    reply_stats_hook(query, st);
 
-    esp_http_client_close(client);
-    esp_http_client_cleanup(client);
+  // Caller owns this now, and should hand it back through FreeReply()
+  return reply_buf.Detach();
+}
 
-    // Buffer will get freed after this, so lose its length indication
-    reply_buffer_len = 0;
-    char *tmp = reply_buffer;
-    reply_buffer = 0;
+void Acme::FreeReply(char *reply) {
+  reply_buf.Release(reply);
+}
 
-    return tmp;
-  } else {
-    err = esp_http_client_open(client, 0);
+void Acme::setReplyStatsHook(reply_stats_hook_t hook) {
+  reply_stats_hook = hook;
+}
 
-    if (err != ESP_OK) {
-      ESP_LOGE(acme_tag, "%s: client_open error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-      esp_http_client_cleanup(client);
-      return 0;
-    }
-    if ((content_length = esp_http_client_fetch_headers(client)) < 0) {
-      ESP_LOGE(acme_tag, "%s: fetch_headers error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-      esp_http_client_cleanup(client);
-      return 0;
-    }
-    buf = (char *)malloc(content_length + 1);
-    if (buf == 0) {
-      ESP_LOGE(acme_tag, "%s: malloc error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-      esp_http_client_cleanup(client);
-      return 0;
-    }
-    pos = 0; total = 0; rlen = 0;
-    while (total < content_length && err == ESP_OK) {
-      rlen = esp_http_client_read(client, buf + pos, content_length - total);
-      if (rlen < 0) {
-        ESP_LOGE(acme_tag, "%s: read error %d %s", __FUNCTION__, err, esp_err_to_name(err));
-        free(buf);
-        esp_http_client_cleanup(client);
-        return 0;
-      }
-      buf[rlen] = 0;
-      pos += rlen;
-      total += rlen;
-    }
+/*
+ * All queries to the ACME server go through one HTTP client, which is kept between queries so
+ * the connection (and its TLS handshake) is reused. A new client is only made when the origin
+ * (scheme, host and port) changes.
+ */
+esp_http_client_handle_t Acme::AcmeClient(const char *url) {
+  const char *p = strstr(url, "://");
+  const char *e = p ? strchr(p + 3, '/') : 0;
+  size_t len = e ? (size_t)(e - url) : strlen(url);
+
+  // Servers drop idle connections after a while, don't bet a query on this one still being there
+  if (acme_client && time(0) - acme_client_used > acme_client_idle) {
+    ESP_LOGD(acme_tag, "%s: client idle for %d s, closing", __FUNCTION__, (int)(time(0) - acme_client_used));
+    CloseAcmeClient();
+  }
+
+  if (acme_client) {
+    if (strlen(acme_client_origin) == len && strncasecmp(acme_client_origin, url, len) == 0
+     && esp_http_client_set_url(acme_client, url) == ESP_OK)
+      return acme_client;
+    CloseAcmeClient();
   }
 
-  ESP_LOGD(acme_tag, "%s -> %s", __FUNCTION__, buf);
+  esp_http_client_config_t	httpc;
+  memset(&httpc, 0, sizeof(httpc));
+  httpc.url = url;
+  httpc.event_handler = HttpEvent;
+  if (root_certificate)
+    httpc.cert_pem = root_certificate;	// Required in esp-idf 4.3 for https
+  httpc.crt_bundle_attach = esp_crt_bundle_attach;
+  httpc.keep_alive_enable = true;
+#ifdef ESP_HTTP_CLIENT_HAS_SESSION_CACHE
+  if (tls_session_cache)
+    httpc.session_cache = tls_session_cache->ClientHook();
+#endif
+
+  if ((acme_client = esp_http_client_init(&httpc)) == 0) {
+    ESP_LOGE(acme_tag, "%s: could not create client for %s", __FUNCTION__, url);
+    return 0;
+  }
+  acme_client_origin = strndup(url, len);
+  SetAcmeUserAgentHeader(acme_client);
+
+  ESP_LOGD(acme_tag, "%s: new client for %s", __FUNCTION__, acme_client_origin);
+  return acme_client;
+}
+
+void Acme::CloseAcmeClient() {
+  if (acme_client) {
+    esp_http_client_close(acme_client);
+    esp_http_client_cleanup(acme_client);
+  }
+  acme_client = 0;
+  if (acme_client_origin)
+    free(acme_client_origin);
+  acme_client_origin = 0;
+  acme_client_connected = false;
+}
+
+/*
+ * This is the only place where a query is retried : once, on a new connection, and only if it
+ * failed on a kept-alive connection (no new one was made) without a single byte of reply.
+ *  - If the request didn't go out (no HTTP_EVENT_HEADER_SENT), sending it is always safe. The
+ *    host port finds a closed connection before writing, esp-idf's client fails the write on a
+ *    reset one.
+ *  - esp-idf's client can only tell that the server dropped an idle connection by reading nothing
+ *    back after the request went out. It is then sent again unchanged : all our POSTs are signed,
+ *    and a copy carries the same nonce, so the server acts on at most one of the two (RFC 8555
+ *    §6.5). GET and HEAD queries can be repeated anyway. SignedQuery() takes a badNonce after
+ *    such a replay as final, rather than signing a third copy.
+ * AcmeClient() doesn't reuse connections that sat idle for long, so this should be rare.
+ */
+esp_err_t Acme::AcmeClientPerform(esp_http_client_handle_t client) {
+  int before = handshakes;
+  bool reused = acme_client_connected;
+
+  // Headers that we pick up belong to this reply only
+  retry_after = 0;
+  free(reply_location);
+  reply_location = 0;
+  request_sent = reply_started = request_replayed = false;
+
+  esp_err_t err = esp_http_client_perform(client);
+  if (err != ESP_OK && reused && handshakes == before && ! reply_started) {
+    ESP_LOGD(acme_tag, "%s: kept connection was closed (%s), %s", __FUNCTION__, esp_err_to_name(err),
+      request_sent ? "sending the request again" : "nothing sent, reconnecting");
+    request_replayed = request_sent;
+    request_sent = false;
+    esp_http_client_close(client);
+    reply_buf.Begin();
+    err = esp_http_client_perform(client);
+  }
+  acme_client_used = time(0);
+  return err;
+}
+
+/*
+ * Number of connections (TCP and TLS handshakes) made to the ACME server since the last order started
+ */
+int Acme::getHandshakeCount() {
+  return handshakes;
+}
+
+/*
+ * Order and challenge data is kept in two arenas, which are reset (not freed) for each new order.
+ */
+size_t Acme::getOrderMemoryUsage() {
+  return order_arena.BytesUsed() + challenge_arena.BytesUsed();
+}
+
+size_t Acme::getOrderMemoryReserved() {
+  return order_arena.BytesReserved() + challenge_arena.BytesReserved();
+}
 
-  esp_http_client_close(client);
-  esp_http_client_cleanup(client);
+void Acme::setUsePsram(bool p) {
+  order_arena.setUsePsram(p);
+  challenge_arena.setUsePsram(p);
+}
 
-  return buf;
+void Acme::setSyncPolicy(SafeFileSync s) {
+  sync_policy = s;
 }
 
 /*
  * This function catches HTTP headers (two of which we trap), and data sent to us as replies.
- * We gatter the latter in the reply_buffer field, whose alloc/free is rather sensitive.
+ * We gather the latter in reply_buf, which is sized from Content-Length if the server sends it.
  */
 esp_err_t Acme::HttpEvent(esp_http_client_event_t *event) {
   switch (event->event_id) {
+  case HTTP_EVENT_ON_CONNECTED:
+    acme->handshakes++;
+    acme->acme_client_connected = true;
+    break;
+  case HTTP_EVENT_DISCONNECTED:
+    acme->acme_client_connected = false;
+    break;
+  case HTTP_EVENT_HEADER_SENT:
+    acme->request_sent = true;
+    break;
   case HTTP_EVENT_ON_HEADER:
+    acme->reply_started = true;
     ESP_LOGD("Acme", "%s: header %s value %s", __FUNCTION__, event->header_key, event->header_value);
     if (strcmp(event->header_key, acme_nonce_header) == 0)
       acme->setNonce(event->header_value);
     else if (strcmp(event->header_key, acme_location_header) == 0)
       acme->setLocation(event->header_value);
+    else if (strcasecmp(event->header_key, acme_content_length_header) == 0)
+      acme->reply_buf.Reserve(strtoul(event->header_value, 0, 10));
+    else if (strcasecmp(event->header_key, acme_retry_after_header) == 0)
+      acme->retry_after = ParseRetryAfter(event->header_value);
     break;
   case HTTP_EVENT_ON_DATA:
     ESP_LOGD("Acme", "%s HTTP_EVENT_ON_DATA (len %d)", __FUNCTION__, event->data_len);
-    if (acme->reply_buffer_len == 0) {
-      acme->reply_buffer_len = event->data_len;
-      acme->reply_buffer = (char *)malloc(event->data_len + 1);
-      strncpy(acme->reply_buffer, (const char *)event->data, event->data_len);
-      acme->reply_buffer[event->data_len] = 0;
-    } else {
-      int oldlen = acme->reply_buffer_len;
-
-      acme->reply_buffer_len += event->data_len;
-      acme->reply_buffer = (char *)realloc(acme->reply_buffer, acme->reply_buffer_len + 1);
-      strncpy(acme->reply_buffer + oldlen, (const char *)event->data, event->data_len);
-      acme->reply_buffer[acme->reply_buffer_len] = 0;
-    }
-    // ESP_LOGD("Acme", "%s: received %s", __FUNCTION__, acme->reply_buffer);
+    acme->reply_started = true;
+    acme->reply_buf.Append(event->data, event->data_len);
     break;
   default:
     break;
@@ -2909,80 +4457,24 @@ esp_err_t Acme::HttpEvent(esp_http_client_event_t *event) {
   return ESP_OK;
 }
 
-/*
- * We're using https://github.com/JohnnyB1290/ESP32-FTP-Client .
- * This is a port of FTPlib (https://nbpfaus.net/~pfau/ftplib/)
- * Docs see https://nbpfaus.net/~pfau/ftplib/ftplib.html
- *
- * Note web server settings need to allow read access to these files.
- * In some cases, adding "-u 002" to the ftpd command helps in setting its umask so this works.
- *
- * Example : such a line in /etc/inetd.conf :
- * ftp     stream  tcp6    nowait  root    /usr/sbin/ftpd  ftpd -u 002
- *
- */
-void Acme::StoreFileOnWebserver(char *localfn, char *remotefn) {
-#if USE_EXTERNAL_WEBSERVER
-  NetBuf_t	*nb = 0;
-
-  if (! (ftp_user && ftp_path && ftp_server && ftp_pass)) {
-    ESP_LOGE(acme_tag, "%s: failed, incomplete setup", __FUNCTION__);
-    return;
-  }
-  ESP_LOGI(acme_tag, "%s(%s,%s)", __FUNCTION__, localfn, remotefn);
-
-  FtpClient	*ftpc = getFtpClient();
-  ftpc->ftpClientConnect(ftp_server, 21, &nb);
-  ftpc->ftpClientLogin(ftp_user, ftp_pass, nb);
-  if (remotefn[0] != '/') {
-    int len = strlen(remotefn) + strlen(ftp_path) + 4;
-    char *b = (char *)malloc(len);
-    sprintf(b, "%s/%s", ftp_path, remotefn);
-    ftpc->ftpClientPut(localfn, b, FTP_CLIENT_BINARY, nb);
-    free(b);
-  } else {
-    ftpc->ftpClientPut(localfn, remotefn, FTP_CLIENT_BINARY, nb);
-  }
-  ftpc->ftpClientQuit(nb);
-#endif
-}
-
-void Acme::RemoveFileFromWebserver(char *remotefn) {
-#if USE_EXTERNAL_WEBSERVER
-  NetBuf_t	*nb = 0;
-
-  if (! (ftp_user && ftp_path && ftp_server && ftp_pass)) {
-    ESP_LOGE(acme_tag, "%s: failed, incomplete setup", __FUNCTION__);
-    return;
-  }
-  ESP_LOGI(acme_tag, "%s(%s)", __FUNCTION__, remotefn);
-
-  FtpClient	*ftpc = getFtpClient();
-  ftpc->ftpClientConnect(ftp_server, 21, &nb);
-  ftpc->ftpClientLogin(ftp_user, ftp_pass, nb);
-  if (remotefn[0] != '/') {
-    int len = strlen(remotefn) + strlen(ftp_path) + 4;
-    char *b = (char *)malloc(len);
-    sprintf(b, "%s/%s", ftp_path, remotefn);
-    ftpc->ftpClientDelete(b, nb);
-    free(b);
-  } else {
-    ftpc->ftpClientDelete(remotefn, nb);
-  }
-  ftpc->ftpClientQuit(nb);
-#endif
-}
-
 void Acme::OrderRemove(char *dir) {
   ClearOrder();
 
+  if (state_fn) {
+    // Rewrite the state file without it, rather than copy it over from the previous one
+    order_stale = true;
+    WriteStateFile();
+    return;
+  }
   if (order_fn == 0)
     return;
 
   ESP_LOGD(acme_tag, "%s(%s,%s)", __FUNCTION__, dir, order_fn);
 
-  int err = unlink(dir);
-  if (err == ESP_OK)
+  order_written_hash = 0;		// Nothing on disk any more, the next order must be written
+
+  // Also its backup, or ReadOrderInfo() would bring the order back from there
+  if (SafeFile::Remove(dir))
     ESP_LOGD(acme_tag, "Removed %s", order_fn);
   else
     ESP_LOGE(acme_tag, "Failed to remove %s", order_fn);
@@ -3125,13 +4617,8 @@ void Acme::FinalizeOrder() {
   char *csr_param = (char *)malloc(csrlen);
   sprintf(csr_param, csr_format, csr);
   free(csr);
-  char *msg = MakeMessageKID(order->finalize, csr_param);
-  ESP_LOGD(acme_tag, "%s : msg %s", __FUNCTION__, msg);
-
-  char *reply = PerformWebQuery(order->finalize, msg, acme_jose_json, 0);
+  char *reply = SignedQuery(order->finalize, csr_param, 0, 0);
   free(csr_param);
-
-  free(msg);
   if (reply) {
     ESP_LOGD(acme_tag, "%s: PerformWebQuery -> %s", __FUNCTION__, reply);
   } else {
@@ -3144,13 +4631,14 @@ void Acme::FinalizeOrder() {
   JsonObject &root = jb.parseObject(reply);
   if (! root.success())
 #else
-  DynamicJsonDocument root(512);
-  DeserializationError je = deserializeJson(root, reply);
+  StaticJsonDocument<acme_json_filter_size> filter;
+  DynamicJsonDocument root(FilterOrder(filter));
+  DeserializationError je = ParseReply(root, reply, filter);
   if (je)
 #endif
   {
     ESP_LOGE(acme_tag, "%s : could not parse JSON", __FUNCTION__);
-    free(reply);
+    FreeReply(reply);
     return;
   }
   ESP_LOGD(acme_tag, "%s : JSON opened", __FUNCTION__);
@@ -3162,7 +4650,7 @@ void Acme::FinalizeOrder() {
 
     ESP_LOGE(acme_tag, "%s: failure %s %s %s", __FUNCTION__, reply_status, reply_type, reply_detail);
 
-    free(reply);
+    FreeReply(reply);
     return;
   } else if (reply_status == 0) {
     // ESP_LOGE(acme_tag, "%s: null reply_status", __FUNCTION__);
@@ -3172,7 +4660,7 @@ void Acme::FinalizeOrder() {
   }
 
   ReadFinalizeReply(root);
-  free(reply);
+  FreeReply(reply);
 }
 
 #ifdef ARDUINOJSON_5
@@ -3188,10 +4676,13 @@ void Acme::ReadFinalizeReply(DynamicJsonDocument &json)
  * Convert timestamp from ACME (e.g. 2019-11-25T16:56:52Z) into time_t.
  */
 time_t Acme::timestamp(const char *ts) {
-  const char *acme_timestamp = "%FT%TZ";
+  const char *acme_timestamp = "%FT%T";
   struct tm tms;
+  memset(&tms, 0, sizeof(tms));
   char *r = strptime(ts, acme_timestamp, &tms);
-  if (r == 0 || *r != 0)
+  if (r && *r == '.')		// Fractional seconds (RFC 3339), we don't need them
+    for (r++; isdigit(*r); r++);
+  if (r == 0 || strcmp(r, "Z") != 0)
     return 0;	// Failed to scan
   return mktime(&tms);
 }
@@ -3212,8 +4703,26 @@ void Acme::ReadCertificate() {
   certificate = (mbedtls_x509_crt *)calloc(1, sizeof(mbedtls_x509_crt));
   mbedtls_x509_crt_init(certificate);
   int ret = mbedtls_x509_crt_parse_file(certificate, fn);
+  if (ret != 0) {
+    // Try the previous copy, in case we crashed while replacing the certificate file
+    char *bak = SafeFile::BackupName(fn);
+    mbedtls_x509_crt_free(certificate);
+    mbedtls_x509_crt_init(certificate);
+    if (bak && mbedtls_x509_crt_parse_file(certificate, bak) == 0) {
+      ESP_LOGE(acme_tag, "%s: %s is unusable, using %s", __FUNCTION__, fn, bak);
+      ret = 0;
+    }
+    free(bak);
+  }
   if (ret == 0) {
     ESP_LOGI(acme_tag, "%s: we have a certificate in %s", __FUNCTION__, fn);
+
+    // A new certificate : renewal information is about the old one
+    char *id = CertificateId();
+    if (cert_id == 0 || id == 0 || strcmp(cert_id, id) != 0)
+      ari_next_check = 0;
+    free(cert_id);
+    cert_id = id;
     ESP_LOGI(acme_tag, "Valid from %04d-%02d-%02d %02d:%02d:%02d to %04d-%02d-%02d %02d:%02d:%02d",
       certificate->valid_from.year, certificate->valid_from.mon, certificate->valid_from.day,
       certificate->valid_from.hour, certificate->valid_from.min, certificate->valid_from.sec,
@@ -3295,9 +4804,17 @@ time_t Acme::TimeMbedToTimestamp(mbedtls_x509_time t) {
  * and replacing the old with the new only happens when the new certificate is successfully downloaded.
  */
 void Acme::RenewCertificate() {
+  // In async mode, the order is created on the ACME task
+  if (engine && ! engine->OnTask()) {
+    if (! engine->Post(ACME_CMD_RENEW, 0))
+      ESP_LOGE(acme_tag, "%s: could not queue the renewal", __FUNCTION__);
+    return;
+  }
+
   ESP_LOGI(acme_tag, "%s", __FUNCTION__);
   CreateNewOrder();
-  WriteOrderInfo();
+  MarkOrderDirty();
+  FlushOrderInfo();
 }
 
 mbedtls_x509_crt *Acme::getCertificate() {
@@ -3313,7 +4830,7 @@ void Acme::setAltUrl(const int ix, const char *fn) {
     alt_urls = (const char **)calloc(sizeof(char *), 4);
     alt_url_cnt = 4;
   }
-  if (alt_url_cnt < ix + 1) {
+  if (alt_url_cnt < ix + 2) {
     alt_url_cnt = ix + 4;
     alt_urls = (const char **)realloc(alt_urls, alt_url_cnt * sizeof(char *));
   }
@@ -3361,9 +4878,9 @@ void Acme::setFsPrefix(const char *fn) {
 }
 
 void Acme::ReadAccountKey() {
-  if (account_key_fn && (accountkey = ReadPrivateKey(account_key_fn))) {
-    rsa = mbedtls_pk_rsa(*accountkey);
-  }
+  if (account_key_fn)
+    accountkey = ReadPrivateKey(account_key_fn);
+  UpdateKeyCache();
 }
 
 void Acme::ReadCertKey() {
@@ -3387,74 +4904,48 @@ void Acme::setFtpPath(const char *s) {
   ftp_path = s;
 }
 
+/*
+ * Serve validation files from our own web server. Our acme-challenge handler stays registered
+ * until the web server is changed, or this object is deleted. The web server must match URIs
+ * with httpd_uri_match_wildcard().
+ */
 void Acme::setWebServer(httpd_handle_t ws) {
-  webserver = ws;
+  setPublisher(ws ? new HttpdPublisher(ws) : 0, true);
 }
 
 /*
- * This is - intentionally - a simplistic HTTP GET handler.
- * It just knows how to return the data that the ACME protocol requires.
- *
- * Other HTTP requests should be serviced by possibly more intelligent handlers
- * in the application.
- */
-esp_err_t Acme::acme_http_get_handler(httpd_req_t *req) {
-  if (strcmp(req->uri, acme->ValidationFile) == 0) {
-    ESP_LOGI(acme_tag, "%s: URI %s", __FUNCTION__, req->uri);
-    httpd_resp_set_type(req, "text/plain");
-    httpd_resp_send(req, acme->ValidationString, strlen(acme->ValidationString));
-  } else {
-    ESP_LOGE(acme_tag, "%s: URI %s -> 404", __FUNCTION__, req->uri);
-    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, acme_http_404);
-  }
-
-  return ESP_OK;
+ * Let the application decide where validation files go, see ChallengePublisher.h .
+ * No memory management, the caller keeps the publisher alive as long as we are.
+ */
+void Acme::setChallengePublisher(ChallengePublisher *p) {
+  setPublisher(p, false);
 }
 
-void Acme::EnableLocalWebServer() {
-  httpd_uri_t	wsconf;
-  esp_err_t	err;
-
-  if (webserver == 0) {
-    ESP_LOGE(acme_tag, "%s: internal error, webserver = 0", __FUNCTION__);
-    return;
-  }
-
-  if (ws_registered && (ovf != NULL)) {
-    // old ValidationFile
-    httpd_unregister_uri_handler(webserver, ovf, HTTP_GET);
-    free(ovf);
-    ovf = NULL;
-  }
-
-  // wsconf.uri = "/.well-known/acme-challenge/*";
-  wsconf.uri = ValidationFile;
-  wsconf.method = HTTP_GET;
-  wsconf.handler = acme_http_get_handler;
-
-  if ((err = httpd_register_uri_handler(webserver, &wsconf)) != ESP_OK) {
-    ESP_LOGE(acme_tag, "%s : failed to register URI handler for %s (%d %s)",
-      __FUNCTION__, wsconf.uri, err, esp_err_to_name(err));
-  } else {
-    ESP_LOGI(acme_tag, "%s(%s)", __FUNCTION__, wsconf.uri);
-    ws_registered = true;
-    ovf = strdup(wsconf.uri);
+void Acme::setPublisher(ChallengePublisher *p, bool own) {
+  if (publisher) {
+    publisher->Close();
+    if (own_publisher)
+      delete publisher;
   }
+  publisher = p;
+  own_publisher = own;
 }
 
-void Acme::DisableLocalWebServer() {
-  if (webserver == 0 || ovf == 0 || !ws_registered) {
-    ESP_LOGE(acme_tag, "%s: failed 0", __FUNCTION__);
-    return;
+/*
+ * Where validation files go. Without a web server or a publisher from the application, we use
+ * FTP when that is set up.
+ */
+ChallengePublisher *Acme::Publisher() {
+#if USE_EXTERNAL_WEBSERVER
+  if (publisher == 0 && ftp_user && ftp_path && ftp_server && ftp_pass) {
+    /*
+     * This case uses services from a "site" web server.
+     * We use FTP to store and remove files on it.
+     */
+    setPublisher(new FtpPublisher(ftp_server, ftp_user, ftp_pass, ftp_path), true);
   }
-
-  // Note this only works if ValidateFile isn't changed between invocations...
-  httpd_unregister_uri_handler(webserver, ovf, HTTP_GET);
-  free(ovf);
-  ovf = NULL;
-  ws_registered = false;
-
-  ESP_LOGI(acme_tag, "%s: disabled local web server", __FUNCTION__);
+#endif
+  return publisher;
 }
 
 /*
@@ -3468,11 +4959,44 @@ void Acme::setRootCertificate(const char *root_cert) {
   root_certificate = root_cert;
 }
 
+void Acme::setRootCertificatePartition(const char *label) {
+  root_certificate_partition = label;
+}
+
+/*
+ * Only the host port's HTTP client can resume sessions, see TlsSessionCache.h .
+ */
+bool Acme::setTlsSessionCache(TlsSessionCache *cache) {
+  if (cache && ! TlsSessionCache::Supported()) {
+    ESP_LOGW(acme_tag, "%s: the HTTP client can't resume TLS sessions, not using the cache", __FUNCTION__);
+    return false;
+  }
+  if (engine && ! engine->OnTask()) {
+    if (! engine->Post(ACME_CMD_SESSION_CACHE, (int64_t)(intptr_t)cache)) {
+      ESP_LOGE(acme_tag, "%s: could not queue the change", __FUNCTION__);
+      return false;
+    }
+    return true;
+  }
+  tls_session_cache = cache;
+  CloseAcmeClient();			// Next query makes a client that uses it
+  return true;
+}
+
 /*
- * This is a modified copy of Acme::ReadAccountInfo().
- * NREAD_INC is reused from that method.
+ * Read the root certificate, from a file or a flash partition. Where possible the data is
+ * mapped rather than copied into the heap, see FileData.h .
  */
 bool Acme::ReadRootCertificate() {
+  if (root_certificate_partition) {
+    if (! root_view.OpenPartition(root_certificate_partition))
+      return false;
+    ESP_LOGI(acme_tag, "Root certificate from partition %s (%d bytes)", root_certificate_partition,
+      (int)root_view.Length());
+    root_certificate = root_view.Data();
+    return true;
+  }
+
   if (root_certificate_fn == 0 || filename_prefix == 0) {
     ESP_LOGE(acme_tag, "%s: ACME files not configured", __FUNCTION__);
     return false;
@@ -3480,41 +5004,17 @@ bool Acme::ReadRootCertificate() {
   char *fn = (char *)malloc(strlen(root_certificate_fn) + 5 + strlen(filename_prefix));
   sprintf(fn, "%s/%s", filename_prefix, root_certificate_fn);
 
-  FILE *f = fopen(fn, "r");
-  if (f == NULL) {
+  if (! root_view.Open(fn)) {
     ESP_LOGE(acme_tag, "Could not read root certificate from %s, %s", fn, strerror(errno));
     free(fn);
     return false;
   }
-
-  // ESP-IDF VFS over SPIFFS doesn't allow use of fseek to determine file length, so read in chunks in that case
-  // Potential over-allocation is limited to NREAD_INC bytes
-  long len = fseek(f, 0L, SEEK_END);
-  if (len == 0) {
-    len = NREAD_INC;
-  }
-  ESP_LOGI(acme_tag, "Reading root certificate from %s", fn);
+  ESP_LOGI(acme_tag, "Reading root certificate from %s (%d bytes%s)", fn, (int)root_view.Length(),
+    root_view.Mapped() ? ", mapped" : "");
   free(fn);
+  ESP_LOGD(acme_tag, "%s: %s", __FUNCTION__, root_view.Data());
 
-  fseek(f, 0L, SEEK_SET);
-  char *buffer = (char *)malloc(len+1);
-  size_t total = fread((void *)buffer, 1, len, f);
-  buffer[total] = 0;
-  int inc = total;
-  while (inc == NREAD_INC) {
-    len += NREAD_INC;
-    buffer = (char *)realloc((void *)buffer, len + 1);
-    inc = fread((void *)(buffer + total), 1, NREAD_INC, f);
-    total += inc;
-    buffer[total] = 0;
-    ESP_LOGD(acme_tag, "Reading -> %d bytes, total %d ", inc, total);
-  }
-  fclose(f);
-  ESP_LOGD(acme_tag, "%s: %s", __FUNCTION__, buffer);
-
-  if (root_certificate)
-    free((void *)root_certificate);
-  root_certificate = buffer;
+  root_certificate = root_view.Data();
 
   return true;
 }
@@ -38,10 +38,16 @@
 #include <sys/socket.h>
 #include <esp_event.h>
 #include <esp_http_client.h>
-#if USE_EXTERNAL_WEBSERVER
-#include <FtpClient.h>
-#endif
 #include <esp_http_server.h>
+#include "TlsSessionCache.h"
+#include "ReplyBuffer.h"
+#include "Arena.h"
+#include "SafeFile.h"
+#include "StateFile.h"
+#include "FileData.h"
+#include "AcmeTask.h"
+#include "ChallengePublisher.h"
+#include <atomic>
 
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
@@ -51,9 +57,35 @@
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/error.h"
 #include "mbedtls/rsa.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/ecdsa.h"
 #include "mbedtls/sha256.h"
 #include <mbedtls/x509_csr.h>
 
+/*
+ * Private key types, can be chosen separately for the account and the certificate key.
+ * ES256 (ECDSA on the P-256 curve) keys are generated and used for signing a lot faster than RSA keys,
+ * and they're smaller.
+ * Keys read from a file are used as they are, this only matters when generating one.
+ */
+enum AcmeKeyType {
+  ACME_KEY_RSA2048 = 0,
+  ACME_KEY_ES256
+};
+
+/*
+ * In async mode (StartTask), results are reported on the ACME task through this callback.
+ * ACME_EVENT_CERTIFICATE is what loop() returning true means otherwise, ACME_EVENT_DONE is sent
+ * after every other tick or command.
+ */
+enum AcmeEvent {
+  ACME_EVENT_DONE = 0,
+  ACME_EVENT_CERTIFICATE
+};
+
+class Acme;
+typedef void (*acme_event_cb_t)(Acme *, AcmeEvent, void *arg);
+
 class Acme {
   public:
     Acme();
@@ -70,6 +102,9 @@ class Acme {
     void setAccountFilename(const char *);
     void setAccountKeyFilename(const char *);
     void setOrderFilename(const char *);
+    void setStateFilename(const char *);	// Binary state file instead of the account and order files
+    void setDirectoryFilename(const char *);	// Cache of the ACME directory (without a state file)
+    void setDirectoryTtl(time_t);		// How long to use the cached directory, 0 disables caching
     void setCertKeyFilename(const char *);
     void setFilenamePrefix(const char *);
     void setFsPrefix(const char *);
@@ -79,10 +114,23 @@ class Acme {
     void setFtpPassword(const char *);
     void setFtpPath(const char *);
     void setWebServer(httpd_handle_t);
+    void setChallengePublisher(ChallengePublisher *);	// Instead of the web server or FTP, not freed by us
     void setRootCertificateFilename(const char *);
     void setRootCertificate(const char *);
-
-    bool loop(time_t now);			// Return true on a certificate change
+    void setRootCertificatePartition(const char *);	// Data partition (label) with the root certificate, esp32 only
+    bool setTlsSessionCache(TlsSessionCache *);	// Resume TLS sessions with the ACME server, may be shared, host only
+    void setReplyStatsHook(reply_stats_hook_t);	// Called after each reply from the ACME server
+
+    bool loop(time_t now);			// Return true on a certificate change (always false in async mode)
+    bool StartTask(int stack_size = 8192, int priority = 5);	// Async mode : run the FSM on a task of its own
+						// then only these, RenewCertificate, NetworkConnected/Disconnected,
+						// TimeSync and setTlsSessionCache may be called from other tasks
+    void StopTask();
+    void setEventCallback(acme_event_cb_t, void *arg);	// Called on the ACME task, see AcmeEvent
+    time_t nextWakeTime();			// When loop() has something to do next, may be in the past
+    void setPollInterval(time_t min, time_t max);	// Backoff while the server is busy, without Retry-After
+    void setRenewalFilename(const char *);	// Renewal window from the server (ARI), without a state file
+    void setRenewalFraction(float fraction, float jitter);	// Without a window : renew this far into the lifetime
     bool HaveValidCertificate(time_t);
     bool HaveValidCertificate();
 
@@ -93,6 +141,8 @@ class Acme {
     mbedtls_pk_context *getCertificateKey();
     void setAccountKey(mbedtls_pk_context *ak);
     void setCertificateKey(mbedtls_pk_context *ck);
+    void setAccountKeyType(AcmeKeyType);
+    void setCertificateKeyType(AcmeKeyType);
 
     bool CreateNewAccount();
     /*
@@ -100,6 +150,7 @@ class Acme {
      * Returns true on a certificate change.
      */
     bool AcmeProcess(time_t);
+    void FlushOrderInfo();			// Checkpoint : write the order file if the order changed
     mbedtls_x509_crt *getCertificate();
 
     void CreateNewOrder();
@@ -116,6 +167,13 @@ class Acme {
     void TimeSync(struct timeval *);
 
     bool checkConfig();
+    int getHandshakeCount();			// Connections made to the ACME server for the current order
+    size_t getOrderMemoryUsage();		// Bytes used by the current order and its challenges
+    size_t getOrderMemoryReserved();		// Bytes held for that, kept between orders
+    void setUsePsram(bool);			// Keep order data in PSRAM, if there is any
+    void setSyncPolicy(SafeFileSync);		// How hard to push state files to flash, see SafeFile.h
+    int getAvoidedOrderWrites();		// Order file writes saved by FlushOrderInfo()
+    bool ImportJsonState();			// Convert the account and order files into the state file
 
   private:
     constexpr const static char *acme_tag = "Acme";	// For ESP_LOGx calls
@@ -142,11 +200,11 @@ class Acme {
     const char *acme_agent_header = "User-Agent";
     const char *acme_content_type = "Content-Type";
     const char *acme_jose_json = "application/jose+json";
+    const char *acme_error_bad_nonce = "urn:ietf:params:acme:error:badNonce";
     const char *acme_accept_header = "Accept";
     const char *acme_accept_pem_chain = "application/pem-certificate-chain";
     // const char *acme_accept_der = "application/pkix-cert";
     // const char *acme_accept_der = "application/pkcs7-mime";
-    const char *well_known = "/.well-known/acme-challenge/";
     const char *acme_http_01 = "http-01";
 
     // JSON
@@ -166,7 +224,18 @@ class Acme {
     const char	*acme_json_finalize =		"finalize";
     const char	*acme_json_certificate =	"certificate";
     const char	*acme_json_identifiers =	"identifiers";
+    const char	*acme_json_identifier =		"identifier";
     const char	*acme_json_authorizations =	"authorizations";
+    const char	*acme_json_generation =		"generation";	// Our own, counts writes of a state file
+    const char	*acme_json_server =		"server";	// Our own, in the directory cache
+    const char	*acme_json_fetched =		"fetched";
+    const char	*acme_json_renewal_info =	"renewalInfo";
+    const char	*acme_json_suggested_window =	"suggestedWindow";
+    const char	*acme_json_start =		"start";
+    const char	*acme_json_end =		"end";
+    const char	*acme_json_cert_id =		"certID";	// Our own, in the renewal file
+    const char	*acme_json_renew_at =		"renewAt";
+    const char	*acme_json_next_check =		"nextCheck";
 
     // Status
     const char	*acme_status_valid =		"valid";
@@ -181,6 +250,7 @@ class Acme {
 
     // Format strings for protocol queries :
     const char *acme_jwk_template = "{\"kty\": \"RSA\", \"n\": \"%s\", \"e\": \"%s\"}";
+    const char *acme_jwk_ec_template = "{\"kty\": \"EC\", \"crv\": \"P-256\", \"x\": \"%s\", \"y\": \"%s\"}";
     const char *acme_mailto = "mailto:";
     const char *new_account_template =
       "{ \"termsOfServiceAgreed\": true, \"contact\": [ \"%s%s\" ], \"onlyReturnExisting\": %s}";
@@ -196,56 +266,62 @@ class Acme {
       "{\n\t\"resource\" : \"new-authz\",\n\t\"identifier\" :\n\t{\n\t\t\"type\" : \"dns\",\n\t\t\"value\" : \"%s\"\n\t}\n}";
     const char *csr_format = "{ \"csr\" : \"%s\" }";
     const char *acme_message_jwk_template1 =
-      "{\"url\": \"%s\", \"jwk\": %s, \"alg\": \"RS256\", \"nonce\": \"%s\"}";
-    const char *acme_message_jwk_template2 =
-      "{\n  \"protected\": \"%s\",\n  \"payload\": \"%s\",\n  \"signature\": \"%s\"\n}";
-    const char *acme_message_kid_template =
-      "{\n  \"protected\": \"%s\",\n  \"payload\": \"%s\",\n  \"signature\": \"%s\"\n}";
+      "{\"url\": \"%s\", \"jwk\": %s, \"alg\": \"%s\", \"nonce\": \"%s\"}";
+    const char *acme_protected_kid_template =
+      "{\"alg\": \"%s\", \"nonce\": \"%s\", \"url\": \"%s\", \"kid\": \"%s\"}";
 
     // These are needed in static member functions
     // We scan HTTP headers in replies for these :
     constexpr static const char *acme_nonce_header = "Replay-Nonce";
     constexpr static const char *acme_location_header = "Location";
-
-    constexpr static const char *acme_http_404 = "404 File not found";
+    constexpr static const char *acme_content_length_header = "Content-Length";
+    constexpr static const char *acme_retry_after_header = "Retry-After";
 
     // These are the static member functions
-    static esp_err_t NonceHttpEvent(esp_http_client_event_t *event);
     static esp_err_t HttpEvent(esp_http_client_event_t *event);
-    static esp_err_t acme_http_get_handler(httpd_req_t *);
 
     // These store the info obtained in one of the static member functions
     void setNonce(char *);
-    char *GetNonce();
+    char *GetNonce();				// Caller must free
+    void ClearNonces();
     void setLocation(const char *);
+    static time_t ParseRetryAfter(const char *);
 
     // Helper functions
     time_t	timestamp(const char *);
     time_t	TimeMbedToTimestamp(mbedtls_x509_time t);
 
-    //
-    void	StoreFileOnWebserver(char *localfn, char *remotefn);
-    void	RemoveFileFromWebserver(char *remotefn);
-
     // Crypto stuff to build the ACME messages (see protocols such as JWS, JOSE, JWK, ..)
     char	*Base64(const char *);
     char	*Base64(const char *, int);
     char	*Unbase64(const char *s);
-    char	*Signature(const char *, const char *);
-    char	*MakeMessageJWK(char *url, char *payload, char *jwk);
+    bool	SignHash(const unsigned char *hash, unsigned char *sig, size_t *sig_len);
+    char	*MakeJWS(const char *url, const char *payload, const char *jwk);
+    char	*MakeMessageJWK(char *url, char *payload, const char *jwk);
     char	*MakeJWK();
     char	*MakeMessageKID(const char *url, const char *payload);
-    char	*MakeProtectedKID(const char *query);
+    char	*SignedQuery(const char *url, const char *payload, const char *jwk, const char *accept_msg);
+    bool	IsBadNonce(const char *reply);
     char	*JWSThumbprint();
+    const char	*JWSAlgorithm();
+    const char	*AccountJWK();			// Cached, caller must not free
+    const char	*AccountThumbprint();		// Cached, caller must not free
+    void	UpdateKeyCache();
+    void	ClearKeyCache();
+    bool	ExportEcPoint(char **x64, char **y64);
 
     // Do an ACME query
     char	*PerformWebQuery(const char *, const char *, const char *, const char *accept_msg);
+    void	FreeReply(char *);		// Instead of free() on a reply from PerformWebQuery
+    esp_http_client_handle_t	AcmeClient(const char *url);
+    esp_err_t	AcmeClientPerform(esp_http_client_handle_t);
+    void	CloseAcmeClient();
 
     void	QueryAcmeDirectory();
     bool	RequestNewNonce();
     void	ClearDirectory();
 
-    mbedtls_pk_context	*GeneratePrivateKey();
+    mbedtls_pk_context	*GeneratePrivateKey(AcmeKeyType type = ACME_KEY_RSA2048);
     bool	ReadPrivateKey();
     mbedtls_pk_context	*ReadPrivateKey(const char *fn);
     void	WritePrivateKey();
@@ -257,6 +333,7 @@ class Acme {
 
     bool	RequestNewAccount(const char *contact, bool onlyExisting);
     bool	ReadAccountInfo();
+    bool	ReadAccountInfo(const char *fn);
     void	WriteAccountInfo();
     void	ClearAccount();
 
@@ -265,14 +342,24 @@ class Acme {
     void	ClearOrder();
     void	ClearOrderContent();
     bool	ReadOrderInfo();
-    void	WriteOrderInfo();
+    bool	ReadOrderInfo(const char *fn);
+    bool	WriteOrderInfo();
+    void	MarkOrderDirty();
+    char	*StatePath();
+    bool	LoadStateFile(StateReader &);
+    bool	ReadStateFile(bool want_account, bool want_order);
+    bool	WriteStateFile();
+    bool	GetDirectory();
+    bool	SetCachedDirectory(const char *server, const char *na, const char *nn, const char *no, const char *ri, time_t fetched);
+    bool	ReadDirectoryCache();
+    void	WriteDirectoryCache();
+    void	InvalidateDirectory();
+    static uint32_t	OrderHash(const char *);
     bool	ValidateOrder();
-    bool	ValidateAlertServer();
-    void	EnableLocalWebServer();
-    void	DisableLocalWebServer();
+    ChallengePublisher	*Publisher();
+    void	setPublisher(ChallengePublisher *, bool own);
 
     int		DownloadAuthorizationResource();
-    bool	CreateValidationFile(const char *localfn, const char *token);
     char	*CreateValidationString(const char *token);
     void	ClearChallenge();
 
@@ -282,16 +369,24 @@ class Acme {
     // All stubs of ArduinoJson dependent functions.
 #ifdef ARDUINOJSON_5
     void	ReadAccount(JsonObject &);
-    void	ReadChallenge(JsonObject &);
-    bool	ReadAuthorizationReply(JsonObject &json);
     void	ReadOrder(JsonObject &);
     void	ReadFinalizeReply(JsonObject &json);
 #else
     void 	ReadAccount(DynamicJsonDocument &);
-    void	ReadChallenge(DynamicJsonDocument &);
-    bool	ReadAuthorizationReply(DynamicJsonDocument &);
     void	ReadOrder(DynamicJsonDocument &);
     void	ReadFinalizeReply(DynamicJsonDocument &);
+
+    // Filters for ACME replies, these return the size of the JSON document to parse into
+    static const int acme_json_max_array = 8;		// Identifiers, authorizations, challenges
+    static const int acme_json_filter_size = 512;	// StaticJsonDocument for a filter
+    void	FilterReplyStatus(JsonDocument &filter);
+    size_t	FilterDirectory(JsonDocument &filter);
+    size_t	FilterAccount(JsonDocument &filter);
+    size_t	FilterOrder(JsonDocument &filter);
+    size_t	FilterAuthorization(JsonDocument &filter);
+    size_t	FilterChallenge(JsonDocument &filter);
+    size_t	FilterRenewalInfo(JsonDocument &filter);
+    DeserializationError ParseReply(DynamicJsonDocument &root, char *reply, JsonDocument &filter);
 #endif
 
     char	*GenerateCSR();
@@ -314,35 +409,68 @@ class Acme {
     Directory	*directory;
     Account	*account;
     Order	*order;
-    Challenge	*challenge;
-
-    char	*nonce;
-    int		nonce_use;
-    char	*account_location;
-    char	*reply_buffer;
-    int		reply_buffer_len;
+    Challenge	*challenge;			// One per authorization in the order
+    int		challenge_count;
+    Arena	order_arena;			// Strings and arrays in order
+    Arena	challenge_arena;		// Same for challenge
+
+    // Nonces from Replay-Nonce headers, newest last. Each can be used once.
+    static const int acme_nonce_pool_size = 4;
+    char	*nonce_pool[acme_nonce_pool_size];
+    int		nonce_count;
+    char	*reply_location;		// Location header of the last reply (account or order URL)
+    time_t	retry_after;			// Retry-After header of the last reply, 0 if none
+    ReplyBuffer	reply_buf;			// Replies from the ACME server, see HttpEvent
+    int		reply_http_status;		// Of the last reply from PerformWebQuery
+    reply_stats_hook_t	reply_stats_hook;
 
-    int		http01_ix;
     time_t	last_run;
-    bool	connected;
+    std::atomic<bool>	connected;		// Set from the network event handlers, read by the ACME task
 
-    mbedtls_rsa_context		*rsa;
     mbedtls_ctr_drbg_context	*ctr_drbg;
     mbedtls_entropy_context	*entropy;
     mbedtls_pk_context		*accountkey;	// Account private key
     mbedtls_pk_context		*certkey;	// Certificate private key
+    AcmeKeyType			account_key_type;	// Type of key to generate
+    char			*account_jwk;		// JWK and its thumbprint, derived from accountkey
+    char			*account_thumbprint;
+
+    esp_http_client_handle_t	acme_client;		// Kept open between queries
+    char			*acme_client_origin;	// scheme://host[:port] of acme_client
+    time_t			acme_client_used;	// Last query, see acme_client_idle
+    static const int		acme_client_idle = 30;	// Seconds, don't reuse a connection idle for longer
+    int				handshakes;
+    bool			acme_client_connected;	// Between HTTP_EVENT_ON_CONNECTED and _DISCONNECTED
+    bool			request_sent;		// The current request went out, see AcmeClientPerform
+    bool			reply_started;		// Any of its reply came back
+    bool			request_replayed;	// It was sent a second time, its nonce may be spent
+    SafeFileSync		sync_policy;
+    unsigned			account_generation;	// Last written to / read from the state files
+    unsigned			order_generation;
+    bool			order_dirty;		// Not written to the order file yet
+    uint32_t			order_written_hash;	// Of what is in the order file
+    int				order_writes_avoided;
+    const char			*state_fn;		// Binary state file, see StateFile.h
+    uint32_t			state_generation;
+    uint32_t			state_written_crc;
+    bool			order_stale;		// Removed, don't take it from the state file
+    const char			*directory_fn;
+    time_t			directory_ttl;
+    time_t			directory_fetched;	// When the server gave us the directory
+    bool			directory_stale;	// The server didn't like the cached URLs
+    bool			local_state_read;	// loop() has read the local certificate
+    AcmeKeyType			cert_key_type;
 
     mbedtls_x509_crt		*certificate;
     const char			*root_certificate_fn;	// File name of the root cert (PEM)
     const char			*root_certificate;
+    const char			*root_certificate_partition;
+    FileView			root_view;		// Root certificate read (or mapped) by us
+    TlsSessionCache		*tls_session_cache;
 
-    // FTP server, if we have one
-    httpd_handle_t	webserver;
-    char		*ValidationString;	// The string to reply to the ACME server
-    char		*ValidationFile;	// File name that must be queried
-    httpd_uri_t		*wsconf;
-    bool		ws_registered;
-    char		*ovf;
+    // Where validation files go : our web server, FTP, or whatever the application plugs in
+    ChallengePublisher	*publisher;
+    bool		own_publisher;		// We made it, so we delete it
 
     /*
      * ACME Protocol data definitions
@@ -351,7 +479,8 @@ class Acme {
     struct Directory {
       char	*newAccount,
 		*newNonce,
-		*newOrder;
+		*newOrder,
+		*renewalInfo;		// ARI, optional
     };
 
     struct Account {			// See ACME RFC § 7.1.2
@@ -378,6 +507,7 @@ class Acme {
       char		**authorizations;
       char		*finalize;	// URL for us to call
       char		*certificate;	// URL to download the certificate
+      char		*location;	// Order URL, from the Location header of the newOrder reply
     };
 
     struct ChallengeItem {
@@ -387,12 +517,14 @@ class Acme {
       char		*token;
     };
 
-    struct Challenge {
-      Identifier	*identifiers;
+    struct Challenge {			// Really an authorization, with its challenges
+      char		*identifier;	// The name it authorizes
       char		*status;
       char		*expires;
       time_t		t_expires;
       ChallengeItem	*challenges;
+      int		nchallenges;
+      bool		published;	// Not from the server : our validation file is on the web server
     };
 
     /*
@@ -402,6 +534,61 @@ class Acme {
     int			step;
     time_t		stepTime;
 
+    bool AcmeProcessPass(time_t);		// One pass, AcmeProcess() then writes the order
+    bool LoopPass(time_t);			// What loop() does in synchronous mode
+    bool OrderInProgress();
+    time_t RenewalTime();			// When loop() starts renewing the certificate
+
+    // Polling while the server works on a challenge or an order
+    time_t		next_wake;		// Don't run AcmeProcess() before this
+    int			poll_attempt;		// Passes in a row that didn't get anywhere
+    time_t		poll_min, poll_max;
+    bool		challenge_posted;	// Told the server to validate, now poll the authorizations
+
+    void SchedulePoll(time_t now);
+    time_t PollDelay();
+    bool PollAuthorization();
+    bool PollOrder();
+
+    // Authorizations, all handled together
+    int DownloadAuthorization(int i);
+    ChallengeItem *Http01(Challenge *);
+    char *ChallengeString(char *old, const char *s);
+    bool PublishValidation(Challenge *);
+    bool ValidateAlertServer(Challenge *);
+    bool CheckAuthorizations();
+    void RemoveValidation(Challenge *);
+    void RemoveValidations();
+#ifdef ARDUINOJSON_5
+    void ReadChallenge(Challenge *, JsonObject &);
+#else
+    void ReadChallenge(Challenge *, DynamicJsonDocument &);
+#endif
+    uint32_t Random();
+
+    // ACME Renewal Information (ARI, RFC 9773) about the current certificate
+    char		*cert_id;		// How ARI names our certificate, see CertificateId()
+    char		*ari_cert_id;		// The certificate that the window below is for
+    time_t		ari_start, ari_end;	// Window suggested by the server
+    time_t		ari_renew_at;		// Picked at random in that window
+    time_t		ari_next_check;		// Ask the server again after this
+    const char		*renewal_fn;
+    float		renew_fraction, renew_jitter;
+
+    char *CertificateId();
+    void CheckRenewalInfo(time_t now);
+    void SetRenewalInfo(time_t start, time_t end);
+    void ReadRenewalInfo();
+    void WriteRenewalInfo();
+
+    // Async mode
+    AcmeTask		*engine;
+    std::atomic<bool>	tick_pending;		// Don't queue a tick while one is waiting
+    std::atomic<bool>	close_pending;		// Close the HTTP client on the task, see NetworkDisconnected
+    acme_event_cb_t	event_cb;
+    void		*event_arg;
+
+    static void TaskHandler(void *ctx, int cmd, int64_t arg);
     void ProcessStep(int);
     bool _ProcessCheck(int);
     bool _ProcessCheck(int, const char *);
@@ -420,7 +607,7 @@ class Acme {
      * Time Sync
      */
     bool wait_for_timesync;
-    bool time_synced;
+    std::atomic<bool> time_synced;
 };
 
 extern Acme *acme;
@@ -0,0 +1,202 @@
+/*
+ * Worker task with a command queue, see AcmeTask.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "AcmeTask.h"
+
+static const char	*acme_task_tag = "AcmeTask";
+static const int	acme_task_stop = -1;		// Internal command, ends the task
+
+AcmeTask::AcmeTask(acme_task_handler_t h, void *c, int d) {
+  handler = h;
+  ctx = c;
+  depth = (d > 0) ? d : 1;
+  running = false;
+#ifdef ESP_PLATFORM
+  task = 0;
+  queue = 0;
+  done = 0;
+#else
+  thread = 0;
+#endif
+}
+
+AcmeTask::~AcmeTask() {
+  Stop();
+}
+
+bool AcmeTask::Running() {
+  return running;
+}
+
+/*
+ * Handle commands until told to stop.
+ */
+void AcmeTask::Run() {
+  while (true) {
+    Command c;
+
+#ifdef ESP_PLATFORM
+    if (xQueueReceive(queue, &c, portMAX_DELAY) != pdTRUE)
+      continue;
+#else
+    {
+      std::unique_lock<std::mutex> l(lock);
+      cv.wait(l, [this] { return ! queue.empty(); });
+      c = queue.front();
+      queue.pop_front();
+    }
+#endif
+    if (c.cmd == acme_task_stop)
+      return;
+    handler(ctx, c.cmd, c.arg);
+  }
+}
+
+#ifdef ESP_PLATFORM
+void AcmeTask::TaskMain(void *p) {
+  AcmeTask *t = (AcmeTask *)p;
+
+  t->Run();
+  xSemaphoreGive(t->done);
+  vTaskDelete(NULL);
+}
+
+bool AcmeTask::Start(const char *name, int stack_size, int priority) {
+  if (running)
+    return true;
+
+  if (queue == 0)
+    queue = xQueueCreate(depth, sizeof(Command));
+  if (done == 0)
+    done = xSemaphoreCreateBinary();
+  if (queue == 0 || done == 0) {
+    ESP_LOGE(acme_task_tag, "%s: could not allocate queue", __FUNCTION__);
+    return false;
+  }
+  xQueueReset(queue);
+
+  if (xTaskCreate(TaskMain, name, stack_size, this, priority, &task) != pdPASS) {
+    ESP_LOGE(acme_task_tag, "%s: could not create task %s (stack %d)", __FUNCTION__, name, stack_size);
+    task = 0;
+    return false;
+  }
+  running = true;
+  ESP_LOGI(acme_task_tag, "%s: task %s started (stack %d, priority %d)", __FUNCTION__, name, stack_size, priority);
+  return true;
+}
+
+void AcmeTask::Stop() {
+  if (! running)
+    return;
+  if (OnTask()) {
+    ESP_LOGE(acme_task_tag, "%s: cannot stop from the task itself", __FUNCTION__);
+    return;
+  }
+
+  // Drop pending commands, then wait until the current one is done
+  xQueueReset(queue);
+  Command c = { acme_task_stop, 0 };
+  xQueueSend(queue, &c, portMAX_DELAY);
+  xSemaphoreTake(done, portMAX_DELAY);
+
+  task = 0;
+  running = false;
+  vQueueDelete(queue);
+  queue = 0;
+  vSemaphoreDelete(done);
+  done = 0;
+}
+
+bool AcmeTask::Post(int cmd, int64_t arg) {
+  if (! running)
+    return false;
+
+  Command c = { cmd, arg };
+  if (xQueueSend(queue, &c, 0) != pdTRUE) {
+    ESP_LOGD(acme_task_tag, "%s: queue full, command %d dropped", __FUNCTION__, cmd);
+    return false;
+  }
+  return true;
+}
+
+bool AcmeTask::OnTask() {
+  return running && xTaskGetCurrentTaskHandle() == task;
+}
+#else
+bool AcmeTask::Start(const char *name, int stack_size, int priority) {
+  if (running)
+    return true;
+
+  queue.clear();
+  thread = new std::thread(&AcmeTask::Run, this);
+  running = true;
+  ESP_LOGI(acme_task_tag, "%s: thread %s started", __FUNCTION__, name);
+  return true;
+}
+
+void AcmeTask::Stop() {
+  if (! running)
+    return;
+  if (OnTask()) {
+    ESP_LOGE(acme_task_tag, "%s: cannot stop from the task itself", __FUNCTION__);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> l(lock);
+    queue.clear();
+    queue.push_back(Command { acme_task_stop, 0 });
+  }
+  cv.notify_one();
+  thread->join();
+
+  delete thread;
+  thread = 0;
+  running = false;
+}
+
+bool AcmeTask::Post(int cmd, int64_t arg) {
+  if (! running)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> l(lock);
+    if ((int)queue.size() >= depth) {
+      ESP_LOGD(acme_task_tag, "%s: queue full, command %d dropped", __FUNCTION__, cmd);
+      return false;
+    }
+    queue.push_back(Command { cmd, arg });
+  }
+  cv.notify_one();
+  return true;
+}
+
+bool AcmeTask::OnTask() {
+  return running && std::this_thread::get_id() == thread->get_id();
+}
+#endif
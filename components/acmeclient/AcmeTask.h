@@ -0,0 +1,85 @@
+/*
+ * Runs commands on a task of its own : a FreeRTOS task on the esp32, a std::thread on the host.
+ *
+ * Post() puts a command in the queue and returns at once, the handler is called for each command
+ * on the worker task, one at a time. The Acme class uses this to run its FSM off the caller's task,
+ * with a stack that's large enough for the crypto, so loop() doesn't block on the network.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_ACME_TASK_H_
+#define	_ACME_TASK_H_
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#endif
+
+typedef void (*acme_task_handler_t)(void *ctx, int cmd, int64_t arg);
+
+class AcmeTask {
+  public:
+    AcmeTask(acme_task_handler_t handler, void *ctx, int depth = 8);
+    ~AcmeTask();
+
+    bool	Start(const char *name, int stack_size, int priority);	// Priority is ignored on the host
+    void	Stop();				// Finish the current command, drop the rest
+    bool	Post(int cmd, int64_t arg);	// Doesn't block, false if the queue is full
+    bool	Running();
+    bool	OnTask();			// Are we called from the worker task
+
+  private:
+    struct Command {
+      int	cmd;
+      int64_t	arg;
+    };
+    acme_task_handler_t	handler;
+    void		*ctx;
+    int			depth;
+    bool		running;
+
+#ifdef ESP_PLATFORM
+    TaskHandle_t	task;
+    QueueHandle_t	queue;
+    SemaphoreHandle_t	done;
+
+    static void TaskMain(void *);
+#else
+    std::thread		*thread;
+    std::mutex		lock;
+    std::condition_variable	cv;
+    std::deque<Command>	queue;
+#endif
+
+    void	Run();
+};
+
+#endif	/* _ACME_TASK_H_ */
@@ -0,0 +1,167 @@
+/*
+ * Simple arena (region) allocator, see Arena.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+
+#ifdef ESP_PLATFORM
+#include <sdkconfig.h>
+#if defined(CONFIG_SPIRAM) || defined(CONFIG_SPIRAM_SUPPORT)
+#include <esp_heap_caps.h>
+#define	ARENA_HAVE_PSRAM	1
+#endif
+#endif
+
+#include "Arena.h"
+
+static const char	*arena_tag = "Arena";
+static const size_t	arena_align = sizeof(void *) > sizeof(long long) ? sizeof(void *) : sizeof(long long);
+
+static size_t align(size_t n) {
+  return (n + arena_align - 1) & ~(arena_align - 1);
+}
+
+Arena::Arena(size_t bs) {
+  first = current = 0;
+  block_size = bs;
+  used = 0;
+  use_psram = false;
+}
+
+Arena::~Arena() {
+  Free();
+}
+
+void Arena::setUsePsram(bool p) {
+  use_psram = p;
+}
+
+Arena::Block *Arena::NewBlock(size_t len) {
+  size_t size = (len > block_size) ? len : block_size;
+  size_t arena_header = align(sizeof(Block));
+  Block *b = 0;
+
+#ifdef ARENA_HAVE_PSRAM
+  if (use_psram)
+    b = (Block *)heap_caps_malloc(arena_header + size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#endif
+  if (b == 0)
+    b = (Block *)malloc(arena_header + size);
+  if (b == 0) {
+    ESP_LOGE(arena_tag, "%s: could not allocate %d bytes", __FUNCTION__, (int)(arena_header + size));
+    return 0;
+  }
+  b->next = 0;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+/*
+ * Allocate from the current block, or move on to the next one (kept from before a Reset()) if
+ * that is large enough, or else put a new block in its place.
+ */
+void *Arena::Alloc(size_t len) {
+  size_t arena_header = align(sizeof(Block));
+  len = align(len ? len : 1);
+
+  if (current == 0) {
+    if (first == 0 && (first = NewBlock(len)) == 0)
+      return 0;
+    current = first;
+    current->used = 0;
+  }
+  if (current->used + len > current->size) {
+    Block *b = current->next;
+    if (b && b->size >= len) {
+      b->used = 0;
+    } else {
+      Block *nb = NewBlock(len);
+      if (nb == 0)
+        return 0;
+      nb->next = b ? b->next : 0;
+      free(b);				// Too small, don't keep it around
+      current->next = b = nb;
+    }
+    current = b;
+  }
+
+  void *r = (char *)current + arena_header + current->used;
+  current->used += len;
+  used += len;
+  return r;
+}
+
+void *Arena::Calloc(size_t n, size_t size) {
+  void *r = Alloc(n * size);
+  if (r)
+    memset(r, 0, n * size);
+  return r;
+}
+
+char *Arena::Strdup(const char *s) {
+  if (s == 0)
+    return 0;
+  size_t len = strlen(s) + 1;
+  char *r = (char *)Alloc(len);
+  if (r)
+    memcpy(r, s, len);
+  return r;
+}
+
+void Arena::Reset() {
+  current = first;
+  if (first)
+    first->used = 0;
+  used = 0;
+}
+
+void Arena::Free() {
+  while (first) {
+    Block *b = first->next;
+    free(first);			// heap_caps_malloc() memory is also freed with free()
+    first = b;
+  }
+  current = 0;
+  used = 0;
+}
+
+size_t Arena::BytesUsed() {
+  return used;
+}
+
+size_t Arena::BytesReserved() {
+  size_t r = 0;
+  for (Block *b = first; b; b = b->next)
+    r += b->size;
+  return r;
+}
+
+int Arena::Blocks() {
+  int n = 0;
+  for (Block *b = first; b; b = b->next)
+    n++;
+  return n;
+}
@@ -0,0 +1,66 @@
+/*
+ * Simple arena (region) allocator.
+ *
+ * Everything allocated from an arena is given back at once by Reset(), which doesn't free memory
+ * but makes it available for the next round : the Acme class uses one arena for an order and one
+ * for its challenges, so a new order reuses the same few blocks instead of strdup/free of each
+ * field.
+ * With setUsePsram(true), blocks are allocated in PSRAM on an esp32 that has it.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_ARENA_H_
+#define	_ARENA_H_
+
+#include <stddef.h>
+
+class Arena {
+  public:
+    Arena(size_t block_size = 512);
+    ~Arena();
+
+    void	*Alloc(size_t len);		// Aligned for any of our structures
+    void	*Calloc(size_t n, size_t size);
+    char	*Strdup(const char *);		// Returns NULL for NULL
+
+    void	Reset();			// Forget everything allocated, keep the memory
+    void	Free();				// Give all memory back
+
+    void	setUsePsram(bool);
+    size_t	BytesUsed();			// Since the last Reset()
+    size_t	BytesReserved();		// Held in blocks
+    int		Blocks();
+
+  private:
+    struct Block {
+      Block	*next;
+      size_t	size, used;
+    };
+    Block	*first, *current;
+    size_t	block_size;
+    size_t	used;
+    bool	use_psram;
+
+    Block	*NewBlock(size_t len);
+};
+
+#endif	/* _ARENA_H_ */
@@ -0,0 +1,246 @@
+/*
+ * base64url codec, see Base64url.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdint.h>
+
+#include "Base64url.h"
+
+/*
+ * The vector code is only built for x86 with gcc or clang. The functions carry a target attribute,
+ * so the rest of the build doesn't need -mssse3, and we check the CPU once at run time.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define	BASE64URL_SSSE3	1
+#include <tmmintrin.h>
+#endif
+
+static const char base64url_alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Character to 6 bit value, 0xff for characters that are not in the alphabet
+static const uint8_t base64url_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+int base64url_encode_scalar(char *dst, size_t dstlen, const void *src, size_t n) {
+  const uint8_t *s = (const uint8_t *)src;
+  size_t olen = base64url_encoded_len(n);
+  size_t i;
+  uint32_t v;
+
+  if (dstlen < olen + 1)
+    return -1;
+
+  for (i=0; i + 3 <= n; i += 3) {
+    v = (s[i] << 16) | (s[i+1] << 8) | s[i+2];
+    *dst++ = base64url_alphabet[v >> 18];
+    *dst++ = base64url_alphabet[(v >> 12) & 0x3f];
+    *dst++ = base64url_alphabet[(v >> 6) & 0x3f];
+    *dst++ = base64url_alphabet[v & 0x3f];
+  }
+
+  // No padding
+  if (n - i == 1) {
+    v = s[i] << 16;
+    *dst++ = base64url_alphabet[v >> 18];
+    *dst++ = base64url_alphabet[(v >> 12) & 0x3f];
+  } else if (n - i == 2) {
+    v = (s[i] << 16) | (s[i+1] << 8);
+    *dst++ = base64url_alphabet[v >> 18];
+    *dst++ = base64url_alphabet[(v >> 12) & 0x3f];
+    *dst++ = base64url_alphabet[(v >> 6) & 0x3f];
+  }
+  *dst = 0;
+
+  return (int)olen;
+}
+
+int base64url_decode_scalar(void *dst, size_t dstlen, const char *src, size_t n) {
+  const uint8_t *s = (const uint8_t *)src;
+  uint8_t *d = (uint8_t *)dst;
+  size_t i;
+  uint32_t a, b, c, e;
+
+  while (n > 0 && s[n-1] == '=')
+    n--;
+  if (n % 4 == 1)
+    return -1;
+  if (dstlen < base64url_decoded_len(n))
+    return -1;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    a = base64url_values[s[i]];
+    b = base64url_values[s[i+1]];
+    c = base64url_values[s[i+2]];
+    e = base64url_values[s[i+3]];
+    if ((a | b | c | e) & 0x80)
+      return -1;
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | e;
+    *d++ = v >> 16;
+    *d++ = (v >> 8) & 0xff;
+    *d++ = v & 0xff;
+  }
+
+  if (n - i >= 2) {
+    a = base64url_values[s[i]];
+    b = base64url_values[s[i+1]];
+    c = (n - i == 3) ? base64url_values[s[i+2]] : 0;
+    if ((a | b | c) & 0x80)
+      return -1;
+    *d++ = (a << 2) | (b >> 4);
+    if (n - i == 3)
+      *d++ = ((b & 0x0f) << 4) | (c >> 2);
+  }
+
+  return (int)(d - (uint8_t *)dst);
+}
+
+#ifdef BASE64URL_SSSE3
+static bool have_ssse3() {
+  static int ssse3 = -1;
+  if (ssse3 < 0)
+    ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+  return ssse3 == 1;
+}
+
+/*
+ * 12 bytes in, 16 characters out per step. This loads 16 bytes, so stop when fewer remain.
+ * Returns the number of input bytes done (a multiple of 12).
+ */
+__attribute__((target("ssse3")))
+static size_t base64url_encode_ssse3(char *dst, const uint8_t *src, size_t n) {
+  // Bits 0..25 map to 'A', 26..51 to 'a', 52..61 to '0', 62 to '-' and 63 to '_'
+  const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '-' - 62, '_' - 63, 'A', 0, 0);
+  size_t i;
+
+  for (i=0; i + 16 <= n; i += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+
+    // Spread 3 bytes over 4 32 bit lanes, then move each group of 6 bits into its own byte
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+
+    // Pick the offset to add, from the range each value is in
+    __m128i r = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i lt26 = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    r = _mm_or_si128(r, _mm_and_si128(lt26, _mm_set1_epi8(13)));
+    __m128i out = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, r), indices);
+
+    _mm_storeu_si128((__m128i *)dst, out);
+    dst += 16;
+  }
+  return i;
+}
+
+/*
+ * 16 characters in, 12 bytes out per step. The store writes 16 bytes, the caller makes sure
+ * there's room. Stops at the first block with a character outside the alphabet, the scalar
+ * code then reports the error.
+ * Returns the number of characters done (a multiple of 16).
+ */
+__attribute__((target("ssse3")))
+static size_t base64url_decode_ssse3(uint8_t *dst, size_t dstlen, const uint8_t *src, size_t n) {
+  size_t i, o;
+
+  for (i=0, o=0; i + 16 <= n && o + 16 <= dstlen; i += 16, o += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+    __m128i dash = _mm_cmpeq_epi8(in, _mm_set1_epi8('-'));
+    __m128i underscore = _mm_cmpeq_epi8(in, _mm_set1_epi8('_'));
+
+    __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(_mm_or_si128(digit, dash), underscore));
+    if (_mm_movemask_epi8(valid) != 0xffff)
+      break;
+
+    __m128i shift = _mm_or_si128(
+      _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+      _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+        _mm_or_si128(_mm_and_si128(dash, _mm_set1_epi8(62 - '-')), _mm_and_si128(underscore, _mm_set1_epi8(63 - '_')))));
+    __m128i values = _mm_add_epi8(in, shift);
+
+    // Pack 4 x 6 bits into 3 bytes, per 32 bit lane, then squeeze out the empty bytes
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    out = _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+    _mm_storeu_si128((__m128i *)(dst + o), out);
+  }
+  return i;
+}
+#endif
+
+int base64url_encode(char *dst, size_t dstlen, const void *src, size_t n) {
+  if (dstlen < base64url_encoded_len(n) + 1)
+    return -1;
+
+#ifdef BASE64URL_SSSE3
+  if (have_ssse3()) {
+    size_t done = base64url_encode_ssse3(dst, (const uint8_t *)src, n);
+    size_t out = (done / 3) * 4;
+    int r = base64url_encode_scalar(dst + out, dstlen - out, (const uint8_t *)src + done, n - done);
+    return (r < 0) ? -1 : (int)out + r;
+  }
+#endif
+  return base64url_encode_scalar(dst, dstlen, src, n);
+}
+
+int base64url_decode(void *dst, size_t dstlen, const char *src, size_t n) {
+  while (n > 0 && src[n-1] == '=')
+    n--;
+  if (n % 4 == 1 || dstlen < base64url_decoded_len(n))
+    return -1;
+
+#ifdef BASE64URL_SSSE3
+  if (have_ssse3()) {
+    size_t done = base64url_decode_ssse3((uint8_t *)dst, dstlen, (const uint8_t *)src, n);
+    size_t out = (done / 4) * 3;
+    int r = base64url_decode_scalar((uint8_t *)dst + out, dstlen - out, src + done, n - done);
+    return (r < 0) ? -1 : (int)out + r;
+  }
+#endif
+  return base64url_decode_scalar(dst, dstlen, src, n);
+}
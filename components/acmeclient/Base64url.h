@@ -0,0 +1,61 @@
+/*
+ * base64url encoding as used in JWS (RFC 7515 §2, RFC 4648 §5) : the URL safe alphabet, no padding.
+ *
+ * The caller provides the output buffer, nothing is allocated. Use base64url_encoded_len() and
+ * base64url_decoded_len() to size it.
+ * On x86 hosts with SSSE3, 12 input bytes (resp. 16 characters) are handled per step, elsewhere
+ * (e.g. on the esp32) a table driven loop does the work.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_BASE64URL_H_
+#define	_BASE64URL_H_
+
+#include <stddef.h>
+
+// Number of characters for n bytes, without the terminating null byte
+static inline size_t base64url_encoded_len(size_t n) {
+  return (n / 3) * 4 + ((n % 3) ? (n % 3) + 1 : 0);
+}
+
+// Upper bound of the number of bytes in n characters
+static inline size_t base64url_decoded_len(size_t n) {
+  return (n / 4) * 3 + ((n % 4) ? (n % 4) - 1 : 0);
+}
+
+/*
+ * Encode n bytes into dst, and add a null byte.
+ * Returns the number of characters (not counting the null byte), or -1 if dst is too small.
+ */
+int base64url_encode(char *dst, size_t dstlen, const void *src, size_t n);
+
+/*
+ * Decode n characters (trailing '=' are tolerated) into dst.
+ * Returns the number of bytes, or -1 if dst is too small or the input is not valid base64url.
+ */
+int base64url_decode(void *dst, size_t dstlen, const char *src, size_t n);
+
+// The portable implementation, also used for the tail of the vector code
+int base64url_encode_scalar(char *dst, size_t dstlen, const void *src, size_t n);
+int base64url_decode_scalar(void *dst, size_t dstlen, const char *src, size_t n);
+
+#endif	/* _BASE64URL_H_ */
@@ -0,0 +1,407 @@
+/*
+ * Backends that put http-01 validation files in place, see ChallengePublisher.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_crt_bundle.h>
+
+#include "ChallengePublisher.h"
+
+static const char	*publisher_tag = "ChallengePublisher";
+static const char	*publisher_404 = "404 File not found";
+
+/*
+ * Local web server
+ */
+HttpdPublisher::HttpdPublisher(httpd_handle_t server) {
+  httpd_uri_t	wsconf;
+  esp_err_t	err;
+
+  this->server = server;
+  registered = false;
+
+  uri = (char *)malloc(strlen(well_known) + 2);
+  sprintf(uri, "%s*", well_known);
+
+  memset(&wsconf, 0, sizeof(wsconf));
+  wsconf.uri = uri;
+  wsconf.method = HTTP_GET;
+  wsconf.handler = Handler;
+  wsconf.user_ctx = this;
+
+  if ((err = httpd_register_uri_handler(server, &wsconf)) != ESP_OK) {
+    ESP_LOGE(publisher_tag, "%s : failed to register URI handler for %s (%d %s)",
+      __FUNCTION__, wsconf.uri, err, esp_err_to_name(err));
+  } else {
+    ESP_LOGI(publisher_tag, "%s(%s)", __FUNCTION__, wsconf.uri);
+    registered = true;
+  }
+}
+
+HttpdPublisher::~HttpdPublisher() {
+  if (registered)
+    httpd_unregister_uri_handler(server, uri, HTTP_GET);
+  free(uri);
+}
+
+const char *HttpdPublisher::Name() {
+  return "httpd";
+}
+
+bool HttpdPublisher::Publish(const char *token, const char *response) {
+  if (! registered)
+    return false;
+  return tokens.Add(token, response);
+}
+
+bool HttpdPublisher::Unpublish(const char *token) {
+  tokens.Remove(token);
+  return true;
+}
+
+void HttpdPublisher::Reset() {
+  tokens.Clear();
+}
+
+/*
+ * This is - intentionally - a simplistic HTTP GET handler.
+ * It just knows how to return the data that the ACME protocol requires.
+ *
+ * Other HTTP requests should be serviced by possibly more intelligent handlers
+ * in the application.
+ */
+esp_err_t HttpdPublisher::Handler(httpd_req_t *req) {
+  HttpdPublisher	*self = (HttpdPublisher *)req->user_ctx;
+  char			response[256];
+  const char		*token = req->uri + strlen(self->well_known);
+  size_t		len = strcspn(token, "?");
+
+  len = self->tokens.Lookup(token, len, response, sizeof(response));
+  if (len) {
+    ESP_LOGI(publisher_tag, "%s: URI %s", __FUNCTION__, req->uri);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, response, len);
+  } else {
+    ESP_LOGE(publisher_tag, "%s: URI %s -> 404", __FUNCTION__, req->uri);
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, publisher_404);
+  }
+
+  return ESP_OK;
+}
+
+/*
+ * Site web server, HTTP PUT and DELETE
+ */
+HttpPutPublisher::HttpPutPublisher(const char *url) {
+  this->url = url;
+  root_certificate = 0;
+  authorization = 0;
+  client = 0;
+  requests = 0;
+}
+
+HttpPutPublisher::~HttpPutPublisher() {
+  End();
+}
+
+const char *HttpPutPublisher::Name() {
+  return "http-put";
+}
+
+/*
+ * No memory management for these, just store a pointer.
+ */
+void HttpPutPublisher::setRootCertificate(const char *pem) {
+  root_certificate = pem;
+}
+
+void HttpPutPublisher::setAuthorization(const char *value) {
+  authorization = value;
+}
+
+int HttpPutPublisher::getRequests() {
+  return requests;
+}
+
+/*
+ * One client for the whole batch, so all requests go over the same (TLS) connection.
+ */
+bool HttpPutPublisher::Begin() {
+  if (client)
+    return true;
+
+  esp_http_client_config_t	httpc;
+  memset(&httpc, 0, sizeof(httpc));
+  httpc.url = url;
+  if (root_certificate)
+    httpc.cert_pem = root_certificate;
+  httpc.crt_bundle_attach = esp_crt_bundle_attach;
+  httpc.keep_alive_enable = true;
+
+  if ((client = esp_http_client_init(&httpc)) == 0) {
+    ESP_LOGE(publisher_tag, "%s: could not create client for %s", __FUNCTION__, url);
+    return false;
+  }
+  if (authorization)
+    esp_http_client_set_header(client, "Authorization", authorization);
+  return true;
+}
+
+void HttpPutPublisher::End() {
+  if (client) {
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+  }
+  client = 0;
+}
+
+bool HttpPutPublisher::Publish(const char *token, const char *response) {
+  return Request(HTTP_METHOD_PUT, token, response);
+}
+
+bool HttpPutPublisher::Unpublish(const char *token) {
+  return Request(HTTP_METHOD_DELETE, token, 0);
+}
+
+bool HttpPutPublisher::Request(esp_http_client_method_t method, const char *token, const char *body) {
+  bool once = (client == 0);			// Not in a batch
+  if (once && ! Begin())
+    return false;
+
+  char *u = (char *)malloc(strlen(url) + strlen(token) + 1);
+  sprintf(u, "%s%s", url, token);
+
+  esp_http_client_set_url(client, u);
+  esp_http_client_set_method(client, method);
+  if (body) {
+    esp_http_client_set_header(client, "Content-Type", "text/plain");
+    esp_http_client_set_post_field(client, body, strlen(body));
+  } else {
+    esp_http_client_set_header(client, "Content-Type", 0);
+    esp_http_client_set_post_field(client, 0, 0);
+  }
+
+  // The server may have closed the connection since the previous batch : try again once
+  esp_err_t err = esp_http_client_perform(client);
+  if (err != ESP_OK) {
+    esp_http_client_close(client);
+    err = esp_http_client_perform(client);
+  }
+  requests++;
+
+  int code = (err == ESP_OK) ? esp_http_client_get_status_code(client) : 0;
+  if (err != ESP_OK)
+    ESP_LOGE(publisher_tag, "%s: %s failed (%s)", __FUNCTION__, u, esp_err_to_name(err));
+  else if (code < 200 || code > 299)
+    ESP_LOGE(publisher_tag, "%s: %s -> %d", __FUNCTION__, u, code);
+  else
+    ESP_LOGD(publisher_tag, "%s: %s -> %d", __FUNCTION__, u, code);
+  free(u);
+
+  if (once)
+    End();
+  return code >= 200 && code <= 299;
+}
+
+#if USE_EXTERNAL_WEBSERVER
+/*
+ * Site web server, FTP.
+ *
+ * We're using https://github.com/JohnnyB1290/ESP32-FTP-Client .
+ * This is a port of FTPlib (https://nbpfaus.net/~pfau/ftplib/)
+ * Docs see https://nbpfaus.net/~pfau/ftplib/ftplib.html
+ *
+ * Note web server settings need to allow read access to these files.
+ * In some cases, adding "-u 002" to the ftpd command helps in setting its umask so this works.
+ *
+ * Example : such a line in /etc/inetd.conf :
+ * ftp     stream  tcp6    nowait  root    /usr/sbin/ftpd  ftpd -u 002
+ */
+FtpPublisher::FtpPublisher(const char *server, const char *user, const char *pass, const char *path) {
+  this->server = server;
+  this->user = user;
+  this->pass = pass;
+  this->path = path;
+  port = 21;
+  idle_timeout = 120;
+  ftpc = getFtpClient();
+  nb = 0;
+  batch = false;
+  last_used = 0;
+  logins = 0;
+}
+
+FtpPublisher::~FtpPublisher() {
+  Close();
+}
+
+const char *FtpPublisher::Name() {
+  return "ftp";
+}
+
+void FtpPublisher::setPort(int port) {
+  this->port = port;
+}
+
+/*
+ * How long an unused session is kept. Also passed as FTP_CLIENT_IDLETIME : a transfer that
+ * doesn't move for that long is aborted.
+ */
+void FtpPublisher::setIdleTimeout(int seconds) {
+  idle_timeout = seconds;
+}
+
+int FtpPublisher::getLogins() {
+  return logins;
+}
+
+/*
+ * Start a batch on the session we have, if it's still there, or log in again.
+ */
+bool FtpPublisher::Begin() {
+  if (batch)
+    return true;
+
+  // Likely closed by the server by now, a QUIT would only wait for a reply that doesn't come
+  if (nb && time(0) - last_used > idle_timeout) {
+    ESP_LOGD(publisher_tag, "%s: session idle for %ds, logging in again", __FUNCTION__,
+      (int)(time(0) - last_used));
+    Drop();
+  }
+  if (nb) {
+    // Cheapest command that ftplib has, to see whether the server kept the session
+    char syst[64];
+    if (! ftpc->ftpClientGetSysType(syst, sizeof(syst), nb)) {
+      ESP_LOGD(publisher_tag, "%s: session lost, logging in again", __FUNCTION__);
+      Drop();
+    }
+  }
+  if (nb == 0 && ! Login())
+    return false;
+
+  batch = true;
+  return true;
+}
+
+/*
+ * The session stays : removal of the same order's files follows later.
+ */
+void FtpPublisher::End() {
+  batch = false;
+  last_used = time(0);
+}
+
+void FtpPublisher::Close() {
+  if (nb)
+    ftpc->ftpClientQuit(nb);
+  nb = 0;
+  batch = false;
+}
+
+// Without QUIT, for a session that the server has (probably) closed already
+void FtpPublisher::Drop() {
+  if (nb)
+    ftpc->ftpClientClose(nb);
+  nb = 0;
+}
+
+bool FtpPublisher::Login() {
+  if (! (server && user && pass && path)) {
+    ESP_LOGE(publisher_tag, "%s: failed, incomplete FTP setup", __FUNCTION__);
+    return false;
+  }
+
+  if (! ftpc->ftpClientConnect(server, port, &nb)) {
+    ESP_LOGE(publisher_tag, "%s: could not connect to %s:%d", __FUNCTION__, server, port);
+    nb = 0;
+    return false;
+  }
+  logins++;
+  if (! ftpc->ftpClientLogin(user, pass, nb)) {
+    ESP_LOGE(publisher_tag, "%s: login as %s on %s failed", __FUNCTION__, user, server);
+    ftpc->ftpClientQuit(nb);
+    nb = 0;
+    return false;
+  }
+  ftpc->ftpClientSetOptions(FTP_CLIENT_IDLETIME, idle_timeout * 1000L, nb);
+  ftpc->ftpClientSetOptions(FTP_CLIENT_CALLBACK, (long)Stalled, nb);
+  ftpc->ftpClientSetOptions(FTP_CLIENT_CALLBACKARG, (long)this, nb);
+
+  ESP_LOGD(publisher_tag, "%s: logged in on %s", __FUNCTION__, server);
+  return true;
+}
+
+/*
+ * Called by the library when a data connection didn't move for the idle time : give up on it.
+ */
+int FtpPublisher::Stalled(NetBuf_t *, uint32_t xfered, void *arg) {
+  FtpPublisher *self = (FtpPublisher *)arg;
+  ESP_LOGE(publisher_tag, "%s: no progress for %ds on %s after %d bytes, aborting", __FUNCTION__,
+    self->idle_timeout, self->server, (int)xfered);
+  return 0;
+}
+
+char *FtpPublisher::RemotePath(const char *token) {
+  char *remotefn = (char *)malloc(strlen(path) + strlen(well_known) + strlen(token) + 2);
+  sprintf(remotefn, "%s%s%s", path, well_known, token);
+  return remotefn;
+}
+
+/*
+ * The response goes straight from memory to the data connection, no local file.
+ */
+bool FtpPublisher::Publish(const char *token, const char *response) {
+  bool once = ! batch;
+  if (once && ! Begin())
+    return false;
+
+  char *remotefn = RemotePath(token);
+  ESP_LOGI(publisher_tag, "%s(%s)", __FUNCTION__, remotefn);
+  bool ok = ftpc->ftpClientPutBuffer(response, strlen(response), remotefn, FTP_CLIENT_BINARY, nb);
+  if (! ok)
+    ESP_LOGE(publisher_tag, "%s: could not store %s", __FUNCTION__, remotefn);
+  free(remotefn);
+
+  if (once)
+    End();
+  return ok;
+}
+
+bool FtpPublisher::Unpublish(const char *token) {
+  bool once = ! batch;
+  if (once && ! Begin())
+    return false;
+
+  char *remotefn = RemotePath(token);
+  ESP_LOGI(publisher_tag, "%s(%s)", __FUNCTION__, remotefn);
+  bool ok = ftpc->ftpClientDelete(remotefn, nb);
+  free(remotefn);
+
+  if (once)
+    End();
+  return ok;
+}
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Where http-01 validation files go : the ACME server fetches
+ *	http://<name>/.well-known/acme-challenge/<token>
+ * and expects <token>.<account key thumbprint> as the reply.
+ *
+ * A ChallengePublisher puts these in place and takes them away again. Acme hands it all tokens of
+ * an order as one batch, between Begin() and End(), so a backend can do the whole batch over one
+ * connection instead of one per token. Publishing and removal are two batches of the same order,
+ * Close() follows when the order is done.
+ * Backends :
+ *  - HttpdPublisher : the device's own web server (esp_http_server), see setWebServer()
+ *  - FtpPublisher : a site web server, files stored over FTP (with USE_EXTERNAL_WEBSERVER)
+ *  - HttpPutPublisher : a site web server that accepts HTTP PUT and DELETE (e.g. WebDAV), over
+ *    one kept-alive connection
+ * Applications can plug in their own with Acme::setChallengePublisher().
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_CHALLENGE_PUBLISHER_H_
+#define	_CHALLENGE_PUBLISHER_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <esp_http_client.h>
+#include <esp_http_server.h>
+#if USE_EXTERNAL_WEBSERVER
+#include <FtpClient.h>
+#endif
+
+#include "TokenTable.h"
+
+class ChallengePublisher {
+  public:
+    virtual ~ChallengePublisher() {}
+    virtual const char *Name() = 0;
+
+    // A batch : Publish() or Unpublish() calls for all tokens of an order
+    virtual bool Begin() { return true; }
+    virtual void End() {}
+    virtual void Close() {}			// Order done, drop what was kept between batches
+
+    virtual bool Publish(const char *token, const char *response) = 0;
+    virtual bool Unpublish(const char *token) = 0;
+    virtual void Reset() {}			// Forget all tokens, if that can be done locally
+
+  protected:
+    const char *well_known = "/.well-known/acme-challenge/";
+};
+
+/*
+ * The device's own web server. One wildcard handler serves all tokens from a TokenTable, it is
+ * registered for as long as this object exists. The web server must match URIs with
+ * httpd_uri_match_wildcard().
+ */
+class HttpdPublisher : public ChallengePublisher {
+  public:
+    HttpdPublisher(httpd_handle_t server);
+    ~HttpdPublisher();
+    const char *Name();
+
+    bool Publish(const char *token, const char *response);
+    bool Unpublish(const char *token);
+    void Reset();
+
+  private:
+    httpd_handle_t	server;
+    char		*uri;			// Of our handler
+    bool		registered;
+    TokenTable		tokens;
+
+    static esp_err_t Handler(httpd_req_t *);
+};
+
+/*
+ * Site web server that accepts PUT and DELETE on url (where the ACME server will look, so ending
+ * in /.well-known/acme-challenge/). One client is kept between Begin() and End().
+ */
+class HttpPutPublisher : public ChallengePublisher {
+  public:
+    HttpPutPublisher(const char *url);
+    ~HttpPutPublisher();
+    const char *Name();
+
+    void setRootCertificate(const char *pem);	// For https, otherwise the certificate bundle is used
+    void setAuthorization(const char *value);	// Authorization header, e.g. "Basic dXNlcjpwYXNz"
+
+    bool Begin();
+    void End();
+    bool Publish(const char *token, const char *response);
+    bool Unpublish(const char *token);
+
+    int getRequests();				// PUT and DELETE requests sent
+
+  private:
+    const char			*url;
+    const char			*root_certificate;
+    const char			*authorization;
+    esp_http_client_handle_t	client;
+    int				requests;
+
+    bool Request(esp_http_client_method_t method, const char *token, const char *body);
+};
+
+#if USE_EXTERNAL_WEBSERVER
+/*
+ * Site web server that we can store files on over FTP, in path/.well-known/acme-challenge/ .
+ * Files are sent from memory, nothing is written to flash.
+ * One login serves the whole order : the control connection is kept between the batches (all
+ * STORs, later all DELEs) until Close(), or until it was idle too long.
+ */
+class FtpPublisher : public ChallengePublisher {
+  public:
+    FtpPublisher(const char *server, const char *user, const char *pass, const char *path);
+    ~FtpPublisher();
+    const char *Name();
+
+    void setPort(int);				// Default 21
+    void setIdleTimeout(int);			// Seconds, default 120
+
+    bool Begin();
+    void End();
+    void Close();
+    bool Publish(const char *token, const char *response);
+    bool Unpublish(const char *token);
+
+    int getLogins();
+
+  private:
+    const char		*server, *user, *pass, *path;
+    int			port;
+    int			idle_timeout;
+    FtpClient		*ftpc;
+    NetBuf_t		*nb;
+    bool		batch;			// Between Begin() and End()
+    time_t		last_used;
+    int			logins;
+
+    bool Login();
+    void Drop();
+    char *RemotePath(const char *token);
+    static int Stalled(NetBuf_t *, uint32_t xfered, void *arg);
+};
+#endif
+
+#endif	/* _CHALLENGE_PUBLISHER_H_ */
@@ -63,6 +63,8 @@
  * Return value is "OK" in case of success.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <esp_log.h>
 #include "Dyndns.h"
@@ -79,6 +81,7 @@ Dyndns::Dyndns() {
   http_config.event_handler = _http_event_handler;
 
   hostname = ip = auth = buf = 0;
+  tls_session_cache = 0;
   provider = DD_UNKNOWN;
 
   __dyndns = this;
@@ -90,6 +93,7 @@ Dyndns::Dyndns(dyndns_provider p) {
   http_config.event_handler = _http_event_handler;
 
   hostname = ip = auth = buf = 0;
+  tls_session_cache = 0;
   provider = p;
 
   __dyndns = this;
@@ -101,6 +105,7 @@ Dyndns::Dyndns(const char *p) {
   http_config.event_handler = _http_event_handler;
 
   hostname = ip = auth = buf = 0;
+  tls_session_cache = 0;
 
   __dyndns = this;
   __dyndns_count++;
@@ -147,6 +152,18 @@ const char *Dyndns::getAuth() {
   return auth;
 }
 
+/*
+ * Sessions are only resumed over https, and only where the HTTP client supports it.
+ */
+bool Dyndns::setTlsSessionCache(TlsSessionCache *cache) {
+  if (cache && ! TlsSessionCache::Supported()) {
+    ESP_LOGW(dyndns_tag, "%s: the HTTP client can't resume TLS sessions, not using the cache", __FUNCTION__);
+    return false;
+  }
+  tls_session_cache = cache;
+  return true;
+}
+
 /*
  * This method does the work
  *
@@ -194,6 +211,9 @@ bool Dyndns::update() {
 
   // Do it
   http_config.url = query;
+#ifdef ESP_HTTP_CLIENT_HAS_SESSION_CACHE
+  http_config.session_cache = tls_session_cache ? tls_session_cache->ClientHook() : 0;
+#endif
   http_client = esp_http_client_init(&http_config);
   if (http_client == 0) {
     ESP_LOGE(dyndns_tag, "Could not initialize");
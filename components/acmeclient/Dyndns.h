@@ -26,6 +26,7 @@
 // #include <Arduino.h>
 #include <esp_http_client.h>
 #include <esp_event.h>
+#include "TlsSessionCache.h"
 
 enum dyndns_provider {
  DD_UNKNOWN,
@@ -49,12 +50,15 @@ public:
   void setAuth(const char *);
   const char *getAuth();
 
+  bool setTlsSessionCache(TlsSessionCache *);	// Host only, see TlsSessionCache.h
+
 private:
   esp_http_client_handle_t	http_client;
   esp_http_client_config_t	http_config;
 
   char				*hostname, *ip, *auth;
   dyndns_provider		provider;
+  TlsSessionCache		*tls_session_cache;
   char				*buf;
 
   // NoIP
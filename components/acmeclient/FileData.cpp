@@ -0,0 +1,205 @@
+/*
+ * Reading whole files, see FileData.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <esp_log.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "FileData.h"
+
+static const char	*file_data_tag = "FileData";
+static const size_t	file_data_min = 512;		// Initial size if fstat() doesn't know
+
+char *read_file(const char *fn, size_t *lenp) {
+  struct stat	st;
+
+  FILE *f = fopen(fn, "r");
+  if (f == 0)
+    return 0;
+
+  size_t cap = file_data_min;
+  if (fstat(fileno(f), &st) == 0 && st.st_size > 0)
+    cap = st.st_size + 1;
+
+  char *buf = (char *)malloc(cap);
+  size_t total = 0;
+  while (buf) {
+    total += fread(buf + total, 1, cap - 1 - total, f);
+    if (total < cap - 1)
+      break;				// End of file (or error)
+
+    // Buffer is full : done if that is the end of the file, otherwise double it
+    int c = fgetc(f);
+    if (c == EOF)
+      break;
+    char *nb = (char *)realloc(buf, 2 * cap);
+    if (nb == 0) {
+      free(buf);
+      buf = 0;
+      break;
+    }
+    buf = nb;
+    cap *= 2;
+    buf[total++] = c;
+  }
+  fclose(f);
+
+  if (buf == 0) {
+    ESP_LOGE(file_data_tag, "%s: could not allocate %d bytes for %s", __FUNCTION__, (int)cap, fn);
+    errno = ENOMEM;
+    return 0;
+  }
+  buf[total] = 0;
+  if (lenp)
+    *lenp = total;
+  ESP_LOGD(file_data_tag, "%s: %s, %d bytes", __FUNCTION__, fn, (int)total);
+  return buf;
+}
+
+FileView::FileView() {
+  data = 0;
+  len = map_len = 0;
+  kind = FILE_VIEW_NONE;
+  handle = 0;
+}
+
+FileView::~FileView() {
+  Close();
+}
+
+bool FileView::Open(const char *fn) {
+  Close();
+
+#ifndef ESP_PLATFORM
+  /*
+   * The bytes after the end of the file, up to the page boundary, read as zero. That is our null
+   * byte, unless the file size is a multiple of the page size : read those into memory.
+   */
+  struct stat st;
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0)
+    return false;
+  long page = sysconf(_SC_PAGESIZE);
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && (page <= 0 || st.st_size % page != 0)) {
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      close(fd);
+      data = (const char *)p;
+      len = map_len = st.st_size;
+      kind = FILE_VIEW_MMAP;
+      return true;
+    }
+  }
+  close(fd);
+#endif
+
+  char *buf = read_file(fn, &len);
+  if (buf == 0)
+    return false;
+  data = buf;
+  kind = FILE_VIEW_HEAP;
+  return true;
+}
+
+bool FileView::OpenPartition(const char *label) {
+  Close();
+
+#ifdef ESP_PLATFORM
+  const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (part == 0) {
+    ESP_LOGE(file_data_tag, "%s: no partition %s", __FUNCTION__, label);
+    return false;
+  }
+
+  const void			*p;
+  spi_flash_mmap_handle_t	h;
+  esp_err_t err = esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &p, &h);
+  if (err != ESP_OK) {
+    ESP_LOGE(file_data_tag, "%s: could not map partition %s, %s", __FUNCTION__, label, esp_err_to_name(err));
+    return false;
+  }
+  const char *end = (const char *)memchr(p, 0, part->size);
+  if (end == 0) {
+    ESP_LOGE(file_data_tag, "%s: partition %s has no terminating null byte", __FUNCTION__, label);
+    spi_flash_munmap(h);
+    return false;
+  }
+
+  data = (const char *)p;
+  len = end - data;
+  map_len = part->size;
+  handle = h;
+  kind = FILE_VIEW_PARTITION;
+  return true;
+#else
+  ESP_LOGE(file_data_tag, "%s(%s): partitions only exist on the esp32", __FUNCTION__, label);
+  return false;
+#endif
+}
+
+void FileView::Close() {
+  switch (kind) {
+  case FILE_VIEW_HEAP:
+    free((void *)data);
+    break;
+  case FILE_VIEW_MMAP:
+#ifndef ESP_PLATFORM
+    munmap((void *)data, map_len);
+#endif
+    break;
+  case FILE_VIEW_PARTITION:
+#ifdef ESP_PLATFORM
+    spi_flash_munmap((spi_flash_mmap_handle_t)handle);
+#endif
+    break;
+  case FILE_VIEW_NONE:
+    break;
+  }
+  data = 0;
+  len = map_len = 0;
+  kind = FILE_VIEW_NONE;
+}
+
+const char *FileView::Data() {
+  return data;
+}
+
+size_t FileView::Length() {
+  return len;
+}
+
+bool FileView::Mapped() {
+  return kind == FILE_VIEW_MMAP || kind == FILE_VIEW_PARTITION;
+}
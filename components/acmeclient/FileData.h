@@ -0,0 +1,68 @@
+/*
+ * Reading whole files.
+ *
+ * read_file() sizes its buffer from fstat() and reads the file in one go; on a VFS that doesn't
+ * report a size it starts small and doubles. The result is null terminated, so text files can
+ * be used as a string.
+ *
+ * FileView gives read-only access to a file without (on the host) copying it : the file is
+ * mapped with mmap(). The esp-idf VFS can't do that, so there the file is read into memory,
+ * but OpenPartition() maps a data partition with esp_partition_mmap(), so e.g. a root
+ * certificate bundle flashed into its own partition costs no heap at all.
+ * The data in a partition must end with a null byte.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_FILE_DATA_H_
+#define	_FILE_DATA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Read a file into a malloc'ed buffer with a null byte appended, the caller frees it.
+ * len (if not NULL) gets the file size. Returns NULL with errno set if the file can't be opened.
+ */
+char *read_file(const char *fn, size_t *len);
+
+class FileView {
+  public:
+    FileView();
+    ~FileView();
+
+    bool	Open(const char *fn);
+    bool	OpenPartition(const char *label);	// esp32 only
+    void	Close();
+
+    const char	*Data();			// Null terminated, NULL if not open
+    size_t	Length();
+    bool	Mapped();			// As opposed to copied into memory
+
+  private:
+    const char	*data;
+    size_t	len;
+    enum { FILE_VIEW_NONE, FILE_VIEW_HEAP, FILE_VIEW_MMAP, FILE_VIEW_PARTITION } kind;
+    size_t	map_len;
+    uint32_t	handle;				// spi_flash_mmap_handle_t
+};
+
+#endif	/* _FILE_DATA_H_ */
@@ -0,0 +1,151 @@
+/*
+ * Collects the body of an HTTP reply, see ReplyBuffer.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "ReplyBuffer.h"
+
+static const char	*reply_buffer_tag = "ReplyBuffer";
+static const size_t	reply_buffer_min = 512;		// Most ACME replies fit
+
+ReplyBuffer::ReplyBuffer() {
+  buf = lent = 0;
+  len = cap = lent_cap = 0;
+  memset(&stats, 0, sizeof(stats));
+}
+
+ReplyBuffer::~ReplyBuffer() {
+  Clear();
+}
+
+void ReplyBuffer::Begin() {
+  len = 0;
+  if (buf)
+    buf[0] = 0;
+  memset(&stats, 0, sizeof(stats));
+}
+
+/*
+ * Make room for need bytes in total (including the null byte).
+ */
+bool ReplyBuffer::Grow(size_t need) {
+  if (need <= cap)
+    return true;
+
+  char *nb = (char *)realloc(buf, need);
+  if (nb == 0) {
+    ESP_LOGE(reply_buffer_tag, "%s: could not allocate %d bytes", __FUNCTION__, (int)need);
+    return false;
+  }
+  buf = nb;
+  cap = need;
+  stats.allocations++;
+  if (cap > stats.peak)
+    stats.peak = cap;
+  return true;
+}
+
+bool ReplyBuffer::Reserve(size_t n) {
+  if (! Grow(len + n + 1))
+    return false;
+  stats.presized = true;
+  return true;
+}
+
+bool ReplyBuffer::Append(const void *data, size_t n) {
+  if (len + n + 1 > cap) {
+    size_t ncap = cap ? 2 * cap : reply_buffer_min;
+    while (ncap < len + n + 1)
+      ncap *= 2;
+    if (! Grow(ncap))
+      return false;
+  }
+  memcpy(buf + len, data, n);
+  len += n;
+  buf[len] = 0;
+
+  stats.length = len;
+  if (cap > stats.peak)
+    stats.peak = cap;
+  return true;
+}
+
+size_t ReplyBuffer::Length() {
+  return len;
+}
+
+const char *ReplyBuffer::Data() {
+  return len ? buf : 0;
+}
+
+char *ReplyBuffer::Detach() {
+  if (len == 0)
+    return 0;
+
+  char *r = buf;
+  lent = buf;
+  lent_cap = cap;
+  buf = 0;
+  len = cap = 0;
+  return r;
+}
+
+/*
+ * Keep the largest buffer for the next reply, free anything else.
+ */
+void ReplyBuffer::Release(char *p) {
+  if (p == 0)
+    return;
+  if (p != lent) {
+    free(p);
+    return;
+  }
+
+  if (lent_cap > cap && len == 0) {
+    free(buf);
+    buf = lent;
+    cap = lent_cap;
+    len = 0;
+    buf[0] = 0;
+  } else {
+    free(lent);
+  }
+  lent = 0;
+  lent_cap = 0;
+}
+
+void ReplyBuffer::Clear() {
+  free(buf);
+  buf = 0;
+  len = cap = 0;
+  // A buffer that is lent out still belongs to the caller, Release() will free it.
+  lent = 0;
+  lent_cap = 0;
+}
+
+const ReplyBufferStats *ReplyBuffer::Stats() {
+  return &stats;
+}
@@ -0,0 +1,72 @@
+/*
+ * Collects the body of an HTTP reply, as it arrives in HTTP_EVENT_ON_DATA chunks.
+ *
+ * The buffer is sized from Content-Length if the server sends one, otherwise it doubles as
+ * needed, so a certificate chain doesn't cost a realloc per chunk.
+ * Detach() hands the data to the caller as a null terminated string; give it back with Release()
+ * so the next reply can reuse the memory instead of allocating again.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_REPLY_BUFFER_H_
+#define	_REPLY_BUFFER_H_
+
+#include <stddef.h>
+
+// Per reply : how much memory it took, and how many times it was (re)allocated
+struct ReplyBufferStats {
+  size_t	length;			// Bytes received
+  size_t	peak;			// Largest buffer size
+  int		allocations;		// malloc/realloc calls, 0 if a buffer was reused
+  bool		presized;		// Sized from Content-Length
+};
+
+typedef void (*reply_stats_hook_t)(const char *url, const ReplyBufferStats *stats);
+
+class ReplyBuffer {
+  public:
+    ReplyBuffer();
+    ~ReplyBuffer();
+
+    void	Begin();			// Start a new reply, keeps the memory
+    bool	Reserve(size_t len);		// Expect len bytes (Content-Length)
+    bool	Append(const void *data, size_t len);
+    size_t	Length();
+    const char	*Data();			// Null terminated, or NULL if nothing arrived
+
+    char	*Detach();			// Caller owns the data, give it back with Release()
+    void	Release(char *);		// Take back a buffer from Detach(), or free() it
+    void	Clear();			// Free all memory
+
+    const ReplyBufferStats *Stats();	// Of the current (or last) reply
+
+  private:
+    char		*buf;
+    size_t		len, cap;
+    char		*lent;			// Last buffer handed out by Detach()
+    size_t		lent_cap;
+    ReplyBufferStats	stats;
+
+    bool	Grow(size_t need);
+};
+
+#endif	/* _REPLY_BUFFER_H_ */
@@ -0,0 +1,156 @@
+/*
+ * Crash safe file writes, see SafeFile.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <esp_log.h>
+
+#include "SafeFile.h"
+
+static const char	*safe_file_tag = "SafeFile";
+static const char	*safe_file_tmp = ".tmp";
+static const char	*safe_file_bak = ".bak";
+
+static char *Suffixed(const char *fn, const char *suffix) {
+  char *r = (char *)malloc(strlen(fn) + strlen(suffix) + 1);
+  if (r)
+    sprintf(r, "%s%s", fn, suffix);
+  return r;
+}
+
+char *SafeFile::BackupName(const char *fn) {
+  return Suffixed(fn, safe_file_bak);
+}
+
+/*
+ * Missing files are fine, the aim is that none of them is left.
+ */
+bool SafeFile::Remove(const char *fn) {
+  const char	*suffixes[] = { "", safe_file_tmp, safe_file_bak };
+  bool		ok = true;
+
+  for (const char *suffix : suffixes) {
+    char *f = Suffixed(fn, suffix);
+    if (f == 0)
+      return false;
+    if (unlink(f) < 0 && errno != ENOENT) {
+      ESP_LOGE(safe_file_tag, "%s: could not remove %s, error %d (%s)", __FUNCTION__, f, errno, strerror(errno));
+      ok = false;
+    }
+    free(f);
+  }
+  return ok;
+}
+
+SafeFile::SafeFile(const char *f, SafeFileSync s) {
+  fn = strdup(f);
+  tmp_fn = Suffixed(f, safe_file_tmp);
+  fp = 0;
+  sync = s;
+}
+
+SafeFile::~SafeFile() {
+  Abort();
+  free(fn);
+  free(tmp_fn);
+}
+
+FILE *SafeFile::Open() {
+  if (fn == 0 || tmp_fn == 0)
+    return 0;
+
+  fp = fopen(tmp_fn, "w");
+  if (fp == 0)
+    ESP_LOGE(safe_file_tag, "%s: could not open %s, error %d (%s)", __FUNCTION__, tmp_fn, errno, strerror(errno));
+  return fp;
+}
+
+void SafeFile::Abort() {
+  if (fp == 0)
+    return;
+  fclose(fp);
+  fp = 0;
+  unlink(tmp_fn);
+}
+
+/*
+ * Get the data on flash, then swap files. If we crash between the two renames, the file
+ * is missing but the previous version is in the backup, which is what readers fall back to.
+ */
+bool SafeFile::Commit() {
+  if (fp == 0)
+    return false;
+
+  bool ok = (fflush(fp) == 0) && ! ferror(fp);
+  if (ok && sync != SAFE_FILE_SYNC_NONE && fsync(fileno(fp)) != 0) {
+    ESP_LOGE(safe_file_tag, "%s: fsync %s failed, error %d (%s)", __FUNCTION__, tmp_fn, errno, strerror(errno));
+    ok = false;
+  }
+  if (fclose(fp) != 0)
+    ok = false;
+  fp = 0;
+
+  if (! ok) {
+    ESP_LOGE(safe_file_tag, "%s: failed to write %s, keeping the old %s", __FUNCTION__, tmp_fn, fn);
+    unlink(tmp_fn);
+    return false;
+  }
+
+  char *bak = BackupName(fn);
+  if (bak) {
+    unlink(bak);
+    if (rename(fn, bak) != 0 && errno != ENOENT)
+      ESP_LOGE(safe_file_tag, "%s: could not keep %s as %s, error %d (%s)", __FUNCTION__, fn, bak, errno, strerror(errno));
+    free(bak);
+  }
+  unlink(fn);			// In case the rename above didn't work
+  if (rename(tmp_fn, fn) != 0) {
+    ESP_LOGE(safe_file_tag, "%s: could not rename %s to %s, error %d (%s)", __FUNCTION__, tmp_fn, fn, errno, strerror(errno));
+    return false;
+  }
+
+#ifndef ESP_PLATFORM
+  // The esp-idf VFS can't open a directory as a file, and SPIFFS/FAT don't need this
+  if (sync == SAFE_FILE_SYNC_FULL) {
+    char *dir = strdup(fn);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+      *slash = 0;
+      int fd = open(*dir ? dir : "/", O_RDONLY);
+      if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+      }
+    }
+    free(dir);
+  }
+#endif
+
+  ESP_LOGD(safe_file_tag, "%s: wrote %s", __FUNCTION__, fn);
+  return true;
+}
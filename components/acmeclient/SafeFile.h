@@ -0,0 +1,63 @@
+/*
+ * Write a file so that a crash or power loss halfway leaves either the old or the new contents,
+ * never a truncated file.
+ *
+ * Open() returns a FILE for "name.tmp". Commit() flushes and (depending on the sync policy)
+ * fsyncs that, keeps the current file as "name.bak", and renames the temporary file into place.
+ * Two renames are used because neither SPIFFS nor FAT rename over an existing file.
+ * If nothing is committed, the temporary file is removed and the old file stays as it was.
+ *
+ * Readers can fall back to BackupName() if the file itself is missing or doesn't parse, so use
+ * Remove() rather than unlink() to get rid of such a file.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_SAFE_FILE_H_
+#define	_SAFE_FILE_H_
+
+#include <stdio.h>
+
+enum SafeFileSync {
+  SAFE_FILE_SYNC_NONE = 0,			// Leave it to the filesystem
+  SAFE_FILE_SYNC_FILE,				// fsync() the data before renaming (default)
+  SAFE_FILE_SYNC_FULL				// Also fsync() the directory, where that is possible
+};
+
+class SafeFile {
+  public:
+    SafeFile(const char *fn, SafeFileSync sync = SAFE_FILE_SYNC_FILE);
+    ~SafeFile();				// Calls Abort() if not committed
+
+    FILE	*Open();
+    bool	Commit();			// Closes the FILE
+    void	Abort();
+
+    static char	*BackupName(const char *fn);	// Caller frees
+    static bool	Remove(const char *fn);		// The file, its temporary and its backup
+
+  private:
+    char		*fn, *tmp_fn;
+    FILE		*fp;
+    SafeFileSync	sync;
+};
+
+#endif	/* _SAFE_FILE_H_ */
@@ -0,0 +1,256 @@
+/*
+ * Binary state file, see StateFile.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <esp_log.h>
+
+#include "StateFile.h"
+#include "FileData.h"
+
+static const char	*state_file_tag = "StateFile";
+static const char	state_file_magic[4] = { 'A', 'C', 'M', 'S' };
+static const uint8_t	state_file_version = 1;
+static const size_t	state_file_min = 512;
+
+struct StateHeader {
+  char		magic[4];
+  uint8_t	version, flags;
+  uint16_t	reserved;
+  uint32_t	generation;
+  uint32_t	length;
+  uint32_t	crc;
+};
+
+/*
+ * CRC-32 (IEEE 802.3), bit by bit : the files are small, so a table isn't worth the flash.
+ */
+uint32_t state_crc32(const uint8_t *data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i=0; i<len; i++) {
+    crc ^= data[i];
+    for (int b=0; b<8; b++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+StateWriter::StateWriter() {
+  buf = 0;
+  len = cap = 0;
+  failed = false;
+}
+
+StateWriter::~StateWriter() {
+  free(buf);
+}
+
+void StateWriter::Reset() {
+  len = 0;
+  failed = false;
+}
+
+bool StateWriter::Failed() {
+  return failed;
+}
+
+void StateWriter::Record(uint8_t tag, const void *data, size_t n) {
+  if (failed)
+    return;
+  if (n > UINT16_MAX) {
+    ESP_LOGE(state_file_tag, "%s: record %d too long (%d)", __FUNCTION__, tag, (int)n);
+    failed = true;
+    return;
+  }
+  if (len + 3 + n > cap) {
+    size_t ncap = cap ? 2 * cap : state_file_min;
+    while (ncap < len + 3 + n)
+      ncap *= 2;
+    uint8_t *nb = (uint8_t *)realloc(buf, ncap);
+    if (nb == 0) {
+      ESP_LOGE(state_file_tag, "%s: could not allocate %d bytes", __FUNCTION__, (int)ncap);
+      failed = true;
+      return;
+    }
+    buf = nb;
+    cap = ncap;
+  }
+
+  uint16_t l = n;
+  buf[len] = tag;
+  memcpy(buf + len + 1, &l, sizeof(l));
+  if (n)
+    memcpy(buf + len + 3, data, n);
+  len += 3 + n;
+}
+
+void StateWriter::String(uint8_t tag, const char *s) {
+  if (s)
+    Record(tag, s, strlen(s) + 1);
+}
+
+void StateWriter::Time(uint8_t tag, time_t t) {
+  int64_t v = t;
+  Record(tag, &v, sizeof(v));
+}
+
+uint32_t StateWriter::Checksum() {
+  return state_crc32(buf, len);
+}
+
+bool StateWriter::Write(const char *fn, uint32_t generation, SafeFileSync sync) {
+  if (failed)
+    return false;
+
+  StateHeader h;
+  memcpy(h.magic, state_file_magic, sizeof(h.magic));
+  h.version = state_file_version;
+  h.flags = 0;
+  h.reserved = 0;
+  h.generation = generation;
+  h.length = len;
+  h.crc = Checksum();
+
+  SafeFile sf(fn, sync);
+  FILE *f = sf.Open();
+  if (f == 0)
+    return false;
+  if (fwrite(&h, sizeof(h), 1, f) != 1 || (len && fwrite(buf, len, 1, f) != 1)) {
+    ESP_LOGE(state_file_tag, "%s: failed to write %s, error %d (%s)", __FUNCTION__, fn, errno, strerror(errno));
+    return false;
+  }
+  if (! sf.Commit())
+    return false;
+  ESP_LOGD(state_file_tag, "%s: wrote %s, generation %u, %d bytes", __FUNCTION__, fn,
+    (unsigned)generation, (int)(sizeof(h) + len));
+  return true;
+}
+
+StateReader::StateReader() {
+  buf = 0;
+  len = pos = 0;
+  generation = 0;
+}
+
+StateReader::~StateReader() {
+  free(buf);
+}
+
+/*
+ * One read for the whole file (see read_file()), then check it before anything is used.
+ */
+bool StateReader::Load(const char *fn) {
+  StateHeader	h;
+  size_t	n;
+
+  free(buf);
+  buf = 0;
+  len = pos = 0;
+
+  uint8_t *data = (uint8_t *)read_file(fn, &n);
+  if (data == 0) {
+    if (errno != ENOENT)
+      ESP_LOGE(state_file_tag, "%s: could not read %s, error %d (%s)", __FUNCTION__, fn, errno, strerror(errno));
+    return false;
+  }
+  if (n < sizeof(h)) {
+    ESP_LOGE(state_file_tag, "%s: %s is too short", __FUNCTION__, fn);
+    free(data);
+    return false;
+  }
+
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, state_file_magic, sizeof(h.magic)) != 0 || h.version != state_file_version) {
+    ESP_LOGE(state_file_tag, "%s: %s is not a version %d state file", __FUNCTION__, fn, state_file_version);
+    free(data);
+    return false;
+  }
+  if (n != sizeof(h) + h.length || state_crc32(data + sizeof(h), h.length) != h.crc) {
+    ESP_LOGE(state_file_tag, "%s: %s is damaged", __FUNCTION__, fn);
+    free(data);
+    return false;
+  }
+
+  // Keep just the payload
+  memmove(data, data + sizeof(h), h.length);
+  buf = data;
+  len = h.length;
+  generation = h.generation;
+  ESP_LOGD(state_file_tag, "%s: %s, generation %u, %d bytes", __FUNCTION__, fn, (unsigned)generation, (int)n);
+  return true;
+}
+
+uint32_t StateReader::Generation() {
+  return generation;
+}
+
+void StateReader::Rewind() {
+  pos = 0;
+}
+
+bool StateReader::Next(uint8_t *tag, const uint8_t **data, size_t *n) {
+  uint16_t l;
+
+  if (pos + 3 > len)
+    return false;
+  memcpy(&l, buf + pos + 1, sizeof(l));
+  if (pos + 3 + l > len)
+    return false;
+
+  *tag = buf[pos];
+  *data = buf + pos + 3;
+  *n = l;
+  pos += 3 + l;
+  return true;
+}
+
+int StateReader::Count(uint8_t t) {
+  uint8_t	tag;
+  const uint8_t	*data;
+  size_t	n, saved = pos;
+  int		c = 0;
+
+  pos = 0;
+  while (Next(&tag, &data, &n))
+    if (tag == t)
+      c++;
+  pos = saved;
+  return c;
+}
+
+const char *StateReader::String(const uint8_t *data, size_t n) {
+  if (n == 0 || data[n-1] != 0)
+    return 0;
+  return (const char *)data;
+}
+
+time_t StateReader::Time(const uint8_t *data, size_t n) {
+  int64_t v;
+  if (n != sizeof(v))
+    return 0;
+  memcpy(&v, data, sizeof(v));
+  return v;
+}
@@ -0,0 +1,88 @@
+/*
+ * Compact binary file format for the ACME client state, an alternative to account.json and
+ * order.json that is read back with one read, and without building a JSON document.
+ *
+ * Layout (native byte order, like the TLS session cache the file is only read by the device
+ * that wrote it) :
+ *	"ACMS", uint8 version (1), uint8 flags (0), uint16 reserved,
+ *	uint32 generation, uint32 payload length, uint32 CRC-32 of the payload,
+ *	payload : records of uint8 tag, uint16 length, data
+ * Strings are stored with their null byte, so they can be used from the buffer directly.
+ * Readers skip tags they don't know, so records can be added without changing the version.
+ *
+ * StateWriter builds the payload in memory and writes the file through SafeFile;
+ * StateReader loads a file, checks it, and walks the records.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_STATE_FILE_H_
+#define	_STATE_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "SafeFile.h"
+
+class StateWriter {
+  public:
+    StateWriter();
+    ~StateWriter();
+
+    void	Reset();
+    void	Record(uint8_t tag, const void *data, size_t len);
+    void	String(uint8_t tag, const char *s);	// Nothing is written for NULL
+    void	Time(uint8_t tag, time_t t);
+    bool	Failed();				// Out of memory at some point
+    uint32_t	Checksum();				// Of the payload so far
+
+    bool	Write(const char *fn, uint32_t generation, SafeFileSync sync);
+
+  private:
+    uint8_t	*buf;
+    size_t	len, cap;
+    bool	failed;
+};
+
+class StateReader {
+  public:
+    StateReader();
+    ~StateReader();
+
+    bool	Load(const char *fn);		// Reads and verifies the whole file
+    uint32_t	Generation();
+
+    void	Rewind();
+    bool	Next(uint8_t *tag, const uint8_t **data, size_t *len);
+    int		Count(uint8_t tag);		// Number of records with this tag
+
+    static const char	*String(const uint8_t *data, size_t len);	// NULL if not a string
+    static time_t	Time(const uint8_t *data, size_t len);
+
+  private:
+    uint8_t	*buf;
+    size_t	len, pos;
+    uint32_t	generation;
+};
+
+uint32_t state_crc32(const uint8_t *data, size_t len);
+
+#endif	/* _STATE_FILE_H_ */
@@ -0,0 +1,295 @@
+/*
+ * Small cache of TLS sessions, keyed by host and port, optionally kept in a file.
+ *
+ * File format (native byte order, the file is only read back by the same device) :
+ *	"TLSC", one byte version (1), then per entry :
+ *	uint8 host length, host, uint16 port, int64 time saved, uint16 session length, session
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <errno.h>
+#include <esp_log.h>
+
+#include "TlsSessionCache.h"
+
+static const char	tls_cache_magic[4] = { 'T', 'L', 'S', 'C' };
+static const uint8_t	tls_cache_version = 1;
+
+TlsSessionCache::TlsSessionCache(int max) {
+  max_entries = (max > 0) ? max : 1;
+  entries = (Entry *)calloc(max_entries, sizeof(Entry));
+  filename = 0;
+  max_age = 86400;
+  save_interval = 300;
+  last_save = 0;
+  dirty = false;
+  hits = misses = 0;
+
+#ifdef ESP_HTTP_CLIENT_HAS_SESSION_CACHE
+  hook.ctx = this;
+  hook.get = HookGet;
+  hook.put = HookPut;
+#endif
+}
+
+TlsSessionCache::~TlsSessionCache() {
+  Save();
+  Clear();
+  free(entries);
+}
+
+void TlsSessionCache::setFilename(const char *fn) {
+  std::lock_guard<std::mutex> l(lock);
+  filename = fn;
+  Load();
+}
+
+void TlsSessionCache::setMaxAge(time_t secs) {
+  max_age = secs;
+}
+
+void TlsSessionCache::setSaveInterval(time_t secs) {
+  save_interval = secs;
+}
+
+int TlsSessionCache::getHits() {
+  std::lock_guard<std::mutex> l(lock);
+  return hits;
+}
+
+int TlsSessionCache::getMisses() {
+  std::lock_guard<std::mutex> l(lock);
+  return misses;
+}
+
+bool TlsSessionCache::Supported() {
+#ifdef ESP_HTTP_CLIENT_HAS_SESSION_CACHE
+  return true;
+#else
+  return false;
+#endif
+}
+
+void TlsSessionCache::ClearEntry(Entry *e) {
+  free(e->host);
+  free(e->session);
+  memset(e, 0, sizeof(Entry));
+}
+
+void TlsSessionCache::Clear() {
+  std::lock_guard<std::mutex> l(lock);
+  ClearAll();
+}
+
+void TlsSessionCache::ClearAll() {
+  for (int i=0; i<max_entries; i++)
+    ClearEntry(&entries[i]);
+}
+
+TlsSessionCache::Entry *TlsSessionCache::Find(const char *host, int port) {
+  for (int i=0; i<max_entries; i++)
+    if (entries[i].host && entries[i].port == port && strcasecmp(entries[i].host, host) == 0)
+      return &entries[i];
+  return 0;
+}
+
+size_t TlsSessionCache::Get(const char *host, int port, unsigned char *buf, size_t len) {
+  std::lock_guard<std::mutex> l(lock);
+  Entry *e = Find(host, port);
+
+  if (e && max_age && time(0) - e->saved > max_age) {
+    ESP_LOGD(tls_cache_tag, "%s: session for %s:%d has expired", __FUNCTION__, host, port);
+    ClearEntry(e);
+    dirty = true;
+    e = 0;
+  }
+  if (e == 0 || e->len > len) {
+    misses++;
+    return 0;
+  }
+
+  memcpy(buf, e->session, e->len);
+  hits++;
+  ESP_LOGD(tls_cache_tag, "%s: session for %s:%d (%d bytes)", __FUNCTION__, host, port, (int)e->len);
+  return e->len;
+}
+
+/*
+ * Store a session, replacing the one for the same host, or else the oldest.
+ */
+void TlsSessionCache::Put(const char *host, int port, const unsigned char *session, size_t len) {
+  if (len > UINT16_MAX || strlen(host) > UINT8_MAX)
+    return;				// Doesn't fit the file format, don't bother
+
+  std::lock_guard<std::mutex> l(lock);
+  Entry *e = Find(host, port);
+
+  if (e == 0) {
+    e = &entries[0];
+    for (int i=1; i<max_entries && e->host; i++)
+      if (entries[i].host == 0 || entries[i].saved < e->saved)
+        e = &entries[i];
+    ClearEntry(e);
+    e->host = strdup(host);
+    e->port = port;
+  } else {
+    free(e->session);
+  }
+
+  e->session = (unsigned char *)malloc(len);
+  if (e->session == 0) {
+    ESP_LOGE(tls_cache_tag, "%s: could not allocate %d bytes", __FUNCTION__, (int)len);
+    ClearEntry(e);
+    return;
+  }
+  memcpy(e->session, session, len);
+  e->len = len;
+  e->saved = time(0);
+  dirty = true;
+
+  ESP_LOGD(tls_cache_tag, "%s: session for %s:%d (%d bytes)", __FUNCTION__, host, port, (int)len);
+
+  if (filename && e->saved - last_save >= save_interval)
+    Write();
+}
+
+bool TlsSessionCache::Save() {
+  std::lock_guard<std::mutex> l(lock);
+  return Write();
+}
+
+bool TlsSessionCache::Write() {
+  if (filename == 0 || ! dirty)
+    return true;
+
+  SafeFile sf(filename);
+  FILE *f = sf.Open();
+  if (f == 0)
+    return false;
+
+  bool ok = (fwrite(tls_cache_magic, sizeof(tls_cache_magic), 1, f) == 1)
+    && (fwrite(&tls_cache_version, 1, 1, f) == 1);
+  for (int i=0; ok && i<max_entries; i++) {
+    Entry *e = &entries[i];
+    if (e->host == 0)
+      continue;
+
+    uint8_t	hl = strlen(e->host);
+    uint16_t	port = e->port, sl = e->len;
+    int64_t	saved = e->saved;
+
+    ok = (fwrite(&hl, sizeof(hl), 1, f) == 1)
+      && (fwrite(e->host, hl, 1, f) == 1)
+      && (fwrite(&port, sizeof(port), 1, f) == 1)
+      && (fwrite(&saved, sizeof(saved), 1, f) == 1)
+      && (fwrite(&sl, sizeof(sl), 1, f) == 1)
+      && (fwrite(e->session, sl, 1, f) == 1);
+  }
+
+  if (! ok || ! sf.Commit()) {		// SafeFile removes the temporary file, the old one stays
+    ESP_LOGE(tls_cache_tag, "%s: failed to write %s", __FUNCTION__, filename);
+    return false;
+  }
+  dirty = false;
+  last_save = time(0);
+  ESP_LOGD(tls_cache_tag, "%s: wrote %s", __FUNCTION__, filename);
+  return true;
+}
+
+/*
+ * Use the previous copy if the file is missing or damaged, in case we crashed while replacing it.
+ */
+bool TlsSessionCache::Load() {
+  if (Load(filename))
+    return true;
+
+  char *bak = SafeFile::BackupName(filename);
+  bool ok = bak && Load(bak);
+  free(bak);
+  return ok;
+}
+
+bool TlsSessionCache::Load(const char *fn) {
+  char		magic[sizeof(tls_cache_magic)];
+  uint8_t	version;
+
+  FILE *f = fopen(fn, "r");
+  if (f == 0) {
+    ESP_LOGD(tls_cache_tag, "%s: no %s", __FUNCTION__, fn);
+    return false;
+  }
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, tls_cache_magic, sizeof(magic)) != 0
+   || fread(&version, 1, 1, f) != 1 || version != tls_cache_version) {
+    ESP_LOGE(tls_cache_tag, "%s: %s is not a session cache file", __FUNCTION__, fn);
+    fclose(f);
+    return false;
+  }
+
+  ClearAll();
+  int n = 0;
+  for (int i=0; i<max_entries; i++) {
+    Entry	*e = &entries[i];
+    uint8_t	hl;
+    uint16_t	port, sl;
+    int64_t	saved;
+
+    if (fread(&hl, sizeof(hl), 1, f) != 1)
+      break;				// End of file
+    e->host = (char *)calloc(1, hl + 1);
+    if (e->host == 0 || fread(e->host, hl, 1, f) != 1
+     || fread(&port, sizeof(port), 1, f) != 1 || fread(&saved, sizeof(saved), 1, f) != 1
+     || fread(&sl, sizeof(sl), 1, f) != 1 || (e->session = (unsigned char *)malloc(sl)) == 0
+     || fread(e->session, sl, 1, f) != 1) {
+      ESP_LOGE(tls_cache_tag, "%s: %s is truncated", __FUNCTION__, fn);
+      ClearEntry(e);
+      break;
+    }
+    e->port = port;
+    e->saved = saved;
+    e->len = sl;
+    n++;
+  }
+  fclose(f);
+
+  dirty = false;
+  ESP_LOGI(tls_cache_tag, "%s: %d session(s) from %s", __FUNCTION__, n, fn);
+  return true;
+}
+
+#ifdef ESP_HTTP_CLIENT_HAS_SESSION_CACHE
+const esp_http_client_session_cache_t *TlsSessionCache::ClientHook() {
+  return &hook;
+}
+
+size_t TlsSessionCache::HookGet(void *ctx, const char *host, int port, unsigned char *buf, size_t len) {
+  return ((TlsSessionCache *)ctx)->Get(host, port, buf, len);
+}
+
+void TlsSessionCache::HookPut(void *ctx, const char *host, int port, const unsigned char *session, size_t len) {
+  ((TlsSessionCache *)ctx)->Put(host, port, session, len);
+}
+#endif
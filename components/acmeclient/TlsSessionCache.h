@@ -0,0 +1,104 @@
+/*
+ * Small cache of TLS sessions (session ID or ticket), keyed by host and port, so that a new
+ * connection can resume an earlier session instead of doing a full handshake.
+ * One instance can be shared by the Acme and Dyndns classes, and can be kept in a file so that
+ * a reboot doesn't lose it. These can run in different tasks, a mutex keeps them apart.
+ *
+ * The sessions are kept as opaque blobs (mbedtls_ssl_session_save() format), filled in by the
+ * HTTP client. This needs a client that allows it, so for now this is a host (port/linux) only
+ * feature : that esp_http_client has ESP_HTTP_CLIENT_HAS_SESSION_CACHE, esp-idf v4.3's doesn't
+ * pass a session through to esp-tls. Supported() tells which, and the setTlsSessionCache()
+ * methods of Acme and Dyndns refuse a cache where it would never be used.
+ *
+ * A saved session contains the secret of the TLS session, so treat the file like a private key.
+ * The file is written through SafeFile, Load() falls back to its backup.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_TLS_SESSION_CACHE_H_
+#define	_TLS_SESSION_CACHE_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <mutex>
+#include <esp_http_client.h>
+#include "SafeFile.h"
+
+class TlsSessionCache {
+  public:
+    TlsSessionCache(int max_entries = 4);
+    ~TlsSessionCache();
+
+    void setFilename(const char *fn);		// Keep the cache in this file, reads it immediately
+    void setMaxAge(time_t secs);		// Don't offer sessions older than this, default one day
+    void setSaveInterval(time_t secs);		// Write the file at most this often, default 5 minutes
+    bool Save();				// Write the file now, if anything changed
+    void Clear();
+
+    // Copy the session for host:port into buf, returns its length, or 0 if there's none
+    size_t Get(const char *host, int port, unsigned char *buf, size_t len);
+    void Put(const char *host, int port, const unsigned char *session, size_t len);
+
+    int getHits();				// Sessions handed out for resumption
+    int getMisses();
+
+    static bool Supported();			// Whether this build's HTTP client can use the cache
+
+#ifdef ESP_HTTP_CLIENT_HAS_SESSION_CACHE
+    const esp_http_client_session_cache_t *ClientHook();	// For esp_http_client_config_t.session_cache
+#endif
+
+  private:
+    const char *tls_cache_tag = "TlsSessionCache";
+
+    struct Entry {
+      char		*host;
+      int		port;
+      time_t		saved;
+      unsigned char	*session;
+      size_t		len;
+    };
+    Entry		*entries;
+    int			max_entries;
+
+    const char		*filename;
+    time_t		max_age, save_interval, last_save;
+    bool		dirty;
+    int			hits, misses;
+    std::mutex		lock;
+
+    // These expect the caller to hold the lock
+    Entry *Find(const char *host, int port);
+    void ClearEntry(Entry *);
+    void ClearAll();
+    bool Write();
+    bool Load();
+    bool Load(const char *fn);
+
+#ifdef ESP_HTTP_CLIENT_HAS_SESSION_CACHE
+    esp_http_client_session_cache_t	hook;
+    static size_t HookGet(void *ctx, const char *host, int port, unsigned char *buf, size_t len);
+    static void HookPut(void *ctx, const char *host, int port, const unsigned char *session, size_t len);
+#endif
+};
+
+#endif	/* _TLS_SESSION_CACHE_H_ */
@@ -0,0 +1,186 @@
+/*
+ * Small hash table of http-01 tokens and their responses, see TokenTable.h
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "TokenTable.h"
+
+static const char	*token_table_tag = "TokenTable";
+
+TokenTable::TokenTable(int n) {
+  for (size = 4; size < n; size *= 2)
+    ;
+  slots = (Entry *)calloc(size, sizeof(Entry));
+  if (slots == 0)
+    size = 0;
+  used = removed = 0;
+}
+
+TokenTable::~TokenTable() {
+  Clear();
+  free(slots);
+}
+
+// FNV-1a
+uint32_t TokenTable::Hash(const char *token, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i=0; i<len; i++) {
+    h ^= (uint8_t)token[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+ * The slot that has this token, or else the first free one on its probe sequence.
+ * There always is a free slot : Grow() keeps the table from filling up.
+ */
+TokenTable::Entry *TokenTable::Find(uint32_t hash, const char *token, size_t len) {
+  Entry *reuse = 0;
+
+  for (int i=0, ix = hash & (size - 1); i<size; i++, ix = (ix + 1) & (size - 1)) {
+    Entry *e = &slots[ix];
+    if (e->state == SLOT_FREE)
+      return reuse ? reuse : e;
+    if (e->state == SLOT_REMOVED) {
+      if (reuse == 0)
+        reuse = e;
+      continue;
+    }
+    if (e->hash == hash && e->token_len == len && memcmp(e->data, token, len) == 0)
+      return e;
+  }
+  return reuse;
+}
+
+/*
+ * Make room for one more entry : double the size if three quarters would be used, otherwise
+ * just rehash to get rid of removed slots.
+ */
+bool TokenTable::Grow() {
+  if (size && (used + removed + 1) * 4 <= size * 3)
+    return true;
+
+  int nsize = (size == 0) ? 4 : ((used + 1) * 4 > size * 3 / 2) ? size * 2 : size;
+  Entry *ns = (Entry *)calloc(nsize, sizeof(Entry));
+  if (ns == 0) {
+    ESP_LOGE(token_table_tag, "%s: could not allocate %d slots", __FUNCTION__, nsize);
+    return false;
+  }
+
+  Entry *os = slots;
+  int osize = size;
+  slots = ns;
+  size = nsize;
+  removed = 0;
+  for (int i=0; i<osize; i++)
+    if (os[i].state == SLOT_USED)
+      *Find(os[i].hash, os[i].data, os[i].token_len) = os[i];
+  free(os);
+  return true;
+}
+
+bool TokenTable::Add(const char *token, const char *response) {
+  size_t tl = strlen(token), rl = strlen(response);
+  if (tl > UINT16_MAX || rl > UINT16_MAX)
+    return false;
+
+  char *data = (char *)malloc(tl + rl + 2);
+  if (data == 0) {
+    ESP_LOGE(token_table_tag, "%s: could not allocate %d bytes", __FUNCTION__, (int)(tl + rl + 2));
+    return false;
+  }
+  memcpy(data, token, tl + 1);
+  memcpy(data + tl + 1, response, rl + 1);
+
+  uint32_t h = Hash(token, tl);
+
+  std::lock_guard<std::mutex> l(lock);
+  if (! Grow()) {
+    free(data);
+    return false;
+  }
+  Entry *e = Find(h, token, tl);
+  if (e->state == SLOT_USED)
+    free(e->data);
+  else {
+    if (e->state == SLOT_REMOVED)
+      removed--;
+    used++;
+  }
+  e->hash = h;
+  e->state = SLOT_USED;
+  e->token_len = tl;
+  e->response_len = rl;
+  e->data = data;
+  ESP_LOGD(token_table_tag, "%s: %s (%d tokens)", __FUNCTION__, token, used);
+  return true;
+}
+
+bool TokenTable::Remove(const char *token) {
+  size_t tl = strlen(token);
+
+  std::lock_guard<std::mutex> l(lock);
+  if (size == 0)
+    return false;
+  Entry *e = Find(Hash(token, tl), token, tl);
+  if (e == 0 || e->state != SLOT_USED)
+    return false;
+  free(e->data);
+  e->data = 0;
+  e->state = SLOT_REMOVED;
+  used--;
+  removed++;
+  ESP_LOGD(token_table_tag, "%s: %s (%d tokens)", __FUNCTION__, token, used);
+  return true;
+}
+
+void TokenTable::Clear() {
+  std::lock_guard<std::mutex> l(lock);
+  for (int i=0; i<size; i++) {
+    free(slots[i].data);
+    memset(&slots[i], 0, sizeof(Entry));
+  }
+  used = removed = 0;
+}
+
+int TokenTable::Count() {
+  std::lock_guard<std::mutex> l(lock);
+  return used;
+}
+
+size_t TokenTable::Lookup(const char *token, size_t len, char *buf, size_t buflen) {
+  uint32_t h = Hash(token, len);
+
+  std::lock_guard<std::mutex> l(lock);
+  if (size == 0)
+    return 0;
+  Entry *e = Find(h, token, len);
+  if (e == 0 || e->state != SLOT_USED || e->response_len > buflen)
+    return 0;
+  memcpy(buf, e->data + e->token_len + 1, e->response_len);
+  return e->response_len;
+}
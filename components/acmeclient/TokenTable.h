@@ -0,0 +1,72 @@
+/*
+ * Small hash table of http-01 tokens and the responses to them, for the local web server.
+ *
+ * Acme registers a single wildcard handler for /.well-known/acme-challenge/ and looks up the
+ * token from the URI here : an entry holds the token and its precomputed response
+ * (token.thumbprint) with their lengths, so a request costs one hash and one memcmp. Open
+ * addressing, the table grows when it's three quarters full, so any number of authorizations
+ * can be outstanding.
+ * Entries are added and removed by the ACME FSM while the web server task looks them up, a
+ * mutex keeps them apart.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_TOKEN_TABLE_H_
+#define	_TOKEN_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+
+class TokenTable {
+  public:
+    TokenTable(int size = 8);			// Rounded up to a power of two
+    ~TokenTable();
+
+    bool	Add(const char *token, const char *response);	// Replaces an existing entry
+    bool	Remove(const char *token);
+    void	Clear();
+    int		Count();
+
+    // Copy the response for token (len bytes, not null terminated) into buf, returns its length,
+    // or 0 if the token isn't known or the response doesn't fit.
+    size_t	Lookup(const char *token, size_t len, char *buf, size_t buflen);
+
+  private:
+    enum { SLOT_FREE = 0, SLOT_USED, SLOT_REMOVED };
+    struct Entry {
+      uint32_t		hash;
+      uint8_t		state;
+      uint16_t		token_len, response_len;
+      char		*data;			// Token, null byte, response, null byte
+    };
+    Entry		*slots;
+    int			size;			// Always a power of two
+    int			used, removed;
+    std::mutex		lock;
+
+    static uint32_t Hash(const char *token, size_t len);
+    Entry *Find(uint32_t hash, const char *token, size_t len);
+    bool Grow();
+};
+
+#endif	/* _TOKEN_TABLE_H_ */
@@ -0,0 +1,799 @@
+/*
+ * Host (Linux) port of the acmeclient component : HTTP(S) client.
+ *
+ * A small HTTP/1.1 client on top of mbedtls_net (POSIX sockets) and mbedTLS,
+ * implementing the esp_http_client calls that the acmeclient component makes.
+ *
+ * Supported :
+ *  - http and https URLs, the CA is taken from cert_pem or from the system bundle
+ *  - GET, POST, PUT, DELETE, HEAD, PATCH
+ *  - Content-Length and chunked replies, or replies delimited by connection close
+ *  - persistent connections : the connection is kept after a request unless the server
+ *    closed it, or esp_http_client_close() is called. A stale connection is detected on the
+ *    next request, which is then retried once on a new connection.
+ * Not supported : redirects, authentication, proxies.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/error.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/version.h"
+
+#include "esp_log.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+
+static const char *httpc_tag = "HTTP_CLIENT";
+
+#define	HTTPC_MAX_HEADERS	16
+#define	HTTPC_RX_BUFFER		2048
+#define	HTTPC_LINE_MAX		2048
+#define	HTTPC_DEFAULT_TIMEOUT	5000
+#define	HTTPC_USER_AGENT	"ESP32 HTTP Client/1.0"
+#define	HTTPC_SESSION_MAX	4096	// Serialized session, includes the peer certificate
+
+// mbedtls_ssl_session_save() and _load() appeared in mbedTLS 2.19
+#if defined(MBEDTLS_SSL_CLI_C) && MBEDTLS_VERSION_NUMBER >= 0x02130000
+#define	HTTPC_SESSION_RESUMPTION	1
+#endif
+
+struct esp_http_client {
+  // Configuration
+  http_event_handle_cb		event_handler;
+  void				*user_data;
+  const char			*cert_pem;
+  bool				use_bundle;
+  int				timeout_ms;
+  esp_http_client_method_t	method;
+  const esp_http_client_session_cache_t	*session_cache;
+
+  // Current request
+  char				*url;
+  bool				https;
+  char				*host;
+  int				port;
+  char				*path;
+  struct {
+    char	*key, *value;
+  }				headers[HTTPC_MAX_HEADERS];
+  int				nheaders;
+  const char			*post_data;
+  int				post_len;
+
+  // Connection
+  bool				connected;
+  bool				reused;		// Current request goes over a connection used before
+  int				sent;		// Bytes of the current request written so far
+  bool				conn_https;
+  char				*conn_host;
+  int				conn_port;
+  mbedtls_net_context		net;
+
+  bool				tls_setup;
+  mbedtls_ssl_context		ssl;
+  mbedtls_ssl_config		conf;
+  mbedtls_x509_crt		ca;
+  mbedtls_entropy_context	entropy;
+  mbedtls_ctr_drbg_context	ctr_drbg;
+
+  unsigned char			rx[HTTPC_RX_BUFFER];
+  int				rx_pos, rx_len;
+
+  // Reply
+  int				status_code;
+  int				content_length;
+  bool				chunked;
+  bool				close_after;
+  bool				no_body;
+  int				body_left;	// In the current chunk, or the whole body
+  bool				body_done;
+};
+
+static void dispatch(esp_http_client_handle_t client, esp_http_client_event_id_t id,
+    void *data, int len, char *key, char *value) {
+  if (client->event_handler == 0)
+    return;
+
+  esp_http_client_event_t	ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.event_id = id;
+  ev.client = client;
+  ev.data = data;
+  ev.data_len = len;
+  ev.user_data = client->user_data;
+  ev.header_key = key;
+  ev.header_value = value;
+  client->event_handler(&ev);
+}
+
+static void log_mbedtls_error(const char *fn, int err) {
+  char buf[80];
+  mbedtls_strerror(err, buf, sizeof(buf));
+  ESP_LOGE(httpc_tag, "%s: error -0x%04x %s", fn, -err, buf);
+}
+
+/*
+ * Split the URL into its parts, e.g. https://host:port/path?query
+ */
+static esp_err_t parse_url(esp_http_client_handle_t client, const char *url) {
+  const char *p;
+
+  if (strncasecmp(url, "https://", 8) == 0) {
+    client->https = true;
+    client->port = 443;
+    p = url + 8;
+  } else if (strncasecmp(url, "http://", 7) == 0) {
+    client->https = false;
+    client->port = 80;
+    p = url + 7;
+  } else {
+    ESP_LOGE(httpc_tag, "%s: unsupported URL %s", __FUNCTION__, url);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  const char *slash = strchr(p, '/');
+  const char *end = slash ? slash : p + strlen(p);
+  const char *colon = memchr(p, ':', end - p);
+
+  free(client->host);
+  if (colon) {
+    client->host = strndup(p, colon - p);
+    client->port = atoi(colon + 1);
+  } else
+    client->host = strndup(p, end - p);
+
+  free(client->path);
+  client->path = strdup(slash ? slash : "/");
+
+  free(client->url);
+  client->url = strdup(url);
+  return ESP_OK;
+}
+
+/*
+ * TLS configuration is done once per handle, connections reuse it.
+ */
+static esp_err_t tls_setup(esp_http_client_handle_t client) {
+  int ret;
+
+  if (client->tls_setup)
+    return ESP_OK;
+
+  mbedtls_ssl_init(&client->ssl);
+  mbedtls_ssl_config_init(&client->conf);
+  mbedtls_x509_crt_init(&client->ca);
+  mbedtls_entropy_init(&client->entropy);
+  mbedtls_ctr_drbg_init(&client->ctr_drbg);
+  client->tls_setup = true;
+
+  if ((ret = mbedtls_ctr_drbg_seed(&client->ctr_drbg, mbedtls_entropy_func, &client->entropy, NULL, 0)) != 0) {
+    log_mbedtls_error("mbedtls_ctr_drbg_seed", ret);
+    return ESP_FAIL;
+  }
+
+  if (client->cert_pem)
+    ret = mbedtls_x509_crt_parse(&client->ca, (const unsigned char *)client->cert_pem, strlen(client->cert_pem) + 1);
+  else if (client->use_bundle)
+    ret = mbedtls_x509_crt_parse_file(&client->ca, ESP_CRT_BUNDLE_HOST_PATH);
+  else
+    ret = 0;
+  if (ret < 0) {
+    log_mbedtls_error("mbedtls_x509_crt_parse", ret);
+    return ESP_FAIL;
+  }
+
+  if ((ret = mbedtls_ssl_config_defaults(&client->conf, MBEDTLS_SSL_IS_CLIENT,
+      MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+    log_mbedtls_error("mbedtls_ssl_config_defaults", ret);
+    return ESP_FAIL;
+  }
+  mbedtls_ssl_conf_authmode(&client->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  mbedtls_ssl_conf_ca_chain(&client->conf, &client->ca, NULL);
+  mbedtls_ssl_conf_rng(&client->conf, mbedtls_ctr_drbg_random, &client->ctr_drbg);
+  mbedtls_ssl_conf_read_timeout(&client->conf, client->timeout_ms);
+
+  if ((ret = mbedtls_ssl_setup(&client->ssl, &client->conf)) != 0) {
+    log_mbedtls_error("mbedtls_ssl_setup", ret);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static void conn_close(esp_http_client_handle_t client) {
+  if (! client->connected)
+    return;
+
+  if (client->conn_https) {
+    mbedtls_ssl_close_notify(&client->ssl);
+    mbedtls_ssl_session_reset(&client->ssl);
+  }
+  mbedtls_net_free(&client->net);
+  client->connected = false;
+  client->rx_pos = client->rx_len = 0;
+
+  dispatch(client, HTTP_EVENT_DISCONNECTED, 0, 0, 0, 0);
+}
+
+#ifdef HTTPC_SESSION_RESUMPTION
+/*
+ * Offer a session from the cache, if there is one for this host.
+ */
+static void session_offer(esp_http_client_handle_t client) {
+  mbedtls_ssl_session	sess;
+  unsigned char		*buf;
+  size_t		len;
+  int			ret;
+
+  if (client->session_cache == 0 || (buf = (unsigned char *)malloc(HTTPC_SESSION_MAX)) == 0)
+    return;
+  len = client->session_cache->get(client->session_cache->ctx, client->host, client->port, buf, HTTPC_SESSION_MAX);
+  if (len) {
+    mbedtls_ssl_session_init(&sess);
+    if ((ret = mbedtls_ssl_session_load(&sess, buf, len)) != 0)
+      log_mbedtls_error("mbedtls_ssl_session_load", ret);
+    else if ((ret = mbedtls_ssl_set_session(&client->ssl, &sess)) != 0)
+      log_mbedtls_error("mbedtls_ssl_set_session", ret);
+    else
+      ESP_LOGD(httpc_tag, "%s: resuming session with %s:%d", __FUNCTION__, client->host, client->port);
+    mbedtls_ssl_session_free(&sess);
+  }
+  free(buf);
+}
+
+/*
+ * After a handshake, store the (new or renewed) session.
+ */
+static void session_store(esp_http_client_handle_t client) {
+  mbedtls_ssl_session	sess;
+  unsigned char		*buf;
+  size_t		len;
+  int			ret;
+
+  if (client->session_cache == 0 || (buf = (unsigned char *)malloc(HTTPC_SESSION_MAX)) == 0)
+    return;
+  mbedtls_ssl_session_init(&sess);
+  if ((ret = mbedtls_ssl_get_session(&client->ssl, &sess)) != 0)
+    log_mbedtls_error("mbedtls_ssl_get_session", ret);
+  else if ((ret = mbedtls_ssl_session_save(&sess, buf, HTTPC_SESSION_MAX, &len)) != 0)
+    log_mbedtls_error("mbedtls_ssl_session_save", ret);
+  else
+    client->session_cache->put(client->session_cache->ctx, client->host, client->port, buf, len);
+  mbedtls_ssl_session_free(&sess);
+  free(buf);
+}
+#else
+static void session_offer(esp_http_client_handle_t client) {}
+static void session_store(esp_http_client_handle_t client) {}
+#endif
+
+/*
+ * Connect to the host in the current URL, or keep the connection if we already have it.
+ */
+static esp_err_t conn_open(esp_http_client_handle_t client) {
+  int ret;
+  char port[8];
+
+  client->sent = 0;
+  if (client->connected) {
+    /*
+     * Between requests the server has nothing to say, so a readable socket means it closed the
+     * connection (or sent a TLS close_notify). Find out now, before the request goes out.
+     */
+    if (client->conn_https == client->https && client->conn_port == client->port
+     && strcasecmp(client->conn_host, client->host) == 0
+     && mbedtls_net_poll(&client->net, MBEDTLS_NET_POLL_READ, 0) == 0) {
+      client->reused = true;
+      return ESP_OK;
+    }
+    conn_close(client);
+  }
+  client->reused = false;
+
+  snprintf(port, sizeof(port), "%d", client->port);
+  mbedtls_net_init(&client->net);
+  if ((ret = mbedtls_net_connect(&client->net, client->host, port, MBEDTLS_NET_PROTO_TCP)) != 0) {
+    log_mbedtls_error("mbedtls_net_connect", ret);
+    dispatch(client, HTTP_EVENT_ERROR, 0, 0, 0, 0);
+    return ESP_ERR_HTTP_CONNECT;
+  }
+
+  if (client->https) {
+    if (tls_setup(client) != ESP_OK) {
+      mbedtls_net_free(&client->net);
+      dispatch(client, HTTP_EVENT_ERROR, 0, 0, 0, 0);
+      return ESP_ERR_HTTP_CONNECT;
+    }
+    mbedtls_ssl_set_hostname(&client->ssl, client->host);
+    mbedtls_ssl_set_bio(&client->ssl, &client->net, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+    session_offer(client);
+
+    while ((ret = mbedtls_ssl_handshake(&client->ssl)) != 0) {
+      if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        log_mbedtls_error("mbedtls_ssl_handshake", ret);
+        mbedtls_ssl_session_reset(&client->ssl);
+        mbedtls_net_free(&client->net);
+        dispatch(client, HTTP_EVENT_ERROR, 0, 0, 0, 0);
+        return ESP_ERR_HTTP_CONNECT;
+      }
+    }
+    session_store(client);
+  }
+
+  client->connected = true;
+  client->conn_https = client->https;
+  client->conn_port = client->port;
+  free(client->conn_host);
+  client->conn_host = strdup(client->host);
+  client->rx_pos = client->rx_len = 0;
+
+  ESP_LOGD(httpc_tag, "%s: connected to %s:%d (%s)", __FUNCTION__, client->host, client->port,
+    client->https ? "https" : "http");
+  dispatch(client, HTTP_EVENT_ON_CONNECTED, 0, 0, 0, 0);
+  return ESP_OK;
+}
+
+static int raw_send(esp_http_client_handle_t client, const unsigned char *buf, int len) {
+  int done = 0, ret;
+
+  while (done < len) {
+    if (client->conn_https)
+      ret = mbedtls_ssl_write(&client->ssl, buf + done, len - done);
+    else
+      ret = mbedtls_net_send(&client->net, buf + done, len - done);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (ret <= 0)
+      return -1;
+    done += ret;
+    client->sent += ret;
+  }
+  return done;
+}
+
+static int raw_recv(esp_http_client_handle_t client, unsigned char *buf, int len) {
+  int ret;
+
+  do {
+    if (client->conn_https)
+      ret = mbedtls_ssl_read(&client->ssl, buf, len);
+    else
+      ret = mbedtls_net_recv_timeout(&client->net, buf, len, client->timeout_ms);
+  } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+  if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_NET_CONN_RESET)
+    return 0;
+  return ret;
+}
+
+// Make sure there's data in the receive buffer, returns the number of bytes available
+static int fill_rx(esp_http_client_handle_t client) {
+  if (client->rx_pos < client->rx_len)
+    return client->rx_len - client->rx_pos;
+
+  client->rx_pos = client->rx_len = 0;
+  int ret = raw_recv(client, client->rx, sizeof(client->rx));
+  if (ret <= 0)
+    return ret;
+  client->rx_len = ret;
+  return ret;
+}
+
+/*
+ * Read one line (without the CR LF) from the connection.
+ * Returns the line length, or -1 if the connection broke before the end of a line.
+ */
+static int read_line(esp_http_client_handle_t client, char *line, int max) {
+  int len = 0;
+
+  for (;;) {
+    if (fill_rx(client) <= 0)
+      return -1;
+    char c = client->rx[client->rx_pos++];
+    if (c == '\n')
+      break;
+    if (c != '\r' && len < max - 1)
+      line[len++] = c;
+  }
+  line[len] = 0;
+  return len;
+}
+
+static bool has_body(esp_http_client_method_t m) {
+  return m == HTTP_METHOD_POST || m == HTTP_METHOD_PUT || m == HTTP_METHOD_PATCH;
+}
+
+static const char *method_name(esp_http_client_method_t m) {
+  switch (m) {
+  case HTTP_METHOD_POST:	return "POST";
+  case HTTP_METHOD_PUT:		return "PUT";
+  case HTTP_METHOD_PATCH:	return "PATCH";
+  case HTTP_METHOD_DELETE:	return "DELETE";
+  case HTTP_METHOD_HEAD:	return "HEAD";
+  case HTTP_METHOD_GET:
+  default:			return "GET";
+  }
+}
+
+static esp_err_t send_request(esp_http_client_handle_t client, int write_len) {
+  int	len, i;
+  char	*req;
+
+  len = strlen(client->path) + strlen(client->host) + 64;
+  for (i=0; i<client->nheaders; i++)
+    len += strlen(client->headers[i].key) + strlen(client->headers[i].value) + 4;
+  req = (char *)malloc(len + 64);
+  if (req == 0)
+    return ESP_ERR_NO_MEM;
+
+  int pos = sprintf(req, "%s %s HTTP/1.1\r\nHost: %s\r\n", method_name(client->method), client->path, client->host);
+  for (i=0; i<client->nheaders; i++)
+    pos += sprintf(req + pos, "%s: %s\r\n", client->headers[i].key, client->headers[i].value);
+  if (write_len > 0 || has_body(client->method))
+    pos += sprintf(req + pos, "Content-Length: %d\r\n", write_len);
+  pos += sprintf(req + pos, "\r\n");
+
+  ESP_LOGD(httpc_tag, "%s: %s %s", __FUNCTION__, method_name(client->method), client->url);
+  int ret = raw_send(client, (const unsigned char *)req, pos);
+  free(req);
+  if (ret < 0)
+    return ESP_ERR_HTTP_WRITE_DATA;
+
+  dispatch(client, HTTP_EVENT_HEADERS_SENT, 0, 0, 0, 0);
+  return ESP_OK;
+}
+
+/*
+ * Read the status line and the headers of a reply, pass each header to the event handler.
+ * Returns ESP_ERR_HTTP_EAGAIN if nothing at all was received : the server closed the connection,
+ * but the request was sent, so it may have been processed.
+ */
+static esp_err_t read_headers(esp_http_client_handle_t client) {
+  char	*line = (char *)malloc(HTTPC_LINE_MAX);
+  int	len;
+
+  client->status_code = -1;
+  client->content_length = -1;
+  client->chunked = false;
+  client->close_after = false;
+  client->body_done = false;
+  client->body_left = 0;
+
+  // Skip 1xx interim replies
+  do {
+    if ((len = read_line(client, line, HTTPC_LINE_MAX)) < 0) {
+      free(line);
+      return (client->status_code < 0) ? ESP_ERR_HTTP_EAGAIN : ESP_ERR_HTTP_FETCH_HEADER;
+    }
+    if (strncmp(line, "HTTP/1.", 7) != 0 || len < 12) {
+      ESP_LOGE(httpc_tag, "%s: bad status line {%s}", __FUNCTION__, line);
+      free(line);
+      return ESP_ERR_HTTP_FETCH_HEADER;
+    }
+    if (line[7] == '0')
+      client->close_after = true;
+    client->status_code = atoi(line + 9);
+
+    while ((len = read_line(client, line, HTTPC_LINE_MAX)) > 0) {
+      char *colon = strchr(line, ':');
+      if (colon == 0)
+        continue;
+      *colon = 0;
+      char *value = colon + 1;
+      while (*value == ' ' || *value == '\t')
+        value++;
+
+      if (strcasecmp(line, "Content-Length") == 0)
+        client->content_length = atoi(value);
+      else if (strcasecmp(line, "Transfer-Encoding") == 0 && strcasecmp(value, "chunked") == 0)
+        client->chunked = true;
+      else if (strcasecmp(line, "Connection") == 0)
+        client->close_after = (strcasecmp(value, "close") == 0);
+
+      if (client->status_code >= 200)
+        dispatch(client, HTTP_EVENT_ON_HEADER, 0, 0, line, value);
+    }
+    if (len < 0) {
+      free(line);
+      return ESP_ERR_HTTP_FETCH_HEADER;
+    }
+  } while (client->status_code < 200);
+  free(line);
+
+  client->no_body = (client->method == HTTP_METHOD_HEAD || client->status_code == 204 || client->status_code == 304);
+  if (client->no_body || client->content_length == 0)
+    client->body_done = true;
+  else if (! client->chunked) {
+    client->body_left = client->content_length;	// -1 means read until the connection closes
+    if (client->content_length < 0)
+      client->close_after = true;
+  }
+  return ESP_OK;
+}
+
+/*
+ * Read part of the reply body. Returns 0 at the end of the body, -1 on error.
+ */
+static int read_body(esp_http_client_handle_t client, char *buf, int max) {
+  if (client->body_done)
+    return 0;
+
+  if (client->chunked && client->body_left == 0) {
+    char line[32];
+    if (read_line(client, line, sizeof(line)) < 0)
+      return -1;
+    client->body_left = (int)strtol(line, 0, 16);
+    if (client->body_left == 0) {
+      // Trailer, up to an empty line
+      while (read_line(client, line, sizeof(line)) > 0)
+        ;
+      client->body_done = true;
+      return 0;
+    }
+  }
+
+  int avail = fill_rx(client);
+  if (avail <= 0) {
+    if (client->content_length < 0 && ! client->chunked) {
+      client->body_done = true;		// Connection close marks the end of the body
+      return 0;
+    }
+    return -1;
+  }
+
+  int n = avail;
+  if (n > max)
+    n = max;
+  if (client->body_left >= 0 && n > client->body_left)
+    n = client->body_left;
+  memcpy(buf, client->rx + client->rx_pos, n);
+  client->rx_pos += n;
+
+  if (client->body_left >= 0) {
+    client->body_left -= n;
+    if (client->body_left == 0) {
+      if (client->chunked) {
+        char crlf[4];
+        read_line(client, crlf, sizeof(crlf));
+      } else
+        client->body_done = true;
+    }
+  }
+  return n;
+}
+
+/*
+ * Public API
+ */
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config) {
+  esp_http_client_handle_t client = (esp_http_client_handle_t)calloc(1, sizeof(struct esp_http_client));
+  if (client == 0)
+    return 0;
+
+  client->event_handler = config->event_handler;
+  client->user_data = config->user_data;
+  client->cert_pem = config->cert_pem;
+  client->use_bundle = (config->crt_bundle_attach != 0);
+  client->timeout_ms = config->timeout_ms ? config->timeout_ms : HTTPC_DEFAULT_TIMEOUT;
+  client->session_cache = config->session_cache;
+  client->method = config->method;
+
+  if (config->url == 0 || parse_url(client, config->url) != ESP_OK) {
+    esp_http_client_cleanup(client);
+    return 0;
+  }
+  esp_http_client_set_header(client, "User-Agent", HTTPC_USER_AGENT);
+  return client;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url) {
+  return parse_url(client, url);
+}
+
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char *data, int len) {
+  client->post_data = data;
+  client->post_len = data ? len : 0;
+  if (data && client->method == HTTP_METHOD_GET)
+    client->method = HTTP_METHOD_POST;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method) {
+  client->method = method;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value) {
+  int i;
+
+  if (value == 0) {			// Like esp-idf : no value removes the header
+    esp_http_client_delete_header(client, key);
+    return ESP_OK;
+  }
+
+  for (i=0; i<client->nheaders; i++)
+    if (strcasecmp(client->headers[i].key, key) == 0)
+      break;
+  if (i == HTTPC_MAX_HEADERS)
+    return ESP_ERR_NO_MEM;
+  if (i == client->nheaders) {
+    client->headers[i].key = strdup(key);
+    client->nheaders++;
+  } else
+    free(client->headers[i].value);
+  client->headers[i].value = strdup(value);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char *key) {
+  for (int i=0; i<client->nheaders; i++)
+    if (strcasecmp(client->headers[i].key, key) == 0) {
+      free(client->headers[i].key);
+      free(client->headers[i].value);
+      client->headers[i] = client->headers[--client->nheaders];
+      return ESP_OK;
+    }
+  return ESP_ERR_NOT_FOUND;
+}
+
+/*
+ * No retries here, that is up to the caller : a POST can't simply be sent twice.
+ * ESP_ERR_HTTP_EAGAIN means that a reused connection failed before any of the request was
+ * written, so sending it again on a fresh connection is safe.
+ */
+esp_err_t esp_http_client_perform(esp_http_client_handle_t client) {
+  esp_err_t	err;
+  char		buf[512];
+
+  if ((err = conn_open(client)) != ESP_OK)
+    return err;
+
+  err = send_request(client, client->post_len);
+  if (err == ESP_OK && client->post_len > 0)
+    if (raw_send(client, (const unsigned char *)client->post_data, client->post_len) < 0)
+      err = ESP_ERR_HTTP_WRITE_DATA;
+  if (err == ESP_OK) {
+    err = read_headers(client);
+    if (err == ESP_ERR_HTTP_EAGAIN)
+      err = ESP_ERR_HTTP_FETCH_HEADER;	// The request went out, the server may have acted on it
+  } else if (client->reused && client->sent == 0)
+    err = ESP_ERR_HTTP_EAGAIN;
+
+  if (err != ESP_OK) {
+    conn_close(client);
+    dispatch(client, HTTP_EVENT_ERROR, 0, 0, 0, 0);
+    return err;
+  }
+
+  int n;
+  while ((n = read_body(client, buf, sizeof(buf))) > 0)
+    dispatch(client, HTTP_EVENT_ON_DATA, buf, n, 0, 0);
+  if (n < 0) {
+    conn_close(client);
+    dispatch(client, HTTP_EVENT_ERROR, 0, 0, 0, 0);
+    return ESP_FAIL;
+  }
+
+  dispatch(client, HTTP_EVENT_ON_FINISH, 0, 0, 0, 0);
+  if (client->close_after)
+    conn_close(client);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len) {
+  esp_err_t err;
+
+  if ((err = conn_open(client)) != ESP_OK)
+    return err;
+  // Only when nothing was written yet, see esp_http_client_perform()
+  if ((err = send_request(client, write_len)) != ESP_OK && client->reused && client->sent == 0) {
+    conn_close(client);
+    if ((err = conn_open(client)) == ESP_OK)
+      err = send_request(client, write_len);
+  }
+  return err;
+}
+
+int esp_http_client_write(esp_http_client_handle_t client, const char *buffer, int len) {
+  return raw_send(client, (const unsigned char *)buffer, len);
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t client) {
+  esp_err_t err = read_headers(client);
+
+  if (err != ESP_OK) {
+    conn_close(client);
+    return ESP_FAIL;
+  }
+  return client->content_length;
+}
+
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client) {
+  return client->chunked;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len) {
+  int total = 0;
+
+  while (total < len) {
+    int n = read_body(client, buffer + total, len - total);
+    if (n < 0)
+      return (total > 0) ? total : -1;
+    if (n == 0)
+      break;
+    dispatch(client, HTTP_EVENT_ON_DATA, buffer + total, n, 0, 0);
+    total += n;
+  }
+  if (client->body_done && client->close_after)
+    conn_close(client);
+  return total;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) {
+  return client->status_code;
+}
+
+int esp_http_client_get_content_length(esp_http_client_handle_t client) {
+  return client->content_length;
+}
+
+esp_http_client_transport_t esp_http_client_get_transport_type(esp_http_client_handle_t client) {
+  return client->https ? HTTP_TRANSPORT_OVER_SSL : HTTP_TRANSPORT_OVER_TCP;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+  conn_close(client);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client) {
+  if (client == 0)
+    return ESP_FAIL;
+
+  conn_close(client);
+  if (client->tls_setup) {
+    mbedtls_ssl_free(&client->ssl);
+    mbedtls_ssl_config_free(&client->conf);
+    mbedtls_x509_crt_free(&client->ca);
+    mbedtls_ctr_drbg_free(&client->ctr_drbg);
+    mbedtls_entropy_free(&client->entropy);
+  }
+  for (int i=0; i<client->nheaders; i++) {
+    free(client->headers[i].key);
+    free(client->headers[i].value);
+  }
+  free(client->url);
+  free(client->host);
+  free(client->path);
+  free(client->conn_host);
+  free(client);
+  return ESP_OK;
+}
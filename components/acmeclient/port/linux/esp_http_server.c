@@ -0,0 +1,637 @@
+/*
+ * Host (Linux) port of the acmeclient component : HTTP server.
+ *
+ * A listening thread accepts connections, each connection gets its own thread which
+ * serves requests until the client closes the connection or it is idle too long.
+ * Handlers are called with a httpd_req_t much like on esp-idf, the response calls
+ * below write directly to the socket.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "esp_log.h"
+#include "esp_http_server.h"
+
+static const char *httpd_tag = "httpd";
+
+#define	HTTPD_MAX_CONNECTIONS	16
+#define	HTTPD_HDR_MAX		4096
+#define	HTTPD_MAX_RESP_HDRS	8
+
+struct httpd_server {
+  httpd_config_t	config;
+  int			listen_fd;
+  pthread_t		thread;
+  pthread_mutex_t	lock;
+  pthread_cond_t	idle;
+  httpd_uri_t		*handlers;
+  int			nhandlers;
+  int			conn_fd[HTTPD_MAX_CONNECTIONS];
+  int			nconn;
+  bool			stopping;
+};
+
+struct httpd_conn {
+  struct httpd_server	*server;
+  int			fd;
+  char			rx[2048];
+  int			rx_pos, rx_len;
+};
+
+// Private data for one request, hooked into httpd_req_t.aux
+struct httpd_req_aux {
+  struct httpd_conn	*conn;
+  char			*hdrs;			// Request headers, "key: value\0" one after the other
+  int			hdrs_len;
+  size_t		body_left;
+  const char		*status;
+  const char		*type;
+  struct {
+    const char *field, *value;
+  }			resp_hdrs[HTTPD_MAX_RESP_HDRS];
+  int			nresp_hdrs;
+  bool			headers_sent;
+  bool			chunked;
+  bool			done;
+  bool			keep_alive;
+};
+
+static int conn_fill(struct httpd_conn *c) {
+  if (c->rx_pos < c->rx_len)
+    return c->rx_len - c->rx_pos;
+  c->rx_pos = c->rx_len = 0;
+
+  int n;
+  do {
+    n = recv(c->fd, c->rx, sizeof(c->rx), 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return -1;
+  c->rx_len = n;
+  return n;
+}
+
+static int conn_line(struct httpd_conn *c, char *line, int max) {
+  int len = 0;
+
+  for (;;) {
+    if (conn_fill(c) < 0)
+      return -1;
+    char ch = c->rx[c->rx_pos++];
+    if (ch == '\n')
+      break;
+    if (ch != '\r' && len < max - 1)
+      line[len++] = ch;
+  }
+  line[len] = 0;
+  return len;
+}
+
+static int conn_send(struct httpd_conn *c, const char *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = send(c->fd, buf + done, len - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static int method_value(const char *s) {
+  if (strcmp(s, "GET") == 0)	return HTTP_GET;
+  if (strcmp(s, "HEAD") == 0)	return HTTP_HEAD;
+  if (strcmp(s, "POST") == 0)	return HTTP_POST;
+  if (strcmp(s, "PUT") == 0)	return HTTP_PUT;
+  if (strcmp(s, "DELETE") == 0)	return HTTP_DELETE;
+  return -1;
+}
+
+/*
+ * URI matching, same rules as in esp-idf : a template ending in '*' matches any URI
+ * with that prefix, a template ending in '?' makes its last character optional.
+ */
+bool httpd_uri_match_wildcard(const char *tpl, const char *uri, size_t len) {
+  const size_t tpl_len = strlen(tpl);
+  size_t exact_match_chars = tpl_len;
+
+  const char last = (tpl_len > 0) ? tpl[tpl_len - 1] : 0;
+  const char prevlast = (tpl_len > 1) ? tpl[tpl_len - 2] : 0;
+  const bool asterisk = last == '*' || (prevlast == '*' && last == '?');
+  const bool quest = last == '?' || (prevlast == '?' && last == '*');
+
+  // Template such as "?" without a preceding character
+  if (exact_match_chars < (size_t)(asterisk + quest * 2))
+    return false;
+  exact_match_chars -= asterisk + quest * 2;
+
+  if (len < exact_match_chars)
+    return false;
+
+  if (! quest) {
+    if (! asterisk && len != exact_match_chars)
+      return false;
+    return strncmp(tpl, uri, exact_match_chars) == 0;
+  }
+
+  // The optional character is present but different
+  if (len > exact_match_chars && tpl[exact_match_chars] != uri[exact_match_chars])
+    return false;
+  if (strncmp(tpl, uri, exact_match_chars) != 0)
+    return false;
+  return asterisk || len <= exact_match_chars + 1;
+}
+
+static httpd_uri_t *find_handler(struct httpd_server *s, const char *uri, int method) {
+  size_t len = strcspn(uri, "?");
+
+  for (int i=0; i<s->nhandlers; i++) {
+    if (s->handlers[i].method != (httpd_method_t)method)
+      continue;
+    if (s->config.uri_match_fn) {
+      if (s->config.uri_match_fn(s->handlers[i].uri, uri, len))
+        return &s->handlers[i];
+    } else if (strlen(s->handlers[i].uri) == len && strncmp(s->handlers[i].uri, uri, len) == 0)
+      return &s->handlers[i];
+  }
+  return 0;
+}
+
+static esp_err_t send_headers(httpd_req_t *r, ssize_t content_len) {
+  struct httpd_req_aux	*aux = (struct httpd_req_aux *)r->aux;
+  char			hdr[1024];
+  int			pos;
+
+  pos = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Type: %s\r\n", aux->status, aux->type);
+  if (content_len >= 0)
+    pos += snprintf(hdr + pos, sizeof(hdr) - pos, "Content-Length: %d\r\n", (int)content_len);
+  else
+    pos += snprintf(hdr + pos, sizeof(hdr) - pos, "Transfer-Encoding: chunked\r\n");
+  for (int i=0; i<aux->nresp_hdrs && pos < (int)sizeof(hdr); i++)
+    pos += snprintf(hdr + pos, sizeof(hdr) - pos, "%s: %s\r\n", aux->resp_hdrs[i].field, aux->resp_hdrs[i].value);
+  if (! aux->keep_alive && pos < (int)sizeof(hdr))
+    pos += snprintf(hdr + pos, sizeof(hdr) - pos, "Connection: close\r\n");
+  if (pos < (int)sizeof(hdr))
+    pos += snprintf(hdr + pos, sizeof(hdr) - pos, "\r\n");
+  if (pos >= (int)sizeof(hdr)) {
+    ESP_LOGE(httpd_tag, "%s: response headers too long", __FUNCTION__);
+    return ESP_FAIL;
+  }
+
+  aux->headers_sent = true;
+  return conn_send(aux->conn, hdr, pos) < 0 ? ESP_FAIL : ESP_OK;
+}
+
+/*
+ * Serve the requests on one connection
+ */
+static void *conn_thread(void *ptr) {
+  struct httpd_conn	*c = (struct httpd_conn *)ptr;
+  struct httpd_server	*s = c->server;
+  char			*line = (char *)malloc(HTTPD_HDR_MAX);
+  char			*hdrs = (char *)malloc(HTTPD_HDR_MAX);
+  bool			keep_alive = true;
+
+  while (keep_alive && ! s->stopping) {
+    char	method[16], version[16];
+    httpd_req_t	req;
+    struct httpd_req_aux aux;
+
+    if (conn_line(c, line, HTTPD_HDR_MAX) < 0)
+      break;
+    if (line[0] == 0)
+      continue;
+
+    memset(&req, 0, sizeof(req));
+    memset(&aux, 0, sizeof(aux));
+    if (sscanf(line, "%15s %512s %15s", method, (char *)req.uri, version) != 3) {
+      ESP_LOGE(httpd_tag, "%s: bad request {%s}", __FUNCTION__, line);
+      break;
+    }
+    keep_alive = (strcmp(version, "HTTP/1.1") == 0);
+
+    // Headers
+    int hlen = 0, len;
+    while ((len = conn_line(c, line, HTTPD_HDR_MAX)) > 0) {
+      if (strncasecmp(line, "Content-Length:", 15) == 0)
+        req.content_len = strtoul(line + 15, 0, 10);
+      else if (strncasecmp(line, "Connection:", 11) == 0) {
+        const char *v = line + 11;
+        while (*v == ' ')
+          v++;
+        if (strcasecmp(v, "close") == 0)
+          keep_alive = false;
+        else if (strcasecmp(v, "keep-alive") == 0)
+          keep_alive = true;
+      }
+      if (hlen + len + 1 <= HTTPD_HDR_MAX) {
+        memcpy(hdrs + hlen, line, len + 1);
+        hlen += len + 1;
+      }
+    }
+    if (len < 0)
+      break;
+
+    req.handle = s;
+    req.method = method_value(method);
+    req.aux = &aux;
+    aux.conn = c;
+    aux.hdrs = hdrs;
+    aux.hdrs_len = hlen;
+    aux.body_left = req.content_len;
+    aux.status = HTTPD_200;
+    aux.type = HTTPD_TYPE_TEXT;
+    aux.keep_alive = keep_alive;
+
+    pthread_mutex_lock(&s->lock);
+    httpd_uri_t *h = find_handler(s, req.uri, req.method);
+    httpd_uri_t handler;
+    if (h)
+      handler = *h;
+    pthread_mutex_unlock(&s->lock);
+
+    ESP_LOGD(httpd_tag, "%s: %s %s -> %s", __FUNCTION__, method, req.uri, h ? "handler" : "404");
+
+    esp_err_t err;
+    if (h) {
+      req.user_ctx = handler.user_ctx;
+      err = handler.handler(&req);
+    } else
+      err = httpd_resp_send_err(&req, HTTPD_404_NOT_FOUND, NULL);
+
+    if (err != ESP_OK) {
+      // Like esp-idf : a failing handler closes the connection
+      if (! aux.headers_sent)
+        httpd_resp_send_err(&req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+      break;
+    }
+    if (! aux.headers_sent)
+      httpd_resp_send(&req, "", 0);
+    else if (aux.chunked && ! aux.done)
+      httpd_resp_send_chunk(&req, NULL, 0);
+
+    // Skip the part of the request body that the handler didn't read
+    while (aux.body_left > 0) {
+      char skip[256];
+      int n = httpd_req_recv(&req, skip, sizeof(skip));
+      if (n <= 0) {
+        keep_alive = false;
+        break;
+      }
+    }
+  }
+
+  free(line);
+  free(hdrs);
+  close(c->fd);
+
+  pthread_mutex_lock(&s->lock);
+  for (int i=0; i<s->nconn; i++)
+    if (s->conn_fd[i] == c->fd) {
+      s->conn_fd[i] = s->conn_fd[--s->nconn];
+      break;
+    }
+  pthread_cond_broadcast(&s->idle);
+  pthread_mutex_unlock(&s->lock);
+
+  free(c);
+  return 0;
+}
+
+static void *listen_thread(void *ptr) {
+  struct httpd_server *s = (struct httpd_server *)ptr;
+
+  while (! s->stopping) {
+    int fd = accept(s->listen_fd, 0, 0);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = s->config.recv_wait_timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    tv.tv_sec = s->config.send_wait_timeout;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_mutex_lock(&s->lock);
+    if (s->nconn == HTTPD_MAX_CONNECTIONS) {
+      pthread_mutex_unlock(&s->lock);
+      ESP_LOGE(httpd_tag, "%s: too many connections", __FUNCTION__);
+      close(fd);
+      continue;
+    }
+    s->conn_fd[s->nconn++] = fd;
+    pthread_mutex_unlock(&s->lock);
+
+    struct httpd_conn *c = (struct httpd_conn *)calloc(1, sizeof(struct httpd_conn));
+    c->server = s;
+    c->fd = fd;
+
+    pthread_t t;
+    if (pthread_create(&t, 0, conn_thread, c) != 0) {
+      ESP_LOGE(httpd_tag, "%s: pthread_create failed", __FUNCTION__);
+      pthread_mutex_lock(&s->lock);
+      s->conn_fd[--s->nconn] = -1;
+      pthread_mutex_unlock(&s->lock);
+      close(fd);
+      free(c);
+      continue;
+    }
+    pthread_detach(t);
+  }
+  return 0;
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+  struct sockaddr_in	sa;
+  int			one = 1;
+
+  struct httpd_server *s = (struct httpd_server *)calloc(1, sizeof(struct httpd_server));
+  if (s == 0)
+    return ESP_ERR_NO_MEM;
+  s->config = *config;
+  s->handlers = (httpd_uri_t *)calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+  pthread_mutex_init(&s->lock, 0);
+  pthread_cond_init(&s->idle, 0);
+
+  s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(config->server_port);
+  sa.sin_addr.s_addr = htonl(config->loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+
+  if (bind(s->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(s->listen_fd, 8) < 0) {
+    ESP_LOGE(httpd_tag, "%s: cannot listen on port %d : %s", __FUNCTION__, config->server_port, strerror(errno));
+    close(s->listen_fd);
+    free(s->handlers);
+    free(s);
+    return ESP_FAIL;
+  }
+
+  if (pthread_create(&s->thread, 0, listen_thread, s) != 0) {
+    close(s->listen_fd);
+    free(s->handlers);
+    free(s);
+    return ESP_ERR_HTTPD_TASK;
+  }
+
+  ESP_LOGD(httpd_tag, "%s: listening on port %d", __FUNCTION__, config->server_port);
+  *handle = s;
+  return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle) {
+  struct httpd_server *s = (struct httpd_server *)handle;
+  if (s == 0)
+    return ESP_ERR_INVALID_ARG;
+
+  s->stopping = true;
+  shutdown(s->listen_fd, SHUT_RDWR);
+  close(s->listen_fd);
+  pthread_join(s->thread, 0);
+
+  // Wake up the connection threads, wait for them to finish
+  pthread_mutex_lock(&s->lock);
+  for (int i=0; i<s->nconn; i++)
+    shutdown(s->conn_fd[i], SHUT_RDWR);
+  while (s->nconn > 0)
+    pthread_cond_wait(&s->idle, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+
+  for (int i=0; i<s->nhandlers; i++)
+    free((void *)s->handlers[i].uri);
+  free(s->handlers);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->idle);
+  free(s);
+  return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler) {
+  struct httpd_server *s = (struct httpd_server *)handle;
+  esp_err_t err = ESP_OK;
+
+  if (s == 0 || uri_handler == 0 || uri_handler->uri == 0)
+    return ESP_ERR_INVALID_ARG;
+
+  pthread_mutex_lock(&s->lock);
+  for (int i=0; i<s->nhandlers; i++)
+    if (s->handlers[i].method == uri_handler->method && strcmp(s->handlers[i].uri, uri_handler->uri) == 0)
+      err = ESP_ERR_HTTPD_HANDLER_EXISTS;
+  if (err == ESP_OK && s->nhandlers == s->config.max_uri_handlers)
+    err = ESP_ERR_HTTPD_HANDLERS_FULL;
+  if (err == ESP_OK) {
+    s->handlers[s->nhandlers] = *uri_handler;
+    s->handlers[s->nhandlers].uri = strdup(uri_handler->uri);
+    s->nhandlers++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return err;
+}
+
+esp_err_t httpd_unregister_uri_handler(httpd_handle_t handle, const char *uri, httpd_method_t method) {
+  struct httpd_server *s = (struct httpd_server *)handle;
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+
+  if (s == 0 || uri == 0)
+    return ESP_ERR_INVALID_ARG;
+
+  pthread_mutex_lock(&s->lock);
+  for (int i=0; i<s->nhandlers; i++)
+    if (s->handlers[i].method == method && strcmp(s->handlers[i].uri, uri) == 0) {
+      free((void *)s->handlers[i].uri);
+      s->handlers[i] = s->handlers[--s->nhandlers];
+      err = ESP_OK;
+      break;
+    }
+  pthread_mutex_unlock(&s->lock);
+  return err;
+}
+
+static const char *find_hdr(httpd_req_t *r, const char *field) {
+  struct httpd_req_aux *aux = (struct httpd_req_aux *)r->aux;
+  size_t flen = strlen(field);
+
+  for (int pos = 0; pos < aux->hdrs_len; pos += strlen(aux->hdrs + pos) + 1) {
+    const char *h = aux->hdrs + pos;
+    if (strncasecmp(h, field, flen) == 0 && h[flen] == ':') {
+      h += flen + 1;
+      while (*h == ' ')
+        h++;
+      return h;
+    }
+  }
+  return 0;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field) {
+  const char *v = find_hdr(r, field);
+  return v ? strlen(v) : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size) {
+  const char *v = find_hdr(r, field);
+  if (v == 0)
+    return ESP_ERR_NOT_FOUND;
+  strncpy(val, v, val_size);
+  if (val_size > 0)
+    val[val_size - 1] = 0;
+  return (strlen(v) >= val_size) ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len) {
+  struct httpd_req_aux *aux = (struct httpd_req_aux *)r->aux;
+  struct httpd_conn *c = aux->conn;
+
+  if (aux->body_left == 0)
+    return 0;
+  int avail = conn_fill(c);
+  if (avail < 0)
+    return -1;
+
+  size_t n = avail;
+  if (n > buf_len)
+    n = buf_len;
+  if (n > aux->body_left)
+    n = aux->body_left;
+  memcpy(buf, c->rx + c->rx_pos, n);
+  c->rx_pos += n;
+  aux->body_left -= n;
+  return n;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+  ((struct httpd_req_aux *)r->aux)->status = status;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+  ((struct httpd_req_aux *)r->aux)->type = type;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value) {
+  struct httpd_req_aux *aux = (struct httpd_req_aux *)r->aux;
+
+  if (aux->nresp_hdrs == HTTPD_MAX_RESP_HDRS)
+    return ESP_ERR_HTTPD_HANDLERS_FULL;
+  aux->resp_hdrs[aux->nresp_hdrs].field = field;
+  aux->resp_hdrs[aux->nresp_hdrs].value = value;
+  aux->nresp_hdrs++;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+  struct httpd_req_aux *aux = (struct httpd_req_aux *)r->aux;
+
+  if (aux->headers_sent)
+    return ESP_ERR_HTTPD_INVALID_REQ;
+  if (buf == 0)
+    buf_len = 0;
+  else if (buf_len == HTTPD_RESP_USE_STRLEN)
+    buf_len = strlen(buf);
+
+  if (send_headers(r, buf_len) != ESP_OK)
+    return ESP_FAIL;
+  aux->done = true;
+  if (r->method == HTTP_HEAD || buf_len == 0)
+    return ESP_OK;
+  return conn_send(aux->conn, buf, buf_len) < 0 ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+  struct httpd_req_aux *aux = (struct httpd_req_aux *)r->aux;
+  char size[16];
+
+  if (aux->done)
+    return ESP_ERR_HTTPD_INVALID_REQ;
+  if (! aux->headers_sent) {
+    aux->chunked = true;
+    if (send_headers(r, -1) != ESP_OK)
+      return ESP_FAIL;
+  }
+  if (buf == 0)
+    buf_len = 0;
+  else if (buf_len == HTTPD_RESP_USE_STRLEN)
+    buf_len = strlen(buf);
+  if (buf_len == 0)
+    aux->done = true;
+
+  int n = sprintf(size, "%x\r\n", (unsigned)buf_len);
+  if (conn_send(aux->conn, size, n) < 0
+   || (buf_len > 0 && conn_send(aux->conn, buf, buf_len) < 0)
+   || conn_send(aux->conn, "\r\n", 2) < 0)
+    return ESP_FAIL;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str) {
+  return httpd_resp_send(r, str, str ? HTTPD_RESP_USE_STRLEN : 0);
+}
+
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *r, const char *str) {
+  return httpd_resp_send_chunk(r, str, str ? HTTPD_RESP_USE_STRLEN : 0);
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg) {
+  const char *status, *dflt;
+
+  switch (error) {
+  case HTTPD_400_BAD_REQUEST:		status = "400 Bad Request";		dflt = "Bad request"; break;
+  case HTTPD_401_UNAUTHORIZED:		status = "401 Unauthorized";		dflt = "Unauthorized"; break;
+  case HTTPD_403_FORBIDDEN:		status = "403 Forbidden";		dflt = "Forbidden"; break;
+  case HTTPD_404_NOT_FOUND:		status = "404 Not Found";		dflt = "Nothing matches the given URI"; break;
+  case HTTPD_405_METHOD_NOT_ALLOWED:	status = "405 Method Not Allowed";	dflt = "Request method for this URI is not handled by server"; break;
+  case HTTPD_408_REQ_TIMEOUT:		status = "408 Request Timeout";		dflt = "Server closed this connection"; break;
+  case HTTPD_411_LENGTH_REQUIRED:	status = "411 Length Required";		dflt = "Chunked encoding not supported"; break;
+  case HTTPD_414_URI_TOO_LONG:		status = "414 URI Too Long";		dflt = "URI is too long"; break;
+  case HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE: status = "431 Request Header Fields Too Large"; dflt = "Header fields are too long"; break;
+  case HTTPD_501_METHOD_NOT_IMPLEMENTED: status = "501 Method Not Implemented"; dflt = "Request method is not supported by server"; break;
+  case HTTPD_505_VERSION_NOT_SUPPORTED:	status = "505 Version Not Supported";	dflt = "HTTP version not supported by server"; break;
+  case HTTPD_500_INTERNAL_SERVER_ERROR:
+  default:				status = "500 Internal Server Error";	dflt = "Server has encountered an unexpected error"; break;
+  }
+  httpd_resp_set_status(req, status);
+  httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+  return httpd_resp_send(req, msg ? msg : dflt, HTTPD_RESP_USE_STRLEN);
+}
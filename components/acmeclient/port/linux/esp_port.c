@@ -0,0 +1,156 @@
+/*
+ * Host (Linux) port of the acmeclient component : logging, error names, system calls.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_crt_bundle.h"
+
+/*
+ * Logging
+ * A small table of per-tag levels, plus a global level for tags not in the table.
+ */
+#define	PORT_LOG_MAX_TAGS	16
+
+static struct {
+  const char		*tag;
+  esp_log_level_t	level;
+} log_tags[PORT_LOG_MAX_TAGS];
+static int log_ntags = 0;
+static int log_global = -1;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static esp_log_level_t log_global_level(void) {
+  if (log_global < 0) {
+    const char *e = getenv("ACME_LOG_LEVEL");
+    log_global = e ? atoi(e) : ESP_LOG_INFO;
+  }
+  return (esp_log_level_t)log_global;
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  pthread_mutex_lock(&log_mutex);
+  if (strcmp(tag, "*") == 0) {
+    log_global = level;
+    log_ntags = 0;
+  } else {
+    int i;
+    for (i=0; i<log_ntags; i++)
+      if (strcmp(log_tags[i].tag, tag) == 0)
+        break;
+    if (i < PORT_LOG_MAX_TAGS) {
+      if (i == log_ntags) {
+        log_tags[i].tag = strdup(tag);
+        log_ntags++;
+      }
+      log_tags[i].level = level;
+    }
+  }
+  pthread_mutex_unlock(&log_mutex);
+}
+
+/*
+ * The table can change under us (esp_log_level_set() from another thread), so look under the lock.
+ */
+int esp_log_level_enabled(esp_log_level_t level, const char *tag) {
+  int r = -1;
+
+  pthread_mutex_lock(&log_mutex);
+  for (int i=0; i<log_ntags; i++)
+    if (strcmp(log_tags[i].tag, tag) == 0) {
+      r = level <= log_tags[i].level;
+      break;
+    }
+  if (r < 0)
+    r = level <= log_global_level();
+  pthread_mutex_unlock(&log_mutex);
+  return r;
+}
+
+uint32_t esp_log_timestamp(void) {
+  static struct timespec t0;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (t0.tv_sec == 0 && t0.tv_nsec == 0)
+    t0 = now;
+  return (uint32_t)((now.tv_sec - t0.tv_sec) * 1000 + (now.tv_nsec - t0.tv_nsec) / 1000000);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+  va_list ap;
+
+  pthread_mutex_lock(&log_mutex);
+  va_start(ap, format);
+  vfprintf(stdout, format, ap);
+  va_end(ap);
+  fflush(stdout);
+  pthread_mutex_unlock(&log_mutex);
+}
+
+/*
+ * Error names
+ */
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:				return "ESP_OK";
+  case ESP_FAIL:			return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:			return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:		return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:		return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:		return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:		return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:		return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:			return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_HTTP_MAX_REDIRECT:	return "ESP_ERR_HTTP_MAX_REDIRECT";
+  case ESP_ERR_HTTP_CONNECT:		return "ESP_ERR_HTTP_CONNECT";
+  case ESP_ERR_HTTP_WRITE_DATA:		return "ESP_ERR_HTTP_WRITE_DATA";
+  case ESP_ERR_HTTP_FETCH_HEADER:	return "ESP_ERR_HTTP_FETCH_HEADER";
+  case ESP_ERR_HTTP_INVALID_TRANSPORT:	return "ESP_ERR_HTTP_INVALID_TRANSPORT";
+  case ESP_ERR_HTTP_CONNECTING:		return "ESP_ERR_HTTP_CONNECTING";
+  case ESP_ERR_HTTP_EAGAIN:		return "ESP_ERR_HTTP_EAGAIN";
+  default:				return "UNKNOWN ERROR";
+  }
+}
+
+/*
+ * System
+ */
+const char *esp_get_idf_version(void) {
+  return "linux-host";
+}
+
+/*
+ * The host HTTP client checks for this function pointer in its configuration
+ * and loads ESP_CRT_BUNDLE_HOST_PATH in that case, so nothing happens here.
+ */
+esp_err_t esp_crt_bundle_attach(void *conf) {
+  return ESP_OK;
+}
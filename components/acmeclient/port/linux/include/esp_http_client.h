@@ -0,0 +1,135 @@
+/*
+ * Host (Linux) port of the acmeclient component : HTTP(S) client.
+ *
+ * This implements the part of the ESP-IDF esp_http_client API that the acmeclient
+ * component uses, on top of POSIX sockets (through mbedtls_net) and mbedTLS.
+ * Behaviour follows esp-idf v4.3 as closely as needed : events are delivered to the
+ * event_handler in the same order, and a handle keeps its connection open between
+ * requests unless the server asks to close it.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_PORT_ESP_HTTP_CLIENT_H_
+#define	_PORT_ESP_HTTP_CLIENT_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_system.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp_http_client *esp_http_client_handle_t;
+
+typedef enum {
+  HTTP_EVENT_ERROR = 0,
+  HTTP_EVENT_ON_CONNECTED,
+  HTTP_EVENT_HEADERS_SENT,
+  HTTP_EVENT_HEADER_SENT = HTTP_EVENT_HEADERS_SENT,
+  HTTP_EVENT_ON_HEADER,
+  HTTP_EVENT_ON_DATA,
+  HTTP_EVENT_ON_FINISH,
+  HTTP_EVENT_DISCONNECTED,
+} esp_http_client_event_id_t;
+
+typedef struct esp_http_client_event {
+  esp_http_client_event_id_t	event_id;
+  esp_http_client_handle_t	client;
+  void				*data;
+  int				data_len;
+  void				*user_data;
+  char				*header_key;
+  char				*header_value;
+} esp_http_client_event_t;
+
+typedef esp_err_t (*http_event_handle_cb)(esp_http_client_event_t *evt);
+
+typedef enum {
+  HTTP_METHOD_GET = 0,
+  HTTP_METHOD_POST,
+  HTTP_METHOD_PUT,
+  HTTP_METHOD_PATCH,
+  HTTP_METHOD_DELETE,
+  HTTP_METHOD_HEAD,
+  HTTP_METHOD_MAX,
+} esp_http_client_method_t;
+
+typedef enum {
+  HTTP_TRANSPORT_UNKNOWN = 0,
+  HTTP_TRANSPORT_OVER_TCP,
+  HTTP_TRANSPORT_OVER_SSL,
+} esp_http_client_transport_t;
+
+/*
+ * Not in esp-idf : a cache of TLS sessions, so a new connection can resume an earlier session.
+ * get() copies the session for host:port (mbedtls_ssl_session_save() format) into buf and returns
+ * its length, or 0. put() is called after each full handshake.
+ */
+#define	ESP_HTTP_CLIENT_HAS_SESSION_CACHE	1
+
+typedef struct {
+  void		*ctx;
+  size_t	(*get)(void *ctx, const char *host, int port, unsigned char *buf, size_t len);
+  void		(*put)(void *ctx, const char *host, int port, const unsigned char *session, size_t len);
+} esp_http_client_session_cache_t;
+
+typedef struct {
+  const char			*url;
+  const char			*cert_pem;		// CA certificate(s), PEM
+  esp_http_client_method_t	method;
+  int				timeout_ms;		// Default 5000
+  http_event_handle_cb		event_handler;
+  int				buffer_size;		// Ignored, kept for source compatibility
+  int				buffer_size_tx;		// Ignored, kept for source compatibility
+  void				*user_data;
+  bool				skip_cert_common_name_check;
+  esp_err_t			(*crt_bundle_attach)(void *conf);
+  bool				keep_alive_enable;	// Ignored, connections are always kept if possible
+  const esp_http_client_session_cache_t	*session_cache;	// Host port only, see above
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config);
+esp_err_t esp_http_client_perform(esp_http_client_handle_t client);
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url);
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char *data, int len);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value);
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char *key);
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method);
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len);
+int esp_http_client_write(esp_http_client_handle_t client, const char *buffer, int len);
+int esp_http_client_fetch_headers(esp_http_client_handle_t client);
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client);
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len);
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+int esp_http_client_get_content_length(esp_http_client_handle_t client);
+esp_http_client_transport_t esp_http_client_get_transport_type(esp_http_client_handle_t client);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _PORT_ESP_HTTP_CLIENT_H_ */
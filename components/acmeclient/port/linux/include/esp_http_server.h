@@ -0,0 +1,151 @@
+/*
+ * Host (Linux) port of the acmeclient component : HTTP server.
+ *
+ * A local stand-in for the ESP-IDF esp_http_server, enough to serve ACME http-01
+ * challenges from the Acme class and to build small test servers.
+ * Each accepted connection is handled on its own thread, requests on a connection
+ * are served in sequence (keep-alive). URI handlers are matched exactly, or with
+ * the matcher supplied in httpd_config_t.uri_match_fn (e.g. httpd_uri_match_wildcard).
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_PORT_ESP_HTTP_SERVER_H_
+#define	_PORT_ESP_HTTP_SERVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	HTTPD_MAX_URI_LEN	512
+#define	HTTPD_RESP_USE_STRLEN	-1
+
+#define	HTTPD_200		"200 OK"
+#define	HTTPD_201		"201 Created"
+#define	HTTPD_204		"204 No Content"
+#define	HTTPD_400		"400 Bad Request"
+#define	HTTPD_404		"404 Not Found"
+#define	HTTPD_500		"500 Internal Server Error"
+
+#define	HTTPD_TYPE_JSON		"application/json"
+#define	HTTPD_TYPE_TEXT		"text/html"
+
+#define	ESP_ERR_HTTPD_BASE		0xb000
+#define	ESP_ERR_HTTPD_HANDLERS_FULL	(ESP_ERR_HTTPD_BASE + 1)
+#define	ESP_ERR_HTTPD_HANDLER_EXISTS	(ESP_ERR_HTTPD_BASE + 2)
+#define	ESP_ERR_HTTPD_INVALID_REQ	(ESP_ERR_HTTPD_BASE + 3)
+#define	ESP_ERR_HTTPD_TASK		(ESP_ERR_HTTPD_BASE + 8)
+
+// Same values as the http_parser enum that esp-idf uses
+typedef enum {
+  HTTP_DELETE = 0,
+  HTTP_GET = 1,
+  HTTP_HEAD = 2,
+  HTTP_POST = 3,
+  HTTP_PUT = 4,
+} httpd_method_t;
+
+typedef enum {
+  HTTPD_500_INTERNAL_SERVER_ERROR = 0,
+  HTTPD_501_METHOD_NOT_IMPLEMENTED,
+  HTTPD_505_VERSION_NOT_SUPPORTED,
+  HTTPD_400_BAD_REQUEST,
+  HTTPD_401_UNAUTHORIZED,
+  HTTPD_403_FORBIDDEN,
+  HTTPD_404_NOT_FOUND,
+  HTTPD_405_METHOD_NOT_ALLOWED,
+  HTTPD_408_REQ_TIMEOUT,
+  HTTPD_411_LENGTH_REQUIRED,
+  HTTPD_414_URI_TOO_LONG,
+  HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE,
+  HTTPD_ERR_CODE_MAX
+} httpd_err_code_t;
+
+typedef void *httpd_handle_t;
+
+typedef bool (*httpd_uri_match_func_t)(const char *reference_uri, const char *uri_to_match, size_t match_upto);
+
+typedef struct httpd_config {
+  uint16_t			server_port;
+  uint16_t			max_uri_handlers;
+  uint16_t			recv_wait_timeout;	// seconds
+  uint16_t			send_wait_timeout;	// seconds
+  bool				loopback_only;		// Host port only : bind to 127.0.0.1
+  httpd_uri_match_func_t	uri_match_fn;
+} httpd_config_t;
+
+#define	HTTPD_DEFAULT_CONFIG() {		\
+  .server_port = 80,				\
+  .max_uri_handlers = 8,			\
+  .recv_wait_timeout = 5,			\
+  .send_wait_timeout = 5,			\
+  .loopback_only = true,			\
+  .uri_match_fn = NULL,				\
+}
+
+typedef struct httpd_req {
+  httpd_handle_t	handle;
+  int			method;
+  const char		uri[HTTPD_MAX_URI_LEN + 1];
+  size_t		content_len;
+  void			*aux;			// Port private data
+  void			*user_ctx;
+} httpd_req_t;
+
+typedef struct httpd_uri {
+  const char		*uri;
+  httpd_method_t	method;
+  esp_err_t		(*handler)(httpd_req_t *r);
+  void			*user_ctx;
+} httpd_uri_t;
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config);
+esp_err_t httpd_stop(httpd_handle_t handle);
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler);
+esp_err_t httpd_unregister_uri_handler(httpd_handle_t handle, const char *uri, httpd_method_t method);
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto);
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size);
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len);
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status);
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type);
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value);
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len);
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len);
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str);
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *r, const char *str);
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _PORT_ESP_HTTP_SERVER_H_ */
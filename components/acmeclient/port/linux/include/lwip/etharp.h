@@ -0,0 +1,7 @@
+/*
+ * Host (Linux) port of the acmeclient component.
+ * Acme.cpp includes this lwIP header but uses nothing from it, the host stack is the kernel's.
+ */
+#ifndef	_PORT_LWIP_ETHARP_H_
+#define	_PORT_LWIP_ETHARP_H_
+#endif	/* _PORT_LWIP_ETHARP_H_ */
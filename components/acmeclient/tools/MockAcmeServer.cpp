@@ -0,0 +1,912 @@
+/*
+ * Mock ACME server, for offline testing and benchmarking of the Acme class on a Linux host.
+ * See MockAcmeServer.h for what is covered.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <ArduinoJson.h>
+
+#include <esp_log.h>
+#include <esp_http_client.h>
+
+#include "mbedtls/base64.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/md.h"
+#include "mbedtls/rsa.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/error.h"
+#include "mbedtls/x509_csr.h"
+#include "mbedtls/x509_crt.h"
+
+#include "MockAcmeServer.h"
+
+/*
+ * base64url without padding (RFC 7515 §2)
+ */
+static std::string b64url_encode(const unsigned char *data, size_t len) {
+  size_t olen = 0;
+  mbedtls_base64_encode(0, 0, &olen, data, len);
+  std::string r(olen, 0);
+  mbedtls_base64_encode((unsigned char *)&r[0], olen, &olen, data, len);
+  r.resize(olen);
+
+  for (size_t i=0; i<r.size(); i++)
+    if (r[i] == '+') r[i] = '-';
+    else if (r[i] == '/') r[i] = '_';
+  while (! r.empty() && r.back() == '=')
+    r.pop_back();
+  return r;
+}
+
+static std::string b64url_decode(const std::string &s) {
+  std::string in(s);
+  for (size_t i=0; i<in.size(); i++)
+    if (in[i] == '-') in[i] = '+';
+    else if (in[i] == '_') in[i] = '/';
+  while (in.size() % 4)
+    in += '=';
+
+  size_t olen = 0;
+  std::string r(in.size(), 0);
+  if (mbedtls_base64_decode((unsigned char *)&r[0], r.size(), &olen, (const unsigned char *)in.data(), in.size()) != 0)
+    return "";
+  r.resize(olen);
+  return r;
+}
+
+static std::string sha256_b64url(const std::string &s) {
+  unsigned char hash[32];
+  mbedtls_sha256_ret((const unsigned char *)s.data(), s.size(), hash, 0);
+  return b64url_encode(hash, sizeof(hash));
+}
+
+/*
+ * CTOR / DTOR
+ */
+MockAcmeServer::MockAcmeServer() {
+  server = 0;
+  port = 0;
+  serial = 1;
+  latency_ms = 0;
+  bad_nonce_every = 0;
+  retry_after = 1;
+  challenge_delay = 0;
+  finalize_delay = 0;
+  validation_port = 80;
+  next_id = 1;
+  ResetCounters();
+
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&ctr_drbg);
+  mbedtls_pk_init(&ca_key);
+  mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0);
+}
+
+MockAcmeServer::~MockAcmeServer() {
+  Stop();
+  for (MockAccount *a : account_list) {
+    mbedtls_pk_free(&a->pk);
+    delete a;
+  }
+  mbedtls_pk_free(&ca_key);
+  mbedtls_ctr_drbg_free(&ctr_drbg);
+  mbedtls_entropy_free(&entropy);
+}
+
+bool MockAcmeServer::Start(int p) {
+  if (ca_pem.empty() && ! CreateCA())
+    return false;
+
+  httpd_config_t cfg = HTTPD_DEFAULT_CONFIG();
+  cfg.server_port = p;
+  cfg.loopback_only = true;
+  cfg.uri_match_fn = httpd_uri_match_wildcard;
+  if (httpd_start(&server, &cfg) != ESP_OK) {
+    ESP_LOGE(mock_tag, "%s: could not start server on port %d", __FUNCTION__, p);
+    server = 0;
+    return false;
+  }
+
+  httpd_uri_t uri;
+  uri.uri = "/*";
+  uri.user_ctx = this;
+  uri.method = HTTP_GET;	uri.handler = GetHandler;	httpd_register_uri_handler(server, &uri);
+  uri.method = HTTP_HEAD;	uri.handler = HeadHandler;	httpd_register_uri_handler(server, &uri);
+  uri.method = HTTP_POST;	uri.handler = PostHandler;	httpd_register_uri_handler(server, &uri);
+
+  port = p;
+  base_url = "http://127.0.0.1:" + std::to_string(port);
+  directory_url = base_url + "/directory";
+  ESP_LOGI(mock_tag, "%s: directory at %s", __FUNCTION__, directory_url.c_str());
+  return true;
+}
+
+void MockAcmeServer::Stop() {
+  if (server)
+    httpd_stop(server);
+  server = 0;
+}
+
+const char *MockAcmeServer::DirectoryUrl() {
+  return directory_url.c_str();
+}
+
+const char *MockAcmeServer::CaCertificate() {
+  return ca_pem.c_str();
+}
+
+void MockAcmeServer::setLatency(int ms) { latency_ms = ms; }
+void MockAcmeServer::setBadNonceEvery(int n) { bad_nonce_every = n; }
+void MockAcmeServer::setRetryAfter(int s) { retry_after = s; }
+void MockAcmeServer::setChallengeDelay(int n) { challenge_delay = n; }
+void MockAcmeServer::setFinalizeDelay(int n) { finalize_delay = n; }
+void MockAcmeServer::setValidationPort(int p) { validation_port = p; }
+
+void MockAcmeServer::ResetCounters() {
+  std::lock_guard<std::mutex> g(lock);
+  memset(&stats, 0, sizeof(stats));
+  signed_requests = 0;
+}
+
+MockAcmeStats MockAcmeServer::getStats() {
+  std::lock_guard<std::mutex> g(lock);
+  return stats;
+}
+
+const char *MockAcmeServer::RequestTypeName(int t) {
+  static const char *names[MOCK_REQ_MAX] = {
+    "directory", "nonce", "account", "order", "authz", "challenge", "finalize", "poll", "cert", "other"
+  };
+  return (t >= 0 && t < MOCK_REQ_MAX) ? names[t] : "?";
+}
+
+void MockAcmeServer::PrintStats(FILE *f) {
+  MockAcmeStats s = getStats();
+
+  fprintf(f, "requests %d (", s.total);
+  for (int i=0; i<MOCK_REQ_MAX; i++)
+    fprintf(f, "%s%s %d", i ? " " : "", RequestTypeName(i), s.requests[i]);
+  fprintf(f, ") badnonce %d+%d retry-after %d validations %d certificates %d errors %d in %ld out %ld\n",
+    s.bad_nonce_injected, s.bad_nonce_rejected, s.retry_after_sent, s.validations, s.certificates,
+    s.errors, s.bytes_in, s.bytes_out);
+}
+
+/*
+ * Test CA : an EC P-256 key and a self-signed certificate, made at startup.
+ */
+bool MockAcmeServer::CreateCA() {
+  int			ret;
+  char			buf[80];
+  mbedtls_x509write_cert	crt;
+  mbedtls_mpi		sn;
+  unsigned char		pem[4096];
+
+  if ((ret = mbedtls_pk_setup(&ca_key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY))) != 0
+   || (ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(ca_key), mbedtls_ctr_drbg_random, &ctr_drbg)) != 0) {
+    mbedtls_strerror(ret, buf, sizeof(buf));
+    ESP_LOGE(mock_tag, "%s: key generation failed %s", __FUNCTION__, buf);
+    return false;
+  }
+
+  ca_name = "CN=Mock ACME test CA,O=esp32-acme-client";
+
+  time_t now = time(0);
+  char from[16], to[16];
+  time_t t = now - 3600;
+  strftime(from, sizeof(from), "%Y%m%d%H%M%S", gmtime(&t));
+  t = now + 10 * 365 * 86400;
+  strftime(to, sizeof(to), "%Y%m%d%H%M%S", gmtime(&t));
+
+  mbedtls_x509write_crt_init(&crt);
+  mbedtls_mpi_init(&sn);
+  mbedtls_mpi_lset(&sn, serial++);
+
+  mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+  mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
+  mbedtls_x509write_crt_set_subject_key(&crt, &ca_key);
+  mbedtls_x509write_crt_set_issuer_key(&crt, &ca_key);
+  mbedtls_x509write_crt_set_subject_name(&crt, ca_name.c_str());
+  mbedtls_x509write_crt_set_issuer_name(&crt, ca_name.c_str());
+  mbedtls_x509write_crt_set_serial(&crt, &sn);
+  mbedtls_x509write_crt_set_validity(&crt, from, to);
+  mbedtls_x509write_crt_set_basic_constraints(&crt, 1, 0);
+  mbedtls_x509write_crt_set_key_usage(&crt, MBEDTLS_X509_KU_KEY_CERT_SIGN | MBEDTLS_X509_KU_CRL_SIGN);
+  mbedtls_x509write_crt_set_subject_key_identifier(&crt);
+  mbedtls_x509write_crt_set_authority_key_identifier(&crt);
+
+  ret = mbedtls_x509write_crt_pem(&crt, pem, sizeof(pem), mbedtls_ctr_drbg_random, &ctr_drbg);
+  mbedtls_x509write_crt_free(&crt);
+  mbedtls_mpi_free(&sn);
+  if (ret != 0) {
+    mbedtls_strerror(ret, buf, sizeof(buf));
+    ESP_LOGE(mock_tag, "%s: CA certificate failed %s", __FUNCTION__, buf);
+    return false;
+  }
+  ca_pem = (char *)pem;
+  return true;
+}
+
+std::string MockAcmeServer::NewNonce() {
+  unsigned char r[16];
+  mbedtls_ctr_drbg_random(&ctr_drbg, r, sizeof(r));
+  std::string n = b64url_encode(r, sizeof(r));
+  nonces.insert(n);
+  return n;
+}
+
+std::string MockAcmeServer::Timestamp(time_t t) {
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+  return buf;
+}
+
+std::string MockAcmeServer::Url(const char *kind, int id) {
+  return base_url + "/" + kind + "/" + std::to_string(id);
+}
+
+/*
+ * Replies. Each of them carries a fresh nonce, like the real thing.
+ */
+esp_err_t MockAcmeServer::Reply(httpd_req_t *req, const char *status, const char *type, const std::string &body,
+    const std::string &location, bool retry) {
+  std::string n = NewNonce();
+  std::string ra = std::to_string(retry_after);
+
+  httpd_resp_set_status(req, status);
+  httpd_resp_set_type(req, type);
+  httpd_resp_set_hdr(req, "Replay-Nonce", n.c_str());
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  if (! location.empty())
+    httpd_resp_set_hdr(req, "Location", location.c_str());
+  if (retry) {
+    httpd_resp_set_hdr(req, "Retry-After", ra.c_str());
+    stats.retry_after_sent++;
+  }
+  stats.bytes_out += body.size();
+  return httpd_resp_send(req, body.data(), body.size());
+}
+
+esp_err_t MockAcmeServer::Problem(httpd_req_t *req, int code, const char *type, const char *detail) {
+  const char *status;
+  switch (code) {
+  case 401:	status = "401 Unauthorized"; break;
+  case 403:	status = "403 Forbidden"; break;
+  case 404:	status = "404 Not Found"; break;
+  case 400:
+  default:	status = "400 Bad Request"; break;
+  }
+  if (strcmp(type, "badNonce") != 0)
+    stats.errors++;
+  ESP_LOGD(mock_tag, "%s: %d %s %s", __FUNCTION__, code, type, detail);
+
+  std::string body = std::string("{\"type\": \"urn:ietf:params:acme:error:") + type
+    + "\", \"detail\": \"" + detail + "\", \"status\": " + std::to_string(code) + "}";
+  return Reply(req, status, "application/problem+json", body);
+}
+
+/*
+ * Unsigned requests : directory and nonces
+ */
+esp_err_t MockAcmeServer::GetHandler(httpd_req_t *req) {
+  MockAcmeServer *m = (MockAcmeServer *)req->user_ctx;
+
+  if (m->latency_ms)
+    usleep(m->latency_ms * 1000);
+
+  std::lock_guard<std::mutex> g(m->lock);
+  m->stats.total++;
+
+  if (strcmp(req->uri, "/directory") == 0) {
+    m->stats.requests[MOCK_REQ_DIRECTORY]++;
+    std::string body = "{\n"
+      "  \"newNonce\": \"" + m->base_url + "/new-nonce\",\n"
+      "  \"newAccount\": \"" + m->base_url + "/new-account\",\n"
+      "  \"newOrder\": \"" + m->base_url + "/new-order\",\n"
+      "  \"revokeCert\": \"" + m->base_url + "/revoke-cert\",\n"
+      "  \"keyChange\": \"" + m->base_url + "/key-change\",\n"
+      "  \"meta\": {\n"
+      "    \"termsOfService\": \"" + m->base_url + "/terms\"\n"
+      "  }\n}";
+    m->stats.bytes_out += body.size();
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, body.data(), body.size());
+  }
+  if (strcmp(req->uri, "/new-nonce") == 0) {
+    m->stats.requests[MOCK_REQ_NONCE]++;
+    return m->Reply(req, "204 No Content", "text/plain", "");
+  }
+
+  m->stats.requests[MOCK_REQ_OTHER]++;
+  return m->Problem(req, 404, "malformed", "No such resource");
+}
+
+esp_err_t MockAcmeServer::HeadHandler(httpd_req_t *req) {
+  MockAcmeServer *m = (MockAcmeServer *)req->user_ctx;
+
+  if (m->latency_ms)
+    usleep(m->latency_ms * 1000);
+
+  std::lock_guard<std::mutex> g(m->lock);
+  m->stats.total++;
+  if (strcmp(req->uri, "/new-nonce") == 0) {
+    m->stats.requests[MOCK_REQ_NONCE]++;
+    return m->Reply(req, "200 OK", "text/plain", "");
+  }
+  m->stats.requests[MOCK_REQ_OTHER]++;
+  return m->Problem(req, 404, "malformed", "No such resource");
+}
+
+/*
+ * Signed requests
+ */
+esp_err_t MockAcmeServer::PostHandler(httpd_req_t *req) {
+  MockAcmeServer *m = (MockAcmeServer *)req->user_ctx;
+  std::string body;
+  char buf[1024];
+
+  while (body.size() < req->content_len) {
+    int n = httpd_req_recv(req, buf, sizeof(buf));
+    if (n <= 0)
+      return ESP_FAIL;
+    body.append(buf, n);
+  }
+
+  if (m->latency_ms)
+    usleep(m->latency_ms * 1000);
+
+  std::lock_guard<std::mutex> g(m->lock);
+  m->stats.total++;
+  m->stats.bytes_in += body.size();
+  return m->HandlePost(req, req->uri, body);
+}
+
+mbedtls_pk_context *MockAcmeServer::KeyFromJwk(const std::string &jwk, std::string &thumbprint) {
+  DynamicJsonDocument doc(jwk.size() * 2 + 256);
+  if (deserializeJson(doc, jwk))
+    return 0;
+
+  const char *kty = doc["kty"];
+  if (kty == 0)
+    return 0;
+
+  mbedtls_pk_context *pk = (mbedtls_pk_context *)calloc(1, sizeof(mbedtls_pk_context));
+  mbedtls_pk_init(pk);
+
+  if (strcmp(kty, "RSA") == 0) {
+    const char *n64 = doc["n"], *e64 = doc["e"];
+    if (n64 == 0 || e64 == 0)
+      goto fail;
+    std::string n = b64url_decode(n64), e = b64url_decode(e64);
+
+    if (mbedtls_pk_setup(pk, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA)) != 0
+     || mbedtls_rsa_import_raw(mbedtls_pk_rsa(*pk), (const unsigned char *)n.data(), n.size(),
+          0, 0, 0, 0, 0, 0, (const unsigned char *)e.data(), e.size()) != 0
+     || mbedtls_rsa_complete(mbedtls_pk_rsa(*pk)) != 0)
+      goto fail;
+
+    // RFC 7638 : required members only, in lexicographic order, no white space
+    thumbprint = sha256_b64url(std::string("{\"e\":\"") + e64 + "\",\"kty\":\"RSA\",\"n\":\"" + n64 + "\"}");
+    return pk;
+  }
+
+  if (strcmp(kty, "EC") == 0) {
+    const char *crv = doc["crv"], *x64 = doc["x"], *y64 = doc["y"];
+    if (crv == 0 || x64 == 0 || y64 == 0 || strcmp(crv, "P-256") != 0)
+      goto fail;
+    // Uncompressed point : 0x04 || X || Y
+    std::string pt = "\x04" + b64url_decode(x64) + b64url_decode(y64);
+    if (pt.size() != 65 || mbedtls_pk_setup(pk, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY)) != 0)
+      goto fail;
+
+    mbedtls_ecp_keypair *ec = mbedtls_pk_ec(*pk);
+    if (mbedtls_ecp_group_load(&ec->grp, MBEDTLS_ECP_DP_SECP256R1) != 0
+     || mbedtls_ecp_point_read_binary(&ec->grp, &ec->Q, (const unsigned char *)pt.data(), pt.size()) != 0
+     || mbedtls_ecp_check_pubkey(&ec->grp, &ec->Q) != 0)
+      goto fail;
+
+    thumbprint = sha256_b64url(std::string("{\"crv\":\"P-256\",\"kty\":\"EC\",\"x\":\"") + x64 + "\",\"y\":\"" + y64 + "\"}");
+    return pk;
+  }
+
+fail:
+  mbedtls_pk_free(pk);
+  free(pk);
+  return 0;
+}
+
+bool MockAcmeServer::VerifySignature(mbedtls_pk_context *pk, const std::string &alg, const std::string &input,
+    const std::string &sig) {
+  unsigned char hash[32];
+
+  mbedtls_sha256_ret((const unsigned char *)input.data(), input.size(), hash, 0);
+  if (alg == "RS256" && mbedtls_pk_can_do(pk, MBEDTLS_PK_RSA))
+    return mbedtls_pk_verify(pk, MBEDTLS_MD_SHA256, hash, sizeof(hash),
+      (const unsigned char *)sig.data(), sig.size()) == 0;
+
+  if (alg == "ES256" && mbedtls_pk_can_do(pk, MBEDTLS_PK_ECDSA)) {
+    // JWS carries R || S, 32 bytes each (RFC 7518 §3.4)
+    if (sig.size() != 64)
+      return false;
+
+    mbedtls_ecp_keypair *ec = mbedtls_pk_ec(*pk);
+    mbedtls_mpi r, s;
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    bool ok = mbedtls_mpi_read_binary(&r, (const unsigned char *)sig.data(), 32) == 0
+      && mbedtls_mpi_read_binary(&s, (const unsigned char *)sig.data() + 32, 32) == 0
+      && mbedtls_ecdsa_verify(&ec->grp, hash, sizeof(hash), &ec->Q, &r, &s) == 0;
+    mbedtls_mpi_free(&r);
+    mbedtls_mpi_free(&s);
+    return ok;
+  }
+  return false;
+}
+
+/*
+ * Check a JWS (flattened JSON serialization) as RFC 8555 §6.2 says.
+ */
+bool MockAcmeServer::ParseJws(const std::string &body, const std::string &path, MockJws &jws,
+    const char **err_type, std::string &err_detail) {
+  jws.account = 0;
+  jws.jwk_pk = 0;
+  *err_type = "malformed";
+
+  DynamicJsonDocument doc(body.size() * 2 + 1024);
+  if (deserializeJson(doc, body)) {
+    err_detail = "Request is not JSON";
+    return false;
+  }
+  const char *p64 = doc["protected"], *pl64 = doc["payload"], *s64 = doc["signature"];
+  if (p64 == 0 || pl64 == 0 || s64 == 0) {
+    err_detail = "Not a flattened JWS";
+    return false;
+  }
+
+  std::string prot = b64url_decode(p64);
+  DynamicJsonDocument ph(prot.size() * 2 + 512);
+  if (deserializeJson(ph, prot)) {
+    err_detail = "Protected header is not JSON";
+    return false;
+  }
+  const char *alg = ph["alg"], *nonce = ph["nonce"], *url = ph["url"], *kid = ph["kid"];
+  if (alg == 0 || nonce == 0 || url == 0) {
+    err_detail = "Protected header lacks alg, nonce or url";
+    return false;
+  }
+  if (base_url + path != url) {
+    *err_type = "unauthorized";
+    err_detail = "url in protected header does not match the request";
+    return false;
+  }
+
+  // Nonces are single use
+  if (nonces.erase(nonce) == 0) {
+    stats.bad_nonce_rejected++;
+    *err_type = "badNonce";
+    err_detail = "Unknown or reused nonce";
+    return false;
+  }
+  signed_requests++;
+  if (bad_nonce_every > 0 && (signed_requests % bad_nonce_every) == 0) {
+    stats.bad_nonce_injected++;
+    *err_type = "badNonce";
+    err_detail = "JWS has an invalid anti-replay nonce (injected)";
+    return false;
+  }
+
+  mbedtls_pk_context *pk = 0;
+  if (kid) {
+    for (MockAccount *a : account_list)
+      if (Url("acct", a->id) == kid)
+        jws.account = a;
+    if (jws.account == 0) {
+      *err_type = "accountDoesNotExist";
+      err_detail = "No such account";
+      return false;
+    }
+    pk = &jws.account->pk;
+  } else if (! ph["jwk"].isNull()) {
+    if (path != "/new-account") {
+      err_detail = "jwk is only allowed on newAccount";
+      return false;
+    }
+    serializeJson(ph["jwk"], jws.jwk);
+    jws.jwk_pk = KeyFromJwk(jws.jwk, jws.thumbprint);
+    if (jws.jwk_pk == 0) {
+      *err_type = "badPublicKey";
+      err_detail = "Could not use jwk";
+      return false;
+    }
+    auto it = accounts.find(jws.thumbprint);
+    if (it != accounts.end())
+      jws.account = it->second;
+    pk = jws.jwk_pk;
+  } else {
+    err_detail = "Protected header has neither jwk nor kid";
+    return false;
+  }
+
+  if (! VerifySignature(pk, alg, std::string(p64) + "." + pl64, b64url_decode(s64))) {
+    *err_type = "badSignatureAlgorithm";
+    err_detail = "JWS signature verification failed";
+    if (jws.jwk_pk) {
+      mbedtls_pk_free(jws.jwk_pk);
+      free(jws.jwk_pk);
+      jws.jwk_pk = 0;
+    }
+    return false;
+  }
+
+  jws.url = url;
+  jws.payload = b64url_decode(pl64);
+  return true;
+}
+
+/*
+ * Fetch the key authorization from the client's web server (RFC 8555 §8.3)
+ */
+static esp_err_t ValidationEvent(esp_http_client_event_t *event) {
+  if (event->event_id == HTTP_EVENT_ON_DATA)
+    ((std::string *)event->user_data)->append((const char *)event->data, event->data_len);
+  return ESP_OK;
+}
+
+bool MockAcmeServer::Validate(MockChallenge &ch) {
+  MockAuthz &az = authzs[ch.authz];
+  MockOrder &o = orders[az.order];
+  MockAccount *a = account_list[o.account - 1];
+
+  std::string url = "http://127.0.0.1:" + std::to_string(validation_port) + "/.well-known/acme-challenge/" + ch.token;
+  std::string reply;
+
+  esp_http_client_config_t httpc;
+  memset(&httpc, 0, sizeof(httpc));
+  httpc.url = url.c_str();
+  httpc.event_handler = ValidationEvent;
+  httpc.user_data = &reply;
+
+  esp_http_client_handle_t client = esp_http_client_init(&httpc);
+  esp_err_t err = esp_http_client_perform(client);
+  int status = esp_http_client_get_status_code(client);
+  esp_http_client_cleanup(client);
+
+  while (! reply.empty() && (reply.back() == '\n' || reply.back() == '\r' || reply.back() == ' '))
+    reply.pop_back();
+
+  bool ok = (err == ESP_OK && status == 200 && reply == ch.token + "." + a->thumbprint);
+  ESP_LOGI(mock_tag, "%s: %s (%s) -> %s", __FUNCTION__, az.identifier.c_str(), url.c_str(), ok ? "valid" : "invalid");
+  return ok;
+}
+
+void MockAcmeServer::UpdateAuthz(MockAuthz &az) {
+  MockChallenge &ch = challenges[az.challenge];
+  if (ch.status == "valid")
+    az.status = "valid";
+  else if (ch.status == "invalid")
+    az.status = "invalid";
+}
+
+void MockAcmeServer::UpdateOrder(MockOrder &o) {
+  if (o.status != "pending")
+    return;
+
+  bool all_valid = true;
+  for (int id : o.authz) {
+    if (authzs[id].status == "invalid") {
+      o.status = "invalid";
+      return;
+    }
+    if (authzs[id].status != "valid")
+      all_valid = false;
+  }
+  if (all_valid)
+    o.status = "ready";
+}
+
+bool MockAcmeServer::IssueCertificate(MockOrder &o, const std::string &csr_b64, std::string &err) {
+  std::string der = b64url_decode(csr_b64);
+  mbedtls_x509_csr csr;
+  unsigned char hash[MBEDTLS_MD_MAX_SIZE];
+  char subject[256];
+  bool ok = false;
+
+  mbedtls_x509_csr_init(&csr);
+  if (mbedtls_x509_csr_parse_der(&csr, (const unsigned char *)der.data(), der.size()) != 0) {
+    err = "Could not parse CSR";
+    mbedtls_x509_csr_free(&csr);
+    return false;
+  }
+
+  const mbedtls_md_info_t *mdi = mbedtls_md_info_from_type(csr.sig_md);
+  if (mdi == 0 || mbedtls_md(mdi, csr.cri.p, csr.cri.len, hash) != 0
+   || mbedtls_pk_verify_ext(csr.sig_pk, csr.sig_opts, &csr.pk, csr.sig_md, hash, mbedtls_md_get_size(mdi),
+        csr.sig.p, csr.sig.len) != 0) {
+    err = "CSR signature does not verify";
+    mbedtls_x509_csr_free(&csr);
+    return false;
+  }
+
+  mbedtls_x509_dn_gets(subject, sizeof(subject), &csr.subject);
+  const char *cn = strstr(subject, "CN=");
+  bool known = false;
+  for (const std::string &id : o.identifiers)
+    if (cn && id == cn + 3)
+      known = true;
+  if (! known) {
+    err = "CSR common name is not in the order";
+    mbedtls_x509_csr_free(&csr);
+    return false;
+  }
+
+  mbedtls_x509write_cert crt;
+  mbedtls_mpi sn;
+  unsigned char pem[4096];
+  char from[16], to[16];
+  time_t now = time(0), t;
+
+  t = now - 60;
+  strftime(from, sizeof(from), "%Y%m%d%H%M%S", gmtime(&t));
+  t = now + 90 * 86400;
+  strftime(to, sizeof(to), "%Y%m%d%H%M%S", gmtime(&t));
+
+  mbedtls_x509write_crt_init(&crt);
+  mbedtls_mpi_init(&sn);
+  mbedtls_mpi_lset(&sn, serial++);
+  mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+  mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
+  mbedtls_x509write_crt_set_subject_key(&crt, &csr.pk);
+  mbedtls_x509write_crt_set_issuer_key(&crt, &ca_key);
+  mbedtls_x509write_crt_set_subject_name(&crt, subject);
+  mbedtls_x509write_crt_set_issuer_name(&crt, ca_name.c_str());
+  mbedtls_x509write_crt_set_serial(&crt, &sn);
+  mbedtls_x509write_crt_set_validity(&crt, from, to);
+  mbedtls_x509write_crt_set_basic_constraints(&crt, 0, -1);
+
+  if (mbedtls_x509write_crt_pem(&crt, pem, sizeof(pem), mbedtls_ctr_drbg_random, &ctr_drbg) == 0) {
+    o.certificate = std::string((char *)pem) + ca_pem;
+    stats.certificates++;
+    ok = true;
+  } else
+    err = "Could not sign certificate";
+
+  mbedtls_x509write_crt_free(&crt);
+  mbedtls_mpi_free(&sn);
+  mbedtls_x509_csr_free(&csr);
+  return ok;
+}
+
+/*
+ * JSON representation of our objects
+ */
+std::string MockAcmeServer::AccountJson(MockAccount *a) {
+  return "{\n  \"key\": " + a->jwk + ",\n  \"contact\": " + a->contact
+    + ",\n  \"initialIp\": \"127.0.0.1\",\n  \"createdAt\": \"" + Timestamp(time(0))
+    + "\",\n  \"status\": \"valid\"\n}";
+}
+
+std::string MockAcmeServer::OrderJson(MockOrder &o) {
+  std::string r = "{\n  \"status\": \"" + o.status + "\",\n  \"expires\": \"" + Timestamp(time(0) + 7 * 86400)
+    + "\",\n  \"identifiers\": [";
+  for (size_t i=0; i<o.identifiers.size(); i++)
+    r += std::string(i ? ", " : "") + "{\"type\": \"dns\", \"value\": \"" + o.identifiers[i] + "\"}";
+  r += "],\n  \"authorizations\": [";
+  for (size_t i=0; i<o.authz.size(); i++)
+    r += std::string(i ? ", " : "") + "\"" + Url("authz", o.authz[i]) + "\"";
+  r += "],\n  \"finalize\": \"" + Url("finalize", o.id) + "\"";
+  if (o.status == "valid")
+    r += ",\n  \"certificate\": \"" + Url("cert", o.id) + "\"";
+  return r + "\n}";
+}
+
+std::string MockAcmeServer::ChallengeJson(MockChallenge &ch) {
+  return "{\"type\": \"http-01\", \"status\": \"" + ch.status + "\", \"url\": \"" + Url("chall", ch.id)
+    + "\", \"token\": \"" + ch.token + "\"}";
+}
+
+std::string MockAcmeServer::AuthzJson(MockAuthz &az) {
+  MockChallenge &ch = challenges[az.challenge];
+
+  // Also offer a dns-01 challenge, like real servers do, to check that the client picks the right one
+  return "{\n  \"identifier\": {\"type\": \"dns\", \"value\": \"" + az.identifier + "\"},\n  \"status\": \""
+    + az.status + "\",\n  \"expires\": \"" + Timestamp(time(0) + 7 * 86400) + "\",\n  \"challenges\": [\n    "
+    + ChallengeJson(ch) + ",\n    {\"type\": \"dns-01\", \"status\": \"pending\", \"url\": \""
+    + Url("chall-dns", ch.id) + "\", \"token\": \"" + ch.token + "\"}\n  ]\n}";
+}
+
+esp_err_t MockAcmeServer::HandlePost(httpd_req_t *req, const std::string &path, const std::string &body) {
+  MockJws	jws;
+  const char	*err_type;
+  std::string	err_detail;
+  int		id = 0;
+  char		kind[32] = "";
+
+  if (path == "/new-account")
+    stats.requests[MOCK_REQ_ACCOUNT]++;
+  else if (path == "/new-order")
+    stats.requests[MOCK_REQ_ORDER]++;
+  else if (sscanf(path.c_str(), "/%31[a-z]/%d", kind, &id) == 2) {
+    if (strcmp(kind, "authz") == 0)		stats.requests[MOCK_REQ_AUTHZ]++;
+    else if (strcmp(kind, "chall") == 0)	stats.requests[MOCK_REQ_CHALLENGE]++;
+    else if (strcmp(kind, "finalize") == 0)	stats.requests[MOCK_REQ_FINALIZE]++;
+    else if (strcmp(kind, "order") == 0)	stats.requests[MOCK_REQ_ORDER_POLL]++;
+    else if (strcmp(kind, "cert") == 0)		stats.requests[MOCK_REQ_CERTIFICATE]++;
+    else					stats.requests[MOCK_REQ_OTHER]++;
+  } else
+    stats.requests[MOCK_REQ_OTHER]++;
+
+  if (! ParseJws(body, path, jws, &err_type, err_detail))
+    return Problem(req, strcmp(err_type, "unauthorized") == 0 ? 401 : 400, err_type, err_detail.c_str());
+
+  /*
+   * newAccount
+   */
+  if (path == "/new-account") {
+    DynamicJsonDocument pl(jws.payload.size() * 2 + 256);
+    deserializeJson(pl, jws.payload);
+    bool only_existing = pl["onlyReturnExisting"] | false;
+
+    MockAccount *a = jws.account;
+    bool created = false;
+    if (a == 0 && only_existing) {
+      mbedtls_pk_free(jws.jwk_pk);
+      free(jws.jwk_pk);
+      return Problem(req, 400, "accountDoesNotExist", "No account exists with the provided key");
+    }
+    if (a == 0) {
+      a = new MockAccount();
+      a->id = account_list.size() + 1;
+      a->thumbprint = jws.thumbprint;
+      a->jwk = jws.jwk;
+      a->pk = *jws.jwk_pk;		// Take over the key
+      free(jws.jwk_pk);
+      jws.jwk_pk = 0;
+      if (pl["contact"].isNull())
+        a->contact = "[]";
+      else
+        serializeJson(pl["contact"], a->contact);
+      account_list.push_back(a);
+      accounts[a->thumbprint] = a;
+      created = true;
+    }
+    if (jws.jwk_pk) {
+      mbedtls_pk_free(jws.jwk_pk);
+      free(jws.jwk_pk);
+    }
+    return Reply(req, created ? "201 Created" : "200 OK", "application/json", AccountJson(a), Url("acct", a->id));
+  }
+
+  /*
+   * newOrder
+   */
+  if (path == "/new-order") {
+    DynamicJsonDocument pl(jws.payload.size() * 2 + 256);
+    if (deserializeJson(pl, jws.payload) || pl["identifiers"].size() == 0)
+      return Problem(req, 400, "malformed", "No identifiers in order");
+
+    MockOrder o;
+    o.id = next_id++;
+    o.account = jws.account->id;
+    o.status = "pending";
+    o.processing_left = 0;
+    for (size_t i=0; i<pl["identifiers"].size(); i++) {
+      const char *v = pl["identifiers"][i]["value"];
+      if (v == 0)
+        return Problem(req, 400, "malformed", "Identifier without value");
+
+      MockChallenge ch;
+      ch.id = next_id++;
+      ch.status = "pending";
+      ch.processing_left = 0;
+      unsigned char r[32];
+      mbedtls_ctr_drbg_random(&ctr_drbg, r, sizeof(r));
+      ch.token = b64url_encode(r, sizeof(r));
+
+      MockAuthz az;
+      az.id = next_id++;
+      az.order = o.id;
+      az.identifier = v;
+      az.status = "pending";
+      az.challenge = ch.id;
+      ch.authz = az.id;
+
+      o.identifiers.push_back(v);
+      o.authz.push_back(az.id);
+      challenges[ch.id] = ch;
+      authzs[az.id] = az;
+    }
+    orders[o.id] = o;
+    return Reply(req, "201 Created", "application/json", OrderJson(orders[o.id]), Url("order", o.id));
+  }
+
+  /*
+   * Objects that belong to an account
+   */
+  if (strcmp(kind, "authz") == 0 || strcmp(kind, "chall") == 0) {
+    MockChallenge *ch = 0;
+    if (strcmp(kind, "authz") == 0 && authzs.count(id))
+      ch = &challenges[authzs[id].challenge];
+    else if (strcmp(kind, "chall") == 0 && challenges.count(id))
+      ch = &challenges[id];
+    if (ch == 0 || orders[authzs[ch->authz].order].account != jws.account->id)
+      return Problem(req, 404, "malformed", "No such authorization or challenge");
+
+    MockAuthz &az = authzs[ch->authz];
+    if (strcmp(kind, "chall") == 0 && ch->status == "pending") {
+      // Client says it's ready : validate now
+      stats.validations++;
+      if (Validate(*ch)) {
+        ch->status = challenge_delay ? "processing" : "valid";
+        ch->processing_left = challenge_delay;
+      } else
+        ch->status = "invalid";
+    } else if (ch->status == "processing") {
+      // Each poll brings the result closer
+      if (--ch->processing_left <= 0)
+        ch->status = "valid";
+    }
+    UpdateAuthz(az);
+    UpdateOrder(orders[az.order]);
+
+    bool retry = (ch->status == "processing");
+    if (strcmp(kind, "chall") == 0)
+      return Reply(req, "200 OK", "application/json", ChallengeJson(*ch), "", retry);
+    return Reply(req, "200 OK", "application/json", AuthzJson(az), "", retry);
+  }
+
+  if (strcmp(kind, "finalize") == 0 || strcmp(kind, "order") == 0 || strcmp(kind, "cert") == 0) {
+    if (orders.count(id) == 0 || orders[id].account != jws.account->id)
+      return Problem(req, 404, "malformed", "No such order");
+    MockOrder &o = orders[id];
+
+    if (strcmp(kind, "finalize") == 0) {
+      if (o.status != "ready")
+        return Problem(req, 403, "orderNotReady", ("Order is " + o.status + ", not ready").c_str());
+
+      DynamicJsonDocument pl(jws.payload.size() * 2 + 256);
+      const char *csr = 0;
+      if (deserializeJson(pl, jws.payload) == DeserializationError::Ok)
+        csr = pl["csr"];
+      std::string err;
+      if (csr == 0 || ! IssueCertificate(o, csr, err))
+        return Problem(req, 400, "badCSR", csr ? err.c_str() : "No csr");
+
+      o.status = finalize_delay ? "processing" : "valid";
+      o.processing_left = finalize_delay;
+    } else if (strcmp(kind, "order") == 0) {
+      if (o.status == "processing" && --o.processing_left <= 0)
+        o.status = "valid";
+    } else {
+      if (o.status != "valid")
+        return Problem(req, 403, "orderNotReady", "Certificate not issued yet");
+      return Reply(req, "200 OK", "application/pem-certificate-chain", o.certificate);
+    }
+    return Reply(req, "200 OK", "application/json", OrderJson(o), Url("order", o.id), o.status == "processing");
+  }
+
+  return Problem(req, 404, "malformed", "No such resource");
+}
@@ -0,0 +1,202 @@
+/*
+ * Mock ACME server, for offline testing and benchmarking of the Acme class on a Linux host.
+ *
+ * This implements the subset of RFC 8555 that the library uses : directory, newNonce,
+ * newAccount, newOrder, authorizations, http-01 challenges, finalize and certificate download.
+ * Certificates are signed by a test CA that is generated at startup.
+ *
+ * The server listens on the loopback interface only, over plain http. Requests are checked
+ * (JWS signature, nonce, url) like a real server would, and it can be told to misbehave :
+ *  - add latency to each reply
+ *  - reject a nonce every so often (badNonce)
+ *  - keep challenges and orders in "processing" state for a number of polls, with a Retry-After header
+ * Counters keep track of the number of requests per type.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_MOCK_ACME_SERVER_H_
+#define	_MOCK_ACME_SERVER_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+
+#include <esp_http_server.h>
+
+#include "mbedtls/pk.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+
+enum MockRequestType {
+  MOCK_REQ_DIRECTORY = 0,
+  MOCK_REQ_NONCE,
+  MOCK_REQ_ACCOUNT,
+  MOCK_REQ_ORDER,
+  MOCK_REQ_AUTHZ,
+  MOCK_REQ_CHALLENGE,
+  MOCK_REQ_FINALIZE,
+  MOCK_REQ_ORDER_POLL,
+  MOCK_REQ_CERTIFICATE,
+  MOCK_REQ_OTHER,
+  MOCK_REQ_MAX
+};
+
+struct MockAcmeStats {
+  int		requests[MOCK_REQ_MAX];
+  int		total;
+  int		bad_nonce_injected;	// Valid nonce, rejected on purpose
+  int		bad_nonce_rejected;	// Client sent a nonce that we didn't issue, or reused one
+  int		retry_after_sent;
+  int		validations;
+  int		certificates;
+  int		errors;			// All other error replies
+  long		bytes_in, bytes_out;
+};
+
+class MockAcmeServer {
+  public:
+    MockAcmeServer();
+    ~MockAcmeServer();
+
+    bool Start(int port);
+    void Stop();
+
+    const char *DirectoryUrl();
+    const char *CaCertificate();		// PEM, can be passed to Acme::setRootCertificate()
+
+    void setLatency(int ms);
+    void setBadNonceEvery(int n);		// Reject every n-th signed request with badNonce, 0 = never
+    void setRetryAfter(int seconds);		// Value of the Retry-After header
+    void setChallengeDelay(int polls);		// Challenge stays "processing" for this many polls
+    void setFinalizeDelay(int polls);		// Order stays "processing" for this many polls after finalize
+    void setValidationPort(int port);		// Where to fetch http-01 validation files, on 127.0.0.1
+
+    void ResetCounters();
+    MockAcmeStats getStats();
+    void PrintStats(FILE *);
+    static const char *RequestTypeName(int);
+
+  private:
+    constexpr const static char *mock_tag = "MockAcme";
+
+    struct MockAccount {
+      int			id;
+      std::string		thumbprint;
+      std::string		jwk;		// As received, for the account object
+      std::string		contact;
+      mbedtls_pk_context	pk;
+    };
+    struct MockChallenge {
+      int			id, authz;
+      std::string		token;
+      std::string		status;
+      int			processing_left;
+    };
+    struct MockAuthz {
+      int			id, order;
+      std::string		identifier;
+      std::string		status;
+      int			challenge;
+    };
+    struct MockOrder {
+      int			id, account;
+      std::string		status;
+      std::vector<std::string>	identifiers;
+      std::vector<int>		authz;
+      std::string		certificate;	// PEM chain
+      int			processing_left;
+    };
+    struct MockJws {
+      std::string		url;
+      std::string		payload;
+      MockAccount		*account;	// Existing account (kid, or jwk of a known key)
+      std::string		jwk;		// Only for newAccount
+      std::string		thumbprint;
+      mbedtls_pk_context	*jwk_pk;	// Key from the jwk, caller must free
+    };
+
+    httpd_handle_t		server;
+    int				port;
+    std::string			base_url;
+    std::string			directory_url;
+    std::mutex			lock;
+
+    mbedtls_entropy_context	entropy;
+    mbedtls_ctr_drbg_context	ctr_drbg;
+    mbedtls_pk_context		ca_key;
+    std::string			ca_pem;
+    std::string			ca_name;
+    int				serial;
+
+    int				latency_ms;
+    int				bad_nonce_every;
+    int				retry_after;
+    int				challenge_delay;
+    int				finalize_delay;
+    int				validation_port;
+
+    MockAcmeStats		stats;
+    int				signed_requests;
+
+    std::set<std::string>	nonces;
+    std::map<std::string, MockAccount *> accounts;	// By thumbprint
+    std::vector<MockAccount *>	account_list;
+    std::map<int, MockOrder>	orders;
+    std::map<int, MockAuthz>	authzs;
+    std::map<int, MockChallenge>	challenges;
+    int				next_id;
+
+    bool CreateCA();
+    std::string NewNonce();
+    std::string Timestamp(time_t);
+    std::string Url(const char *kind, int id);
+
+    static esp_err_t GetHandler(httpd_req_t *);
+    static esp_err_t HeadHandler(httpd_req_t *);
+    static esp_err_t PostHandler(httpd_req_t *);
+    esp_err_t HandlePost(httpd_req_t *, const std::string &path, const std::string &body);
+
+    esp_err_t Reply(httpd_req_t *, const char *status, const char *type, const std::string &body,
+      const std::string &location = "", bool retry = false);
+    esp_err_t Problem(httpd_req_t *, int code, const char *type, const char *detail);
+
+    bool ParseJws(const std::string &body, const std::string &path, MockJws &jws,
+      const char **err_type, std::string &err_detail);
+    bool VerifySignature(mbedtls_pk_context *pk, const std::string &alg, const std::string &input,
+      const std::string &sig);
+    static mbedtls_pk_context *KeyFromJwk(const std::string &jwk, std::string &thumbprint);
+
+    bool Validate(MockChallenge &);
+    void UpdateAuthz(MockAuthz &);
+    void UpdateOrder(MockOrder &);
+    bool IssueCertificate(MockOrder &, const std::string &csr_b64, std::string &err);
+
+    std::string AccountJson(MockAccount *);
+    std::string OrderJson(MockOrder &);
+    std::string AuthzJson(MockAuthz &);
+    std::string ChallengeJson(MockChallenge &);
+};
+
+#endif	/* _MOCK_ACME_SERVER_H_ */
@@ -0,0 +1,320 @@
+/*
+ * Stand-in for a "site" web server, for benchmarking the challenge publishers on a Linux host.
+ * See SiteStandIn.h for what is covered.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <esp_log.h>
+
+#include "SiteStandIn.h"
+
+SiteStandIn::SiteStandIn() {
+  server = 0;
+  ftp_socket = -1;
+  stopping = false;
+  latency_ms = 0;
+  ResetCounters();
+}
+
+SiteStandIn::~SiteStandIn() {
+  Stop();
+}
+
+bool SiteStandIn::StartHttp(int port) {
+  httpd_config_t cfg = HTTPD_DEFAULT_CONFIG();
+  cfg.server_port = port;
+  cfg.loopback_only = true;
+  cfg.uri_match_fn = httpd_uri_match_wildcard;
+  if (httpd_start(&server, &cfg) != ESP_OK) {
+    ESP_LOGE(site_tag, "%s: could not start server on port %d", __FUNCTION__, port);
+    server = 0;
+    return false;
+  }
+
+  httpd_uri_t uri;
+  uri.uri = "/*";
+  uri.user_ctx = this;
+  uri.method = HTTP_PUT;	uri.handler = PutHandler;	httpd_register_uri_handler(server, &uri);
+  uri.method = HTTP_DELETE;	uri.handler = DeleteHandler;	httpd_register_uri_handler(server, &uri);
+  uri.method = HTTP_GET;	uri.handler = GetHandler;	httpd_register_uri_handler(server, &uri);
+  return true;
+}
+
+bool SiteStandIn::StartFtp(int port) {
+  struct sockaddr_in	sin;
+  int			one = 1;
+
+  ftp_socket = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(ftp_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(port);
+  if (bind(ftp_socket, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(ftp_socket, 4) < 0) {
+    ESP_LOGE(site_tag, "%s: could not listen on port %d, %s", __FUNCTION__, port, strerror(errno));
+    close(ftp_socket);
+    ftp_socket = -1;
+    return false;
+  }
+
+  stopping = false;
+  ftp_thread = std::thread(&SiteStandIn::FtpLoop, this);
+  return true;
+}
+
+void SiteStandIn::Stop() {
+  if (server)
+    httpd_stop(server);
+  server = 0;
+
+  if (ftp_socket >= 0) {
+    stopping = true;
+    shutdown(ftp_socket, SHUT_RDWR);
+    close(ftp_socket);
+    ftp_socket = -1;
+  }
+  if (ftp_thread.joinable())
+    ftp_thread.join();
+}
+
+void SiteStandIn::setLatency(int ms) {
+  latency_ms = ms;
+}
+
+void SiteStandIn::Delay() {
+  if (latency_ms)
+    usleep(latency_ms * 1000);
+}
+
+bool SiteStandIn::Get(const std::string &path, std::string &content) {
+  std::lock_guard<std::mutex> g(lock);
+  auto it = files.find(path);
+  if (it == files.end())
+    return false;
+  content = it->second;
+  return true;
+}
+
+int SiteStandIn::Count() {
+  std::lock_guard<std::mutex> g(lock);
+  return files.size();
+}
+
+void SiteStandIn::ResetCounters() {
+  std::lock_guard<std::mutex> g(lock);
+  memset(&stats, 0, sizeof(stats));
+}
+
+SiteStandInStats SiteStandIn::getStats() {
+  std::lock_guard<std::mutex> g(lock);
+  return stats;
+}
+
+void SiteStandIn::Store(const std::string &path, const std::string &content) {
+  std::lock_guard<std::mutex> g(lock);
+  files[path] = content;
+  stats.stored++;
+}
+
+bool SiteStandIn::Remove(const std::string &path) {
+  std::lock_guard<std::mutex> g(lock);
+  if (files.erase(path) == 0)
+    return false;
+  stats.removed++;
+  return true;
+}
+
+/*
+ * HTTP
+ */
+esp_err_t SiteStandIn::PutHandler(httpd_req_t *req) {
+  SiteStandIn	*site = (SiteStandIn *)req->user_ctx;
+  std::string	body;
+  char		buf[512];
+
+  while (body.size() < req->content_len) {
+    int n = httpd_req_recv(req, buf, sizeof(buf));
+    if (n <= 0)
+      return ESP_FAIL;
+    body.append(buf, n);
+  }
+
+  site->Delay();
+  site->Store(req->uri, body);
+  {
+    std::lock_guard<std::mutex> g(site->lock);
+    site->stats.http_requests++;
+  }
+  httpd_resp_set_status(req, HTTPD_201);
+  return httpd_resp_send(req, "", 0);
+}
+
+esp_err_t SiteStandIn::DeleteHandler(httpd_req_t *req) {
+  SiteStandIn *site = (SiteStandIn *)req->user_ctx;
+
+  site->Delay();
+  bool found = site->Remove(req->uri);
+  {
+    std::lock_guard<std::mutex> g(site->lock);
+    site->stats.http_requests++;
+  }
+  if (! found)
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such file");
+  httpd_resp_set_status(req, HTTPD_204);
+  return httpd_resp_send(req, "", 0);
+}
+
+esp_err_t SiteStandIn::GetHandler(httpd_req_t *req) {
+  SiteStandIn	*site = (SiteStandIn *)req->user_ctx;
+  std::string	content;
+
+  if (! site->Get(req->uri, content))
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such file");
+  httpd_resp_set_type(req, "text/plain");
+  return httpd_resp_send(req, content.data(), content.size());
+}
+
+/*
+ * FTP : one control connection at a time, that's all the publishers need.
+ */
+void SiteStandIn::FtpLoop() {
+  while (! stopping) {
+    int s = accept(ftp_socket, 0, 0);
+    if (s < 0)
+      break;
+    {
+      std::lock_guard<std::mutex> g(lock);
+      stats.ftp_connections++;
+    }
+    FtpSession(s);
+    close(s);
+  }
+}
+
+void SiteStandIn::FtpReply(int s, const char *reply) {
+  Delay();
+  std::string r = std::string(reply) + "\r\n";
+  if (write(s, r.data(), r.size()) < 0)
+    ESP_LOGE(site_tag, "%s: %s", __FUNCTION__, strerror(errno));
+}
+
+void SiteStandIn::FtpSession(int s) {
+  std::string	in;
+  char		buf[512];
+  int		pasv = -1;		// Listening for the next data connection
+
+  FtpReply(s, "220 SiteStandIn ready");
+  while (! stopping) {
+    size_t eol = in.find("\r\n");
+    if (eol == std::string::npos) {
+      int n = read(s, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      in.append(buf, n);
+      continue;
+    }
+    std::string line = in.substr(0, eol);
+    in.erase(0, eol + 2);
+
+    std::string cmd = line.substr(0, line.find(' '));
+    std::string arg = (line.size() > cmd.size()) ? line.substr(cmd.size() + 1) : "";
+    {
+      std::lock_guard<std::mutex> g(lock);
+      stats.ftp_commands++;
+    }
+
+    if (cmd == "USER") {
+      FtpReply(s, "331 Password required");
+    } else if (cmd == "PASS") {
+      {
+        std::lock_guard<std::mutex> g(lock);
+        stats.ftp_logins++;
+      }
+      FtpReply(s, "230 Logged in");
+    } else if (cmd == "TYPE" || cmd == "NOOP") {
+      FtpReply(s, "200 Ok");
+    } else if (cmd == "SYST") {
+      FtpReply(s, "215 UNIX Type: L8");
+    } else if (cmd == "PASV") {
+      struct sockaddr_in	sin;
+      socklen_t			l = sizeof(sin);
+
+      if (pasv >= 0)
+        close(pasv);
+      pasv = socket(AF_INET, SOCK_STREAM, 0);
+      memset(&sin, 0, sizeof(sin));
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      bind(pasv, (struct sockaddr *)&sin, sizeof(sin));
+      listen(pasv, 1);
+      getsockname(pasv, (struct sockaddr *)&sin, &l);
+      int port = ntohs(sin.sin_port);
+      snprintf(buf, sizeof(buf), "227 Entering Passive Mode (127,0,0,1,%d,%d)", port >> 8, port & 0xFF);
+      FtpReply(s, buf);
+    } else if (cmd == "STOR") {
+      if (pasv < 0) {
+        FtpReply(s, "425 Use PASV first");
+        continue;
+      }
+      int d = accept(pasv, 0, 0);
+      close(pasv);
+      pasv = -1;
+      if (d < 0) {
+        FtpReply(s, "425 Can't open data connection");
+        continue;
+      }
+      FtpReply(s, "150 Opening BINARY mode data connection");
+
+      std::string content;
+      int n;
+      while ((n = read(d, buf, sizeof(buf))) > 0)
+        content.append(buf, n);
+      close(d);
+      Store(arg, content);
+      {
+        std::lock_guard<std::mutex> g(lock);
+        stats.ftp_transfers++;
+      }
+      FtpReply(s, "226 Transfer complete");
+    } else if (cmd == "DELE") {
+      if (Remove(arg))
+        FtpReply(s, "250 File deleted");
+      else
+        FtpReply(s, "550 No such file");
+    } else if (cmd == "QUIT") {
+      FtpReply(s, "221 Goodbye");
+      break;
+    } else {
+      FtpReply(s, "502 Command not implemented");
+    }
+  }
+  if (pasv >= 0)
+    close(pasv);
+}
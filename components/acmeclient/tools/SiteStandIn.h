@@ -0,0 +1,96 @@
+/*
+ * Stand-in for a "site" web server, for benchmarking the challenge publishers on a Linux host.
+ *
+ * Files are kept in memory, by path. They can be put in place in two ways :
+ *  - HTTP : PUT stores, DELETE removes, GET reads back (as the ACME server would)
+ *  - FTP : a minimal passive mode server, with just enough commands for ftplib
+ *    (USER, PASS, TYPE, PASV, STOR, DELE, NOOP, SYST, QUIT), any user and password are accepted
+ * Both listen on the loopback interface only. Each reply can be delayed, to make round trips
+ * cost what they would over a real network. Counters keep track of requests, connections and
+ * logins.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef	_SITE_STAND_IN_H_
+#define	_SITE_STAND_IN_H_
+
+#include <stdio.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include <esp_http_server.h>
+
+struct SiteStandInStats {
+  int		http_requests;
+  int		ftp_connections;
+  int		ftp_logins;
+  int		ftp_commands;
+  int		ftp_transfers;		// Data connections
+  int		stored, removed;
+};
+
+class SiteStandIn {
+  public:
+    SiteStandIn();
+    ~SiteStandIn();
+
+    bool StartHttp(int port);
+    bool StartFtp(int port);
+    void Stop();
+
+    void setLatency(int ms);			// Added to each reply
+    bool Get(const std::string &path, std::string &content);
+    int Count();				// Files that we have
+
+    void ResetCounters();
+    SiteStandInStats getStats();
+
+  private:
+    constexpr const static char *site_tag = "SiteStandIn";
+
+    httpd_handle_t			server;
+    int					ftp_socket;
+    std::thread				ftp_thread;
+    std::atomic<bool>			stopping;
+    int					latency_ms;
+
+    std::mutex				lock;
+    std::map<std::string, std::string>	files;
+    SiteStandInStats			stats;
+
+    void Delay();
+    void Store(const std::string &path, const std::string &content);
+    bool Remove(const std::string &path);
+
+    static esp_err_t PutHandler(httpd_req_t *);
+    static esp_err_t DeleteHandler(httpd_req_t *);
+    static esp_err_t GetHandler(httpd_req_t *);
+
+    void FtpLoop();
+    void FtpSession(int s);
+    void FtpReply(int s, const char *reply);
+};
+
+#endif	/* _SITE_STAND_IN_H_ */
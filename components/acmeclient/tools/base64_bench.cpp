@@ -0,0 +1,178 @@
+/*
+ * Micro-benchmark : base64url encoding and decoding as the Acme class used to do it (mbedtls,
+ * then rewrite the characters), against the codec in Base64url.cpp (scalar and vector paths).
+ * Sizes are those of a CSR (DER) and of a JWS signing input.
+ *
+ * Usage : acme_base64_bench [iterations]
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mbedtls/base64.h"
+
+#include "Base64url.h"
+
+/*
+ * The previous implementation, from Acme::Base64(const char *, int) and Acme::Unbase64()
+ */
+static char *old_base64(const char *s, int len) {
+  size_t olen;
+  (void) mbedtls_base64_encode(0, 0, &olen, (const unsigned char *)s, len);
+
+  char *r = (char *)malloc(olen + 1);
+  (void) mbedtls_base64_encode((unsigned char *)r, olen+1, &olen, (const unsigned char *)s, len);
+
+  for (size_t i=0; i<=olen; i++)
+    if (r[i] == '+')
+      r[i] = '-';
+    else if (r[i] == '/')
+      r[i] = '_';
+    else if (r[i] == '=')
+      r[i] = 0;
+  return r;
+}
+
+static char *old_unbase64(const char *s) {
+  int len = strlen(s);
+  char *r = (char *)malloc(len+4);
+  for (int i=0; i<=len; i++)
+    if (s[i] == '-')
+      r[i] = '+';
+    else if (s[i] == '_')
+      r[i] = '/';
+    else if (s[i] == 0) {
+      r[i]   = '=';
+      r[i+1] = '=';
+      r[i+2] = 0;
+    } else
+      r[i] = s[i];
+
+  size_t olen = 0;
+  (void) mbedtls_base64_decode(0, 0, &olen, (const unsigned char *)r, len);
+  char *obuf = (char *)malloc(olen+1);
+  if (mbedtls_base64_decode((unsigned char *)obuf, olen+1, &olen, (const unsigned char *)r, len) != 0) {
+    free(r);
+    free(obuf);
+    return 0;
+  }
+  free(r);
+  return obuf;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile size_t sink;
+
+static void report(const char *what, size_t size, int iterations, double t0, double t1) {
+  double ns = (t1 - t0) / iterations;
+  printf("  %-16s %8.1f ns/op %8.1f MB/s\n", what, ns, size / ns * 1e3);
+}
+
+static void bench(const char *name, size_t size, int iterations) {
+  unsigned char *in = (unsigned char *)malloc(size);
+  for (size_t i=0; i<size; i++)
+    in[i] = rand();
+
+  size_t elen = base64url_encoded_len(size) + 1;
+  char *enc = (char *)malloc(elen);
+  unsigned char *dec = (unsigned char *)malloc(size + 16);
+  double t0, t1;
+
+  // Check that all variants agree before timing them
+  char *o = old_base64((const char *)in, size);
+  base64url_encode_scalar(enc, elen, in, size);
+  if (strcmp(o, enc) != 0)
+    printf("%s: scalar encoder differs from the old code\n", name);
+  base64url_encode(enc, elen, in, size);
+  if (strcmp(o, enc) != 0)
+    printf("%s: encoder differs from the old code\n", name);
+  free(o);
+  if (base64url_decode(dec, size + 16, enc, elen - 1) != (int)size || memcmp(dec, in, size) != 0)
+    printf("%s: decoder does not round trip\n", name);
+
+  printf("%s (%d bytes, %d characters)\n", name, (int)size, (int)(elen - 1));
+
+  t0 = now_ns();
+  for (int i=0; i<iterations; i++) {
+    char *r = old_base64((const char *)in, size);
+    sink += r[0];
+    free(r);
+  }
+  t1 = now_ns();
+  report("encode old", size, iterations, t0, t1);
+
+  t0 = now_ns();
+  for (int i=0; i<iterations; i++)
+    sink += base64url_encode_scalar(enc, elen, in, size);
+  t1 = now_ns();
+  report("encode scalar", size, iterations, t0, t1);
+
+  t0 = now_ns();
+  for (int i=0; i<iterations; i++)
+    sink += base64url_encode(enc, elen, in, size);
+  t1 = now_ns();
+  report("encode", size, iterations, t0, t1);
+
+  t0 = now_ns();
+  for (int i=0; i<iterations; i++) {
+    char *r = old_unbase64(enc);
+    sink += r[0];
+    free(r);
+  }
+  t1 = now_ns();
+  report("decode old", size, iterations, t0, t1);
+
+  t0 = now_ns();
+  for (int i=0; i<iterations; i++)
+    sink += base64url_decode_scalar(dec, size + 16, enc, elen - 1);
+  t1 = now_ns();
+  report("decode scalar", size, iterations, t0, t1);
+
+  t0 = now_ns();
+  for (int i=0; i<iterations; i++)
+    sink += base64url_decode(dec, size + 16, enc, elen - 1);
+  t1 = now_ns();
+  report("decode", size, iterations, t0, t1);
+
+  free(in);
+  free(enc);
+  free(dec);
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+
+  srand(1);
+  bench("CSR, RSA-2048 key", 680, iterations);
+  bench("CSR, ES256 key", 330, iterations);
+  bench("JWS signing input", 1400, iterations);
+  bench("certificate chain", 3300, iterations / 4);
+  return 0;
+}
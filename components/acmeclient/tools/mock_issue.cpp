@@ -0,0 +1,235 @@
+/*
+ * Drive the Acme class through a complete certificate issuance against the mock ACME server,
+ * without network access. Prints the time to certificate and the number of requests.
+ *
+ * Usage : acme_mock_issue [-p port] [-v validation-port] [-l latency-ms] [-b badnonce-every]
+ *		[-r retry-after] [-c challenge-polls] [-f finalize-polls] [-i interval-ms] [-m max-passes]
+ *		[-e] [-E]
+ *
+ * -e uses an ES256 account key, -E an ES256 certificate key, instead of RSA-2048.
+ *
+ * The Acme class runs a process at most a handful of passes (see process_count in Acme.cpp),
+ * so this does one issuance per run.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <ftw.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <condition_variable>
+
+#include <esp_log.h>
+#include <esp_http_server.h>
+
+#include "Acme.h"
+#include "MockAcmeServer.h"
+
+static const char *mock_issue_tag = "mock_issue";
+
+Acme *acme;
+
+// Largest reply buffer, and allocations for all replies
+static size_t	reply_peak = 0;
+static int	reply_allocations = 0;
+
+static void reply_stats(const char *, const ReplyBufferStats *st) {
+  if (st->peak > reply_peak)
+    reply_peak = st->peak;
+  reply_allocations += st->allocations;
+}
+
+// Async mode (-a) : wait for the ACME task to report on each tick
+static std::mutex		event_lock;
+static std::condition_variable	event_cv;
+static int			events = 0;
+static bool			event_certificate = false;
+
+static void acme_event(Acme *, AcmeEvent ev, void *) {
+  std::lock_guard<std::mutex> l(event_lock);
+  events++;
+  if (ev == ACME_EVENT_CERTIFICATE)
+    event_certificate = true;
+  event_cv.notify_one();
+}
+
+static bool async_loop(time_t now) {
+  std::unique_lock<std::mutex> l(event_lock);
+  int n = events;
+  acme->loop(now);
+  event_cv.wait(l, [n] { return events != n; });
+  return event_certificate;
+}
+
+static long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int rm_entry(const char *path, const struct stat *, int, struct FTW *) {
+  return remove(path);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage : %s [-p port] [-v validation-port] [-l latency-ms] [-b badnonce-every]\n"
+    "\t[-r retry-after] [-c challenge-polls] [-f finalize-polls] [-i interval-ms] [-m max-passes] [-n names] [-e] [-E] [-s] [-a]\n", prog);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  int	port = 14000, vport = 15080, latency = 0, badnonce = 0, retry_after = 1;
+  int	challenge_delay = 0, finalize_delay = 0, interval_ms = 0, max_passes = 20;
+  int	waited = 0, names = 1;
+  int	c;
+  AcmeKeyType	account_key_type = ACME_KEY_RSA2048, cert_key_type = ACME_KEY_RSA2048;
+  bool		state_file = false, async = false;
+
+  while ((c = getopt(argc, argv, "p:v:l:b:r:c:f:i:m:n:eEsa")) != -1)
+    switch (c) {
+    case 'p':	port = atoi(optarg); break;
+    case 'v':	vport = atoi(optarg); break;
+    case 'l':	latency = atoi(optarg); break;
+    case 'b':	badnonce = atoi(optarg); break;
+    case 'r':	retry_after = atoi(optarg); break;
+    case 'c':	challenge_delay = atoi(optarg); break;
+    case 'f':	finalize_delay = atoi(optarg); break;
+    case 'i':	interval_ms = atoi(optarg); break;
+    case 'm':	max_passes = atoi(optarg); break;
+    case 'n':	names = atoi(optarg); break;
+    case 'e':	account_key_type = ACME_KEY_ES256; break;
+    case 'E':	cert_key_type = ACME_KEY_ES256; break;
+    case 's':	state_file = true; break;
+    case 'a':	async = true; break;
+    default:	usage(argv[0]);
+    }
+
+  MockAcmeServer *mock = new MockAcmeServer();
+  mock->setLatency(latency);
+  mock->setBadNonceEvery(badnonce);
+  mock->setRetryAfter(retry_after);
+  mock->setChallengeDelay(challenge_delay);
+  mock->setFinalizeDelay(finalize_delay);
+  mock->setValidationPort(vport);
+  if (! mock->Start(port))
+    exit(1);
+
+  // The web server on which the Acme class publishes http-01 validation files
+  httpd_handle_t ws = 0;
+  httpd_config_t cfg = HTTPD_DEFAULT_CONFIG();
+  cfg.server_port = vport;
+  cfg.uri_match_fn = httpd_uri_match_wildcard;
+  if (httpd_start(&ws, &cfg) != ESP_OK) {
+    ESP_LOGE(mock_issue_tag, "could not start web server on port %d", vport);
+    exit(1);
+  }
+
+  char dir[] = "/tmp/acme-mock-XXXXXX";
+  if (mkdtemp(dir) == 0) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  std::string prefix = std::string(dir) + "/";
+
+  acme = new Acme();
+  acme->setFsPrefix(prefix.c_str());
+  acme->setFilenamePrefix(prefix.c_str());
+  acme->setAcmeServer(mock->DirectoryUrl());
+  acme->setRootCertificate(mock->CaCertificate());
+  acme->setEmail("test@example.test");
+  acme->setUrl("device.example.test");
+  // More names on the certificate : one authorization each
+  std::vector<std::string> alt_names;
+  for (int i=1; i<names; i++)
+    alt_names.push_back("alt" + std::to_string(i) + ".example.test");
+  for (int i=0; i<(int)alt_names.size(); i++)
+    acme->setAltUrl(i, alt_names[i].c_str());
+  acme->setAccountFilename("account.json");
+  acme->setOrderFilename("order.json");
+  if (state_file)
+    acme->setStateFilename("acme.state");
+  acme->setAccountKeyFilename("account.pem");
+  acme->setCertKeyFilename("certkey.pem");
+  acme->setCertificateFilename("certificate.pem");
+  acme->setWebServer(ws);
+  acme->setAccountKeyType(account_key_type);
+  acme->setCertificateKeyType(cert_key_type);
+  acme->setReplyStatsHook(reply_stats);
+
+  long long t0 = now_us();
+  acme->GenerateAccountKey();
+  long long t1 = now_us();
+  acme->GenerateCertificateKey();
+  long long t2 = now_us();
+
+  mock->ResetCounters();
+
+  long long start = now_us();
+  acme->NetworkConnected(0, 0);
+  bool ok = acme->CreateNewAccount();
+  int passes = 0;
+  if (ok) {
+    acme->CreateNewOrder();
+    if (async) {
+      acme->setEventCallback(acme_event, 0);
+      if (! acme->StartTask())
+        max_passes = 0;
+    }
+    for (ok = false; ! ok && passes < max_passes; passes++) {
+      // Sleep while the server is busy, as a device would
+      time_t wake = acme->nextWakeTime();
+      if (wake > time(0)) {
+        waited += wake - time(0);
+        sleep(wake - time(0));
+      }
+      ok = async ? async_loop(time(0)) : acme->loop(time(0));
+      if (! ok && interval_ms)
+        usleep(interval_ms * 1000);
+    }
+  }
+  long long elapsed = now_us() - start;
+
+  MockAcmeStats s = mock->getStats();
+  printf("result %s time_ms %.1f passes %d keygen_ms %.1f/%.1f",
+    ok ? "ok" : "FAIL", elapsed / 1000.0, passes, (t1 - t0) / 1000.0, (t2 - t1) / 1000.0);
+  for (int i=0; i<MOCK_REQ_MAX; i++)
+    printf(" %s %d", MockAcmeServer::RequestTypeName(i), s.requests[i]);
+  printf(" total %d badnonce %d retry_after %d waited_s %d bytes_in %ld bytes_out %ld connections %d"
+    " reply_peak %d reply_allocs %d order_bytes %d order_writes_avoided %d\n",
+    s.total, s.bad_nonce_injected + s.bad_nonce_rejected, s.retry_after_sent, waited, s.bytes_in, s.bytes_out,
+    acme->getHandshakeCount(), (int)reply_peak, reply_allocations, (int)acme->getOrderMemoryUsage(),
+    acme->getAvoidedOrderWrites());
+
+  acme->StopTask();
+  delete acme;
+  httpd_stop(ws);
+  mock->Stop();
+  delete mock;
+  nftw(dir, rm_entry, 8, FTW_DEPTH | FTW_PHYS);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,252 @@
+/*
+ * Benchmark the challenge publishers (ChallengePublisher.h) against a local stand-in site web
+ * server : publish and then remove the validation files of an order, either one connection per
+ * token (as the library used to do) or in two batches over one session per order.
+ * Prints the time per order and what it cost in requests, connections and logins.
+ *
+ * Usage : publish_bench [-n tokens] [-r rounds] [-l latency-ms] [-p base-port]
+ *
+ * The FTP backend is only there when built with USE_EXTERNAL_WEBSERVER.
+ *
+ * Copyright (c) 2022 Danny Backx
+ *
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ *
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include <esp_log.h>
+#include <esp_http_client.h>
+#include <esp_http_server.h>
+
+#include "ChallengePublisher.h"
+#include "SiteStandIn.h"
+
+static const char *well_known = "/.well-known/acme-challenge/";
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static std::string random_b64url(int len) {
+  static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  std::string r;
+  for (int i=0; i<len; i++)
+    r += chars[rand() % 64];
+  return r;
+}
+
+// Token and thumbprint are SHA-256 sized, base64url encoded
+struct Token {
+  std::string	token, response;
+};
+
+static std::vector<Token> make_tokens(int n) {
+  std::string thumbprint = random_b64url(43);
+  std::vector<Token> v(n);
+  for (int i=0; i<n; i++) {
+    v[i].token = random_b64url(43);
+    v[i].response = v[i].token + "." + thumbprint + "\n";
+  }
+  return v;
+}
+
+/*
+ * What we benchmark : a publisher, and where the ACME server would find the files.
+ * Either on the stand-in (site != 0, under path), or on our own web server (port).
+ */
+struct Backend {
+  const char		*name;
+  ChallengePublisher	*publisher;
+  SiteStandIn		*site;
+  std::string		path;
+  int			port;
+};
+
+static int http_status(const std::string &url) {
+  esp_http_client_config_t	httpc;
+  memset(&httpc, 0, sizeof(httpc));
+  httpc.url = url.c_str();
+
+  esp_http_client_handle_t client = esp_http_client_init(&httpc);
+  int code = 0;
+  if (esp_http_client_perform(client) == ESP_OK)
+    code = esp_http_client_get_status_code(client);
+  esp_http_client_cleanup(client);
+  return code;
+}
+
+static bool check(Backend &b, std::vector<Token> &tokens, bool present) {
+  for (auto &t : tokens) {
+    if (b.site) {
+      std::string content;
+      bool found = b.site->Get(b.path + well_known + t.token, content);
+      if (found != present || (found && content != t.response))
+        return false;
+    } else {
+      std::string url = "http://127.0.0.1:" + std::to_string(b.port) + well_known + t.token;
+      if (http_status(url) != (present ? 200 : 404))
+        return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Publish or remove all tokens.
+ * Batched : Begin() and End() around all of them, like Acme does. Otherwise a session of its own
+ * for each token, as the library used to do.
+ */
+static bool batch(ChallengePublisher *p, std::vector<Token> &tokens, bool batched, bool publish) {
+  bool ok = true;
+
+  if (batched && ! p->Begin())
+    return false;
+  for (auto &t : tokens) {
+    if (! batched && ! p->Begin())
+      return false;
+    if (publish)
+      ok = p->Publish(t.token.c_str(), t.response.c_str()) && ok;
+    else
+      ok = p->Unpublish(t.token.c_str()) && ok;
+    if (! batched) {
+      p->End();
+      p->Close();
+    }
+  }
+  if (batched)
+    p->End();
+  return ok;
+}
+
+static void bench(Backend &b, int ntokens, int rounds, bool batched) {
+  double	t = 0;
+  int		errors = 0;
+
+  if (b.site)
+    b.site->ResetCounters();
+  for (int r=0; r<rounds; r++) {
+    std::vector<Token> tokens = make_tokens(ntokens);
+
+    double t0 = now_ms();
+    bool ok = batch(b.publisher, tokens, batched, true);
+    t += now_ms() - t0;
+
+    // This is where the ACME server reads them
+    if (! ok || ! check(b, tokens, true))
+      errors++;
+
+    t0 = now_ms();
+    ok = batch(b.publisher, tokens, batched, false);
+    b.publisher->Close();			// Order done
+    t += now_ms() - t0;
+
+    if (! ok || ! check(b, tokens, false))
+      errors++;
+  }
+
+  printf("  %-10s %-9s %8.2f ms/order", b.name, batched ? "batched" : "per token", t / rounds);
+  if (b.site) {
+    SiteStandInStats st = b.site->getStats();
+    if (st.http_requests)
+      printf(", %d requests", st.http_requests / rounds);
+    if (st.ftp_connections)
+      printf(", %d connections, %d logins, %d commands", st.ftp_connections / rounds,
+        st.ftp_logins / rounds, st.ftp_commands / rounds);
+  }
+  printf("%s\n", errors ? ", FAILED" : "");
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage : %s [-n tokens] [-r rounds] [-l latency-ms] [-p base-port]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int	ntokens = 3, rounds = 20, latency = 0, base_port = 18480;
+  int	c;
+
+  while ((c = getopt(argc, argv, "n:r:l:p:")) != -1)
+    switch (c) {
+    case 'n':	ntokens = atoi(optarg);		break;
+    case 'r':	rounds = atoi(optarg);		break;
+    case 'l':	latency = atoi(optarg);		break;
+    case 'p':	base_port = atoi(optarg);	break;
+    default:	usage(argv[0]);
+    }
+  if (ntokens < 1 || rounds < 1)
+    usage(argv[0]);
+
+  esp_log_level_set("*", ESP_LOG_WARN);
+  srand(1);
+
+  std::vector<Backend> backends;
+
+  // Our own web server
+  httpd_handle_t ws = 0;
+  httpd_config_t cfg = HTTPD_DEFAULT_CONFIG();
+  cfg.server_port = base_port;
+  cfg.uri_match_fn = httpd_uri_match_wildcard;
+  if (httpd_start(&ws, &cfg) != ESP_OK) {
+    fprintf(stderr, "Could not start web server on port %d\n", base_port);
+    exit(1);
+  }
+  HttpdPublisher httpd(ws);
+  backends.push_back({ "httpd", &httpd, 0, "", base_port });
+
+  // Site web server, HTTP PUT
+  SiteStandIn site;
+  site.setLatency(latency);
+  if (! site.StartHttp(base_port + 1)) {
+    fprintf(stderr, "Could not start the stand-in web server on port %d\n", base_port + 1);
+    exit(1);
+  }
+  std::string put_url = "http://127.0.0.1:" + std::to_string(base_port + 1) + "/www" + well_known;
+  HttpPutPublisher put(put_url.c_str());
+  backends.push_back({ "http-put", &put, &site, "/www", 0 });
+
+#if USE_EXTERNAL_WEBSERVER
+  // Site web server, FTP
+  if (! site.StartFtp(base_port + 2)) {
+    fprintf(stderr, "Could not start the stand-in FTP server on port %d\n", base_port + 2);
+    exit(1);
+  }
+  FtpPublisher ftp("127.0.0.1", "bench", "bench", "/www");
+  ftp.setPort(base_port + 2);
+  backends.push_back({ "ftp", &ftp, &site, "/www", 0 });
+#endif
+
+  printf("%d token(s) per order, %d rounds, %d ms latency\n", ntokens, rounds, latency);
+  for (auto &b : backends) {
+    bench(b, ntokens, rounds, false);
+    bench(b, ntokens, rounds, true);
+  }
+
+  site.Stop();
+  httpd_stop(ws);
+  return 0;
+}
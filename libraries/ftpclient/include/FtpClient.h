@@ -65,6 +65,8 @@ extern "C" {
 typedef struct NetBuf NetBuf_t;
 
 typedef int (*FtpClientCallback_t)(NetBuf_t* nControl, uint32_t xfered, void* arg);
+/* Fills buf with at most max bytes, returns the count, 0 at the end, -1 on error */
+typedef int (*FtpClientReader_t)(void* buf, int max, void* arg);
 
 typedef struct
 {
@@ -109,6 +111,11 @@ typedef struct
 		NetBuf_t* nControl);
 	int (*ftpClientDelete)(const char* fnm, NetBuf_t* nControl);
 	int (*ftpClientRename)(const char* src, const char* dst, NetBuf_t* nControl);
+	/*Memory to File Transfer*/
+	int (*ftpClientPutBuffer)(const void* buf, int len, const char* path, char mode,
+		NetBuf_t* nControl);
+	int (*ftpClientPutStream)(FtpClientReader_t reader, void* arg, const char* path,
+		char mode, NetBuf_t* nControl);
 	/*File to Program Transfer*/
 	int (*ftpClientAccess)(const char* path, int typ, int mode, NetBuf_t* nControl,
 	    NetBuf_t** nData);
@@ -104,6 +104,11 @@ static int putDataFtpClient(const char* inputfile, const char* path, char mode,
 	NetBuf_t* nControl);
 static int deleteDataFtpClient(const char* fnm, NetBuf_t* nControl);
 static int renameFtpClient(const char* src, const char* dst, NetBuf_t* nControl);
+/*Memory to File Transfer*/
+static int putBufferFtpClient(const void* buf, int len, const char* path, char mode,
+	NetBuf_t* nControl);
+static int putStreamFtpClient(FtpClientReader_t reader, void* arg, const char* path,
+	char mode, NetBuf_t* nControl);
 /*File to Program Transfer*/
 static int accessFtpClient(const char* path, int typ, int mode, NetBuf_t* nControl,
     NetBuf_t** nData);
@@ -1128,6 +1133,73 @@ static int renameFtpClient(const char* src, const char* dst, NetBuf_t* nControl)
 
 
 
+/*
+ * putBufferFtpClient - issue a PUT command and send data from memory,
+ * without a local file
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int putBufferFtpClient(const void* buf, int len, const char* path, char mode,
+	NetBuf_t* nControl)
+{
+    NetBuf_t* nData;
+    if (!accessFtpClient(path, FTP_CLIENT_FILE_WRITE, mode, nControl, &nData))
+    	return 0;
+
+    int rv = 1;
+    const char* p = buf;
+    while (len > 0) {
+		int c = writeFtpClient(p, len, nData);
+		if (c <= 0) {
+			rv = 0;
+			break;
+		}
+		p += c;
+		len -= c;
+    }
+    /* The transfer only counts once the server confirms it (226) */
+    if (!closeFtpClient(nData))
+    	rv = 0;
+    return rv;
+}
+
+
+
+/*
+ * putStreamFtpClient - issue a PUT command and send data from a reader
+ * callback, until it returns 0
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int putStreamFtpClient(FtpClientReader_t reader, void* arg, const char* path,
+	char mode, NetBuf_t* nControl)
+{
+    NetBuf_t* nData;
+    if (!accessFtpClient(path, FTP_CLIENT_FILE_WRITE, mode, nControl, &nData))
+    	return 0;
+
+    int rv = 1;
+    int l = 0;
+    char* dbuf = malloc(FTP_CLIENT_TEMP_BUFFER_SIZE);
+    if (dbuf == NULL)
+    	rv = 0;
+    while (rv && (l = reader(dbuf, FTP_CLIENT_TEMP_BUFFER_SIZE, arg)) > 0) {
+		int c = writeFtpClient(dbuf, l, nData);
+		if (c < l) {
+			printf("Ftp Client putStream short write: passed %d, wrote %d\n", l, c);
+			rv = 0;
+		}
+    }
+    if (l < 0)
+    	rv = 0;
+    free(dbuf);
+    if (!closeFtpClient(nData))
+    	rv = 0;
+    return rv;
+}
+
+
+
 /*
  * accessFtpClient - return a handle for a data stream
  *
@@ -1340,6 +1412,8 @@ FtpClient* getFtpClient(void)
 		ftpClient_.ftpClientPut = putDataFtpClient;
 		ftpClient_.ftpClientDelete = deleteDataFtpClient;
 		ftpClient_.ftpClientRename = renameFtpClient;
+		ftpClient_.ftpClientPutBuffer = putBufferFtpClient;
+		ftpClient_.ftpClientPutStream = putStreamFtpClient;
 		ftpClient_.ftpClientAccess = accessFtpClient;
 		ftpClient_.ftpClientRead = readFtpClient;
 		ftpClient_.ftpClientWrite = writeFtpClient;